@@ -133,6 +133,7 @@ class OSLEXECPUBLIC AccumAutomata
 {
     public:
 
+        AccumAutomata():m_ndf_states(0), m_df_states(0), m_compile_time(0) {};
         ~AccumAutomata();
 
         /// Add a single rule for rendering outputs
@@ -153,6 +154,23 @@ class OSLEXECPUBLIC AccumAutomata
         /// Get an specific transition
         int getTransition(int state, ustring symbol)const { return m_dfoptautomata.getTransition(state, symbol); };
 
+        /// Get the integer id of a label, to be looked up once (after compile)
+        /// and used with the integer versions of getTransition and Accumulator::move.
+        /// Labels not used by any rule get 0.
+        int getLabelId(ustring symbol)const { return m_dfoptautomata.getLabelId(symbol); };
+
+        /// Get an specific transition by label id, a single table lookup
+        int getTransition(int state, int label)const { return m_dfoptautomata.getTransition(state, label); };
+
+        int getNumStates()const { return m_dfoptautomata.getNumStates(); };
+
+        /// Compile statistics: states in the non deterministic automata built
+        /// from the rules, in the deterministic one before minimization (the
+        /// final count is getNumStates) and seconds spent in compile()
+        int getNdfStates()const { return m_ndf_states; };
+        int getDfStates()const { return m_df_states; };
+        double getCompileTime()const { return m_compile_time; };
+
         /// The rule list is for public use in read-only, so Accumulator knows what AOVS are we using
         const std::list<AccumRule> &getRuleList()const { return m_accumrules; };
 
@@ -168,6 +186,10 @@ class OSLEXECPUBLIC AccumAutomata
         DfOptimizedAutomata      m_dfoptautomata;
         // List of rules linked as void * from the automata's states
         std::list<AccumRule>     m_accumrules;
+        // Compile statistics
+        int                      m_ndf_states;
+        int                      m_df_states;
+        double                   m_compile_time;
 };
 
 
@@ -213,6 +235,26 @@ class OSLEXECPUBLIC Accumulator
             return active;
         }
 
+        /// Same as the ustring versions above but with label ids from
+        /// AccumAutomata::getLabelId, which makes every label a table lookup.
+        /// custom is terminated by -1 (instead of Labels::NONE)
+        void move(int label)
+        {
+            if (m_state >= 0)
+                m_state = m_accum_automata->getTransition(m_state, label);
+        }
+
+        void move(int event, int scatt, const int *custom, int stop);
+
+        bool test(int dir, int sca, const int *custom, int stop)
+        {
+            pushState();
+            move(dir, sca, custom, stop);
+            bool active = ! broken();
+            popState();
+            return active;
+        }
+
 
 
 
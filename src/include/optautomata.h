@@ -52,6 +52,7 @@ class DfAutomata;
 class DfOptimizedAutomata
 {
     public:
+        DfOptimizedAutomata() : m_nlabels(0) {}
 
         void compileFrom(const DfAutomata &dfautomata);
 
@@ -72,6 +73,24 @@ class DfOptimizedAutomata
             return mystate.wildcard_trans;
         }
 
+        /// Get the integer id of a label for the fast getTransition below
+        ///
+        /// Every label used by some transition gets its own id, starting at 1.
+        /// Any other label gets 0, which only follows wildcard transitions.
+        int getLabelId(ustring symbol)const;
+
+        /// Same as getTransition(state, symbol) for the symbol with the given
+        /// label id, but it is a single table lookup
+        int getTransition(int state, int label)const
+        {
+            return m_table[state * m_nlabels + label];
+        }
+
+        int getNumStates()const { return m_states.size(); }
+
+        /// Number of label ids (including the catch all 0)
+        int numLabels()const { return m_nlabels; }
+
         void * const * getRules(int state, int &count)const
         {
             count = m_states[state].nrules;
@@ -97,6 +116,11 @@ class DfOptimizedAutomata
         std::vector<Transition> m_trans;
         std::vector<void *>     m_rules;
         std::vector<State>      m_states;
+        // Label ids, sorted like the transitions (state is the id here)
+        std::vector<Transition> m_label_ids;
+        // Dense transition table, m_nlabels entries per state
+        std::vector<int>        m_table;
+        int                     m_nlabels;
 };
 
 };
@@ -208,9 +208,7 @@ public:
 
     /// Find a structure record by id number.
     ///
-    static StructSpec *structspec (int id) {
-        return id ? struct_list()[id].get() : NULL;
-    }
+    static StructSpec *structspec (int id);
 
     /// Find a structure index by name, or return 0 if not found.
     /// If 'add' is true, add the struct if not already found.
@@ -224,6 +222,10 @@ public:
     ///
     static std::vector<shared_ptr<StructSpec> > & struct_list ();
 
+    /// Remove all structures from the list.
+    ///
+    static void clear_struct_list ();
+
     /// Is this an array (either a simple array, or an array of structs)?
     ///
     bool is_array () const { return m_simple.arraylen != 0; }
@@ -485,6 +485,16 @@ struct ClosureAdd : public ClosureColor
 };
 
 
+
+/// One entry of a flattened closure (see ShadingSystem::flatten_closure):
+/// a primitive component and the total weight it is scaled by.
+struct FlatClosureComponent
+{
+    Color3 weight;                  ///< Accumulated weight
+    const ClosureComponent *comp;   ///< The primitive component
+};
+
+
 namespace pvt {
 class ShadingSystemImpl;
 }
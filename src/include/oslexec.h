@@ -46,8 +46,10 @@ class RendererServices;
 class ShadingAttribState;
 typedef shared_ptr<ShadingAttribState> ShadingAttribStateRef;
 struct ShaderGlobals;
+struct ShaderGlobalsBatch;
 struct ClosureColor;
 struct ClosureParam;
+struct FlatClosureComponent;
 struct PerThreadInfo;
 class ShadingContext;
 
@@ -215,34 +217,113 @@ public:
     virtual bool execute (ShadingContext &ctx, ShadingAttribState &sas,
                           ShaderGlobals &ssg, bool run=true) = 0;
 
+    /// Execute the shader group for a whole batch of 'npoints' shade
+    /// points at once, ssg[0..npoints-1].  All points share the same
+    /// ShadingAttribState, so the per-execution setup (optimization
+    /// check, heap sizing, closure pool reset) is done only once per
+    /// batch.  If runflags is not NULL, only points whose runflag is
+    /// nonzero are shaded (the Ci of the others is set to NULL).  The
+    /// closures of every point in the batch remain valid until the
+    /// next execute call on the context.  Return value has the same
+    /// meaning as for execute().
+    virtual bool execute_batch (ShadingContext &ctx, ShadingAttribState &sas,
+                                ShaderGlobals *ssg, int npoints,
+                                const unsigned char *runflags=NULL,
+                                bool run=true) = 0;
+
+    /// Execute the shader group for a batch of up to
+    /// ShaderGlobalsBatch::MaxSize points whose globals are given in
+    /// structure-of-arrays form.  If the "batchjit" attribute was set
+    /// when the group was compiled, and the group is made only of the
+    /// simple math, comparison, and conditional ops, it runs several
+    /// points at once in SIMD lanes; otherwise it's run one point at a
+    /// time, and the results are the same either way.  On return, sgb.Ci[i] holds the
+    /// closure of point i.  runflags, get_symbol, and the return value
+    /// work as for the ShaderGlobals version above.
+    virtual bool execute_batch (ShadingContext &ctx, ShadingAttribState &sas,
+                                ShaderGlobalsBatch &sgb, int npoints,
+                                const unsigned char *runflags=NULL,
+                                bool run=true) = 0;
+
     /// Get a raw pointer to a named symbol (such as you'd need to pull
     /// out the value of an output parameter).  ctx is the shading
     /// context (presumably already run), name is the name of the
     /// symbol.  If found, get_symbol will return the pointer to the
     /// symbol's data, and type will get the symbol's type.  If the
-    /// symbol is not found, get_symbol will return NULL.
+    /// symbol is not found, get_symbol will return NULL.  After
+    /// execute_batch, 'point' selects which point of the batch to
+    /// retrieve the symbol for.
     virtual const void* get_symbol (ShadingContext &ctx, ustring name,
-                                    TypeDesc &type) = 0;
+                                    TypeDesc &type, int point=0) = 0;
 
     /// Return the statistics output as a huge string.
     ///
     virtual std::string getstats (int level=1) const = 0;
 
+    /// Return the statistics as a JSON object (compile times, group
+    /// counts, JIT cache, getattribute and memory figures), for tools
+    /// that want to ingest them rather than read them.
+    virtual std::string getstats_json () const = 0;
+
     virtual void register_closure(const char *name, int id, const ClosureParam *params, int size,
                                   PrepareClosureFunc prepare, SetupClosureFunc setup, CompareClosureFunc compare) = 0;
 
     void register_builtin_closures();
 
+    /// Flatten the closure tree into a list of weighted primitive
+    /// components, written to comps[0..maxcomps-1] -- storage supplied
+    /// by the caller, so nothing is allocated.  The weights of enclosing
+    /// ClosureMul nodes are multiplied through, components whose weight
+    /// ends up zero are dropped, and mergeable components (same closure
+    /// id and parameters that the closure's compare function considers
+    /// equal, or that are bitwise identical if it has none) are combined
+    /// into one entry with their weights summed.  The tree itself is not
+    /// modified.  Return the number of components written; any that
+    /// don't fit in maxcomps are dropped.
+    virtual int flatten_closure (const ClosureColor *closure,
+                                 FlatClosureComponent *comps,
+                                 int maxcomps) const = 0;
+
     /// For the proposed raytype name, return the bit pattern that
     /// describes it, or 0 for an unrecognized name.  (This retrieves
     /// data passed in via attribute("raytypes")).
     virtual int raytype_bit (ustring name) = 0;
 
-    /// If option "greedyjit" was set, this call will trigger all
-    /// shader groups that have not yet been compiled to do so with the
-    /// specified number of threads (0 means use all available HW cores).
+    /// If option "greedyjit" was set, groups are handed to a persistent
+    /// pool of background JIT threads as they are declared (the pool
+    /// size is given by option "jitthreads", 0 meaning all available HW
+    /// cores), and execute() only ever waits on the group it needs.
+    /// This call makes the calling thread help with the backlog and
+    /// returns when every group declared so far has been compiled.  The
+    /// nthreads argument sizes the pool if it was not already running.
     virtual void optimize_all_groups (int nthreads=0) = 0;
 
+    /// Optimize the (not yet compiled) surface shader group of sas and,
+    /// besides readying it to run as usual, write its native code --
+    /// for the CPU given by the "llvm_cpu" and "llvm_features" options
+    /// -- to the named object file.  Linked into a shared library (e.g.
+    /// "cc -shared -o group.so group.o"), it can be handed to
+    /// register_compiled_group by other processes, such as the other
+    /// nodes of a render farm.  Return true on success.
+    virtual bool write_compiled_group (ShadingAttribState &sas,
+                                       const char *filename) = 0;
+
+    /// Set up the (not yet compiled) surface shader group of sas to run
+    /// the code in a shared library made by write_compiled_group, so
+    /// that execute() never optimizes or JITs it.  The group must be
+    /// declared with the same shaders, parameters, and connections as
+    /// the one that was written, the library must have been built by
+    /// the same OSL version for a CPU this one can stand in for, and
+    /// anything that its optimization looked up (coordinate systems,
+    /// texture info, dictionaries) must not have changed.  If not,
+    /// return false and leave the group to be compiled as usual.  A
+    /// library should only be registered for one group.  With option
+    /// "greedyjit", register it before beginning the next group: until
+    /// then, the group returned by state() is held back from the JIT
+    /// workers.
+    virtual bool register_compiled_group (ShadingAttribState &sas,
+                                          const char *filename) = 0;
+
 private:
     // Make delete private and unimplemented in order to prevent apps
     // from calling it.  Instead, they should call ShadingSystem::destroy().
@@ -291,13 +372,70 @@ struct ShaderGlobals {
 
 
 
+/// The ShaderGlobals of a batch of shade points, laid out as a structure
+/// of arrays (the u of every point, then the v of every point, and so
+/// on, with each triple split into its x, y, and z arrays) so that the
+/// shading system can load a field of several points at once.  Point i
+/// of the batch is element i of every array.  The fields mean the same
+/// as in ShaderGlobals, except that raytype is shared by the whole
+/// batch.
+struct ShaderGlobalsBatch {
+    enum { MaxSize = 16 };           ///< Most points in one batch
+
+    /// The x, y, and z components of a triple for each point
+    struct Vec3Array {
+        float x[MaxSize], y[MaxSize], z[MaxSize];
+        Vec3 get (int i) const { return Vec3 (x[i], y[i], z[i]); }
+        void set (int i, const Vec3 &v) { x[i] = v.x;  y[i] = v.y;  z[i] = v.z; }
+    };
+
+    Vec3Array P, dPdx, dPdy;
+    Vec3Array dPdz;
+    Vec3Array I, dIdx, dIdy;
+    Vec3Array N;
+    Vec3Array Ng;
+    float u[MaxSize], dudx[MaxSize], dudy[MaxSize];
+    float v[MaxSize], dvdx[MaxSize], dvdy[MaxSize];
+    Vec3Array dPdu, dPdv;
+    float time[MaxSize];
+    float dtime[MaxSize];
+    Vec3Array dPdtime;
+    Vec3Array Ps, dPsdx, dPsdy;
+    void* renderstate[MaxSize];
+    void* tracedata[MaxSize];
+    void* objdata[MaxSize];
+    ShadingContext* context;         /**< (this will be set by OSL itself) */
+    TransformationPtr object2common[MaxSize];
+    TransformationPtr shader2common[MaxSize];
+    ClosureColor *Ci[MaxSize];       /**< Output closures */
+    float surfacearea[MaxSize];
+    int raytype;                     /**< Ray type flags of every point */
+    int flipHandedness[MaxSize];
+    int backfacing[MaxSize];
+};
+
+
+
 /// RendererServices defines an abstract interface through which a 
 /// renderer may provide callback to the ShadingSystem.
 class OSLEXECPUBLIC RendererServices {
 public:
-    RendererServices () { }
+    /// Make a RendererServices whose default texture implementations
+    /// use the given TextureSystem (the shared one if NULL).
+    RendererServices (TextureSystem *texsys=NULL);
     virtual ~RendererServices () { }
 
+    /// Does the renderer support the named optional feature?  The
+    /// shading system asks before using any of these:
+    ///
+    ///   "texture_handles"  Texture lookups may go through the handle
+    ///                      version of texture() (see below), with
+    ///                      handles from get_texture_handle().
+    ///
+    /// The default supports none of them, so that a renderer only gets
+    /// the new behavior once it says it's ready for it.
+    virtual bool supports (const char *feature) const { return false; }
+
     /// Get the 4x4 matrix that transforms by the specified
     /// transformation at the given time.  Return true if ok, false
     /// on error.
@@ -424,6 +562,35 @@ public:
                           float s, float t, float dsdx, float dtdx,
                           float dsdy, float dtdy, float *result);
 
+#if OIIO_VERSION >= 10100
+    typedef TextureSystem::TextureHandle TextureHandle;
+    typedef TextureSystem::Perthread TexturePerthread;
+
+    /// Return an opaque handle for the named texture, or NULL if there
+    /// isn't one.  The shading system asks once, when it compiles a
+    /// texture() call whose filename is a constant, and passes the
+    /// handle to every lookup made by that call.  The default returns
+    /// the TextureSystem's handle if supports("texture_handles"), and
+    /// otherwise NULL, so that lookups keep going through the
+    /// filename-only texture() of renderers that override it.
+    virtual TextureHandle *get_texture_handle (ustring filename);
+
+    /// Return the texture system's per-thread info for the calling
+    /// thread.  Each ShadingContext asks once and keeps it.
+    virtual TexturePerthread *get_texture_perthread ();
+
+    /// Filtered 2D texture lookup for a single point, as above, but
+    /// with the handle from get_texture_handle (or NULL if there isn't
+    /// one, in which case this just calls the filename-only version)
+    /// and the per-thread info of the calling thread, so that the
+    /// lookup needs neither locks nor a search for the file.
+    virtual bool texture (ustring filename, TextureHandle *texture_handle,
+                          TexturePerthread *texture_thread_info,
+                          TextureOpt &options, ShaderGlobals *sg,
+                          float s, float t, float dsdx, float dtdx,
+                          float dsdy, float dtdy, float *result);
+#endif
+
     /// Filtered 3D texture lookup for a single point.
     ///
     /// P is the volumetric texture coordinate; dPd{x,y,z} are the
@@ -504,6 +671,10 @@ public:
         return false;
     }
 
+    /// Return the TextureSystem used by the default texture
+    /// implementations.
+    TextureSystem *texturesys () const { return m_texturesys; }
+
 private:
     TextureSystem *m_texturesys;   // For default texture implementation
 };
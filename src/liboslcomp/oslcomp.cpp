@@ -54,6 +54,8 @@ namespace Sysutil = OIIO::Sysutil;
 #define yyFlexLexer oslFlexLexer
 #include "FlexLexer.h"
 
+#include "../liboslexec/osoreader.h"
+
 #ifdef USE_BOOST_WAVE
 #include <boost/wave.hpp>
 #include <boost/wave/cpplexer/cpp_lex_token.hpp>
@@ -84,7 +86,8 @@ OSLCompilerImpl *oslcompiler = NULL;
 OSLCompilerImpl::OSLCompilerImpl ()
     : m_lexer(NULL), m_err(false), m_symtab(*this),
       m_current_typespec(TypeDesc::UNKNOWN), m_current_output(false),
-      m_verbose(false), m_quiet(false), m_debug(false), m_optimizelevel(1),
+      m_verbose(false), m_quiet(false), m_debug(false), m_binary_oso(false),
+      m_optimizelevel(1),
       m_next_temp(0), m_next_const(0),
       m_osofile(NULL), m_sourcefile(NULL), m_last_sourceline(0),
       m_total_nesting(0), m_loop_nesting(0), m_derivsym(NULL),
@@ -353,6 +356,8 @@ OSLCompilerImpl::compile (const std::string &filename,
             m_debug = true;
         } else if (options[i] == "-E") {
             preprocess_only = true;
+        } else if (options[i] == "-b") {
+            m_binary_oso = true;
         } else if (options[i] == "-o" && i < options.size()-1) {
             ++i;
             m_output_filename = options[i];
@@ -426,6 +431,8 @@ OSLCompilerImpl::compile (const std::string &filename,
             if (m_output_filename.size() == 0)
                 m_output_filename = default_output_filename ();
             write_oso_file (m_output_filename);
+            if (m_binary_oso && ! error_encountered())
+                write_binary_oso_file (m_output_filename);
         }
 
         oslcompiler = NULL;
@@ -797,6 +804,19 @@ OSLCompilerImpl::write_oso_file (const std::string &outfilename)
 
 
 
+void
+OSLCompilerImpl::write_binary_oso_file (const std::string &filename)
+{
+    // Read back the text .oso we just wrote and replace it with the
+    // equivalent binary form, so that there is only one description of
+    // what goes in an .oso (write_oso_file) and one of how it's read.
+    OSOReaderToBinary bin;
+    if (! bin.parse (filename) || ! bin.write (filename))
+        error (ustring(), 0, "Could not write binary \"%s\"", filename.c_str());
+}
+
+
+
 void
 OSLCompilerImpl::oso (const char *fmt, ...) const
 {
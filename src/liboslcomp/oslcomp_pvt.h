@@ -290,6 +290,7 @@ private:
     void initialize_builtin_funcs ();
     std::string default_output_filename ();
     void write_oso_file (const std::string &outfilename);
+    void write_binary_oso_file (const std::string &filename);
     void write_oso_const_value (const ConstantSymbol *sym) const;
     void write_oso_symbol (const Symbol *sym);
     void write_oso_metadata (const ASTNode *metanode) const;
@@ -359,6 +360,7 @@ private:
     bool m_verbose;           ///< Verbose mode
     bool m_quiet;             ///< Quiet mode
     bool m_debug;             ///< Debug mode
+    bool m_binary_oso;        ///< Write binary .oso?
     int m_optimizelevel;      ///< Optimization level
     OpcodeVec m_ircode;       ///< Generated IR code
     SymbolPtrVec m_opargs;    ///< Arguments for all instructions
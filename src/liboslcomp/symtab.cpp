@@ -224,7 +224,7 @@ SymbolTable::delete_syms ()
     for (SymbolPtrVec::iterator i = m_allsyms.begin(); i != m_allsyms.end(); ++i)
         delete (*i);
     m_allsyms.clear ();
-    TypeSpec::struct_list().clear ();
+    TypeSpec::clear_struct_list ();
 }
 
 
@@ -30,6 +30,7 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include "lpeparse.h"
 #include "oslclosure.h"
 #include "OpenImageIO/dassert.h"
+#include <OpenImageIO/timer.h>
 
 
 #ifdef OSL_NAMESPACE
@@ -37,6 +38,10 @@ namespace OSL_NAMESPACE {
 #endif
 namespace OSL {
 
+#ifdef OIIO_NAMESPACE
+using OIIO::Timer;
+#endif
+
 
 
 void
@@ -104,6 +109,7 @@ AccumAutomata::addRule(const char *pattern, int outidx, bool toalpha)
 void
 AccumAutomata::compile()
 {
+    Timer timer;
     NdfAutomata ndfautomata;
     for (std::list<lpexp::Rule *>::const_iterator i = m_rules.begin(); i != m_rules.end(); ++i) {
         (*i)->genAuto(ndfautomata);
@@ -113,7 +119,12 @@ AccumAutomata::compile()
     m_rules.clear();
     DfAutomata dfautomata;
     ndfautoToDfauto(ndfautomata, dfautomata);
+    m_ndf_states = ndfautomata.size();
+    m_df_states = dfautomata.size();
+    dfautomata.minimize();
+    dfautomata.removeUselessTransitions();
     m_dfoptautomata.compileFrom(dfautomata);
+    m_compile_time = timer();
 }
 
 
@@ -210,6 +221,21 @@ Accumulator::move(ustring event, ustring scatt, const ustring *custom, ustring s
 
 
 
+void
+Accumulator::move(int event, int scatt, const int *custom, int stop)
+{
+    if (m_state >= 0)
+        m_state = m_accum_automata->getTransition(m_state, event);
+    if (m_state >= 0)
+        m_state = m_accum_automata->getTransition(m_state, scatt);
+    while (m_state >= 0 && custom && *custom >= 0)
+        m_state = m_accum_automata->getTransition(m_state, *(custom++));
+    if (m_state >= 0)
+        m_state = m_accum_automata->getTransition(m_state, stop);
+}
+
+
+
 void
 Accumulator::begin()
 {
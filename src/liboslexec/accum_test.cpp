@@ -26,10 +26,16 @@ THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
 OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 */
 
+#include <cstring>
+#include <OpenImageIO/strutil.h>
+
 #include "accum.h"
 #include "oslclosure.h"
 
 using namespace OSL;
+#ifdef OIIO_NAMESPACE
+namespace Strutil = OIIO::Strutil;
+#endif
 
 #define END_AOV 65535
 
@@ -112,6 +118,77 @@ void simulate(Accumulator &accum, const char **events, int testno)
     accum.end((void *)(long int)testno);
 }
 
+// Same as simulate but with the integer label ids, which is what a
+// renderer would use after looking them up once
+void simulate_ids(Accumulator &accum, const AccumAutomata &automata,
+                  const char **events, int testno)
+{
+    int stop = automata.getLabelId(Labels::STOP);
+    accum.begin();
+    accum.pushState();
+    // every hit in the test cases is event, scattering and custom labels
+    while (*events) {
+        const char *e = *events;
+        int custom[8];
+        int ncustom = 0;
+        for (const char *c = e + 2; *c; ++c)
+            custom[ncustom++] = automata.getLabelId(ustring(c, 1));
+        custom[ncustom] = -1;
+        accum.move(automata.getLabelId(ustring(e, 1)),
+                   automata.getLabelId(ustring(e + 1, 1)), custom, stop);
+        events++;
+    }
+    accum.accum(Color3(1, 1, 1));
+    accum.popState();
+    accum.end((void *)(long int)testno);
+}
+
+// Walk the automata label by label, "/" stands for the stop label
+int walk(const AccumAutomata &automata, const char **labels)
+{
+    int state = 0;
+    for (; *labels && state >= 0; ++labels)
+        state = automata.getTransition(state, strcmp(*labels, "/") ? ustring(*labels) : Labels::STOP);
+    return state;
+}
+
+// Compile a production sized rule set, with per object and per light
+// outputs, and report how big the automata gets and how long it takes
+void bench_large_ruleset()
+{
+    const int nobjects = 64;
+    AccumAutomata automata;
+    for (int i = 0; i < nobjects; ++i) {
+        ASSERT(automata.addRule(Strutil::format("C[SG]*<.D'o%d'>D*L", i).c_str(), 2 * i));
+        ASSERT(automata.addRule(Strutil::format("C[SG]*D*<L.'l%d'>", i).c_str(), 2 * i + 1));
+    }
+    automata.compile();
+    std::cout << 2 * nobjects << " light expressions: "
+              << automata.getNdfStates() << " NDF states, "
+              << automata.getDfStates() << " DF states, "
+              << automata.getNumStates() << " after minimization, compiled in "
+              << Strutil::format("%.1f", 1.0e3 * automata.getCompileTime()) << " ms\n";
+    ASSERT(automata.getNumStates() <= automata.getDfStates());
+
+    // A diffuse bounce off object 5 lit by light 7 has to hit exactly those two rules
+    const char *path[] = { "C", "_", "/", "R", "D", "o5", "/", "L", "_", "l7", "/", NULL };
+    int state = walk(automata, path);
+    ASSERT(state >= 0);
+    int nrules = 0;
+    void * const * rules = automata.getRulesInState(state, nrules);
+    ASSERT(nrules == 2);
+    int outputs = 0;
+    for (int i = 0; i < nrules; ++i)
+        outputs |= 1 << (((AccumRule *)rules[i])->getOutputIndex() - 10);
+    ASSERT(outputs == ((1 << 0) | (1 << 5)));
+    // while a glossy bounce only gets to the light one
+    const char *glossy[] = { "C", "_", "/", "R", "G", "o5", "/", "L", "_", "l7", "/", NULL };
+    state = walk(automata, glossy);
+    ASSERT(state >= 0);
+    rules = automata.getRulesInState(state, nrules);
+    ASSERT(nrules == 1 && ((AccumRule *)rules[0])->getOutputIndex() == 15);
+}
+
 int main()
 {
     // Some constants to avoid refering to AOV's by number
@@ -186,5 +263,33 @@ int main()
     ASSERT(aovs[reflections ].check());
     ASSERT(aovs[nocaustic   ].check());
 
+    // The dense label id tables have to agree with the ustring lookups for
+    // every state, including labels no rule mentions
+    const char *labels[] = { "C", "R", "T", "D", "S", "G", "s", "L", "_", "1", "3", "x", NULL };
+    for (int s = 0; s < automata.getNumStates(); ++s) {
+        for (int l = 0; labels[l]; ++l)
+            ASSERT(automata.getTransition(s, automata.getLabelId(ustring(labels[l]))) ==
+                   automata.getTransition(s, ustring(labels[l])));
+        ASSERT(automata.getTransition(s, automata.getLabelId(Labels::STOP)) ==
+               automata.getTransition(s, Labels::STOP));
+    }
+    ASSERT(automata.getLabelId(ustring("x")) == 0);
+
+    // and run the whole thing again with label ids
+    for (int i = 0; test[i].path[0]; ++i)
+        simulate_ids(accum, automata, test[i].path, i);
+
+    ASSERT(aovs[beauty      ].check());
+    ASSERT(aovs[diffuse2_3  ].check());
+    ASSERT(aovs[light3      ].check());
+    ASSERT(aovs[object_1    ].check());
+    ASSERT(aovs[specular    ].check());
+    ASSERT(aovs[diffuse     ].check());
+    ASSERT(aovs[transpshadow].check());
+    ASSERT(aovs[reflections ].check());
+    ASSERT(aovs[nocaustic   ].check());
+
+    bench_large_ruleset();
+
     std::cout << "Light expressions check OK" << std::endl;
 }
@@ -47,8 +47,53 @@ namespace Strutil = OIIO::Strutil;
 
 ustring lambda("__lambda__");
 
+
+
+bool
+StateSet::empty()const
+{
+    for (size_t w = 0; w < m_bits.size(); ++w)
+        if (m_bits[w])
+            return false;
+    return true;
+}
+
+
+
+int
+StateSet::next(int i)const
+{
+    ++i;
+    for (size_t w = i >> 5; w < m_bits.size(); ++w, i = w << 5) {
+        unsigned int bits = m_bits[w] >> (i & 31);
+        if (bits) {
+            // there is one in this word, find it
+            while (!(bits & 1u)) {
+                bits >>= 1;
+                ++i;
+            }
+            return i;
+        }
+    }
+    return -1;
+}
+
+
+
+size_t
+StateSet::hash()const
+{
+    // FNV-1a on the words, these are dense and fit in very few of them
+    size_t h = 2166136261u;
+    for (size_t w = 0; w < m_bits.size(); ++w)
+        h = (h ^ m_bits[w]) * 16777619u;
+    return h;
+}
+
+
+
 void
-NdfAutomata::State::getTransitions(ustring symbol, IntSet &out_states)const
+NdfAutomata::State::getTransitions(ustring symbol, StateSet &out_states)const
 {
     SymbolToIntList::const_iterator s = m_symbol_trans.find(symbol);
     if (s != m_symbol_trans.end())
@@ -159,10 +204,10 @@ NdfAutomata::newState()
 
 
 void
-NdfAutomata::symbolsFrom(const IntSet &states, SymbolSet &out_symbols, Wildcard *&wildcard)const
+NdfAutomata::symbolsFrom(const StateSet &states, SymbolSet &out_symbols, Wildcard *&wildcard)const
 {
-    for (IntSet::const_iterator i = states.begin(); i != states.end(); ++i) {
-        const State *state = m_states[*i];
+    for (int i = states.first(); i >= 0; i = states.next(i)) {
+        const State *state = m_states[i];
         // For every state we have to go thorugh all the symbols in the transition table
         // m_symbol_trans and add them to the output
         for (SymbolToIntList::const_iterator j = state->m_symbol_trans.begin(); j != state->m_symbol_trans.end(); ++j)
@@ -180,8 +225,8 @@ NdfAutomata::symbolsFrom(const IntSet &states, SymbolSet &out_symbols, Wildcard
     if (wildcard) {
         // We have to make sure that all the symbols covered by the wildcards
         // are either covered by our wildcard or in out_symbols set
-        for (IntSet::const_iterator i = states.begin(); i != states.end(); ++i) {
-            const State *state = m_states[*i];
+        for (int i = states.first(); i >= 0; i = states.next(i)) {
+            const State *state = m_states[i];
             if (state->m_wildcard)
                 for (SymbolSet::const_iterator j = wildcard->m_minus.begin(); j != wildcard->m_minus.end(); ++j)
                     if (state->m_wildcard->matches(*j))
@@ -195,11 +240,11 @@ NdfAutomata::symbolsFrom(const IntSet &states, SymbolSet &out_symbols, Wildcard
 
 
 void
-NdfAutomata::transitionsFrom(const IntSet &states, ustring symbol, IntSet &out_states)const
+NdfAutomata::transitionsFrom(const StateSet &states, ustring symbol, StateSet &out_states)const
 {
-    for (IntSet::const_iterator i = states.begin(); i != states.end(); ++i)
+    for (int i = states.first(); i >= 0; i = states.next(i))
         // remember getTransitions is not destructive with out_states, it just adds stuff
-        m_states[*i]->getTransitions(symbol, out_states);
+        m_states[i]->getTransitions(symbol, out_states);
 
     lambdaClosure(out_states);
 }
@@ -207,10 +252,10 @@ NdfAutomata::transitionsFrom(const IntSet &states, ustring symbol, IntSet &out_s
 
 
 void
-NdfAutomata::wildcardTransitionsFrom(const IntSet &states, IntSet &out_states)const
+NdfAutomata::wildcardTransitionsFrom(const StateSet &states, StateSet &out_states)const
 {
-    for (IntSet::const_iterator i = states.begin(); i != states.end(); ++i) {
-        const State *state = m_states[*i];
+    for (int i = states.first(); i >= 0; i = states.next(i)) {
+        const State *state = m_states[i];
         if (state->m_wildcard)
             out_states.insert(state->m_wildcard_trans);
     }
@@ -220,43 +265,27 @@ NdfAutomata::wildcardTransitionsFrom(const IntSet &states, IntSet &out_states)co
 
 
 void
-NdfAutomata::lambdaClosure(IntSet &states)const
-{
-    // This algorithm basically keeps expanding the set until no new states appear
-    // to avoid checking over and over the same states we keep a frontier pair of sets
-    // so we only expand newly discovered states
-    std::vector<int> frontier, discovered;
-    // First iterate all the states in the given set
-    // and see what lambda transitions are there
-    for (IntSet::const_iterator i = states.begin(); i != states.end(); ++i) {
-        const State *state = m_states[*i];
+NdfAutomata::lambdaClosure(StateSet &states)const
+{
+    // This algorithm basically keeps expanding the set until no new states appear.
+    // To avoid checking over and over the same states we keep a stack with the
+    // states that still have to be expanded, initially the whole set
+    std::vector<int> frontier;
+    for (int i = states.first(); i >= 0; i = states.next(i))
+        frontier.push_back(i);
+    while (frontier.size()) {
+        const State *state = m_states[frontier.back()];
+        frontier.pop_back();
         std::pair <IntSet::const_iterator, IntSet::const_iterator> lr;
         // iterate all lambda transitions for this state
         for (lr = state->getLambdaTransitions(); lr.first != lr.second; lr.first++) {
-            // Add them to the set, and if they were not already there add to the
-            // frontier
-            std::pair<IntSet::iterator, bool> rec = states.insert(*(lr.first));
-            if (rec.second) // newly added
+            // Add them to the set, and if they were not already there
+            // they have to be expanded too
+            if (!states.contains(*(lr.first))) {
+                states.insert(*(lr.first));
                 frontier.push_back(*(lr.first));
-        }
-    }
-    // frontier becomes last discovered
-    frontier.swap(discovered); // swap discovered and frontier
-    while (discovered.size()) { // as long as there are new found states
-        frontier.clear();
-        // we do the same as in the above loop but with discovered instead of states
-        for (std::vector<int>::iterator i = discovered.begin(); i != discovered.end(); ++i) {
-            const State *state = m_states[*i];
-            std::pair <IntSet::const_iterator, IntSet::const_iterator> lr;
-            for (lr = state->getLambdaTransitions(); lr.first != lr.second; lr.first++) {
-                std::pair<IntSet::iterator, bool> rec = states.insert(*(lr.first));
-                if (rec.second)
-                    frontier.push_back(*(lr.first));
             }
-
         }
-        // again frontier becomes last discovered
-        frontier.swap(discovered); // swap discovered and frontier
     }
 }
 
@@ -284,17 +313,6 @@ NdfAutomata::~NdfAutomata()
 
 
 
-void keyFromStateSet(const IntSet &states, StateSetKey &out_key)
-{
-    out_key.clear(); // just in case
-    for (IntSet::const_iterator i = states.begin(); i != states.end(); ++i)
-        out_key.push_back(*i);
-    // Sort the ids so we make sure the vector is unique for each set
-    sort(out_key.begin(), out_key.end());
-}
-
-
-
 int
 DfAutomata::State::getTransition(ustring symbol)const
 {
@@ -337,16 +355,15 @@ DfAutomata::State::addWildcardTransition(Wildcard *wildcard, DfAutomata::State *
 void
 DfAutomata::State::removeUselessTransitions()
 {
-    if (m_wildcard_trans >= 0) {
-        std::list<SymbolToInt::iterator> toremove;
-        for (SymbolToInt::iterator i = m_symbol_trans.begin(); i != m_symbol_trans.end(); ++i)
-            // If there is a transition to the same state as the wildcard, we better nuke it
-            // and just add that symbol to the wildcard be removing it from the map itself
-            if (i->second == m_wildcard_trans)
-                toremove.push_back(i);
-        for (std::list<SymbolToInt::iterator>::iterator i = toremove.begin(); i != toremove.end(); ++i)
-            m_symbol_trans.erase(*i);
-    }
+    std::list<SymbolToInt::iterator> toremove;
+    for (SymbolToInt::iterator i = m_symbol_trans.begin(); i != m_symbol_trans.end(); ++i)
+        // If there is a transition to the same state as the wildcard, we better nuke it
+        // and just add that symbol to the wildcard be removing it from the map itself.
+        // This also drops the -1 black list entries when there is no wildcard.
+        if (i->second == m_wildcard_trans)
+            toremove.push_back(i);
+    for (std::list<SymbolToInt::iterator>::iterator i = toremove.begin(); i != toremove.end(); ++i)
+        m_symbol_trans.erase(*i);
 }
 
 
@@ -424,85 +441,212 @@ DfAutomata::tostr()const
 
 
 
-bool
-DfAutomata::equivalent(const State *dfstateA, const State *dfstateB)
-{
-    // early exit if the size of the tables is different
-    if (dfstateA->m_symbol_trans.size() != dfstateB->m_symbol_trans.size())
-        return false;
-    // The pointed state by both transitions have to be the same or any of dfstateA and dfstateB
-    int destA = (dfstateA->m_wildcard_trans == dfstateA->getId() || dfstateA->m_wildcard_trans == dfstateB->getId()) ? -2 : dfstateA->m_wildcard_trans;
-    int destB = (dfstateB->m_wildcard_trans == dfstateA->getId() || dfstateB->m_wildcard_trans == dfstateB->getId()) ? -2 : dfstateB->m_wildcard_trans;
-    if (destA != destB)
-        return false;
-    // Rules have to be the same
-    if (dfstateA->m_rules != dfstateB->m_rules)
-        return false;
-    for (SymbolToInt::const_iterator i = dfstateA->m_symbol_trans.begin(); i != dfstateA->m_symbol_trans.end(); ++i) {
-        SymbolToInt::const_iterator other = dfstateB->m_symbol_trans.find(i->first);
-        if (other == dfstateB->m_symbol_trans.end())
-            return false;
-        // The pointed state by both transitions have to be the same or any of dfstateA and dfstateB
-        int destA = (i->second == dfstateA->getId() || i->second == dfstateB->getId()) ? -2 : i->second;
-        int destB = (other->second == dfstateA->getId() || other->second == dfstateB->getId()) ? -2 : other->second;
-        // when they are -1 is because they are in the wildcard black list, anyway they have to match so ...
-        if (destA != destB)
-            return false;
-    }
-    // if everything passed, they are equivalent, congratulations.
-    return true;
-}
+// Helper for DfAutomata::minimize, this is the partition of the states
+// in blocks, kept as a permutation of the states where each block is a
+// contiguous range. It also supports marking states in a block (moving
+// them to the front of it) and splitting the marked ones off.
+class StatePartition {
+    public:
+        StatePartition(int nstates):
+            m_elems(nstates), m_loc(nstates), m_block(nstates, 0)
+        {
+            for (int i = 0; i < nstates; ++i)
+                m_elems[i] = m_loc[i] = i;
+        }
+
+        int size()const { return m_first.size(); };
+        int blockOf(int state)const { return m_block[state]; };
+        int blockSize(int b)const { return m_end[b] - m_first[b]; };
+        const int *blockBegin(int b)const { return &m_elems[m_first[b]]; };
+
+        /// Set the initial blocks from a block id for each state
+        void init(const std::vector<int> &blocks, int nblocks)
+        {
+            m_first.assign(nblocks, 0);
+            m_end.assign(nblocks, 0);
+            int n = m_elems.size();
+            for (int i = 0; i < n; ++i)
+                m_end[blocks[i]]++;
+            for (int b = 0, pos = 0; b < nblocks; ++b) {
+                m_first[b] = pos;
+                pos += m_end[b];
+                m_end[b] = m_first[b];
+            }
+            for (int i = 0; i < n; ++i) {
+                m_block[i] = blocks[i];
+                m_loc[i] = m_end[blocks[i]]++;
+                m_elems[m_loc[i]] = i;
+            }
+            m_mid = m_first;
+        }
+
+        /// Mark a state, returns true if it was the first one in its block
+        bool mark(int state)
+        {
+            int b = m_block[state];
+            int pos = m_loc[state];
+            if (pos < m_mid[b]) // already marked
+                return false;
+            bool first = m_mid[b] == m_first[b];
+            int other = m_elems[m_mid[b]];
+            std::swap(m_elems[pos], m_elems[m_mid[b]]);
+            m_loc[other] = pos;
+            m_loc[state] = m_mid[b]++;
+            return first;
+        }
+
+        /// Split the marked states of a block into a new block and return
+        /// its id, or -1 if they were the whole block. Clears the marks.
+        int split(int b)
+        {
+            if (m_mid[b] == m_end[b]) {
+                m_mid[b] = m_first[b];
+                return -1;
+            }
+            int nb = m_first.size();
+            m_first.push_back(m_first[b]);
+            m_end.push_back(m_mid[b]);
+            m_mid.push_back(m_first[b]);
+            m_first[b] = m_mid[b];
+            for (int i = m_first[nb]; i < m_end[nb]; ++i)
+                m_block[m_elems[i]] = nb;
+            return nb;
+        }
+
+    private:
+        std::vector<int> m_elems; // states, each block is contiguous in here
+        std::vector<int> m_loc;   // position of each state in m_elems
+        std::vector<int> m_block; // block of each state
+        std::vector<int> m_first, m_mid, m_end; // block ranges, [first, mid) are marked
+};
 
 
 
 void
-DfAutomata::removeEquivalentStates()
+DfAutomata::minimize()
 {
-    std::vector<State *> newstatelist;
-    HashIntInt newfromold;
+    int nstates = m_states.size();
+    if (!nstates)
+        return;
+    // Our alphabet is every symbol with an explicit transition somewhere
+    // plus an extra one that stands for all the others (the wildcards)
+    SymbolSet allsymbols;
+    for (int s = 0; s < nstates; ++s)
+        for (SymbolToInt::const_iterator i = m_states[s]->m_symbol_trans.begin(); i != m_states[s]->m_symbol_trans.end(); ++i)
+            allsymbols.insert(i->first);
+    std::vector<ustring> symbols(allsymbols.begin(), allsymbols.end());
+    int nsymbols = symbols.size() + 1;
+    // And the automata has to be complete, so we add a dead state at the
+    // end for all the -1 transitions
+    int dead = nstates;
+    int total = nstates + 1;
+    std::vector<int> delta(total * nsymbols, dead);
+    for (int s = 0; s < nstates; ++s) {
+        for (int c = 0; c < nsymbols; ++c) {
+            int dest = c < nsymbols - 1 ? m_states[s]->getTransition(symbols[c]) : m_states[s]->m_wildcard_trans;
+            delta[s * nsymbols + c] = dest < 0 ? dead : dest;
+        }
+    }
+    // Inverse transitions, the sources for symbol c and destination d are
+    // in inv[inv_begin[c * total + d] .. inv_begin[c * total + d + 1])
+    std::vector<int> inv_begin(nsymbols * total + 1, 0);
+    std::vector<int> inv(delta.size());
+    for (int s = 0; s < total; ++s)
+        for (int c = 0; c < nsymbols; ++c)
+            inv_begin[c * total + delta[s * nsymbols + c] + 1]++;
+    for (size_t i = 1; i < inv_begin.size(); ++i)
+        inv_begin[i] += inv_begin[i-1];
+    {
+        std::vector<int> cursor(inv_begin.begin(), inv_begin.end() - 1);
+        for (int s = 0; s < total; ++s)
+            for (int c = 0; c < nsymbols; ++c)
+                inv[cursor[c * total + delta[s * nsymbols + c]]++] = s;
+    }
 
-    // First go through all states and delete all those
-    // that are equivalent with a previous one
-    for (size_t i = 0; i < m_states.size(); ++i) {
-        if (!m_states[i]) // it has already been removed
-            continue;
-        // create a new state id from newstatelist.size()
-        // move the pointer there and register the translation
-        int newstate = newfromold[i] = newstatelist.size();
-        newstatelist.push_back(m_states[i]);
-        for (size_t j = i + 1; j < m_states.size(); ++j)
-            if (m_states[j] && equivalent(m_states[i], m_states[j])) {
-                // put in the record that this state will be known as
-                // the one in newstate from now on
-                newfromold[j] = newstate;
-                delete m_states[j];
-                m_states[j] = NULL;
-            }
+    // Initial partition, states with the same rules (the dead state has none)
+    std::map<RuleSet, int> ruleblocks;
+    std::vector<int> initial(total);
+    for (int s = 0; s < total; ++s) {
+        RuleSet rules;
+        if (s != dead) {
+            rules = m_states[s]->m_rules;
+            std::sort(rules.begin(), rules.end());
+        }
+        std::map<RuleSet, int>::iterator i = ruleblocks.find(rules);
+        if (i == ruleblocks.end())
+            i = ruleblocks.insert(std::make_pair(rules, (int)ruleblocks.size())).first;
+        initial[s] = i->second;
     }
-    // Everything has been moved now, but we still have to fix the
-    // transitions so they point to the right states!
-    for (size_t i = 0; i < newstatelist.size(); ++i) {
-        State *state = newstatelist[i];
-        for (SymbolToInt::iterator j = state->m_symbol_trans.begin(); j != state->m_symbol_trans.end(); ++j) {
-            if (j->second != -1) { // if it is -1 it is just in the wildcards black list
-                // Get the new state that maps to the oldstate pointed by the transition
-                HashIntInt::const_iterator trans = newfromold.find(j->second);
-                if (trans != newfromold.end())
-                    j->second = trans->second;
+    StatePartition partition(total);
+    partition.init(initial, ruleblocks.size());
+
+    // Hopcroft's refinement. We use whole blocks as splitters for all
+    // the symbols at once and only queue the smaller half of a split
+    // block unless the block was already waiting.
+    std::vector<int> worklist;
+    std::vector<bool> waiting(partition.size(), true);
+    for (int b = 0; b < partition.size(); ++b)
+        worklist.push_back(b);
+    std::vector<int> splitter, touched;
+    while (worklist.size()) {
+        int a = worklist.back();
+        worklist.pop_back();
+        waiting[a] = false;
+        // copy it, it might get split while we use it
+        splitter.assign(partition.blockBegin(a), partition.blockBegin(a) + partition.blockSize(a));
+        for (int c = 0; c < nsymbols; ++c) {
+            touched.clear();
+            for (size_t i = 0; i < splitter.size(); ++i) {
+                int key = c * total + splitter[i];
+                for (int j = inv_begin[key]; j < inv_begin[key + 1]; ++j)
+                    if (partition.mark(inv[j]))
+                        touched.push_back(partition.blockOf(inv[j]));
+            }
+            for (size_t i = 0; i < touched.size(); ++i) {
+                int b = touched[i];
+                int nb = partition.split(b);
+                if (nb < 0)
+                    continue;
+                waiting.push_back(false);
+                if (waiting[b] || partition.blockSize(nb) <= partition.blockSize(b))
+                    worklist.push_back(nb);
                 else
-                    std::cerr << "[pathexp] broken translation list between states" << std::endl;
+                    worklist.push_back(b);
+                waiting[worklist.back()] = true;
             }
         }
-        // Do the same with the wildcard
-        if (state->m_wildcard_trans >=0) {
-            HashIntInt::const_iterator trans = newfromold.find(state->m_wildcard_trans);
-            if (trans != newfromold.end())
-                state->m_wildcard_trans = trans->second;
-            else
-                std::cerr << "[pathexp] broken translation list between states" << std::endl;
-        }
     }
-    // switch to the new hopefully reduced state vector
+
+    // Now every block is a state. The dead one is gone (-1), and the rest
+    // get new ids in order of their first state, so the initial state
+    // stays 0. We reuse the first state of each block and delete the others.
+    std::vector<int> newid(partition.size(), -2);
+    newid[partition.blockOf(dead)] = -1;
+    if (partition.blockOf(0) == partition.blockOf(dead)) {
+        // Nothing can ever be accepted, leave a lonely initial state
+        clear();
+        newState();
+        return;
+    }
+    std::vector<State *> newstatelist;
+    for (int s = 0; s < nstates; ++s) {
+        int &id = newid[partition.blockOf(s)];
+        if (id == -2) {
+            id = newstatelist.size();
+            newstatelist.push_back(m_states[s]);
+        } else
+            delete m_states[s];
+    }
+    // Finally fix the transitions so they point to the right states
+    for (size_t i = 0; i < newstatelist.size(); ++i) {
+        State *state = newstatelist[i];
+        state->m_id = i;
+        for (SymbolToInt::iterator j = state->m_symbol_trans.begin(); j != state->m_symbol_trans.end(); ++j)
+            if (j->second >= 0) // if it is -1 it is just in the wildcards black list
+                j->second = newid[partition.blockOf(j->second)];
+        if (state->m_wildcard_trans >= 0)
+            state->m_wildcard_trans = newid[partition.blockOf(state->m_wildcard_trans)];
+    }
     m_states = newstatelist;
 }
 
@@ -535,20 +679,17 @@ DfAutomata::~DfAutomata()
 
 
 DfAutomata::State *
-StateSetRecord::ensureState(const IntSet &newstates, std::list<StateSetRecord::Discovery> &discovered)
+StateSetRecord::ensureState(const StateSet &newstates, std::list<StateSetRecord::Discovery> &discovered)
 {
-    // create the key
-    StateSetKey newkey;
-    keyFromStateSet(newstates, newkey);
     // check if it is there
-    StateSetMap::const_iterator i = m_key_to_dfstate.find(newkey);
+    StateSetMap::const_iterator i = m_key_to_dfstate.find(newstates);
     if (i != m_key_to_dfstate.end())
         return i->second;
     else {
         // if not in our records create a new DF state
         DfAutomata::State *tstate = m_dfautomata.newState();
         getRulesFromSet(tstate, m_ndfautomata, newstates);
-        m_key_to_dfstate[newkey] = tstate;
+        m_key_to_dfstate[newstates] = tstate;
         // Add the discovery to the list so it will be explored
         discovered.push_back(Discovery(tstate, newstates));
         return tstate;
@@ -558,10 +699,10 @@ StateSetRecord::ensureState(const IntSet &newstates, std::list<StateSetRecord::D
 
 
 void
-StateSetRecord::getRulesFromSet(DfAutomata::State *dfstate, const NdfAutomata &ndfautomata, const IntSet &ndfstates)
+StateSetRecord::getRulesFromSet(DfAutomata::State *dfstate, const NdfAutomata &ndfautomata, const StateSet &ndfstates)
 {
-    for (IntSet::const_iterator i = ndfstates.begin(); i != ndfstates.end(); ++i) {
-        const NdfAutomata::State *ndfstate = ndfautomata.getState(*i);
+    for (int i = ndfstates.first(); i >= 0; i = ndfstates.next(i)) {
+        const NdfAutomata::State *ndfstate = ndfautomata.getState(i);
         if (ndfstate->getRule())
             dfstate->addRule(ndfstate->getRule());
     }
@@ -575,7 +716,7 @@ ndfautoToDfauto(const NdfAutomata &ndfautomata, DfAutomata &dfautomata)
     std::list<StateSetRecord::Discovery> toexplore, discovered;
     // our initial state is the lambda closure
     // of the initial state in the NDF automata
-    IntSet initial;
+    StateSet initial(ndfautomata.size());
     initial.insert(0);
     ndfautomata.lambdaClosure(initial);
     StateSetRecord record(ndfautomata, dfautomata);
@@ -594,7 +735,7 @@ ndfautoToDfauto(const NdfAutomata &ndfautomata, DfAutomata &dfautomata)
             Wildcard *wildcard = NULL;
             ndfautomata.symbolsFrom(i->second, symbols, wildcard);
             for (SymbolSet::iterator j = symbols.begin(); j != symbols.end(); ++j) {
-                IntSet newstates;
+                StateSet newstates(ndfautomata.size());
                 // get all the states reachable with this symbol
                 ndfautomata.transitionsFrom(i->second, *j, newstates);
                 // build or recover the associated DF state
@@ -603,7 +744,7 @@ ndfautoToDfauto(const NdfAutomata &ndfautomata, DfAutomata &dfautomata)
                 i->first->addTransition(*j, next_state);
             }
             if (wildcard) {
-                IntSet newstates;
+                StateSet newstates(ndfautomata.size());
                 // we know they all match whatever ours match
                 ndfautomata.wildcardTransitionsFrom(i->second, newstates);
                 // build or recover the associated DF state
@@ -615,9 +756,6 @@ ndfautoToDfauto(const NdfAutomata &ndfautomata, DfAutomata &dfautomata)
         // swap toexplore and discovered
         toexplore.swap(discovered);
     }
-    // final optimizations
-    dfautomata.removeEquivalentStates();
-    dfautomata.removeUselessTransitions();
 }
 
 
@@ -661,6 +799,51 @@ DfOptimizedAutomata::compileFrom(const DfAutomata &dfautomata)
                      DfOptimizedAutomata::Transition::trans_comp);
         m_states[s].wildcard_trans = dfautomata.m_states[s]->m_wildcard_trans;
     }
+
+    // Intern all the labels that show up in transitions to small integer
+    // ids, and flatten the transitions into a dense state x label table
+    // with the wildcard transition in column 0 for all the other labels.
+    m_label_ids.clear();
+    m_label_ids.reserve(m_trans.size());
+    for (size_t t = 0; t < m_trans.size(); ++t)
+        m_label_ids.push_back(m_trans[t]);
+    std::sort(m_label_ids.begin(), m_label_ids.end(), DfOptimizedAutomata::Transition::trans_comp);
+    size_t nlabels = 0;
+    for (size_t t = 0; t < m_label_ids.size(); ++t) {
+        if (nlabels && m_label_ids[nlabels-1].symbol == m_label_ids[t].symbol)
+            continue;
+        m_label_ids[nlabels] = m_label_ids[t];
+        m_label_ids[nlabels].state = nlabels + 1;
+        ++nlabels;
+    }
+    m_label_ids.resize(nlabels);
+    m_nlabels = nlabels + 1;
+    m_table.resize(m_states.size() * m_nlabels);
+    for (size_t s = 0; s < m_states.size(); ++s) {
+        int *row = &m_table[s * m_nlabels];
+        row[0] = m_states[s].wildcard_trans;
+        for (size_t l = 0; l < nlabels; ++l)
+            row[l+1] = getTransition(s, m_label_ids[l].symbol);
+    }
+}
+
+
+
+int
+DfOptimizedAutomata::getLabelId(ustring symbol)const
+{
+    const Transition *begin = m_label_ids.empty() ? NULL : &m_label_ids[0];
+    const Transition *end = begin + m_label_ids.size();
+    while (begin < end) { // binary search
+        const Transition *middle = begin + ((end - begin)>>1);
+        if (symbol.data() < middle->symbol.data())
+            end = middle;
+        else if (middle->symbol.data() < symbol.data())
+            begin = middle + 1;
+        else // match
+            return middle->state;
+    }
+    return 0;
 }
 
 
@@ -71,6 +71,38 @@ typedef hash_map<int, int> HashIntInt;
 
 #endif // OIIO_HAVE_BOOST_UNORDERED_MAP
 
+/// Set of state ids of a NDF automata as a fixed size bit set
+///
+/// The subset construction handles lots of these, so they have to be
+/// cheap to build, merge, compare and hash. All the sets that are
+/// combined together must be created with the same number of states.
+class StateSet {
+    public:
+        StateSet(size_t nstates = 0):m_bits((nstates + 31) >> 5, 0u) {};
+
+        void insert(int i) { m_bits[i >> 5] |= 1u << (i & 31); };
+        bool contains(int i)const { return (m_bits[i >> 5] >> (i & 31)) & 1u; };
+        bool empty()const;
+
+        /// Iterate the ids in the set with
+        /// for (int i = set.first(); i >= 0; i = set.next(i))
+        int first()const { return next(-1); };
+        /// Next id in the set after i or -1 if there are no more
+        int next(int i)const;
+
+        size_t hash()const;
+        bool operator==(const StateSet &other)const { return m_bits == other.m_bits; };
+
+    private:
+        std::vector<unsigned int> m_bits;
+};
+
+struct StateSetHash {
+    size_t operator()(const StateSet &s)const { return s.hash(); };
+};
+
+
+
 // For the rules in the deterministic states, we don't need a real set
 // cause when converting from the NDF automata we will never find the same
 // rule twice
@@ -124,7 +156,7 @@ class NdfAutomata {
                 ///
                 /// It doesn't clean the given result set, so you can use this
                 /// function to accumulate states.
-                void getTransitions (ustring symbol, IntSet &out_states)const;
+                void getTransitions (ustring symbol, StateSet &out_states)const;
 
                 /// Get all the lambda transitions
                 ///
@@ -188,18 +220,18 @@ class NdfAutomata {
         /// match the returned wildcard (if present). And the union of out_symbols
         /// and those matched by the wildcard, are all the valid transitions from
         /// the given state set
-        void symbolsFrom(const IntSet &states, SymbolSet &out_symbols, Wildcard *&wildcard)const;
+        void symbolsFrom(const StateSet &states, SymbolSet &out_symbols, Wildcard *&wildcard)const;
 
         /// Get the set of states that are reachable from the given state set using the given symbol
-        void transitionsFrom(const IntSet &states, ustring symbol, IntSet &out_states)const;
+        void transitionsFrom(const StateSet &states, ustring symbol, StateSet &out_states)const;
         /// Get the set of states that are reachable from the given state set by lambda
-        void wildcardTransitionsFrom(const IntSet &states, IntSet &out_states)const;
+        void wildcardTransitionsFrom(const StateSet &states, StateSet &out_states)const;
 
         /// Perform a lambda closure of a state set
         ///
         /// In other words, complete the given set so it includes all the aditional
         /// states that are reachable by the lambda symbol
-        void lambdaClosure(IntSet &states)const;
+        void lambdaClosure(StateSet &states)const;
 
         /// for debuging purposes
         std::string tostr()const;
@@ -211,17 +243,6 @@ class NdfAutomata {
 
 
 
-// We need to make a set of sets of integers (states). For doing that
-// we need a unique key for a single set, which is going to be the list
-// of state ids sorted by value. And this is the type that is going to hold
-// that. Legal to use in a std::set
-typedef std::vector<int> StateSetKey;
-
-// Compute the unique key for the given set of states
-void keyFromStateSet(const IntSet &states, StateSetKey &out_key);
-
-
-
 /// Deterministic Finite Automata
 ///
 /// This is a ready to use for parsing finite state automata where every
@@ -289,7 +310,12 @@ class DfAutomata {
         void clear();
 
         /// Colapse all the equivalent states into single ones
-        void removeEquivalentStates();
+        ///
+        /// This is Hopcroft's partition refinement, so the result is the
+        /// minimal automata recognizing the same paths with the same rules.
+        /// States that can't lead to any rule are dropped and their
+        /// transitions replaced by -1.
+        void minimize();
         /// Go through all the states and perform removeUselessTransitions
         /// method call on them
         void removeUselessTransitions();
@@ -299,12 +325,6 @@ class DfAutomata {
 
     protected:
 
-        /// Return true if two states are equivalent
-        ///
-        /// Two states are equivalent if their transition tables lead
-        /// to the same states for the same symbols
-        bool equivalent(const State *dfstateA, const State *dfstateB);
-
         // State vector with the automata
         std::vector<State *> m_states;
 };
@@ -322,20 +342,24 @@ class StateSetRecord {
 
         // A new found state is defined by the deterministic state created
         // for it and the state(int) set in the original automata
-        typedef std::pair<DfAutomata::State *, IntSet> Discovery;
-        // The type that will index our new created states indexed by the set key
-        typedef std::map<StateSetKey, DfAutomata::State *> StateSetMap;
+        typedef std::pair<DfAutomata::State *, StateSet> Discovery;
+        // The type that will index our new created states indexed by the set
+#ifdef OIIO_HAVE_BOOST_UNORDERED_MAP
+        typedef boost::unordered_map<StateSet, DfAutomata::State *, StateSetHash> StateSetMap;
+#else
+        typedef hash_map<StateSet, DfAutomata::State *, StateSetHash> StateSetMap;
+#endif
 
         /// Take a state set and build a new df state (or return existing one)
         /// Also, if it was newly created, append it to the discovered list so we
         /// can iterate over it later
-        DfAutomata::State *ensureState(const IntSet &newstates, std::list<Discovery> &discovered);
+        DfAutomata::State *ensureState(const StateSet &newstates, std::list<Discovery> &discovered);
 
     private:
 
         /// Gather all the rules from the original automata in the given sets (if any)
         /// and put them in the dfstate rule set
-        void getRulesFromSet(DfAutomata::State *dfstate, const NdfAutomata &ndfautomata, const IntSet &ndfstates);
+        void getRulesFromSet(DfAutomata::State *dfstate, const NdfAutomata &ndfautomata, const StateSet &ndfstates);
 
         const NdfAutomata &m_ndfautomata;
         DfAutomata &m_dfautomata;
@@ -348,7 +372,8 @@ class StateSetRecord {
 ///
 /// This function is the most important pice of the whole process. It takes
 /// a non-deterministic finite automata and computes an equivalent deterministic
-/// one. It is equivalente in the sense that they  both recognize the same language
+/// one. It is equivalente in the sense that they  both recognize the same language.
+/// The result is not minimized, call DfAutomata::minimize on it afterwards.
 void ndfautoToDfauto(const NdfAutomata &ndfautomata, DfAutomata &dfautomata);
 
 }; // namespace OSL
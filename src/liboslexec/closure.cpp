@@ -29,6 +29,7 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <vector>
 #include <string>
 #include <cstdio>
+#include <cstring>
 
 #include <OpenImageIO/dassert.h>
 #include <OpenImageIO/sysutil.h>
@@ -54,51 +55,6 @@ operator<< (std::ostream &out, const ClosurePrimitive &prim)
     return out;
 }
 
-/*
-void
-ClosureColor::flatten (ClosureColor *closure, const Color3 &w, ShadingSystemImpl *ss)
-{
-    ClosureComponent *comp;
-
-    if (closure == NULL)
-        return;
-
-    switch (closure->type) {
-        case ClosureColor::CLOSURE_MUL:
-            flatten((ClosureColor *)((ClosureMul *)closure)->closure, ((ClosureMul *)closure)->weight * w, ss);
-            break;
-        case ClosureColor::CLOSURE_ADD:
-            flatten((ClosureColor *)((ClosureAdd *)closure)->closureA, w, ss);
-            flatten((ClosureColor *)((ClosureAdd *)closure)->closureB, w, ss);
-            break;
-        case ClosureColor::CLOSURE_COMPONENT:
-            comp = (ClosureComponent *)closure;
-            comp->weight *= w;
-            if (comp->weight[0] != 0.0f || comp->weight[1] != 0.0f || comp->weight[2] != 0.0f)
-            {
-                for (int i = 0; i < ncomponents(); ++i)
-                {
-                    ClosureComponent *existing = m_components[i];
-                    if (existing->id != comp->id) continue;
-                    const ClosureRegistry::ClosureEntry *closure = ss->find_closure(comp->id);
-                    DASSERT(closure != NULL);
-                    CompareClosureFunc compare = closure->compare;
-                    if (compare ? compare(comp->id, comp->mem, existing->mem) : !memcmp(comp->mem, existing->mem, closure->struct_size))
-                    {
-                        existing->weight += comp->weight;
-                        comp = NULL;
-                        break;
-                    }
-                }
-                if (comp)
-                    push_component(comp);
-            }
-            break;
-    }
-}
-*/
-
-
 
 
 const ustring Labels::NONE       = ustring(NULL);
@@ -204,6 +160,87 @@ print_closure (std::ostream &out, const ClosureColor *closure, ShadingSystemImpl
 
 
 
+/// Are components a and b (of the same closure entry) the same closure,
+/// apart from their weights?
+static inline bool
+mergeable (const ClosureRegistry::ClosureEntry *clentry,
+           const ClosureComponent *a, const ClosureComponent *b)
+{
+    if (a->id != b->id || a->size != b->size || a->nattrs != b->nattrs)
+        return false;
+    CompareClosureFunc compare = clentry->compare;
+    if (compare ? ! compare (a->id, a->data(), b->data())
+                : memcmp (a->data(), b->data(), a->size))
+        return false;
+    return ! a->nattrs ||
+        ! memcmp (a->attrs(), b->attrs(), a->nattrs * sizeof(ClosureComponent::Attr));
+}
+
+
+
+static int
+flatten_closure (const ShadingSystemImpl &ss, const ClosureColor *closure,
+                 Color3 w, FlatClosureComponent *comps, int ncomps,
+                 int maxcomps)
+{
+    // Walk down MUL nodes and the second branch of ADD nodes in place,
+    // recursing only into the first branch of each ADD.
+    while (closure) {
+        if (w[0] == 0.0f && w[1] == 0.0f && w[2] == 0.0f)
+            return ncomps;   // Everything below contributes nothing
+        switch (closure->type) {
+        case ClosureColor::MUL:
+            w *= ((const ClosureMul *)closure)->weight;
+            closure = ((const ClosureMul *)closure)->closure;
+            break;
+        case ClosureColor::ADD:
+            ncomps = flatten_closure (ss, ((const ClosureAdd *)closure)->closureA,
+                                      w, comps, ncomps, maxcomps);
+            closure = ((const ClosureAdd *)closure)->closureB;
+            break;
+        case ClosureColor::COMPONENT: {
+            const ClosureComponent *comp = (const ClosureComponent *)closure;
+            const ClosureRegistry::ClosureEntry *clentry = ss.find_closure (comp->id);
+            DASSERT (clentry != NULL);
+            for (int i = 0;  i < ncomps;  ++i) {
+                if (mergeable (clentry, comps[i].comp, comp)) {
+                    comps[i].weight += w;
+                    return ncomps;
+                }
+            }
+            if (ncomps < maxcomps) {
+                comps[ncomps].weight = w;
+                comps[ncomps].comp = comp;
+                ++ncomps;
+            }
+            return ncomps;
+        }
+        }
+    }
+    return ncomps;
+}
+
+
+
+int
+ShadingSystemImpl::flatten_closure (const ClosureColor *closure,
+                                    FlatClosureComponent *comps,
+                                    int maxcomps) const
+{
+    int ncomps = pvt::flatten_closure (*this, closure, Color3 (1, 1, 1),
+                                       comps, 0, maxcomps);
+    // Merging may have cancelled some weights out entirely
+    int n = 0;
+    for (int i = 0;  i < ncomps;  ++i) {
+        const Color3 &w (comps[i].weight);
+        if (w[0] != 0.0f || w[1] != 0.0f || w[2] != 0.0f)
+            comps[n++] = comps[i];
+    }
+    return n;
+}
+
+
+
 } // namespace pvt
 
 
@@ -53,7 +53,11 @@ using OIIO::Timer;
 ShadingContext::ShadingContext (ShadingSystemImpl &shadingsys,
                                 PerThreadInfo *threadinfo) 
     : m_shadingsys(shadingsys), m_renderer(m_shadingsys.renderer()),
-      m_attribs(NULL), m_dictionary(NULL), m_next_failed_attrib(0)
+#if OIIO_VERSION >= 10100
+      m_texture_thread_info(NULL),
+#endif
+      m_attribs(NULL), m_heap_point_size(0), m_heap_points(0),
+      m_sampled_group(NULL), m_unsampled_runs(0), m_dictionary(NULL), m_next_failed_attrib(0)
 {
     m_shadingsys.m_stat_contexts += 1;
     m_threadinfo = threadinfo ? threadinfo : shadingsys.get_perthread_info ();
@@ -64,17 +68,14 @@ ShadingContext::ShadingContext (ShadingSystemImpl &shadingsys,
 ShadingContext::~ShadingContext ()
 {
     m_shadingsys.m_stat_contexts -= 1;
-    for (RegexMap::iterator it = m_regex_map.begin(); it != m_regex_map.end(); ++it) {
-      delete it->second;
-    }
     free_dict_resources ();
 }
 
 
 
 bool
-ShadingContext::execute (ShaderUse use, ShadingAttribState &sas,
-                         ShaderGlobals &ssg, bool run)
+ShadingContext::prepare_execution (ShaderUse use, ShadingAttribState &sas,
+                                   int npoints)
 {
     DASSERT (use == ShadUseSurface);  // FIXME
 
@@ -82,18 +83,39 @@ ShadingContext::execute (ShaderUse use, ShadingAttribState &sas,
     m_attribs = &sas;
     m_closures_allotted = 0;
 
-    if (shadingsys().m_groups_to_compile_count) {
-        // If we are greedily JITing, optimize/JIT everything now
-        shadingsys().optimize_all_groups ();
-    }
-
-    // Optimize if we haven't already
+    // Optimize if we haven't already.  If we are greedily JITing, the
+    // background workers may already have it (or be working on it, in
+    // which case optimize_group will wait for them), but we never wait
+    // on the rest of their backlog.
     ShaderGroup &sgroup (sas.shadergroup (use));
     if (sgroup.nlayers()) {
         sgroup.start_running ();
         if (! sgroup.optimized()) {
             shadingsys().optimize_group (sas, sgroup);
         }
+        // Hot groups compiled quickly at tier 1 get re-JITed in the
+        // background; we keep running the tier 1 code meanwhile.  We
+        // count our consecutive runs of the same group here and only
+        // every so often credit them to it, so there's no shared write
+        // on every execute.  Switching groups credits the new group's
+        // first run right away (and forgets the few runs of the old
+        // one not yet credited), so renderers that interleave groups
+        // still get their hot ones promoted.
+        int tieredjit = shadingsys().m_tieredjit;
+        if (tieredjit > 0) {
+            bool switched = (&sgroup != m_sampled_group);
+            if (switched) {
+                m_sampled_group = &sgroup;
+                m_unsampled_runs = 0;
+            }
+            m_unsampled_runs += npoints;
+            if (switched || m_unsampled_runs >= std::min (tieredjit, 64)) {
+                long long runs = sgroup.count_hot_runs (m_unsampled_runs);
+                m_unsampled_runs = 0;
+                if (sgroup.llvm_tier2_pending() && runs >= tieredjit)
+                    shadingsys().request_tier2 (sas, sgroup);
+            }
+        }
         if (sgroup.does_nothing())
             return false;
     } else {
@@ -101,8 +123,21 @@ ShadingContext::execute (ShaderUse use, ShadingAttribState &sas,
        return false; 
     }
 
-    // Allocate enough space on the heap
-    size_t heap_size_needed = sgroup.llvm_groupdata_size();
+    // Set up closure storage
+    m_closure_pool.clear();
+    return true;
+}
+
+
+
+void
+ShadingContext::allocate_heap (ShaderGroup &sgroup, int npoints)
+{
+    // Round each point's slice up so that every point's group data
+    // starts with the same alignment as the first.
+    m_heap_point_size = (sgroup.llvm_groupdata_size() + 15) & ~size_t(15);
+    m_heap_points = npoints;
+    size_t heap_size_needed = m_heap_point_size * npoints;
     if (heap_size_needed > m_heap.size()) {
         if (shadingsys().debug())
             shadingsys().info ("  ShadingContext %p growing heap to %llu",
@@ -112,9 +147,20 @@ ShadingContext::execute (ShaderUse use, ShadingAttribState &sas,
     // Zero out the heap memory we will be using
     if (shadingsys().m_clearmemory)
         memset (&m_heap[0], 0, heap_size_needed);
+}
+
 
-    // Set up closure storage
-    m_closure_pool.clear();
+
+bool
+ShadingContext::execute (ShaderUse use, ShadingAttribState &sas,
+                         ShaderGlobals &ssg, bool run)
+{
+    if (! prepare_execution (use, sas))
+        return false;
+
+    // Allocate enough space on the heap
+    ShaderGroup &sgroup (sas.shadergroup (use));
+    allocate_heap (sgroup, 1);
 
     // Clear the message blackboard
     m_messages.clear ();
@@ -125,6 +171,7 @@ ShadingContext::execute (ShaderUse use, ShadingAttribState &sas,
         RunLLVMGroupFunc run_func = sgroup.llvm_compiled_version();
         DASSERT (run_func);
         DASSERT (sgroup.llvm_groupdata_size() <= m_heap.size());
+        sgroup.init_params (&m_heap[0]);
         run_func (&ssg, &m_heap[0]);
     }
     return true;
@@ -132,6 +179,134 @@ ShadingContext::execute (ShaderUse use, ShadingAttribState &sas,
 
 
 
+bool
+ShadingContext::execute_batch (ShaderUse use, ShadingAttribState &sas,
+                               ShaderGlobals *ssg, int npoints,
+                               const Runflag *runflags, bool run)
+{
+    if (npoints < 1 || ! prepare_execution (use, sas, npoints))
+        return false;
+
+    // Allocate a slice of the heap for each point in the batch
+    ShaderGroup &sgroup (sas.shadergroup (use));
+    allocate_heap (sgroup, npoints);
+
+    if (run) {
+        RunLLVMGroupFunc run_func = sgroup.llvm_compiled_version();
+        DASSERT (run_func);
+        char *heap = &m_heap[0];
+        for (int i = 0;  i < npoints;  ++i, heap += m_heap_point_size) {
+            ssg[i].Ci = NULL;
+            if (runflags && runflags[i] == RunflagOff)
+                continue;
+            // Messages are private to each point, but closures are
+            // kept for the whole batch.
+            m_messages.clear ();
+            ssg[i].context = this;
+            sgroup.init_params (heap);
+            run_func (&ssg[i], heap);
+        }
+        ShadingStats &stats (m_shadingsys.thread_stats (m_threadinfo));
+        stats.batches += 1;
+        stats.batch_points += npoints;
+    }
+    return true;
+}
+
+
+
+/// Copy point i of a ShaderGlobalsBatch into sg, to run it by itself.
+static void
+batch_point_globals (const ShaderGlobalsBatch &b, int i, ShaderGlobals &sg)
+{
+    sg.P = b.P.get(i);  sg.dPdx = b.dPdx.get(i);  sg.dPdy = b.dPdy.get(i);
+    sg.dPdz = b.dPdz.get(i);
+    sg.I = b.I.get(i);  sg.dIdx = b.dIdx.get(i);  sg.dIdy = b.dIdy.get(i);
+    sg.N = b.N.get(i);
+    sg.Ng = b.Ng.get(i);
+    sg.u = b.u[i];  sg.dudx = b.dudx[i];  sg.dudy = b.dudy[i];
+    sg.v = b.v[i];  sg.dvdx = b.dvdx[i];  sg.dvdy = b.dvdy[i];
+    sg.dPdu = b.dPdu.get(i);  sg.dPdv = b.dPdv.get(i);
+    sg.time = b.time[i];
+    sg.dtime = b.dtime[i];
+    sg.dPdtime = b.dPdtime.get(i);
+    sg.Ps = b.Ps.get(i);  sg.dPsdx = b.dPsdx.get(i);  sg.dPsdy = b.dPsdy.get(i);
+    sg.renderstate = b.renderstate[i];
+    sg.tracedata = b.tracedata[i];
+    sg.objdata = b.objdata[i];
+    sg.context = b.context;
+    sg.object2common = b.object2common[i];
+    sg.shader2common = b.shader2common[i];
+    sg.Ci = NULL;
+    sg.surfacearea = b.surfacearea[i];
+    sg.raytype = b.raytype;
+    sg.flipHandedness = b.flipHandedness[i];
+    sg.backfacing = b.backfacing[i];
+}
+
+
+
+bool
+ShadingContext::execute_batch (ShaderUse use, ShadingAttribState &sas,
+                               ShaderGlobalsBatch &sgb, int npoints,
+                               const Runflag *runflags, bool run)
+{
+    ASSERT (npoints <= ShaderGlobalsBatch::MaxSize);
+    if (npoints < 1 || ! prepare_execution (use, sas, npoints))
+        return false;
+
+    // The batch code shades whole vectors of BatchWidth points, so give
+    // it group data for every lane, even past npoints.
+    ShaderGroup &sgroup (sas.shadergroup (use));
+    RunLLVMBatchFunc batch_func = sgroup.llvm_batch_version();
+    int nlanes = npoints;
+    if (batch_func)
+        nlanes = (npoints + BatchWidth-1) / BatchWidth * BatchWidth;
+    allocate_heap (sgroup, nlanes);
+    m_heap_points = npoints;
+
+    if (run) {
+        sgb.context = this;
+        for (int i = 0;  i < npoints;  ++i)
+            sgb.Ci[i] = NULL;
+        char *heap = &m_heap[0];
+        if (batch_func) {
+            // Batch code has only ops that don't touch messages
+            m_messages.clear ();
+            for (int i = 0;  i < nlanes;  ++i)
+                sgroup.init_params (heap + i * m_heap_point_size);
+            for (int first = 0;  first < npoints;  first += BatchWidth) {
+                int lanemask = 0;
+                for (int i = 0;  i < BatchWidth && first+i < npoints;  ++i)
+                    if (! runflags || runflags[first+i] != RunflagOff)
+                        lanemask |= 1 << i;
+                if (lanemask)
+                    batch_func (&sgb, heap + first * m_heap_point_size,
+                                (int) m_heap_point_size, first, lanemask);
+            }
+        } else {
+            RunLLVMGroupFunc run_func = sgroup.llvm_compiled_version();
+            DASSERT (run_func);
+            ShaderGlobals sg;
+            for (int i = 0;  i < npoints;  ++i, heap += m_heap_point_size) {
+                if (runflags && runflags[i] == RunflagOff)
+                    continue;
+                batch_point_globals (sgb, i, sg);
+                m_messages.clear ();
+                sgroup.init_params (heap);
+                run_func (&sg, heap);
+                sgb.Ci[i] = sg.Ci;
+            }
+        }
+        ShadingStats &stats (m_shadingsys.thread_stats (m_threadinfo));
+        stats.batches += 1;
+        stats.batch_points += npoints;
+    }
+    return true;
+}
+
+
+
 Symbol *
 ShadingContext::symbol (ShaderUse use, ustring name)
 {
@@ -150,14 +325,17 @@ ShadingContext::symbol (ShaderUse use, ustring name)
 
 
 void *
-ShadingContext::symbol_data (Symbol &sym)
+ShadingContext::symbol_data (Symbol &sym, int point)
 {
     ShaderGroup &sgroup (attribs()->shadergroup ((ShaderUse)m_curuse));
     if (! sgroup.llvm_compiled_version())
         return NULL;   // can't retrieve symbol if we didn't JIT and runit
 
-    if (sym.dataoffset() >= 0)  // lives on the heap
-        return &m_heap[sym.dataoffset()];
+    if (sym.dataoffset() >= 0) {  // lives on the heap
+        if (point < 0 || point >= m_heap_points)
+            return NULL;
+        return &m_heap[point * m_heap_point_size + sym.dataoffset()];
+    }
 
     // doesn't live on the heap
     if ((sym.symtype() == SymTypeParam || sym.symtype() == SymTypeOutputParam) &&
@@ -177,11 +355,10 @@ ShadingContext::find_regex (ustring r)
     RegexMap::const_iterator found = m_regex_map.find (r);
     if (found != m_regex_map.end())
         return *found->second;
-    // otherwise, it wasn't found, add it
-    m_regex_map[r] = new boost::regex(r.c_str());
-    m_shadingsys.m_stat_regexes += 1;
-    // std::cerr << "Made new regex for " << r << "\n";
-    return *m_regex_map[r];
+    // otherwise, it wasn't found, get it from the shading system
+    const boost::regex &regex (m_shadingsys.find_regex (r));
+    m_regex_map[r] = &regex;
+    return regex;
 }
 
 
@@ -209,9 +386,10 @@ ShadingContext::osl_get_attribute (void *renderstate, void *objdata,
             m_failed_attribs[i].objdata) {
 #if 0
             double time = timer();
-            shadingsys().m_stat_getattribute_time += time;
-            shadingsys().m_stat_getattribute_fail_time += time;
-            shadingsys().m_stat_getattribute_calls += 1;
+            ShadingStats &stats (shadingsys().thread_stats (m_threadinfo));
+            stats.getattribute_time += time;
+            stats.getattribute_fail_time += time;
+            stats.getattribute_calls += 1;
 #endif
             return false;
         }
@@ -238,10 +416,11 @@ ShadingContext::osl_get_attribute (void *renderstate, void *objdata,
 
 #if 0
     double time = timer();
-    shadingsys().m_stat_getattribute_time += time;
+    ShadingStats &stats (shadingsys().thread_stats (m_threadinfo));
+    stats.getattribute_time += time;
     if (!ok)
-        shadingsys().m_stat_getattribute_fail_time += time;
-    shadingsys().m_stat_getattribute_calls += 1;
+        stats.getattribute_fail_time += time;
+    stats.getattribute_calls += 1;
 #endif
 //    std::cout << "getattribute! '" << obj_name << "' " << attr_name << ' ' << attr_type.c_str() << " ok=" << ok << ", objdata was " << objdata << "\n";
     return ok;
@@ -30,6 +30,7 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <string>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
 #include <ctype.h>
 
 #include <boost/unordered_map.hpp>
@@ -71,6 +72,13 @@ namespace pugi = OIIO_NAMESPACE::pugi;
 // particular query to return a string is a totally different cache
 // entry than asking for it to be converted to a matrix, say.
 //
+// There is just one Dictionary for the whole ShadingSystem, so that
+// each document is only read and parsed once no matter how many
+// threads use it, and node IDs mean the same thing everywhere (which
+// also lets the runtime optimizer fold queries with constant arguments
+// into the shader).  All its methods lock; the per-context
+// DictionaryCache below keeps the lookups themselves from contending.
+//
 class Dictionary {
 public:
     Dictionary (ShadingSystemImpl &ss) : m_shadingsys(ss) {
@@ -157,12 +165,74 @@ private:
     std::vector<int>     m_intdata;
     std::vector<ustring> m_stringdata;
 
+    mutex m_mutex;   // Thread-safe lock
+
     // Helper function: return the document index given dictionary name.
     int get_document_index (ustring dictionaryname);
 };
 
 
 
+// Each ShadingContext keeps its own copy of the answers it has gotten
+// from the shared Dictionary, keyed by the arguments of the calls.
+// Shaders make the same few queries at every point they shade, so
+// nearly every lookup is answered here, by the thread alone, without
+// taking the Dictionary's lock.
+//
+class DictionaryCache {
+public:
+    DictionaryCache (ShadingSystemImpl &ss) : m_shadingsys(ss) { }
+
+    int dict_find (ustring dictionaryname, ustring query);
+    int dict_find (int nodeID, ustring query);
+    int dict_next (int nodeID);
+    int dict_value (int nodeID, ustring attribname, TypeDesc type, void *data);
+
+private:
+    // The arguments of a call: the dictionary name (for dict_find from
+    // the root) or the node ID, the query or attribute name, and for
+    // dict_value the type requested.
+    struct Key {
+        ustring dictionary;
+        int node;
+        ustring name;
+        TypeDesc type;
+        Key (ustring dict_, int node_, ustring name_,
+             TypeDesc type_=TypeDesc::UNKNOWN) :
+            dictionary(dict_), node(node_), name(name_), type(type_) { }
+        bool operator== (const Key &k) const {
+            return dictionary == k.dictionary && node == k.node &&
+                   name == k.name && type == k.type;
+        }
+    };
+
+    struct KeyHash {
+        size_t operator() (const Key &key) const {
+            return key.name.hash() + 17*key.node + 79*key.dictionary.hash();
+        }
+    };
+
+    // A remembered dict_value result: whether it succeeded, and where
+    // its data live in m_valuedata.
+    struct Value {
+        int result;
+        int offset;
+        Value (int r=0, int o=0) : result(r), offset(o) { }
+    };
+
+    typedef boost::unordered_map<Key, int, KeyHash> FindMap;
+    typedef boost::unordered_map<Key, Value, KeyHash> ValueMap;
+    typedef boost::unordered_map<int, int> NextMap;
+
+    ShadingSystemImpl &m_shadingsys;  // back-pointer to shading sys
+    FindMap m_finds;                  // dict_find results
+    NextMap m_next;                   // dict_next results
+    ValueMap m_values;                // dict_value results
+    std::vector<char> m_valuedata;    // raw data of dict_value results
+};
+
+
+
 int
 Dictionary::get_document_index (ustring dictionaryname)
 {
@@ -202,6 +272,7 @@ Dictionary::get_document_index (ustring dictionaryname)
 int
 Dictionary::dict_find (ustring dictionaryname, ustring query)
 {
+    lock_guard lock (m_mutex);
     int dindex = get_document_index (dictionaryname);
     if (dindex < 0)
         return dindex;
@@ -253,6 +324,7 @@ Dictionary::dict_find (ustring dictionaryname, ustring query)
 int
 Dictionary::dict_find (int nodeID, ustring query)
 {
+    lock_guard lock (m_mutex);
     if (nodeID <= 0 || nodeID >= (int)m_nodes.size())
         return 0;     // invalid node ID
 
@@ -300,6 +372,7 @@ Dictionary::dict_find (int nodeID, ustring query)
 int
 Dictionary::dict_next (int nodeID)
 {
+    lock_guard lock (m_mutex);
     if (nodeID <= 0 || nodeID >= (int)m_nodes.size())
         return 0;     // invalid node ID
     return m_nodes[nodeID].next;
@@ -311,6 +384,7 @@ int
 Dictionary::dict_value (int nodeID, ustring attribname,
                         TypeDesc type, void *data)
 {
+    lock_guard lock (m_mutex);
     if (nodeID <= 0 || nodeID >= (int)m_nodes.size())
         return 0;     // invalid node ID
 
@@ -396,6 +470,126 @@ Dictionary::dict_value (int nodeID, ustring attribname,
 }
 
 
+int
+DictionaryCache::dict_find (ustring dictionaryname, ustring query)
+{
+    Key k (dictionaryname, 0, query);
+    FindMap::const_iterator found = m_finds.find (k);
+    if (found != m_finds.end())
+        return found->second;
+    int r = m_shadingsys.dict_find (dictionaryname, query);
+    m_finds[k] = r;
+    return r;
+}
+
+
+
+int
+DictionaryCache::dict_find (int nodeID, ustring query)
+{
+    Key k (ustring(), nodeID, query);
+    FindMap::const_iterator found = m_finds.find (k);
+    if (found != m_finds.end())
+        return found->second;
+    int r = m_shadingsys.dict_find (nodeID, query);
+    m_finds[k] = r;
+    return r;
+}
+
+
+
+int
+DictionaryCache::dict_next (int nodeID)
+{
+    NextMap::const_iterator found = m_next.find (nodeID);
+    if (found != m_next.end())
+        return found->second;
+    int r = m_shadingsys.dict_next (nodeID);
+    m_next[nodeID] = r;
+    return r;
+}
+
+
+
+int
+DictionaryCache::dict_value (int nodeID, ustring attribname,
+                             TypeDesc type, void *data)
+{
+    Key k (ustring(), nodeID, attribname, type);
+    size_t size = type.size();
+    ValueMap::const_iterator found = m_values.find (k);
+    if (found != m_values.end()) {
+        if (found->second.result)
+            memcpy (data, &m_valuedata[found->second.offset], size);
+        return found->second.result;
+    }
+    // Ask the shared dictionary.  We only remember what it answered;
+    // on failure it leaves data alone, and so will we next time.
+    std::vector<char> value (size);
+    int r = m_shadingsys.dict_value (nodeID, attribname, type, &value[0]);
+    Value v (r, (int) m_valuedata.size());
+    if (r) {
+        m_valuedata.insert (m_valuedata.end(), value.begin(), value.end());
+        memcpy (data, &value[0], size);
+    }
+    m_values[k] = v;
+    return r;
+}
+
+
+
+Dictionary *
+ShadingSystemImpl::dictionary ()
+{
+    spin_lock lock (m_dictionary_mutex);
+    if (! m_dictionary)
+        m_dictionary = new Dictionary (*this);
+    return m_dictionary;
+}
+
+
+
+int
+ShadingSystemImpl::dict_find (ustring dictionaryname, ustring query)
+{
+    return dictionary()->dict_find (dictionaryname, query);
+}
+
+
+
+int
+ShadingSystemImpl::dict_find (int nodeID, ustring query)
+{
+    return dictionary()->dict_find (nodeID, query);
+}
+
+
+
+int
+ShadingSystemImpl::dict_next (int nodeID)
+{
+    return dictionary()->dict_next (nodeID);
+}
+
+
+
+int
+ShadingSystemImpl::dict_value (int nodeID, ustring attribname,
+                               TypeDesc type, void *data)
+{
+    return dictionary()->dict_value (nodeID, attribname, type, data);
+}
+
+
+
+void
+ShadingSystemImpl::free_dict_resources ()
+{
+    delete m_dictionary;
+    m_dictionary = NULL;
+}
+
+
 }; // namespace pvt
 
 
@@ -404,7 +598,7 @@ int
 ShadingContext::dict_find (ustring dictionaryname, ustring query)
 {
     if (! m_dictionary) {
-        m_dictionary = new Dictionary (shadingsys());
+        m_dictionary = new DictionaryCache (shadingsys());
     }
     return m_dictionary->dict_find (dictionaryname, query);
 }
@@ -415,7 +609,7 @@ int
 ShadingContext::dict_find (int nodeID, ustring query)
 {
     if (! m_dictionary) {
-        m_dictionary = new Dictionary (shadingsys());
+        m_dictionary = new DictionaryCache (shadingsys());
     }
     return m_dictionary->dict_find (nodeID, query);
 }
@@ -425,8 +619,10 @@ ShadingContext::dict_find (int nodeID, ustring query)
 int
 ShadingContext::dict_next (int nodeID)
 {
+    // The optimizer may have done the dict_find for us, so this
+    // might be the first we hear of dictionaries.
     if (! m_dictionary)
-        return 0;
+        m_dictionary = new DictionaryCache (shadingsys());
     return m_dictionary->dict_next (nodeID);
 }
 
@@ -437,7 +633,7 @@ ShadingContext::dict_value (int nodeID, ustring attribname,
                             TypeDesc type, void *data)
 {
     if (! m_dictionary)
-        return 0;
+        m_dictionary = new DictionaryCache (shadingsys());
     return m_dictionary->dict_value (nodeID, attribname, type, data);
 }
 
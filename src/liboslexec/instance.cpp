@@ -29,6 +29,7 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <vector>
 #include <string>
 #include <cstdio>
+#include <sstream>
 
 #include <boost/foreach.hpp>
 
@@ -402,17 +403,112 @@ ShaderInstance::print ()
 
 
 ShaderGroup::ShaderGroup ()
-  : m_llvm_compiled_version(NULL), m_llvm_groupdata_size(0), m_optimized(0), m_does_nothing(false)
+  : m_compiled(new CompiledGroup), m_optimized(0)
 {
     m_executions = 0;
+    m_hot_runs = 0;
 }
 
 
 
 ShaderGroup::ShaderGroup (const ShaderGroup &g)
-  : m_layers(g.m_layers), m_llvm_compiled_version(NULL), m_llvm_groupdata_size(0), m_optimized(0), m_does_nothing(false)
+  : m_layers(g.m_layers), m_compiled(new CompiledGroup), m_optimized(0)
 {
     m_executions = 0;
+    m_hot_runs = 0;
+}
+
+
+
+const std::string &
+ShaderGroup::fingerprint (bool paramagnostic)
+{
+    std::string &fingerprint (m_fingerprint[paramagnostic]);
+    if (! fingerprint.empty() || m_layers.empty())
+        return fingerprint;
+    std::ostringstream out;
+    write_fingerprint (out, paramagnostic, false);
+    fingerprint = out.str();
+    return fingerprint;
+}
+
+
+
+void
+ShaderGroup::write_fingerprint (std::ostream &out, bool paramagnostic,
+                                bool osohash) const
+{
+    for (int layer = 0;  layer < nlayers();  ++layer) {
+        const ShaderInstance *inst = m_layers[layer].get();
+        out << "layer " << inst->shadername() << ' ';
+        if (osohash) {
+            // Taken while loading if there's a JIT cache.  Without one,
+            // only register_compiled_group gets here: fall back to
+            // reading the file.
+            const std::string &hash (inst->master()->osohash());
+            if (hash.size())
+                out << hash;
+            else
+                out << inst->master()->hash_oso_file();
+        } else
+            out << (const void *) inst->master();
+        out << ' ' << inst->layername() << ' '
+            << inst->run_lazily() << inst->outgoing_connections() << "\n";
+        for (int i = inst->firstparam();  i < inst->lastparam();  ++i) {
+            const Symbol *s = inst->symbol (i);
+            if (paramagnostic && param_value_is_agnostic (*s)) {
+                // Value supplied at run time -- any value will do
+                out << "param " << s->name() << " *\n";
+                continue;
+            }
+            out << "param " << s->name() << ' ' << (int)s->valuesource()
+                << s->lockgeom();
+            if (s->valuesource() == Symbol::InstanceVal) {
+                const TypeDesc &t (s->typespec().simpletype());
+                if (t.basetype == TypeDesc::STRING) {
+                    for (size_t j = 0;  j < t.numelements();  ++j) {
+                        ustring v = ((const ustring *)s->data())[j];
+                        out << ' ' << v.length() << ':' << v;
+                    }
+                } else {
+                    out << ' ';
+                    const unsigned char *d = (const unsigned char *)s->data();
+                    for (size_t j = 0;  j < t.size();  ++j)
+                        out << Strutil::format ("%02x", d[j]);
+                }
+            }
+            out << "\n";
+        }
+        BOOST_FOREACH (const Connection &c, inst->connections())
+            out << "connect " << c.srclayer << ' ' << c.src.param << ' '
+                << c.src.arrayindex << ' ' << c.src.channel << ' '
+                << c.src.offset << ' ' << c.src.type.c_str() << ' '
+                << c.dst.param << ' ' << c.dst.arrayindex << ' '
+                << c.dst.channel << ' ' << c.dst.offset << ' '
+                << c.dst.type.c_str() << "\n";
+    }
+}
+
+
+
+void
+ShaderGroup::build_param_block ()
+{
+    const std::vector<CompiledGroup::ParamBlockEntry> &layout (m_compiled->param_block_layout);
+    size_t size = 0;
+    for (size_t i = 0;  i < layout.size();  ++i)
+        size += layout[i].size;
+    m_param_block.clear ();
+    m_param_block.resize (size, 0);
+    size_t pos = 0;
+    for (size_t i = 0;  i < layout.size();  ++i) {
+        const ShaderInstance *inst = m_layers[layout[i].layer].get();
+        int p = inst->findparam (layout[i].name);
+        const Symbol *sym = p >= 0 ? inst->symbol (p) : NULL;
+        if (sym && sym->data())
+            memcpy (&m_param_block[pos], sym->data(), layout[i].size);
+        pos += layout[i].size;
+    }
 }
 
 
@@ -44,6 +44,7 @@ namespace OSL_NAMESPACE {
 namespace OSL {
 namespace pvt {
 
+static ustring op_add("add");
 static ustring op_and("and");
 static ustring op_bitand("bitand");
 static ustring op_bitor("bitor");
@@ -53,11 +54,13 @@ static ustring op_cellnoise("cellnoise");
 static ustring op_color("color");
 static ustring op_compl("compl");
 static ustring op_continue("continue");
+static ustring op_div("div");
 static ustring op_dowhile("dowhile");
 static ustring op_eq("eq");
 static ustring op_error("error");
 static ustring op_fabs("fabs");
 static ustring op_floor("floor");
+static ustring op_fmod("fmod");
 static ustring op_for("for");
 static ustring op_format("format");
 static ustring op_ge("ge");
@@ -66,16 +69,21 @@ static ustring op_if("if");
 static ustring op_le("le");
 static ustring op_lt("lt");
 static ustring op_min("min");
+static ustring op_mod("mod");
+static ustring op_mul("mul");
 static ustring op_neq("neq");
 static ustring op_normal("normal");
 static ustring op_or("or");
+static ustring op_pnoise("pnoise");
 static ustring op_point("point");
 static ustring op_printf("printf");
+static ustring op_psnoise("psnoise");
 static ustring op_round("round");
 static ustring op_shl("shl");
 static ustring op_shr("shr");
 static ustring op_sign("sign");
 static ustring op_step("step");
+static ustring op_sub("sub");
 static ustring op_trunc("trunc");
 static ustring op_vector("vector");
 static ustring op_warning("warning");
@@ -142,9 +150,17 @@ RuntimeOptimizer::llvm_call_layer (int layer, bool unconditional)
     builder().CreateStore (trueval, layerfield);
     std::string name = Strutil::format ("%s_%d", parent->layername().c_str(),
                                         parent->id());
+    // When profiling, don't charge the called layer's time to this one
+    llvm::Value *call_start = m_llvm_profile_children ? llvm_cycles() : NULL;
     // Mark the call as a fast call
     llvm::CallInst* call_inst = llvm::cast<llvm::CallInst>(llvm_call_function (name.c_str(), args, 2));
     call_inst->setCallingConv (llvm::CallingConv::Fast);
+    if (call_start) {
+        llvm::Value *spent = builder().CreateSub (llvm_cycles(), call_start);
+        llvm::Value *children = builder().CreateLoad (m_llvm_profile_children);
+        builder().CreateStore (builder().CreateAdd (children, spent),
+                               m_llvm_profile_children);
+    }
 
     if (! unconditional) {
         builder().CreateBr (after_block);
@@ -1534,6 +1550,23 @@ LLVMGEN (llvm_gen_regex)
     call_args.push_back (rop.llvm_load_value (Pattern));
     // Pass whether or not to do the full match
     call_args.push_back (rop.llvm_constant(fullmatch));
+    // If the pattern is a constant, compile it now and pass the regex
+    // itself, so that only the match is left to do as the shader runs.
+    // (A bad pattern is left to fail at run time, as it always has.)
+    const boost::regex *regex = NULL;
+    if (Pattern.is_constant()) {
+        try {
+            regex = &rop.shadingsys().find_regex (*(ustring *)Pattern.data());
+        } catch (const std::exception &) {
+            regex = NULL;
+        }
+    }
+    if (regex)
+        call_args.push_back (rop.llvm_relocatable_ptr (RuntimeOptimizer::RelocRegex,
+                                       ((ustring *)Pattern.data())->string(),
+                                       (void *)regex, rop.llvm_type_void_ptr()));
+    else
+        call_args.push_back (rop.llvm_void_ptr_null());
 
     llvm::Value *ret = rop.llvm_call_function ("osl_regex_impl", &call_args[0],
                                                (int)call_args.size());
@@ -1916,6 +1949,27 @@ llvm_gen_texture_options (RuntimeOptimizer &rop, int opnum,
 
 
 
+/// Return the texture handle for a constant filename, looked up now
+/// (once) so that the lookups needn't find the file by name, or NULL if
+/// the filename isn't known until run time.
+static llvm::Value *
+llvm_gen_texture_handle (RuntimeOptimizer &rop, Symbol &Filename)
+{
+#if OIIO_VERSION >= 10100
+    if (Filename.is_constant() && Filename.typespec().is_string()) {
+        ustring filename = *(ustring *)Filename.data();
+        void *handle = rop.shadingsys().renderer()->get_texture_handle (filename);
+        if (handle)
+            return rop.llvm_relocatable_ptr (RuntimeOptimizer::RelocTextureHandle,
+                                             filename.string(), handle,
+                                             rop.llvm_type_void_ptr());
+    }
+#endif
+    return rop.llvm_void_ptr_null ();
+}
+
+
+
 LLVMGEN (llvm_gen_texture)
 {
     Opcode &op (rop.inst()->ops()[opnum]);
@@ -1944,6 +1998,7 @@ LLVMGEN (llvm_gen_texture)
     std::vector<llvm::Value *> args;
     args.push_back (rop.sg_void_ptr());
     args.push_back (rop.llvm_load_value (Filename));
+    args.push_back (llvm_gen_texture_handle (rop, Filename));
     args.push_back (opt);
     args.push_back (rop.llvm_load_value (S));
     args.push_back (rop.llvm_load_value (T));
@@ -2309,7 +2364,9 @@ LLVMGEN (llvm_gen_getattribute)
     args.push_back (rop.llvm_load_value (Attribute));
     args.push_back (rop.llvm_constant ((int)array_lookup));
     args.push_back (rop.llvm_load_value (Index));
-    args.push_back (rop.llvm_constant_ptr ((void *) dest_type));
+    args.push_back (rop.llvm_relocatable_ptr (RuntimeOptimizer::RelocTypeDesc,
+                        std::string ((const char *)dest_type, sizeof(TypeDesc)),
+                        (void *) dest_type, rop.llvm_type_void_ptr()));
     args.push_back (rop.llvm_void_ptr (Destination));
 
     llvm::Value *r = rop.llvm_call_function ("osl_get_attribute", &args[0], args.size());
@@ -2357,6 +2414,19 @@ LLVMGEN (llvm_gen_gettextureinfo)
 
 
 
+// Size in bytes of the value a message transfers for Data (closures
+// are passed as their pointers).
+static size_t
+message_data_size (const Symbol &Data)
+{
+    const TypeSpec &t (Data.typespec());
+    if (t.is_closure_based())
+        return sizeof(void *) * std::max (1, t.arraylength());
+    return t.simpletype().size();
+}
+
+
+
 LLVMGEN (llvm_gen_getmessage)
 {
     // getmessage() has four "flavors":
@@ -2375,6 +2445,27 @@ LLVMGEN (llvm_gen_getmessage)
     DASSERT (Result.typespec().is_int() && Name.typespec().is_string());
     DASSERT (has_source == 0 || Source.typespec().is_string());
 
+    // Messages from "trace" come from the renderer, never from a slot
+    static ustring ktrace ("trace");
+    int slot = rop.message_slot (Name);
+    if (slot >= 0 && (! has_source || (Source.is_constant() &&
+                                       *(ustring *)Source.data() != ktrace))) {
+        // Resolved at JIT time: read straight from its group data slot
+        llvm::Value *args[9];
+        args[0] = rop.sg_void_ptr();
+        args[1] = rop.llvm_offset_ptr (rop.groupdata_void_ptr(), slot);
+        args[2] = rop.llvm_load_value (Name);
+        args[3] = rop.llvm_void_ptr (Data);
+        args[4] = rop.llvm_constant ((int) message_data_size (Data));
+        args[5] = rop.llvm_constant ((int)Data.has_derivs());
+        args[6] = rop.llvm_constant(rop.inst()->id());
+        args[7] = rop.llvm_constant(op.sourcefile());
+        args[8] = rop.llvm_constant(op.sourceline());
+        llvm::Value *r = rop.llvm_call_function ("osl_getmessage_slot", args, 9);
+        rop.llvm_store_value (r, Result);
+        return true;
+    }
+
     llvm::Value *args[9];
     args[0] = rop.sg_void_ptr();
     args[1] = has_source ? rop.llvm_load_value(Source) 
@@ -2413,6 +2504,22 @@ LLVMGEN (llvm_gen_setmessage)
     Symbol& Data   = *rop.opargsym (op, 1);
     DASSERT (Name.typespec().is_string());
 
+    int slot = rop.message_slot (Name);
+    if (slot >= 0) {
+        // Resolved at JIT time: store straight into its group data slot
+        llvm::Value *args[8];
+        args[0] = rop.sg_void_ptr();
+        args[1] = rop.llvm_offset_ptr (rop.groupdata_void_ptr(), slot);
+        args[2] = rop.llvm_load_value (Name);
+        args[3] = rop.llvm_void_ptr (Data);
+        args[4] = rop.llvm_constant ((int) message_data_size (Data));
+        args[5] = rop.llvm_constant(rop.inst()->id());
+        args[6] = rop.llvm_constant(op.sourcefile());
+        args[7] = rop.llvm_constant(op.sourceline());
+        rop.llvm_call_function ("osl_setmessage_slot", args, 8);
+        return true;
+    }
+
     llvm::Value *args[7];
     args[0] = rop.sg_void_ptr();
     args[1] = rop.llvm_load_value (Name);
@@ -2603,7 +2710,7 @@ llvm_gen_keyword_fill(RuntimeOptimizer &rop, Opcode &op, const ClosureRegistry::
         }
 
         llvm::Value *key_to     = rop.builder().CreateConstGEP2_32 (attr_p, attr_i, 0);
-        llvm::Value *key_const  = rop.llvm_constant_ptr(*((void **)key), rop.llvm_type_string());
+        llvm::Value *key_const  = rop.llvm_constant(*key);
         llvm::Value *value_to   = rop.builder().CreateConstGEP2_32 (attr_p, attr_i, 1);
         llvm::Value *value_from = rop.llvm_void_ptr (Value);
         value_to = rop.llvm_ptr_cast (value_to, rop.llvm_type_void_ptr());
@@ -2638,7 +2745,8 @@ LLVMGEN (llvm_gen_closure)
 
     // Call osl_allocate_closure_component(closure, id, size).  It returns
     // the memory for the closure parameter data.
-    llvm::Value *render_ptr = rop.llvm_constant_ptr(rop.shadingsys().renderer(), rop.llvm_type_void_ptr());
+    llvm::Value *render_ptr = rop.llvm_relocatable_ptr (RuntimeOptimizer::RelocRenderer, "",
+                                  rop.shadingsys().renderer(), rop.llvm_type_void_ptr());
     llvm::Value *sg_ptr = rop.sg_void_ptr();
     llvm::Value *id_int = rop.llvm_constant(clentry->id);
     llvm::Value *size_int = rop.llvm_constant(clentry->struct_size);
@@ -2656,7 +2764,9 @@ LLVMGEN (llvm_gen_closure)
     // zero out the closure parameter memory.
     if (clentry->prepare) {
         // Call clentry->prepare(renderservices *, int id, void *mem)
-        llvm::Value *funct_ptr = rop.llvm_constant_ptr((void *)clentry->prepare, rop.llvm_type_prepare_closure_func());
+        llvm::Value *funct_ptr = rop.llvm_relocatable_ptr (RuntimeOptimizer::RelocClosurePrepare,
+                                     closure_name.string(), (void *)clentry->prepare,
+                                     rop.llvm_type_prepare_closure_func());
         llvm::Value *args[3] = {render_ptr, id_int, mem_void_ptr};
         rop.llvm_call_function (funct_ptr, args, 3);
     } else {
@@ -2687,7 +2797,9 @@ LLVMGEN (llvm_gen_closure)
     // setup(render_services, id, mem_ptr).
     if (clentry->setup) {
         // Call clentry->setup(renderservices *, int id, void *mem)
-        llvm::Value *funct_ptr = rop.llvm_constant_ptr((void *)clentry->setup, rop.llvm_type_setup_closure_func());
+        llvm::Value *funct_ptr = rop.llvm_relocatable_ptr (RuntimeOptimizer::RelocClosureSetup,
+                                     closure_name.string(), (void *)clentry->setup,
+                                     rop.llvm_type_setup_closure_func());
         llvm::Value *args[3] = {render_ptr, id_int, mem_void_ptr};
         rop.llvm_call_function (funct_ptr, args, 3);
     }
@@ -2806,8 +2918,8 @@ LLVMGEN (llvm_gen_pointcloud_search)
     static ustring errorfmt("Arrays too small for pointcloud lookup at (%s:%d)");
 
     args.push_back (rop.sg_void_ptr());
-    args.push_back (rop.llvm_constant_ptr ((void *)errorfmt.c_str()));
-    args.push_back (rop.llvm_constant_ptr ((void *)op.sourcefile().c_str()));
+    args.push_back (rop.llvm_constant (errorfmt));
+    args.push_back (rop.llvm_constant (op.sourcefile()));
     args.push_back (rop.llvm_constant (op.sourceline()));
     rop.llvm_call_function ("osl_error", &args[0], args.size());
 
@@ -2869,8 +2981,8 @@ LLVMGEN (llvm_gen_pointcloud_get)
     static ustring errorfmt("Arrays too small for pointcloud attribute get at (%s:%d)");
 
     args.push_back (rop.sg_void_ptr());
-    args.push_back (rop.llvm_constant_ptr ((void *)errorfmt.c_str()));
-    args.push_back (rop.llvm_constant_ptr ((void *)op.sourcefile().c_str()));
+    args.push_back (rop.llvm_constant (errorfmt));
+    args.push_back (rop.llvm_constant (op.sourcefile()));
     args.push_back (rop.llvm_constant (op.sourceline()));
     rop.llvm_call_function ("osl_error", &args[0], args.size());
 
@@ -3059,6 +3171,682 @@ LLVMGEN (llvm_gen_return)
 
 
 
+// Batch versions of the simple ops, used by build_llvm_batch to shade
+// BatchWidth points at once.  Every value is a vector with one lane per
+// point, and stores only change the lanes in rop.llvm_batch_mask().
+// They must give exactly the same results as the scalar versions above,
+// and return false for any case they don't handle, which leaves the
+// group with only its scalar code.
+
+
+
+static llvm::Value *
+llvm_batch_zero (llvm::Value *like)
+{
+    return llvm::Constant::getNullValue (like->getType());
+}
+
+
+
+// Batch llvm_make_safe_div/llvm_make_safe_mod.  Every lane divides, even
+// ones that are off, so integer lanes with b == 0 divide by one instead
+// of trapping (and still give zero, as the scalar code does).
+static llvm::Value *
+llvm_batch_safe_divmod (RuntimeOptimizer &rop, bool is_float, bool mod,
+                        llvm::Value *a, llvm::Value *b)
+{
+    llvm::IRBuilder<> &builder (rop.builder());
+    llvm::Value *zero = llvm_batch_zero (b);
+    if (is_float) {
+        llvm::Value *r = mod ? builder.CreateFRem (a, b) : builder.CreateFDiv (a, b);
+        return builder.CreateSelect (builder.CreateFCmpOEQ (b, zero), zero, r);
+    }
+    llvm::Value *iszero = builder.CreateICmpEQ (b, zero);
+    b = builder.CreateSelect (iszero, rop.llvm_batch_splat (rop.llvm_constant(1)), b);
+    llvm::Value *r = mod ? builder.CreateSRem (a, b) : builder.CreateSDiv (a, b);
+    return builder.CreateSelect (iszero, zero, r);
+}
+
+
+
+// add, sub, mul, div, mod, fmod
+LLVMGEN (llvm_gen_batch_arith)
+{
+    Opcode &op (rop.inst()->ops()[opnum]);
+    Symbol& Result = *rop.opargsym (op, 0);
+    Symbol& A = *rop.opargsym (op, 1);
+    Symbol& B = *rop.opargsym (op, 2);
+    if (Result.typespec().is_closure_based() || Result.typespec().is_matrix())
+        return false;
+
+    TypeDesc type = Result.typespec().simpletype();
+    bool is_float = Result.typespec().is_floatbased();
+    ustring opname = op.opname();
+    llvm::IRBuilder<> &builder (rop.builder());
+    for (int i = 0;  i < (int)type.aggregate;  ++i) {
+        llvm::Value *a = rop.llvm_batch_load (A, i, type);
+        llvm::Value *b = rop.llvm_batch_load (B, i, type);
+        if (!a || !b)
+            return false;
+        llvm::Value *r;
+        if (opname == op_add)
+            r = is_float ? builder.CreateFAdd (a, b) : builder.CreateAdd (a, b);
+        else if (opname == op_sub)
+            r = is_float ? builder.CreateFSub (a, b) : builder.CreateSub (a, b);
+        else if (opname == op_mul)
+            r = is_float ? builder.CreateFMul (a, b) : builder.CreateMul (a, b);
+        else if (opname == op_div)
+            r = llvm_batch_safe_divmod (rop, is_float, false, a, b);
+        else if (opname == op_mod || opname == op_fmod)
+            r = llvm_batch_safe_divmod (rop, is_float, true, a, b);
+        else
+            return false;
+        if (! rop.llvm_batch_store (r, Result, i))
+            return false;
+    }
+    return true;
+}
+
+
+
+LLVMGEN (llvm_gen_batch_neg)
+{
+    Opcode &op (rop.inst()->ops()[opnum]);
+    Symbol& Result = *rop.opargsym (op, 0);
+    Symbol& A = *rop.opargsym (op, 1);
+
+    TypeDesc type = Result.typespec().simpletype();
+    bool is_float = Result.typespec().is_floatbased();
+    for (int i = 0;  i < (int)type.aggregate;  ++i) {
+        llvm::Value *a = rop.llvm_batch_load (A, i, type);
+        if (! a)
+            return false;
+        llvm::Value *r = is_float ? rop.builder().CreateFNeg (a)
+                                  : rop.builder().CreateNeg (a);
+        if (! rop.llvm_batch_store (r, Result, i))
+            return false;
+    }
+    return true;
+}
+
+
+
+// abs, fabs: fabsf for floats (clear the sign bit), abs for ints
+LLVMGEN (llvm_gen_batch_abs)
+{
+    Opcode &op (rop.inst()->ops()[opnum]);
+    Symbol& Result = *rop.opargsym (op, 0);
+    Symbol& A = *rop.opargsym (op, 1);
+
+    TypeDesc type = Result.typespec().simpletype();
+    bool is_float = Result.typespec().is_floatbased();
+    llvm::IRBuilder<> &builder (rop.builder());
+    llvm::Type *inttype = rop.llvm_type_batch (TypeDesc::INT);
+    for (int i = 0;  i < (int)type.aggregate;  ++i) {
+        llvm::Value *a = rop.llvm_batch_load (A, i, type);
+        if (! a)
+            return false;
+        llvm::Value *r;
+        if (is_float) {
+            r = builder.CreateBitCast (a, inttype);
+            r = builder.CreateAnd (r, rop.llvm_batch_splat (rop.llvm_constant(0x7fffffff)));
+            r = builder.CreateBitCast (r, a->getType());
+        } else {
+            r = builder.CreateSelect (builder.CreateICmpSLT (a, llvm_batch_zero (a)),
+                                      builder.CreateNeg (a), a);
+        }
+        if (! rop.llvm_batch_store (r, Result, i))
+            return false;
+    }
+    return true;
+}
+
+
+
+LLVMGEN (llvm_gen_batch_minmax)
+{
+    Opcode &op (rop.inst()->ops()[opnum]);
+    Symbol& Result = *rop.opargsym (op, 0);
+    Symbol& x = *rop.opargsym (op, 1);
+    Symbol& y = *rop.opargsym (op, 2);
+
+    TypeDesc type = Result.typespec().simpletype();
+    bool is_float = Result.typespec().is_floatbased();
+    llvm::IRBuilder<> &builder (rop.builder());
+    for (int i = 0;  i < (int)type.aggregate;  ++i) {
+        llvm::Value *x_val = rop.llvm_batch_load (x, i, type);
+        llvm::Value *y_val = rop.llvm_batch_load (y, i, type);
+        if (!x_val || !y_val)
+            return false;
+        llvm::Value *cond;
+        if (op.opname() == op_min)
+            cond = is_float ? builder.CreateFCmpULE (x_val, y_val)
+                            : builder.CreateICmpSLE (x_val, y_val);
+        else
+            cond = is_float ? builder.CreateFCmpUGT (x_val, y_val)
+                            : builder.CreateICmpSGT (x_val, y_val);
+        if (! rop.llvm_batch_store (builder.CreateSelect (cond, x_val, y_val),
+                                    Result, i))
+            return false;
+    }
+    return true;
+}
+
+
+
+LLVMGEN (llvm_gen_batch_clamp)
+{
+    Opcode &op (rop.inst()->ops()[opnum]);
+    Symbol& Result = *rop.opargsym (op, 0);
+    Symbol& X = *rop.opargsym (op, 1);
+    Symbol& Min = *rop.opargsym (op, 2);
+    Symbol& Max = *rop.opargsym (op, 3);
+
+    TypeDesc type = Result.typespec().simpletype();
+    bool is_float = Result.typespec().is_floatbased();
+    llvm::IRBuilder<> &builder (rop.builder());
+    for (int i = 0;  i < (int)type.aggregate;  ++i) {
+        llvm::Value *val = rop.llvm_batch_load (X, i, type);
+        llvm::Value *min = rop.llvm_batch_load (Min, i, type);
+        llvm::Value *max = rop.llvm_batch_load (Max, i, type);
+        if (!val || !min || !max)
+            return false;
+        llvm::Value *cond = is_float ? builder.CreateFCmpULT (val, min)
+                                     : builder.CreateICmpSLT (val, min);
+        val = builder.CreateSelect (cond, min, val);
+        cond = is_float ? builder.CreateFCmpUGT (val, max)
+                        : builder.CreateICmpSGT (val, max);
+        val = builder.CreateSelect (cond, max, val);
+        if (! rop.llvm_batch_store (val, Result, i))
+            return false;
+    }
+    return true;
+}
+
+
+
+// safe_sqrt: 0 for x <= 0, else sqrt(x)
+LLVMGEN (llvm_gen_batch_sqrt)
+{
+    Opcode &op (rop.inst()->ops()[opnum]);
+    Symbol& Result = *rop.opargsym (op, 0);
+    Symbol& A = *rop.opargsym (op, 1);
+    if (! Result.typespec().is_floatbased())
+        return false;
+
+    TypeDesc type = Result.typespec().simpletype();
+    llvm::IRBuilder<> &builder (rop.builder());
+    llvm::Type *types[] = { rop.llvm_type_batch (TypeDesc::FLOAT) };
+#if OSL_LLVM_VERSION <= 29
+    llvm::Function *sqrt_func = llvm::Intrinsic::getDeclaration (rop.llvm_module(),
+        llvm::Intrinsic::sqrt, (const llvm::Type**) types, 1);
+#else
+    llvm::Function *sqrt_func = llvm::Intrinsic::getDeclaration (rop.llvm_module(),
+        llvm::Intrinsic::sqrt, llvm::ArrayRef<llvm::Type *>(types, 1));
+#endif
+    for (int i = 0;  i < (int)type.aggregate;  ++i) {
+        llvm::Value *a = rop.llvm_batch_load (A, i, type);
+        if (! a)
+            return false;
+        llvm::Value *zero = llvm_batch_zero (a);
+        llvm::Value *r = builder.CreateSelect (builder.CreateFCmpOLE (a, zero),
+                                               zero, builder.CreateCall (sqrt_func, a));
+        if (! rop.llvm_batch_store (r, Result, i))
+            return false;
+    }
+    return true;
+}
+
+
+
+// floor, ceil.  There's no vector floor intrinsic, so round toward zero
+// through ints and adjust.  Values at least 2^23 in magnitude (and
+// infinities and NaNs) are already integral and pass through, and the
+// result always has the sign of x, which keeps floorf's and ceilf's -0.
+LLVMGEN (llvm_gen_batch_floorceil)
+{
+    Opcode &op (rop.inst()->ops()[opnum]);
+    Symbol& Result = *rop.opargsym (op, 0);
+    Symbol& A = *rop.opargsym (op, 1);
+    if (! Result.typespec().is_floatbased())
+        return false;
+
+    TypeDesc type = Result.typespec().simpletype();
+    bool is_floor = (op.opname() == op_floor);
+    llvm::IRBuilder<> &builder (rop.builder());
+    llvm::Type *floattype = rop.llvm_type_batch (TypeDesc::FLOAT);
+    llvm::Type *inttype = rop.llvm_type_batch (TypeDesc::INT);
+    llvm::Value *signbit = rop.llvm_batch_splat (rop.llvm_constant((int)0x80000000));
+    llvm::Value *one = rop.llvm_batch_splat (rop.llvm_constant(1.0f));
+    llvm::Value *big = rop.llvm_batch_splat (rop.llvm_constant(8388608.0f));
+    for (int i = 0;  i < (int)type.aggregate;  ++i) {
+        llvm::Value *x = rop.llvm_batch_load (A, i, type);
+        if (! x)
+            return false;
+        llvm::Value *xbits = builder.CreateBitCast (x, inttype);
+        llvm::Value *absx = builder.CreateBitCast (builder.CreateAnd (xbits,
+                                  builder.CreateNot (signbit)), floattype);
+        llvm::Value *t = builder.CreateSIToFP (builder.CreateFPToSI (x, inttype),
+                                               floattype);
+        if (is_floor)
+            t = builder.CreateSelect (builder.CreateFCmpOGT (t, x),
+                                      builder.CreateFSub (t, one), t);
+        else
+            t = builder.CreateSelect (builder.CreateFCmpOLT (t, x),
+                                      builder.CreateFAdd (t, one), t);
+        llvm::Value *tbits = builder.CreateOr (builder.CreateBitCast (t, inttype),
+                                               builder.CreateAnd (xbits, signbit));
+        t = builder.CreateBitCast (tbits, floattype);
+        llvm::Value *r = builder.CreateSelect (builder.CreateFCmpOLT (absx, big),
+                                               t, x);
+        if (! rop.llvm_batch_store (r, Result, i))
+            return false;
+    }
+    return true;
+}
+
+
+
+// step (edge, x): x < edge ? 0 : 1
+LLVMGEN (llvm_gen_batch_step)
+{
+    Opcode &op (rop.inst()->ops()[opnum]);
+    Symbol& Result = *rop.opargsym (op, 0);
+    Symbol& Edge = *rop.opargsym (op, 1);
+    Symbol& X = *rop.opargsym (op, 2);
+    if (! Result.typespec().is_floatbased())
+        return false;
+
+    TypeDesc type = Result.typespec().simpletype();
+    llvm::Value *zero = rop.llvm_batch_splat (rop.llvm_constant(0.0f));
+    llvm::Value *one = rop.llvm_batch_splat (rop.llvm_constant(1.0f));
+    for (int i = 0;  i < (int)type.aggregate;  ++i) {
+        llvm::Value *edge = rop.llvm_batch_load (Edge, i, type);
+        llvm::Value *x = rop.llvm_batch_load (X, i, type);
+        if (!edge || !x)
+            return false;
+        llvm::Value *r = rop.builder().CreateSelect (
+                             rop.builder().CreateFCmpOLT (x, edge), zero, one);
+        if (! rop.llvm_batch_store (r, Result, i))
+            return false;
+    }
+    return true;
+}
+
+
+
+LLVMGEN (llvm_gen_batch_dot)
+{
+    Opcode &op (rop.inst()->ops()[opnum]);
+    Symbol& Result = *rop.opargsym (op, 0);
+    Symbol& A = *rop.opargsym (op, 1);
+    Symbol& B = *rop.opargsym (op, 2);
+    if (! A.typespec().is_triple() || ! B.typespec().is_triple())
+        return false;
+
+    llvm::IRBuilder<> &builder (rop.builder());
+    llvm::Value *r = NULL;
+    for (int i = 0;  i < 3;  ++i) {
+        llvm::Value *a = rop.llvm_batch_load (A, i);
+        llvm::Value *b = rop.llvm_batch_load (B, i);
+        if (!a || !b)
+            return false;
+        llvm::Value *ab = builder.CreateFMul (a, b);
+        r = r ? builder.CreateFAdd (r, ab) : ab;
+    }
+    return rop.llvm_batch_store (r, Result);
+}
+
+
+
+LLVMGEN (llvm_gen_batch_cross)
+{
+    Opcode &op (rop.inst()->ops()[opnum]);
+    Symbol& Result = *rop.opargsym (op, 0);
+    Symbol& A = *rop.opargsym (op, 1);
+    Symbol& B = *rop.opargsym (op, 2);
+
+    llvm::IRBuilder<> &builder (rop.builder());
+    llvm::Value *a[3], *b[3];
+    for (int i = 0;  i < 3;  ++i) {
+        a[i] = rop.llvm_batch_load (A, i);
+        b[i] = rop.llvm_batch_load (B, i);
+        if (!a[i] || !b[i])
+            return false;
+    }
+    // Load them all before storing any, in case Result is A or B
+    llvm::Value *r[3];
+    for (int i = 0;  i < 3;  ++i) {
+        int j = (i+1) % 3, k = (i+2) % 3;
+        r[i] = builder.CreateFSub (builder.CreateFMul (a[j], b[k]),
+                                   builder.CreateFMul (a[k], b[j]));
+    }
+    for (int i = 0;  i < 3;  ++i)
+        if (! rop.llvm_batch_store (r[i], Result, i))
+            return false;
+    return true;
+}
+
+
+
+LLVMGEN (llvm_gen_batch_assign)
+{
+    Opcode &op (rop.inst()->ops()[opnum]);
+    Symbol& Result (*rop.opargsym (op, 0));
+    Symbol& Src (*rop.opargsym (op, 1));
+
+    return rop.llvm_batch_assign (Result, Src);
+}
+
+
+
+// A constant index into a triple.  Out-of-range constant indices are
+// clamped, as in the scalar code, unless range checking is on, which
+// needs osl_range_check to report them.
+static bool
+llvm_batch_const_component (RuntimeOptimizer &rop, const Symbol &Index,
+                            int &i)
+{
+    if (! Index.is_constant())
+        return false;
+    i = *(int *)Index.data();
+    if (rop.shadingsys().range_checking() && (i < 0 || i >= 3))
+        return false;
+    i = Imath::clamp (i, 0, 2);
+    return true;
+}
+
+
+
+LLVMGEN (llvm_gen_batch_compref)
+{
+    Opcode &op (rop.inst()->ops()[opnum]);
+    Symbol& Result = *rop.opargsym (op, 0);
+    Symbol& Val = *rop.opargsym (op, 1);
+    Symbol& Index = *rop.opargsym (op, 2);
+
+    int i;
+    if (! llvm_batch_const_component (rop, Index, i))
+        return false;
+    return rop.llvm_batch_store (rop.llvm_batch_load (Val, i), Result);
+}
+
+
+
+LLVMGEN (llvm_gen_batch_compassign)
+{
+    Opcode &op (rop.inst()->ops()[opnum]);
+    Symbol& Result = *rop.opargsym (op, 0);
+    Symbol& Index = *rop.opargsym (op, 1);
+    Symbol& Val = *rop.opargsym (op, 2);
+
+    int i;
+    if (! llvm_batch_const_component (rop, Index, i))
+        return false;
+    return rop.llvm_batch_store (rop.llvm_batch_load (Val, 0, TypeDesc::TypeFloat),
+                                 Result, i);
+}
+
+
+
+// color, point, vector, normal -- only without a space name
+LLVMGEN (llvm_gen_batch_construct_triple)
+{
+    Opcode &op (rop.inst()->ops()[opnum]);
+    Symbol& Result = *rop.opargsym (op, 0);
+    if (op.nargs() != 4)
+        return false;
+
+    llvm::Value *vals[3];
+    for (int c = 0;  c < 3;  ++c) {
+        vals[c] = rop.llvm_batch_load (*rop.opargsym (op, c+1), 0,
+                                       TypeDesc::TypeFloat);
+        if (! vals[c])
+            return false;
+    }
+    for (int c = 0;  c < 3;  ++c)
+        if (! rop.llvm_batch_store (vals[c], Result, c))
+            return false;
+    return true;
+}
+
+
+
+LLVMGEN (llvm_gen_batch_compare_op)
+{
+    Opcode &op (rop.inst()->ops()[opnum]);
+    Symbol &Result (*rop.opargsym (op, 0));
+    Symbol &A (*rop.opargsym (op, 1));
+    Symbol &B (*rop.opargsym (op, 2));
+
+    int num_components = std::max (A.typespec().aggregate(), B.typespec().aggregate());
+    bool float_based = A.typespec().is_floatbased() || B.typespec().is_floatbased();
+    TypeDesc cast (float_based ? TypeDesc::FLOAT : TypeDesc::UNKNOWN);
+    ustring opname = op.opname();
+    llvm::IRBuilder<> &builder (rop.builder());
+
+    llvm::Value *final_result = NULL;
+    for (int i = 0;  i < num_components;  ++i) {
+        llvm::Value *a = rop.llvm_batch_load (A, i, cast);
+        llvm::Value *b = rop.llvm_batch_load (B, i, cast);
+        if (!a || !b)
+            return false;
+        llvm::Value *result;
+        if (opname == op_lt)
+            result = float_based ? builder.CreateFCmpULT(a, b) : builder.CreateICmpSLT(a, b);
+        else if (opname == op_le)
+            result = float_based ? builder.CreateFCmpULE(a, b) : builder.CreateICmpSLE(a, b);
+        else if (opname == op_eq)
+            result = float_based ? builder.CreateFCmpUEQ(a, b) : builder.CreateICmpEQ(a, b);
+        else if (opname == op_ge)
+            result = float_based ? builder.CreateFCmpUGE(a, b) : builder.CreateICmpSGE(a, b);
+        else if (opname == op_gt)
+            result = float_based ? builder.CreateFCmpUGT(a, b) : builder.CreateICmpSGT(a, b);
+        else if (opname == op_neq)
+            result = float_based ? builder.CreateFCmpUNE(a, b) : builder.CreateICmpNE(a, b);
+        else
+            return false;
+        if (! final_result)
+            final_result = result;
+        else if (opname != op_neq)
+            final_result = builder.CreateAnd (final_result, result);
+        else
+            final_result = builder.CreateOr (final_result, result);
+    }
+    final_result = builder.CreateZExt (final_result,
+                                       rop.llvm_type_batch (TypeDesc::INT));
+    return rop.llvm_batch_store (final_result, Result);
+}
+
+
+
+LLVMGEN (llvm_gen_batch_andor)
+{
+    Opcode& op (rop.inst()->ops()[opnum]);
+    Symbol& result = *rop.opargsym (op, 0);
+    Symbol& a = *rop.opargsym (op, 1);
+    Symbol& b = *rop.opargsym (op, 2);
+
+    llvm::Value *a_val = rop.llvm_batch_load (a, 0, TypeDesc::TypeInt);
+    llvm::Value *b_val = rop.llvm_batch_load (b, 0, TypeDesc::TypeInt);
+    if (!a_val || !b_val)
+        return false;
+    llvm::IRBuilder<> &builder (rop.builder());
+    llvm::Value *zero = llvm_batch_zero (a_val);
+    llvm::Value *i1_res;
+    if (op.opname() == op_and)
+        i1_res = builder.CreateAnd (builder.CreateICmpNE (b_val, zero),
+                                    builder.CreateICmpNE (a_val, zero));
+    else
+        i1_res = builder.CreateICmpNE (builder.CreateOr (a_val, b_val), zero);
+    return rop.llvm_batch_store (builder.CreateZExt (i1_res, a_val->getType()),
+                                 result);
+}
+
+
+
+LLVMGEN (llvm_gen_batch_bitwise_binary_op)
+{
+    Opcode &op (rop.inst()->ops()[opnum]);
+    Symbol& Result = *rop.opargsym (op, 0);
+    Symbol& A = *rop.opargsym (op, 1);
+    Symbol& B = *rop.opargsym (op, 2);
+
+    llvm::Value *a = rop.llvm_batch_load (A);
+    llvm::Value *b = rop.llvm_batch_load (B);
+    if (!a || !b)
+        return false;
+    llvm::IRBuilder<> &builder (rop.builder());
+    llvm::Value *r;
+    if (op.opname() == op_bitand)
+        r = builder.CreateAnd (a, b);
+    else if (op.opname() == op_bitor)
+        r = builder.CreateOr (a, b);
+    else if (op.opname() == op_xor)
+        r = builder.CreateXor (a, b);
+    else if (op.opname() == op_shl)
+        r = builder.CreateShl (a, b);
+    else if (op.opname() == op_shr)
+        r = builder.CreateAShr (a, b);
+    else
+        return false;
+    return rop.llvm_batch_store (r, Result);
+}
+
+
+
+LLVMGEN (llvm_gen_batch_compl)
+{
+    Opcode &op (rop.inst()->ops()[opnum]);
+    Symbol& Result = *rop.opargsym (op, 0);
+    Symbol& A = *rop.opargsym (op, 1);
+
+    llvm::Value *a = rop.llvm_batch_load (A);
+    if (! a)
+        return false;
+    return rop.llvm_batch_store (rop.builder().CreateNot (a), Result);
+}
+
+
+
+// Both sides of the if are run, each storing only to the lanes that
+// would have taken it.
+LLVMGEN (llvm_gen_batch_if)
+{
+    Opcode &op (rop.inst()->ops()[opnum]);
+    Symbol& cond = *rop.opargsym (op, 0);
+
+    llvm::Value *cond_val = rop.llvm_batch_load (cond, 0, TypeDesc::TypeInt);
+    if (! cond_val)
+        return false;
+    llvm::IRBuilder<> &builder (rop.builder());
+    llvm::Value *on = builder.CreateICmpNE (cond_val, llvm_batch_zero (cond_val));
+    llvm::Value *off = builder.CreateNot (on);
+
+    llvm::Value *outer = rop.llvm_batch_mask ();
+    rop.llvm_batch_mask (outer ? builder.CreateAnd (outer, on) : on);
+    bool ok = rop.build_llvm_batch_code (opnum+1, op.jump(0));
+    rop.llvm_batch_mask (outer ? builder.CreateAnd (outer, off) : off);
+    ok = ok && rop.build_llvm_batch_code (op.jump(0), op.jump(1));
+    rop.llvm_batch_mask (outer);
+    return ok;
+}
+
+
+
+// A function body without any 'return' (which has no batch version) is
+// just its ops in line.
+LLVMGEN (llvm_gen_batch_functioncall)
+{
+    Opcode &op (rop.inst()->ops()[opnum]);
+    return rop.build_llvm_batch_code (opnum+1, op.jump(0));
+}
+
+
+
+// The batch code runs every layer up front, in order, so there's
+// nothing to do here.
+LLVMGEN (llvm_gen_batch_useparam)
+{
+    return true;
+}
+
+
+
+LLVMGEN (llvm_gen_batch_get_simple_SG_field)
+{
+    Opcode &op (rop.inst()->ops()[opnum]);
+    Symbol& Result = *rop.opargsym (op, 0);
+    return rop.llvm_batch_store (rop.llvm_batch_load_global (op.opname()),
+                                 Result);
+}
+
+
+
+// noise, snoise, cellnoise, pnoise, psnoise: spill the coordinates (and
+// periods) of all the lanes to memory, points across lanes, and make one
+// call to osl_<op>_batch for all of them.
+LLVMGEN (llvm_gen_batch_noise)
+{
+    Opcode &op (rop.inst()->ops()[opnum]);
+    Symbol& Result = *rop.opargsym (op, 0);
+    bool periodic = (op.opname() == op_pnoise || op.opname() == op_psnoise);
+    int ncoords = periodic ? (op.nargs() - 1) / 2 : op.nargs() - 1;
+    if (ncoords < 1 || ncoords > 2 ||
+        ! (Result.typespec().is_float() || Result.typespec().is_triple()))
+        return false;
+    bool xtriple = rop.opargsym(op,1)->typespec().is_triple();
+    if (periodic && rop.opargsym(op,1+ncoords)->typespec().is_triple() != xtriple)
+        return false;
+
+    // Arguments: the coordinates, then (if periodic) their periods
+    llvm::IRBuilder<> &builder (rop.builder());
+    llvm::BasicBlock &entry (rop.layer_func()->getEntryBlock());
+    llvm::IRBuilder<> top (&entry, entry.begin());
+    llvm::Type *floattype = rop.llvm_type_batch (TypeDesc::FLOAT);
+    llvm::Value *lanes[4] = { NULL, NULL, NULL, NULL };
+    for (int a = 0;  a < op.nargs() - 1;  ++a) {
+        Symbol &A (*rop.opargsym (op, a+1));
+        const TypeSpec &t (A.typespec());
+        bool first = (a % ncoords) == 0;
+        if (! (t.is_float() || (first && t.is_triple())))
+            return false;
+        int ncomps = t.is_triple() ? 3 : 1;
+        lanes[a] = top.CreateAlloca (llvm::ArrayType::get (floattype, ncomps));
+        for (int c = 0;  c < ncomps;  ++c) {
+            llvm::Value *val = rop.llvm_batch_load (A, c);
+            if (! val)
+                return false;
+            builder.CreateStore (val, builder.CreateConstGEP2_32 (lanes[a], 0, c));
+        }
+    }
+
+    int rcomps = Result.typespec().is_triple() ? 3 : 1;
+    llvm::Value *result = top.CreateAlloca (llvm::ArrayType::get (floattype, rcomps));
+    llvm::Value *args[7];
+    args[0] = rop.llvm_void_ptr (result);
+    args[1] = rop.llvm_constant (rcomps);
+    args[2] = rop.llvm_void_ptr (lanes[0]);
+    args[3] = rop.llvm_constant (xtriple ? 3 : 1);
+    args[4] = ncoords > 1 ? rop.llvm_void_ptr (lanes[1]) : rop.llvm_void_ptr_null();
+    if (periodic) {
+        args[5] = rop.llvm_void_ptr (lanes[ncoords]);
+        args[6] = ncoords > 1 ? rop.llvm_void_ptr (lanes[ncoords+1])
+                              : rop.llvm_void_ptr_null();
+    }
+    std::string name = std::string("osl_") + op.opname().string() + "_batch";
+    rop.llvm_call_function (name.c_str(), args, periodic ? 7 : 5);
+
+    for (int c = 0;  c < rcomps;  ++c) {
+        llvm::Value *val = builder.CreateLoad (builder.CreateConstGEP2_32 (result, 0, c));
+        if (! rop.llvm_batch_store (val, Result, c))
+            return false;
+    }
+    return true;
+}
+
+
+
 }; // namespace pvt
 }; // namespace osl
 
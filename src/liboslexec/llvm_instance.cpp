@@ -28,7 +28,25 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #include <cmath>
 #include <cstddef> // FIXME: OIIO's timer.h depends on NULL being defined and should include this itself
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <sstream>
+#if (defined(__i386__) || defined(__x86_64__)) && defined(__GNUC__)
+# include <cpuid.h>
+# define OSL_HAVE_CPUID 1
+#endif
+#ifdef _WIN32
+# include <process.h>
+# define getpid _getpid
+#else
+# include <unistd.h>
+#endif
+
+#include <boost/algorithm/string.hpp>
+#include <boost/filesystem.hpp>
 
+#include <OpenImageIO/plugin.h>
 #include <OpenImageIO/timer.h>
 
 #include "llvm_headers.h"
@@ -36,21 +54,29 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 // More LLVM headers that we only need for setup and calling the JIT and
 // optimizer
 #include <llvm/Analysis/Verifier.h>
+#include <llvm/Metadata.h>
+#include <llvm/Support/DebugLoc.h>
+#include <llvm/Support/FormattedStream.h>
+#include <llvm/Support/Host.h>
 #include <llvm/Support/PrettyStackTrace.h>
+#include <llvm/Target/TargetMachine.h>
 #include <llvm/Target/TargetOptions.h>
 #include <llvm/Transforms/Scalar.h>
 #include <llvm/Transforms/IPO.h>
+#include <llvm/Transforms/Utils/Cloning.h>
 #include <llvm/Transforms/Utils/UnifyFunctionExitNodes.h>
 #if OSL_LLVM_VERSION <= 29
 # include <llvm/Support/StandardPasses.h>
 # include <llvm/Target/TargetSelect.h>
 #else
+# include <llvm/Support/TargetRegistry.h>
 # include <llvm/Support/TargetSelect.h>
 #endif
 
 #include "oslexec_pvt.h"
 #include "../liboslcomp/oslcomp_pvt.h"
 #include "runtimeoptimize.h"
+#include "genclosure.h"
 
 /*
 This whole file is concerned with taking our post-optimized OSO
@@ -108,8 +134,22 @@ Schematically, we want to create code that resembles the following:
 
 */
 
+// The llvm_ops bitcode.  CMake may also build it for newer instruction
+// sets, and says so by defining OSL_LLVM_OPS_<ISA>.
 extern int osl_llvm_compiled_ops_size;
 extern char osl_llvm_compiled_ops_block[];
+#ifdef OSL_LLVM_OPS_SSE4_2
+extern int osl_llvm_compiled_ops_sse4_2_size;
+extern char osl_llvm_compiled_ops_sse4_2_block[];
+#endif
+#ifdef OSL_LLVM_OPS_AVX
+extern int osl_llvm_compiled_ops_avx_size;
+extern char osl_llvm_compiled_ops_avx_block[];
+#endif
+#ifdef OSL_LLVM_OPS_AVX2
+extern int osl_llvm_compiled_ops_avx2_size;
+extern char osl_llvm_compiled_ops_avx2_block[];
+#endif
 
 using namespace OSL;
 using namespace OSL::pvt;
@@ -128,6 +168,144 @@ using OIIO::Timer;
 
 static ustring op_end("end");
 static ustring op_nop("nop");
+static ustring op_setmessage("setmessage");
+static ustring op_getmessage("getmessage");
+static ustring op_texture("texture"), op_texture3d("texture3d");
+static ustring op_environment("environment");
+static ustring op_gettextureinfo("gettextureinfo");
+static ustring op_getattribute("getattribute"), op_trace("trace");
+static ustring op_noise("noise"), op_snoise("snoise");
+static ustring op_pnoise("pnoise"), op_psnoise("psnoise");
+static ustring op_cellnoise("cellnoise");
+static ustring u_trace("trace");
+
+
+
+/// The instruction set levels that llvm_ops may be built for, in
+/// increasing order (each includes the ones before it).
+enum LLVMOpsISA { ISA_SSE2, ISA_SSE4_2, ISA_AVX, ISA_AVX2, ISA_COUNT };
+
+static const char *isa_names[ISA_COUNT] = { "sse2", "sse4.2", "avx", "avx2" };
+
+#ifndef OSL_LLVM_NO_BITCODE
+/// The llvm_ops bitcode for each ISA level, NULL for those not built.
+static struct { const char *block; const int *size; }
+llvm_ops_builds[ISA_COUNT] = {
+    { osl_llvm_compiled_ops_block, &osl_llvm_compiled_ops_size },
+#ifdef OSL_LLVM_OPS_SSE4_2
+    { osl_llvm_compiled_ops_sse4_2_block, &osl_llvm_compiled_ops_sse4_2_size },
+#else
+    { NULL, NULL },
+#endif
+#ifdef OSL_LLVM_OPS_AVX
+    { osl_llvm_compiled_ops_avx_block, &osl_llvm_compiled_ops_avx_size },
+#else
+    { NULL, NULL },
+#endif
+#ifdef OSL_LLVM_OPS_AVX2
+    { osl_llvm_compiled_ops_avx2_block, &osl_llvm_compiled_ops_avx2_size },
+#else
+    { NULL, NULL },
+#endif
+};
+#endif
+
+
+
+/// Return the highest ISA level that this machine supports.
+///
+static int
+host_isa ()
+{
+#ifdef OSL_HAVE_CPUID
+    unsigned int eax, ebx, ecx, edx;
+    if (! __get_cpuid (1, &eax, &ebx, &ecx, &edx) || ! (ecx & (1 << 20)))
+        return ISA_SSE2;                     // no SSE4.2
+    bool fma = (ecx & (1 << 12)) != 0;
+    // AVX also needs the OS to save the YMM registers (OSXSAVE + XCR0)
+    if (! (ecx & (1 << 28)) || ! (ecx & (1 << 27)))
+        return ISA_SSE4_2;
+    unsigned int xcr0, xcr0_hi;
+    __asm__ ("xgetbv" : "=a" (xcr0), "=d" (xcr0_hi) : "c" (0));
+    if ((xcr0 & 6) != 6)
+        return ISA_SSE4_2;
+    if (__get_cpuid_max (0, NULL) < 7)
+        return ISA_AVX;
+    __cpuid_count (7, 0, eax, ebx, ecx, edx);
+    return (fma && (ebx & (1 << 5))) ? ISA_AVX2 : ISA_AVX;
+#else
+    return ISA_SSE2;
+#endif
+}
+
+
+
+/// Return the lowest ISA level that has everything LLVM's CPU of the
+/// given name has, or -1 if we don't know one (for instance, AMD parts
+/// with instructions that no Intel chip of any level has).
+static int
+cpu_isa (const std::string &cpu)
+{
+    static const struct { const char *name; int isa; } cpus[] = {
+        { "generic", ISA_SSE2 }, { "x86-64", ISA_SSE2 },
+        { "nocona", ISA_SSE4_2 }, { "core2", ISA_SSE4_2 },
+        { "penryn", ISA_SSE4_2 },
+        { "nehalem", ISA_SSE4_2 }, { "corei7", ISA_SSE4_2 },
+        { "westmere", ISA_AVX },   // AES and PCLMUL
+        { "sandybridge", ISA_AVX }, { "corei7-avx", ISA_AVX },
+        { "ivybridge", ISA_AVX2 }, { "core-avx-i", ISA_AVX2 },  // F16C
+        { "haswell", ISA_AVX2 }, { "core-avx2", ISA_AVX2 },
+        { NULL, -1 }
+    };
+    for (int i = 0;  cpus[i].name;  ++i)
+        if (cpu == cpus[i].name)
+            return cpus[i].isa;
+    return -1;
+}
+
+
+
+/// Adjust an ISA level for LLVM target features that turn instruction
+/// sets on ("+avx") or off ("-avx").  Turning on a feature we don't
+/// know the level of makes the result unknown (-1) too.
+static int
+features_isa (int isa, const std::vector<std::string> &features)
+{
+    static const struct { const char *name; int isa; } levels[] = {
+        { "+sse", ISA_SSE2 }, { "+sse2", ISA_SSE2 }, { "+mmx", ISA_SSE2 },
+        { "+cmov", ISA_SSE2 }, { "+64bit", ISA_SSE2 },
+        { "+sse3", ISA_SSE4_2 }, { "+ssse3", ISA_SSE4_2 },
+        { "+sse41", ISA_SSE4_2 }, { "+sse4.1", ISA_SSE4_2 },
+        { "+sse42", ISA_SSE4_2 }, { "+sse4.2", ISA_SSE4_2 },
+        { "+popcnt", ISA_SSE4_2 }, { "+cmpxchg16b", ISA_SSE4_2 },
+        { "+avx", ISA_AVX }, { "+aes", ISA_AVX }, { "+clmul", ISA_AVX },
+        { "+pclmul", ISA_AVX },
+        { "+f16c", ISA_AVX2 }, { "+rdrand", ISA_AVX2 },
+        { "+fsgsbase", ISA_AVX2 }, { "+avx2", ISA_AVX2 },
+        { "+fma", ISA_AVX2 }, { "+fma3", ISA_AVX2 }, { "+bmi", ISA_AVX2 },
+        { "+bmi2", ISA_AVX2 }, { "+lzcnt", ISA_AVX2 }, { "+movbe", ISA_AVX2 },
+        { NULL, -1 }
+    };
+    for (size_t i = 0;  i < features.size() && isa >= 0;  ++i) {
+        const std::string &f (features[i]);
+        if (f.empty())
+            continue;
+        if (f[0] != '-') {
+            int level = -1;
+            for (int j = 0;  levels[j].name;  ++j)
+                if (f == levels[j].name || ("+" + f) == levels[j].name)
+                    level = levels[j].isa;
+            isa = (level < 0) ? -1 : std::max (isa, level);
+        }
+        else if (f == "-sse4.2" || f == "-sse4.1" || f == "-ssse3")
+            isa = std::min (isa, (int)ISA_SSE2);
+        else if (f == "-avx")
+            isa = std::min (isa, (int)ISA_SSE4_2);
+        else if (f == "-avx2" || f == "-fma")
+            isa = std::min (isa, (int)ISA_AVX);
+    }
+    return isa;
+}
 
 
 
@@ -228,6 +406,11 @@ static const char *llvm_helper_function_table[] = {
     PNOISE_DERIV_IMPL(pnoise),
     PNOISE_IMPL(psnoise),
     PNOISE_DERIV_IMPL(psnoise),
+    "osl_cellnoise_batch", "xXiXiX",
+    "osl_noise_batch", "xXiXiX",
+    "osl_snoise_batch", "xXiXiX",
+    "osl_pnoise_batch", "xXiXiXXX",
+    "osl_psnoise_batch", "xXiXiXXX",
 #endif
     "osl_spline_fff", "xXXXXi",
     "osl_spline_dfdfdf", "xXXXXi",
@@ -366,7 +549,7 @@ static const char *llvm_helper_function_table[] = {
     "osl_startswith_iss", "iss",
     "osl_endswith_iss", "iss",
     "osl_substr_ssii", "ssii",
-    "osl_regex_impl", "iXsXisi",
+    "osl_regex_impl", "iXsXisiX",
 
     "osl_texture_clear", "xX",
     "osl_texture_set_firstchannel", "xXi",
@@ -381,8 +564,8 @@ static const char *llvm_helper_function_table[] = {
     "osl_texture_set_rwidth", "xXf",
     "osl_texture_set_fill", "xXf",
     "osl_texture_set_time", "xXf",
-    "osl_texture", "iXsXffffffiXXX",
-    "osl_texture_alpha", "iXsXffffffiXXXXXX",
+    "osl_texture", "iXsXXffffffiXXX",
+    "osl_texture_alpha", "iXsXXffffffiXXXXXX",
     "osl_texture3d", "iXsXXXXXiXXXX",
     "osl_texture3d_alpha", "iXsXXXXXiXXXXXXXX",
     "osl_environment", "iXsXXXXiXXXXXX",
@@ -406,6 +589,8 @@ static const char *llvm_helper_function_table[] = {
     "osl_raytype_name", "iXX",
     "osl_raytype_bit", "iXi",
     "osl_bind_interpolated_param", "iXXLiX",
+    "osl_setmessage_slot", "xXXsXiisi",
+    "osl_getmessage_slot", "iXXsXiiisi",
 #endif // OSL_LLVM_NO_BITCODE
 
     NULL
@@ -517,6 +702,7 @@ RuntimeOptimizer::llvm_type_groupdata ()
             ++order;
         }
     }
+    offset = llvm_assign_message_slots (offset, fields);
     m_group.llvm_groupdata_size (offset);
 
     m_llvm_type_groupdata = llvm_type_struct (fields);
@@ -531,6 +717,102 @@ RuntimeOptimizer::llvm_type_groupdata ()
 
 
 
+size_t
+RuntimeOptimizer::llvm_assign_message_slots (size_t offset,
+                                             std::vector<llvm::Type*> &fields)
+{
+    m_message_slots.clear ();
+    m_message_slots_begin = 0;
+    m_message_slots_size = 0;
+    if (! m_shadingsys.m_messageslots)
+        return offset;
+
+    // Gather the type each name is used with.  Slots are all or nothing:
+    // one message op with a name (or non-"trace" source) that isn't
+    // known until run time could touch any message, so it has to find
+    // them all in the MessageList.
+    typedef std::map<ustring,TypeSpec> NameTypeMap;
+    NameTypeMap types;
+    std::set<ustring> mismatched;
+    for (int layer = 0;  layer < m_group.nlayers();  ++layer) {
+        ShaderInstance *inst = m_group[layer];
+        if (inst->unused() && layer != m_group.nlayers()-1)
+            continue;
+        BOOST_FOREACH (Opcode &op, inst->ops()) {
+            int namearg;
+            if (op.opname() == op_setmessage)
+                namearg = 0;
+            else if (op.opname() == op_getmessage) {
+                namearg = op.nargs() - 2;
+                if (namearg == 2) {
+                    Symbol *Source = inst->argsymbol (op.firstarg()+1);
+                    if (! Source->is_constant())
+                        return offset;
+                    if (*(ustring *)Source->data() == u_trace)
+                        continue;   // Goes to the renderer
+                }
+            } else
+                continue;
+            Symbol *Name = inst->argsymbol (op.firstarg()+namearg);
+            Symbol *Data = inst->argsymbol (op.firstarg()+namearg+1);
+            if (! Name->is_constant())
+                return offset;
+            ustring name = *(ustring *)Name->data();
+            NameTypeMap::iterator found = types.find (name);
+            if (found == types.end())
+                types[name] = Data->typespec();
+            else if (! (found->second == Data->typespec()))
+                mismatched.insert (name);  // Leave the error to run time
+        }
+    }
+
+    // Lay out the slots in name order, each a MessageSlot header
+    // followed by the value, as one 8-byte aligned field.
+    size_t begin = (offset + 7) & ~7;
+    size_t slotoffset = begin;
+    BOOST_FOREACH (NameTypeMap::value_type &t, types) {
+        if (mismatched.find (t.first) != mismatched.end())
+            continue;
+        if (shadingsys().llvm_debug() >= 2)
+            std::cout << "  message \"" << t.first << "\" "
+                      << t.second.c_str() << ", offset " << slotoffset
+                      << std::endl;
+        m_message_slots[t.first] = (int) slotoffset;
+        size_t size = MessageSlot::header_size();
+        size += t.second.is_closure_based()
+                  ? sizeof(void *) * std::max (1, t.second.arraylength())
+                  : t.second.simpletype().size();
+        slotoffset += (size + 7) & ~7;
+    }
+    if (m_message_slots.empty())
+        return offset;
+    // Pad explicitly, since long long may be only 4-byte aligned.
+    if (begin != offset) {
+        llvm::Type *pad = llvm::Type::getInt8Ty (*m_llvm_context);
+        fields.push_back (llvm::ArrayType::get (pad, begin - offset));
+    }
+    m_message_slots_begin = (int) begin;
+    m_message_slots_size = (int) (slotoffset - begin);
+    fields.push_back (llvm::ArrayType::get (llvm_type_longlong(),
+                                            m_message_slots_size / 8));
+    m_shadingsys.m_stat_message_slots += (int) m_message_slots.size();
+    return slotoffset;
+}
+
+
+
+int
+RuntimeOptimizer::message_slot (const Symbol &name) const
+{
+    if (m_message_slots.empty() || ! name.is_constant())
+        return -1;
+    std::map<ustring,int>::const_iterator found =
+        m_message_slots.find (*(ustring *)name.data());
+    return found == m_message_slots.end() ? -1 : found->second;
+}
+
+
+
 llvm::Type *
 RuntimeOptimizer::llvm_type_groupdata_ptr ()
 {
@@ -628,6 +910,11 @@ RuntimeOptimizer::llvm_assign_initial_value (const Symbol& sym)
     if (sym.has_init_ops() && sym.valuesource() == Symbol::DefaultVal) {
         // Handle init ops.
         build_llvm_code (sym.initbegin(), sym.initend());
+    } else if (param_is_agnostic (m_layer, sym)) {
+        // The value is copied into the group data from the group's
+        // parameter block before the group runs (see init_params).
+        if (sym.has_derivs())
+            llvm_zero_derivs (sym);
     } else {
         // Use default value
         int num_components = sym.typespec().simpletype().aggregate;
@@ -711,6 +998,22 @@ RuntimeOptimizer::llvm_generate_debugnan (const Opcode &op)
 
 
 
+/// Is this one of the ops that "profile" level 2 times on its own?
+/// Only the ones that call out to the texture system, the renderer,
+/// or the noise functions are worth the cycle counter reads.
+static bool
+profiled_op (ustring opname)
+{
+    return (opname == op_texture || opname == op_texture3d ||
+            opname == op_environment || opname == op_gettextureinfo ||
+            opname == op_getattribute || opname == op_trace ||
+            opname == op_noise || opname == op_snoise ||
+            opname == op_pnoise || opname == op_psnoise ||
+            opname == op_cellnoise);
+}
+
+
+
 bool
 RuntimeOptimizer::build_llvm_code (int beginop, int endop, llvm::BasicBlock *bb)
 {
@@ -720,10 +1023,26 @@ RuntimeOptimizer::build_llvm_code (int beginop, int endop, llvm::BasicBlock *bb)
     for (int opnum = beginop;  opnum < endop;  ++opnum) {
         const Opcode& op = inst()->ops()[opnum];
         const OpDescriptor *opd = m_shadingsys.op_descriptor (op.opname());
+        if (m_shadingsys.llvm_perfmap() >= 2)
+            llvm_set_source_location (op);
         if (opd && opd->llvmgen) {
+            llvm::Value *op_start = NULL;
+            if (m_shadingsys.profile() >= 2 && op.farthest_jump() < 0 &&
+                    profiled_op (op.opname()))
+                op_start = llvm_cycles ();
             bool ok = (*opd->llvmgen) (*this, opnum);
             if (! ok)
                 return false;
+            if (op_start) {
+                std::string name = Strutil::format ("%s/%s: %s (%s:%d)",
+                                        m_group.name().c_str(),
+                                        inst()->layername().c_str(),
+                                        op.opname().c_str(),
+                                        op.sourcefile().c_str(),
+                                        op.sourceline());
+                llvm_profile_add (m_shadingsys.profile_id (ProfileOp, name),
+                                  builder().CreateSub (llvm_cycles(), op_start));
+            }
             if (m_shadingsys.debug_nan() /* debug NaN/Inf */
                 && op.farthest_jump() < 0 /* Jumping ops don't need it */) {
                 llvm_generate_debugnan (op);
@@ -747,6 +1066,237 @@ RuntimeOptimizer::build_llvm_code (int beginop, int endop, llvm::BasicBlock *bb)
 
 
 
+llvm::Function*
+RuntimeOptimizer::build_llvm_batch ()
+{
+    // Make the function: void batch_func(ShaderGlobalsBatch*, heap,
+    // heap_point_size, first, lanemask), see RunLLVMBatchFunc.
+    ShaderInstance *entry = m_group[m_group.nlayers()-1];
+    std::string name = Strutil::format ("%s_%d_batch",
+                                        entry->layername().c_str(),
+                                        entry->id());
+    m_layer_func = llvm::cast<llvm::Function>(m_llvm_module->getOrInsertFunction(name,
+                    llvm_type_void(), llvm_type_void_ptr(),
+                    llvm_type_void_ptr(), llvm_type_int(), llvm_type_int(),
+                    llvm_type_int(), NULL));
+    llvm::Function::arg_iterator arg_it = m_layer_func->arg_begin();
+    m_batch_sg = arg_it++;
+    llvm::Value *heap = arg_it++;
+    llvm::Value *heap_point_size = arg_it++;
+    m_batch_first = arg_it++;
+    llvm::Value *lanemask = arg_it++;
+
+    delete m_builder;
+    m_builder = new llvm::IRBuilder<> (llvm_new_basic_block (name));
+    m_batch_values.clear ();
+    m_batch_params.clear ();
+    m_batch_mask = NULL;
+    m_batch_groupdata.clear ();
+    for (int lane = 0;  lane < BatchWidth;  ++lane) {
+        m_batch_groupdata.push_back (heap);
+        heap = builder().CreateGEP (heap, heap_point_size);
+    }
+
+    // Run every used layer in order, each storing its outputs into the
+    // params connected to them.
+    bool ok = true;
+    for (int layer = 0;  ok && layer < m_group.nlayers();  ++layer) {
+        if (m_layer_remap[layer] != -1) {
+            set_inst (layer);
+            ok = build_llvm_batch_instance ();
+        }
+    }
+
+    if (ok) {
+        // Copy the params into the group data of each lane being
+        // shaded, where get_symbol expects to find them.
+        for (int lane = 0;  lane < BatchWidth;  ++lane) {
+            llvm::BasicBlock *copy_block = llvm_new_basic_block ("copy");
+            llvm::BasicBlock *next_block = llvm_new_basic_block ("");
+            llvm::Value *on = builder().CreateAnd (lanemask, llvm_constant(1 << lane));
+            builder().CreateCondBr (builder().CreateICmpNE (on, llvm_constant(0)),
+                                    copy_block, next_block);
+            builder().SetInsertPoint (copy_block);
+            BOOST_FOREACH (const Symbol *sym, m_batch_params) {
+                TypeDesc t = sym->typespec().simpletype();
+                llvm::Type *ptrtype = t.basetype == TypeDesc::INT
+                                        ? llvm_type_int_ptr() : llvm_type_float_ptr();
+                for (int c = 0;  c < (int)t.aggregate;  ++c) {
+                    llvm::Value *val = builder().CreateLoad (
+                        builder().CreateConstGEP2_32 (m_batch_values[sym], 0, c));
+                    val = builder().CreateExtractElement (val, llvm_constant(lane));
+                    builder().CreateStore (val, llvm_offset_ptr (m_batch_groupdata[lane],
+                                   sym->dataoffset() + c * (int)t.basesize(), ptrtype));
+                }
+            }
+            builder().CreateBr (next_block);
+            builder().SetInsertPoint (next_block);
+        }
+        builder().CreateRetVoid ();
+    } else if (shadingsys().llvm_debug()) {
+        m_shadingsys.info ("Group %s has no batch code (layer %s)",
+                           m_group.name().c_str(), inst()->layername().c_str());
+    }
+
+    delete m_builder;
+    m_builder = NULL;
+    m_batch_values.clear ();
+    m_batch_params.clear ();
+    m_batch_groupdata.clear ();
+    llvm::Function *func = m_layer_func;
+    if (! ok) {
+        func->eraseFromParent ();
+        return NULL;
+    }
+    return func;
+}
+
+
+
+bool
+RuntimeOptimizer::build_llvm_batch_instance ()
+{
+    FOREACH_PARAM (Symbol &s, inst()) {
+        // Skip structure placeholders
+        if (s.typespec().is_structure())
+            continue;
+        // Skip if it's never read and isn't connected
+        if (! s.everread() && ! s.connected_down() && ! s.connected())
+            continue;
+        if (! llvm_batch_assign_initial_value (s))
+            return false;
+    }
+
+    if (! build_llvm_batch_code (inst()->maincodebegin(), inst()->maincodeend()))
+        return false;
+
+    // Transfer all of this layer's outputs into the downstream shader's
+    // inputs.
+    for (int layer = m_layer+1;  layer < group().nlayers();  ++layer) {
+        ShaderInstance *child = m_group[layer];
+        for (int c = 0;  c < child->nconnections();  ++c) {
+            const Connection &con (child->connection (c));
+            if (con.srclayer == m_layer &&
+                ! llvm_batch_assign (*child->symbol (con.dst.param),
+                                     *inst()->symbol (con.src.param)))
+                return false;
+        }
+    }
+    return true;
+}
+
+
+
+bool
+RuntimeOptimizer::build_llvm_batch_code (int beginop, int endop)
+{
+    for (int opnum = beginop;  opnum < endop;  ++opnum) {
+        const Opcode& op = inst()->ops()[opnum];
+        const OpDescriptor *opd = m_shadingsys.op_descriptor (op.opname());
+        if (opd && opd->llvmgen_batch) {
+            if (! (*opd->llvmgen_batch) (*this, opnum))
+                return false;
+        } else if (op.opname() != op_nop && op.opname() != op_end) {
+            if (shadingsys().llvm_debug())
+                m_shadingsys.info ("No batch version of op %s (%s:%d)",
+                                   op.opname().c_str(), op.sourcefile().c_str(),
+                                   op.sourceline());
+            return false;
+        }
+
+        // If the op we coded jumps around, skip past its recursive block
+        // executions.
+        int next = op.farthest_jump ();
+        if (next >= 0)
+            opnum = next-1;
+    }
+    return true;
+}
+
+
+
+bool
+RuntimeOptimizer::llvm_batch_assign_initial_value (const Symbol &sym)
+{
+    // Connection values are stored by the earlier layer
+    if (sym.valuesource() == Symbol::ConnectedVal)
+        return true;
+    // Interpolated params would need a renderer call for each lane
+    if (! sym.lockgeom())
+        return false;
+    if (sym.has_init_ops() && sym.valuesource() == Symbol::DefaultVal)
+        return build_llvm_batch_code (sym.initbegin(), sym.initend());
+    if (! llvm_batch_storage (sym))
+        return false;
+
+    TypeDesc t = sym.typespec().simpletype();
+    bool agnostic = param_is_agnostic (m_layer, sym);
+    for (int c = 0;  c < (int)t.aggregate;  ++c) {
+        llvm::Value *val;
+        if (agnostic) {
+            // Gather each lane's value from its group data, where
+            // init_params put it.
+            llvm::Type *ptrtype = t.basetype == TypeDesc::INT
+                                    ? llvm_type_int_ptr() : llvm_type_float_ptr();
+            val = llvm::UndefValue::get (llvm_type_batch (t));
+            for (int lane = 0;  lane < BatchWidth;  ++lane) {
+                llvm::Value *ptr = llvm_offset_ptr (m_batch_groupdata[lane],
+                                       sym.dataoffset() + c * (int)t.basesize(),
+                                       ptrtype);
+                val = builder().CreateInsertElement (val, builder().CreateLoad (ptr),
+                                                     llvm_constant(lane));
+            }
+        } else if (t.basetype == TypeDesc::INT) {
+            val = llvm_batch_splat (llvm_constant (((int *)sym.data())[c]));
+        } else {
+            val = llvm_batch_splat (llvm_constant (((float *)sym.data())[c]));
+        }
+        if (! llvm_batch_store (val, sym, c))
+            return false;
+    }
+    return true;
+}
+
+
+
+void
+RuntimeOptimizer::llvm_set_source_location (const Opcode &op)
+{
+    // There's no real debug info, the scope is just a node holding the
+    // source file name, which is all OSL_PerfMapListener needs.
+    llvm::Value *file = llvm::MDString::get (llvm_context(),
+                                             op.sourcefile().string());
+#if OSL_LLVM_VERSION <= 29
+    llvm::MDNode *scope = llvm::MDNode::get (llvm_context(), &file, 1);
+#else
+    llvm::MDNode *scope = llvm::MDNode::get (llvm_context(), file);
+#endif
+    builder().SetCurrentDebugLocation (llvm::DebugLoc::get (op.sourceline(), 0, scope));
+}
+
+
+
+llvm::Value *
+RuntimeOptimizer::llvm_cycles ()
+{
+    llvm::Function *func = llvm::Intrinsic::getDeclaration (llvm_module(),
+                                       llvm::Intrinsic::readcyclecounter);
+    return builder().CreateCall (func);
+}
+
+
+
+void
+RuntimeOptimizer::llvm_profile_add (int id, llvm::Value *cycles)
+{
+    if (id < 0)
+        return;   // Ran out of counters, don't bother
+    llvm::Value *args[3] = { sg_void_ptr(), llvm_constant(id), cycles };
+    llvm_call_function ("osl_profile_add", args, 3);
+}
+
+
+
 llvm::Function*
 RuntimeOptimizer::build_llvm_instance (bool groupentry)
 {
@@ -771,6 +1321,19 @@ RuntimeOptimizer::build_llvm_instance (bool groupentry)
     m_builder = new llvm::IRBuilder<> (entry_bb);
     // llvm_gen_debug_printf (std::string("enter layer ")+inst()->shadername());
 
+    // When profiling, time the whole layer, and keep a running total of
+    // the time spent in the layers it calls so that we can charge the
+    // layer only for its own work.
+    m_llvm_profile_start = NULL;
+    m_llvm_profile_children = NULL;
+    if (shadingsys().profile()) {
+        m_llvm_profile_children = builder().CreateAlloca (llvm_type_longlong(),
+                                                  0, "profile_children");
+        builder().CreateStore (llvm::ConstantInt::get (llvm_type_longlong(), 0),
+                               m_llvm_profile_children);
+        m_llvm_profile_start = llvm_cycles ();
+    }
+
     if (groupentry) {
         if (m_num_used_layers > 1) {
             // If this is the group entry point, clear all the "layer
@@ -779,6 +1342,11 @@ RuntimeOptimizer::build_llvm_instance (bool groupentry)
             int sz = (m_num_used_layers + 3) & (~3);  // round up to 32 bits
             llvm_memset (llvm_void_ptr(layer_run_ptr(0)), 0, sz, 4 /*align*/);
         }
+        // Mark all the message slots unset.
+        if (m_message_slots_size)
+            llvm_memset (llvm_offset_ptr (groupdata_void_ptr(),
+                                          m_message_slots_begin),
+                         0, m_message_slots_size, 8 /*align*/);
         // Group entries also need to allot space for ALL layers' params
         // that are closures (to avoid weird order of layer eval problems).
         for (int i = 0;  i < group().nlayers();  ++i) {
@@ -875,6 +1443,20 @@ RuntimeOptimizer::build_llvm_instance (bool groupentry)
     }
     // llvm_gen_debug_printf ("done copying connections");
 
+    if (m_llvm_profile_start) {
+        llvm::Value *total = builder().CreateSub (llvm_cycles(),
+                                                  m_llvm_profile_start);
+        llvm::Value *self = builder().CreateSub (total,
+                                builder().CreateLoad (m_llvm_profile_children));
+        std::string name = Strutil::format ("%s/%s", m_group.name().c_str(),
+                                            inst()->layername().c_str());
+        llvm_profile_add (shadingsys().profile_id (ProfileLayer, name), self);
+        if (groupentry)
+            llvm_profile_add (shadingsys().profile_id (ProfileGroup,
+                                                   m_group.name().string()),
+                              total);
+    }
+
     // All done
     // llvm_gen_debug_printf (std::string("exit layer ")+inst()->shadername());
     builder().CreateRetVoid();
@@ -896,8 +1478,11 @@ RuntimeOptimizer::build_llvm_instance (bool groupentry)
 class OSL_Dummy_JITMemoryManager : public llvm::JITMemoryManager {
 protected:
     llvm::JITMemoryManager *mm;
+    size_t *codesize;     // if non-NULL, accumulate machine code size here
 public:
-    OSL_Dummy_JITMemoryManager(llvm::JITMemoryManager *realmm) : mm(realmm) { HasGOT = realmm->isManagingGOT(); }
+    OSL_Dummy_JITMemoryManager(llvm::JITMemoryManager *realmm,
+                               size_t *codesize_total=NULL)
+        : mm(realmm), codesize(codesize_total) { HasGOT = realmm->isManagingGOT(); }
     virtual ~OSL_Dummy_JITMemoryManager() { }
     virtual void setMemoryWritable() { mm->setMemoryWritable(); }
     virtual void setMemoryExecutable() { mm->setMemoryExecutable(); }
@@ -914,6 +1499,8 @@ public:
     }
     virtual void endFunctionBody(const llvm::Function *F,
                                  uint8_t *FunctionStart, uint8_t *FunctionEnd) {
+        if (codesize)
+            *codesize += FunctionEnd - FunctionStart;
         mm->endFunctionBody (F, FunctionStart, FunctionEnd);
     }
     virtual uint8_t *allocateSpace(intptr_t Size, unsigned Alignment) {
@@ -955,13 +1542,50 @@ public:
 
 
 
+/// OSL_PerfMapListener - Hand every function the JIT emits to the
+/// ShadingSystem's perf map, named after the group.  If lines is true,
+/// also split each function into the ranges of code that came from
+/// each OSL source line (tagged by llvm_set_source_location).
+class OSL_PerfMapListener : public llvm::JITEventListener {
+    ShadingSystemImpl &m_shadingsys;
+    std::string m_prefix;   // "osl:<group>:"
+    bool m_lines;
+public:
+    OSL_PerfMapListener (ShadingSystemImpl &shadingsys, ustring groupname,
+                         bool lines)
+        : m_shadingsys(shadingsys), m_lines(lines)
+    {
+        m_prefix = Strutil::format ("osl:%s:", groupname.size() ? groupname.c_str() : "group");
+    }
+    virtual void NotifyFunctionEmitted (const llvm::Function &F,
+                                        void *code, size_t size,
+                                        const EmittedFunctionDetails &details) {
+        std::string name = m_prefix + F.getName().str();
+        std::string rangename = name;
+        uintptr_t begin = (uintptr_t)code, end = begin + size;
+        for (size_t i = 0;  m_lines && i < details.LineStarts.size();  ++i) {
+            const EmittedFunctionDetails::LineStart &line (details.LineStarts[i]);
+            uintptr_t addr = std::min (std::max (line.Address, begin), end);
+            if (addr > begin)
+                m_shadingsys.perfmap_write ((void *)begin, addr-begin, rangename);
+            begin = addr;
+            llvm::MDNode *scope = line.Loc.getScope (F.getContext());
+            llvm::MDString *file = (scope && scope->getNumOperands()) ?
+                llvm::dyn_cast_or_null<llvm::MDString>(scope->getOperand(0)) : NULL;
+            rangename = Strutil::format ("%s:%s:%d", name.c_str(),
+                                         file ? file->getString().str().c_str() : "?",
+                                         (int)line.Loc.getLine());
+        }
+        if (end > begin)
+            m_shadingsys.perfmap_write ((void *)begin, end-begin, rangename);
+    }
+};
+
+
+
 void
-RuntimeOptimizer::build_llvm_group ()
+RuntimeOptimizer::llvm_setup_thread ()
 {
-    // At this point, we already hold the lock for this group, by virtue
-    // of ShadingSystemImpl::optimize_group.
-    Timer timer;
-
     if (! m_thread->llvm_context)
         m_thread->llvm_context = new llvm::LLVMContext();
 
@@ -970,37 +1594,200 @@ RuntimeOptimizer::build_llvm_group ()
         spin_lock lock (m_shadingsys.m_llvm_mutex);  // lock m_llvm_jitmm_hold
         m_shadingsys.m_llvm_jitmm_hold.push_back (shared_ptr<llvm::JITMemoryManager>(m_thread->llvm_jitmm));
     }
+}
 
-    ASSERT (! m_llvm_module);
-    // Load the LLVM bitcode and parse it into a Module
-    const char *data = osl_llvm_compiled_ops_block;
-    llvm::MemoryBuffer* buf = llvm::MemoryBuffer::getMemBuffer (llvm::StringRef(data, osl_llvm_compiled_ops_size));
-    std::string err;
+
+
+void
+RuntimeOptimizer::llvm_select_target ()
+{
+    if (m_llvm_isa >= 0)
+        return;
+    // The target that was asked for, exactly, and the ISA level it needs
+    // (-1 if we can't tell)
+    std::string hostcpu = llvm::sys::getHostCPUName ();
+    std::string cpu = shadingsys().m_llvm_cpu.string();
+    if (cpu.empty() || cpu == "host" || cpu == hostcpu) {
+        m_llvm_target_cpu = hostcpu;
+        m_llvm_target_isa = host_isa ();
+    } else {
+        m_llvm_target_cpu = cpu;
+        m_llvm_target_isa = cpu_isa (cpu);
+    }
+    m_llvm_target_features.clear ();
+    std::string features = shadingsys().m_llvm_features.string();
+    if (! features.empty()) {
+        boost::split (m_llvm_target_features, features, boost::is_any_of(","));
+        for (size_t i = 0;  i < m_llvm_target_features.size();  ++i)
+            boost::trim (m_llvm_target_features[i]);
+        m_llvm_target_isa = features_isa (m_llvm_target_isa,
+                                          m_llvm_target_features);
+    }
+
+    // Code for a CPU with instructions this one lacks would die the
+    // first time it ran, so what we JIT here never aims past the host,
+    // nor at a target we can't be sure the host can run.  Only objects
+    // written ahead of time, to be run elsewhere, get exactly the
+    // target that was asked for (see llvm_write_object).
+    m_llvm_cpu = m_llvm_target_cpu;
+    m_llvm_features = m_llvm_target_features;
+    m_llvm_isa = m_llvm_target_isa;
+    if (m_llvm_isa < 0 || m_llvm_isa > host_isa()) {
+        if (m_aot_filename.empty() &&
+              shadingsys().m_llvm_cpu_clamped.bool_compare_and_swap (0, 1)) {
+            if (m_llvm_isa < 0)
+                shadingsys().warning ("llvm_cpu \"%s\" (features \"%s\") "
+                                      "can't be checked against this "
+                                      "machine; JITing for the host instead",
+                                      cpu.c_str(), features.c_str());
+            else
+                shadingsys().warning ("llvm_cpu \"%s\" (features \"%s\") "
+                                      "needs %s, which this machine lacks; "
+                                      "JITing for the host instead",
+                                      cpu.c_str(), features.c_str(),
+                                      isa_names[m_llvm_isa]);
+        }
+        m_llvm_cpu = hostcpu;
+        m_llvm_isa = host_isa ();
+        m_llvm_features.clear ();
+    }
+    if (! m_aot_filename.empty()) {
+        // The llvm_ops code goes into the object too, so it mustn't need
+        // more than its target has either.  And a target we don't know
+        // the level of may only be loaded where everything is there.
+        m_llvm_isa = std::min (m_llvm_isa, std::max (m_llvm_target_isa,
+                                                     (int)ISA_SSE2));
+        if (m_llvm_target_isa < 0)
+            m_llvm_target_isa = ISA_COUNT - 1;
+    }
+#ifndef OSL_LLVM_NO_BITCODE
+    // Use the best llvm_ops that was built and that the target can run
+    while (m_llvm_isa > ISA_SSE2 && ! llvm_ops_builds[m_llvm_isa].block)
+        --m_llvm_isa;
+#endif
+    if (shadingsys().debug())
+        shadingsys().info ("JIT target cpu \"%s\" features \"%s\", llvm_ops for %s",
+                           m_llvm_cpu.c_str(),
+                           boost::algorithm::join (m_llvm_features, ",").c_str(),
+                           isa_names[m_llvm_isa]);
+}
+
+
+
+llvm::Module *
+RuntimeOptimizer::llvm_load_ops_module ()
+{
 #ifdef OSL_LLVM_NO_BITCODE
-    m_llvm_module = new llvm::Module("llvm_ops", *llvm_context());
+    return new llvm::Module("llvm_ops", *m_thread->llvm_context);
 #else
-    // Load the LLVM bitcode and parse it into a Module
-    m_llvm_module = llvm::ParseBitcodeFile (buf, *m_thread->llvm_context, &err);
-    if (err.length())
-        m_shadingsys.error ("ParseBitcodeFile returned '%s'\n", err.c_str());
-    delete buf;
+    llvm_select_target ();
+    if (m_thread->llvm_ops_module && m_thread->llvm_ops_isa != m_llvm_isa) {
+        // Parsed for another target (the attributes changed)
+        delete m_thread->llvm_ops_module;
+        m_thread->llvm_ops_module = NULL;
+    }
+    if (! m_thread->llvm_ops_module) {
+        // First group this thread has compiled: load the LLVM bitcode
+        // and parse it into a Module that we keep for the life of the
+        // thread's LLVMContext.
+        Timer timer;
+        const char *data = llvm_ops_builds[m_llvm_isa].block;
+        int size = *llvm_ops_builds[m_llvm_isa].size;
+        llvm::MemoryBuffer* buf = llvm::MemoryBuffer::getMemBuffer (llvm::StringRef(data, size));
+        std::string err;
+        m_thread->llvm_ops_module = llvm::ParseBitcodeFile (buf, *m_thread->llvm_context, &err);
+        if (err.length())
+            m_shadingsys.error ("ParseBitcodeFile returned '%s'\n", err.c_str());
+        delete buf;
+        m_stat_llvm_ops_parse_time += timer();
+        m_shadingsys.m_stat_llvm_ops_parses += 1;
+        if (! m_thread->llvm_ops_module)
+            return NULL;
+        m_thread->llvm_ops_isa = m_llvm_isa;
+    }
+    // Each group gets its own copy, since the group's code is added to
+    // it, it's optimized in place, and it's owned (and eventually
+    // destroyed) by the group's ExecutionEngine.
+    Timer timer;
+    llvm::Module *module = llvm::CloneModule (m_thread->llvm_ops_module);
+    m_stat_llvm_ops_clone_time += timer();
+    return module;
 #endif
+}
 
+
+
+bool
+RuntimeOptimizer::llvm_create_exec (bool aggressive)
+{
     // Create the ExecutionEngine
     ASSERT (! m_llvm_exec);
-    err.clear ();
-    llvm::JITMemoryManager *mm = new OSL_Dummy_JITMemoryManager(m_thread->llvm_jitmm);
-    m_llvm_exec = llvm::ExecutionEngine::createJIT (m_llvm_module, &err, mm, llvm::CodeGenOpt::Default, /*AllocateGVsWithCode*/ false);
+    std::string err;
+    llvm::JITMemoryManager *mm = new OSL_Dummy_JITMemoryManager(m_thread->llvm_jitmm,
+                                                                &m_llvm_code_size);
+    llvm_select_target ();
+    llvm::EngineBuilder engine (m_llvm_module);
+    engine.setEngineKind (llvm::EngineKind::JIT);
+    engine.setErrorStr (&err);
+    engine.setJITMemoryManager (mm);
+    engine.setOptLevel (aggressive ? llvm::CodeGenOpt::Aggressive : llvm::CodeGenOpt::Default);
+    engine.setAllocateGVsWithCode (false);
+    if (! m_llvm_cpu.empty())
+        engine.setMCPU (m_llvm_cpu);
+    if (! m_llvm_features.empty())
+        engine.setMAttrs (m_llvm_features);
+    m_llvm_exec = engine.create ();
     if (! m_llvm_exec) {
         m_shadingsys.error ("Failed to create engine: %s\n", err.c_str());
-        ASSERT (0);
-        return;
+        return false;
     }
     // Force it to JIT as soon as we ask it for the code pointer,
     // don't take any chances that it might JIT lazily, since we
     // will be stealing the JIT code memory from under its nose and
     // destroying the Module & ExecutionEngine.
     m_llvm_exec->DisableLazyCompilation ();
+    if (shadingsys().llvm_perfmap()) {
+        ASSERT (! m_llvm_perfmap_listener);
+        m_llvm_perfmap_listener = new OSL_PerfMapListener (m_shadingsys,
+                                    m_group.name(), shadingsys().llvm_perfmap() >= 2);
+        m_llvm_exec->RegisterJITEventListener (m_llvm_perfmap_listener);
+    }
+    return true;
+}
+
+
+
+RunLLVMGroupFunc
+RuntimeOptimizer::llvm_jit_function (llvm::Function *func)
+{
+#if OSL_LLVM_VERSION <= 29
+    // Lock this! -- there seems to be at least one bug in LLVM 2.9
+    // where the JIT isn't really thread-safe.
+    // Doesn't seem to be necessary for LLVM 3.0.
+    static mutex jit_mutex;
+    lock_guard lock (jit_mutex);
+#endif
+    return (RunLLVMGroupFunc) m_llvm_exec->getPointerToFunction (func);
+}
+
+
+
+void
+RuntimeOptimizer::build_llvm_group ()
+{
+    // At this point, we already hold the lock for this group, by virtue
+    // of ShadingSystemImpl::optimize_group.
+    Timer timer;
+
+    llvm_setup_thread ();
+
+    ASSERT (! m_llvm_module);
+    m_llvm_module = llvm_load_ops_module ();
+
+    if (! llvm_create_exec ()) {
+        ASSERT (0);
+        return;
+    }
 
     m_stat_llvm_setup_time += timer.lap();
 
@@ -1031,37 +1818,41 @@ RuntimeOptimizer::build_llvm_group ()
         if (index != -1) funcs[index] = build_llvm_instance (lastlayer);
     }
     llvm::Function* entry_func = funcs[m_num_used_layers-1];
+    llvm_param_block_layout ();
+
+    // Also make the version that shades BatchWidth points at once, if
+    // asked for and the group's ops allow it.  It's never cached or
+    // compiled ahead of time, and NaN checks and profiling are done
+    // only by the scalar code.
+    llvm::Function *batch_func = NULL;
+    if (shadingsys().m_batchjit && m_aot_filename.empty() &&
+          ! shadingsys().debug_nan() && ! shadingsys().profile())
+        batch_func = build_llvm_batch ();
     m_stat_llvm_irgen_time += timer.lap();
 
+    // With tiered JIT, groups first get only the cheap per-function
+    // passes so they can start running sooner; the ones that turn out
+    // to be hot are recompiled with everything by reoptimize_group.
+    bool tiered = (shadingsys().m_tieredjit > 0);
+
     // Optimize the LLVM IR unless it's just a ret void group (1 layer, 1 BB, 1 inst == retvoid)
     bool skip_optimization = m_num_used_layers == 1 && entry_func->size() == 1 && entry_func->front().size() == 1;
     // Label the group as being retvoid or not.
     m_group.does_nothing(skip_optimization);
     if (skip_optimization) {
         m_shadingsys.m_stat_empty_groups += 1;
-    } else {
-#if 0
-      // First do the simple function passes
+    } else if (tiered) {
+      // Tier 1: just the simple function passes on the layer functions
       m_llvm_func_passes->doInitialization();
-      for (llvm::Module::iterator i = llvm_module()->begin();
-           i != llvm_module()->end(); ++i) {
-        m_llvm_func_passes->run (*i);
+      for (int i = 0; i < m_num_used_layers; ++i) {
+          m_llvm_func_passes->run (*funcs[i]);
       }
+      if (batch_func)
+          m_llvm_func_passes->run (*batch_func);
       m_llvm_func_passes->doFinalization();
-#endif
-
-      // Next do the module passes
+    } else {
+      // Do the module passes
       m_llvm_passes->run (*llvm_module());
-
-#if 0
-      // Now do additional highly optimized function passes on just the
-      // new functions we added for the shader layers
-      m_llvm_func_passes_optimized->doInitialization();
-      for (int i = 0; i < m_num_used_layers; ++i) {
-          m_llvm_func_passes_optimized->run (funcs[i]);
-      }
-      m_llvm_func_passes_optimized->doFinalization();
-#endif
     }
 
     if (shadingsys().llvm_debug())
@@ -1079,18 +1870,40 @@ RuntimeOptimizer::build_llvm_group ()
 
     m_stat_llvm_opt_time += timer.lap();
 
+    // Save the optimized IR in the JIT cache, if we're using one, and
+    // with the group if it will need a second tier.
+    bool cacheable = m_llvm_relocatable && ! m_llvm_not_relocatable;
+    bool aot = ! m_aot_filename.empty();
+    if (m_llvm_relocatable && ! cacheable && ! aot)
+        m_shadingsys.m_stat_jitcache_uncacheable += 1;
+    std::string entryname = entry_func->getName().str();
+    std::string bitcode;
+    if ((cacheable || tiered) && ! m_group.does_nothing())
+        bitcode = llvm_group_bitcode (funcs, m_num_used_layers);
+    if (cacheable && ! aot)
+        jitcache_save (entryname, bitcode);
+    if (tiered)
+        m_group.llvm_tier2 (bitcode, entryname);
+
+    // Ahead-of-time compilation: write the native code too
+    if (aot) {
+        if (cacheable)
+            m_aot_written = llvm_write_object (entryname,
+                                 jitcache_record (entryname, std::string()));
+        else
+            m_shadingsys.error ("Shader group %s can't be compiled ahead of time: its code embeds pointers into this process",
+                                m_group.name().c_str());
+    }
+
     // Force the JIT to happen now
-    {
-#if OSL_LLVM_VERSION <= 29
-        // Lock this! -- there seems to be at least one bug in LLVM 2.9
-        // where the JIT isn't really thread-safe.
-        // Doesn't seem to be necessary for LLVM 3.0.
-        static mutex jit_mutex;
-        lock_guard lock (jit_mutex);
-#endif
-        RunLLVMGroupFunc f = (RunLLVMGroupFunc) m_llvm_exec->getPointerToFunction(entry_func);
-        m_group.llvm_compiled_version (f);
+    llvm_bind_relocations ();
+    m_group.llvm_compiled_version (llvm_jit_function (entry_func));
+    if (batch_func) {
+        m_group.llvm_batch_version ((RunLLVMBatchFunc) llvm_jit_function (batch_func));
+        m_shadingsys.m_stat_groups_batch += 1;
     }
+    m_group.llvm_code_size (m_llvm_code_size);
+    m_shadingsys.m_stat_llvm_code_bytes += (long long) m_llvm_code_size;
 
     // Remove the IR for the group layer functions, we've already JITed it
     // and will never need the IR again.  This saves memory, and also saves
@@ -1099,11 +1912,15 @@ RuntimeOptimizer::build_llvm_group ()
     for (int i = 0; i < m_num_used_layers; ++i) {
         funcs[i]->deleteBody();
     }
+    if (batch_func)
+        batch_func->deleteBody();
 
     // Free the exec and module to reclaim all the memory.  This definitely
     // saves memory, and has almost no effect on runtime.
     delete m_llvm_exec;
     m_llvm_exec = NULL;
+    delete m_llvm_perfmap_listener;
+    m_llvm_perfmap_listener = NULL;
 
     // N.B. Destroying the EE should have destroyed the module as well.
     m_llvm_module = NULL;
@@ -1113,6 +1930,780 @@ RuntimeOptimizer::build_llvm_group ()
 
 
 
+bool
+RuntimeOptimizer::reoptimize_group ()
+{
+    // At this point, we already hold the locks for this group and its
+    // compiled code, by virtue of ShadingSystemImpl::reoptimize_group.
+    std::string err;
+    RunLLVMGroupFunc func = llvm_jit_bitcode (m_group.llvm_tier2_bitcode(),
+                                              m_group.llvm_tier2_entry(),
+                                              true, err);
+    // Whether or not it worked, don't try again -- the tier 1 code
+    // is still perfectly good.
+    m_group.llvm_tier2 (std::string(), std::string());
+    if (! func) {
+        m_shadingsys.warning ("Could not re-optimize group %s: %s",
+                              m_group.name().c_str(), err.c_str());
+        return false;
+    }
+    // N.B. Threads may be running the tier 1 code right now, which is
+    // fine: we never free JITed code, and they'll pick up the new
+    // version on their next execute().
+    m_group.llvm_compiled_version (func);
+    return true;
+}
+
+
+
+void
+RuntimeOptimizer::llvm_param_block_layout ()
+{
+    std::vector<CompiledGroup::ParamBlockEntry> &layout (m_group.param_block_layout());
+    layout.clear ();
+    for (int layer = 0;  layer < (int)m_agnostic_params.size();  ++layer) {
+        ShaderInstance *inst = m_group[layer];
+        if (inst->unused())
+            continue;
+        BOOST_FOREACH (ustring name, m_agnostic_params[layer]) {
+            const Symbol *sym = inst->symbol (inst->findparam (name));
+            if (sym && sym->dataoffset() >= 0) {
+                // N.B. size() already includes the array length
+                layout.push_back (CompiledGroup::ParamBlockEntry (layer, name,
+                                                 sym->dataoffset(), sym->size()));
+            }
+        }
+    }
+}
+
+
+
+// The on-disk JIT cache (enabled by setting the "jitcache" attribute to
+// a directory name) stores, for each group, the optimized LLVM IR of
+// just the layer functions, plus what we need to know about the group
+// to run it without re-optimizing.  Each file is a sequence of records,
+// each of the form "tag length\n" followed by length bytes and "\n".
+
+static void
+jitcache_put (std::string &out, const char *tag, const std::string &data)
+{
+    out += Strutil::format ("%s %llu\n", tag, (unsigned long long)data.size());
+    out += data;
+    out += '\n';
+}
+
+
+
+static bool
+jitcache_get (const std::string &in, size_t &pos,
+              std::string &tag, std::string &data)
+{
+    size_t eol = in.find ('\n', pos);
+    if (eol == std::string::npos)
+        return false;
+    size_t space = in.find (' ', pos);
+    if (space == std::string::npos || space > eol)
+        return false;
+    tag.assign (in, pos, space-pos);
+    size_t len = strtoul (in.c_str()+space+1, NULL, 10);
+    if (eol+1+len+1 > in.size() || in[eol+1+len] != '\n')
+        return false;
+    data.assign (in, eol+1, len);
+    pos = eol + 1 + len + 1;
+    return true;
+}
+
+
+
+static std::string
+jitcache_filename (ustring dir, const std::string &fingerprint)
+{
+    return Strutil::format ("%s/%016llx.osljit", dir.c_str(),
+                            fnv1a_hash (fingerprint.data(), fingerprint.size()));
+}
+
+
+
+std::string
+RuntimeOptimizer::jitcache_fingerprint (bool with_target)
+{
+    ShadingSystemImpl &ss (shadingsys());
+    std::ostringstream out;
+
+    // The library version, the llvm_ops it was built with, and the
+    // target we generate code for
+    out << "osl " << OSL_LIBRARY_VERSION_STRING << " llvm " << OSL_LLVM_VERSION
+        << " ptr " << sizeof(void *);
+    if (with_target) {
+        llvm_select_target ();
+#ifdef OSL_LLVM_NO_BITCODE
+        unsigned long long ops_hash = 0;
+#else
+        static unsigned long long ops_hashes[ISA_COUNT];  // 0 = not yet known
+        unsigned long long &ops_hash (ops_hashes[m_llvm_isa]);
+        if (! ops_hash)
+            ops_hash = fnv1a_hash (llvm_ops_builds[m_llvm_isa].block,
+                                   *llvm_ops_builds[m_llvm_isa].size);
+#endif
+        out << " ops " << ops_hash << "\n";
+        out << "target " << m_llvm_cpu;
+        for (size_t i = 0;  i < m_llvm_features.size();  ++i)
+            out << ' ' << m_llvm_features[i];
+    }
+    out << "\n";
+
+    // Options that change the results of optimization or code generation
+    out << "options " << ss.m_lazylayers << ss.m_lazyglobals
+        << ss.m_debugnan << ss.m_strict_messages << ss.m_range_checking
+        << ss.m_unknown_coordsys_error << ss.m_paramagnostic
+        << ss.m_messageslots << ' '
+        << ss.m_optimize << ' '
+        << ss.m_commonspace_synonym << ' ' << ss.m_colorspace << "\n";
+    out << "raytypes";
+    for (size_t i = 0;  i < ss.m_raytypes.size();  ++i)
+        out << ' ' << ss.m_raytypes[i];
+    out << "\n";
+
+    // Closure ids, layouts, and callbacks are baked into the code
+    const ClosureRegistry &closures (ss.m_closure_registry);
+    for (int id = 0;  id < closures.size();  ++id) {
+        const ClosureRegistry::ClosureEntry *c = closures.get_entry (id);
+        out << "closure " << id << ' ' << c->name << ' ' << c->struct_size
+            << ' ' << (c->prepare != NULL) << (c->setup != NULL);
+        for (size_t p = 0;  p < c->params.size();  ++p)
+            out << ' ' << c->params[p].type.c_str() << '@'
+                << c->params[p].offset << '=' 
+                << (c->params[p].key ? c->params[p].key : "");
+        out << "\n";
+    }
+
+    // The layers: which shaders, with what parameters and connections
+    m_group.write_fingerprint (out, ss.m_paramagnostic, true);
+    return out.str();
+}
+
+
+
+void
+RuntimeOptimizer::add_jitcache_dependency (JitCacheDepKind kind,
+                                           ustring name, ustring dataname,
+                                           TypeDesc type, const void *data)
+{
+    std::string dep;
+    jitcache_put (dep, "kind", Strutil::format ("%d", (int)kind));
+    jitcache_put (dep, "name", name.string());
+    jitcache_put (dep, "dataname", dataname.string());
+    jitcache_put (dep, "type", std::string ((const char *)&type, sizeof(TypeDesc)));
+    jitcache_put (dep, "data", std::string ((const char *)data, type.size()));
+    jitcache_put (m_jitcache_deps, "dep", dep);
+}
+
+
+
+/// Re-run a renderer, texture system, or dictionary query that a cached
+/// group's optimization relied on, and return true if the answer hasn't
+/// changed.
+static bool
+jitcache_check_dependency (ShadingSystemImpl &ss, const std::string &dep)
+{
+    int kind = -1;
+    ustring name, dataname;
+    TypeDesc type;
+    std::string data, tag, value;
+    size_t pos = 0;
+    while (jitcache_get (dep, pos, tag, value)) {
+        if (tag == "kind")
+            kind = atoi (value.c_str());
+        else if (tag == "name")
+            name = ustring (value);
+        else if (tag == "dataname")
+            dataname = ustring (value);
+        else if (tag == "type" && value.size() == sizeof(TypeDesc))
+            memcpy (&type, value.data(), sizeof(TypeDesc));
+        else if (tag == "data")
+            data.swap (value);
+    }
+    if (data.size() != type.size())
+        return false;
+
+    std::vector<char> result (type.size());
+    bool ok = false;
+    RendererServices *rs = ss.renderer();
+    switch (kind) {
+    case RuntimeOptimizer::DepMatrix :
+        ok = rs && type == TypeDesc::TypeMatrix &&
+             rs->get_matrix (*(Matrix44 *)&result[0], name);
+        break;
+    case RuntimeOptimizer::DepInverseMatrix :
+        ok = rs && type == TypeDesc::TypeMatrix &&
+             rs->get_inverse_matrix (*(Matrix44 *)&result[0], name);
+        break;
+    case RuntimeOptimizer::DepTextureInfo :
+#if OPENIMAGEIO_VERSION >= 900  /* 0.9.0 */
+        ok = ss.texturesys()->get_texture_info (name, 0, dataname, type,
+                                                &result[0]);
+#else
+        ok = ss.texturesys()->get_texture_info (name, dataname, type,
+                                                &result[0]);
+#endif
+        if (! ok)
+            (void) ss.texturesys()->geterror ();  // eat the error
+        break;
+    case RuntimeOptimizer::DepDictFind :
+        ok = type == TypeDesc::TypeInt;
+        if (ok)
+            *(int *)&result[0] = ss.dict_find (name, dataname);
+        break;
+    case RuntimeOptimizer::DepDictFindNode :
+        ok = type == TypeDesc::TypeInt;
+        if (ok)
+            *(int *)&result[0] = ss.dict_find (atoi (name.c_str()), dataname);
+        break;
+    case RuntimeOptimizer::DepDictNext :
+        ok = type == TypeDesc::TypeInt;
+        if (ok)
+            *(int *)&result[0] = ss.dict_next (atoi (name.c_str()));
+        break;
+    case RuntimeOptimizer::DepDictValue :
+        ok = ss.dict_value (atoi (name.c_str()), dataname, type, &result[0]);
+        break;
+    }
+    return ok && ! memcmp (&result[0], data.data(), data.size());
+}
+
+
+
+void *
+RuntimeOptimizer::llvm_resolve_relocation (const Relocation &r)
+{
+    switch (r.kind) {
+    case RelocUstring :
+        return (void *) ustring (r.payload).c_str();
+    case RelocRenderer :
+        return shadingsys().renderer();
+    case RelocClosurePrepare :
+    case RelocClosureSetup : {
+        const ClosureRegistry::ClosureEntry *clentry =
+            shadingsys().find_closure (ustring (r.payload));
+        if (! clentry)
+            return NULL;
+        if (r.kind == RelocClosurePrepare)
+            return (void *) clentry->prepare;
+        return (void *) clentry->setup;
+    }
+    case RelocTypeDesc :
+        m_group.llvm_reloc_data().push_back (std::vector<char> (r.payload.begin(),
+                                                                r.payload.end()));
+        return &m_group.llvm_reloc_data().back()[0];
+    case RelocStringArray : {
+        // The payload is a list of nul-terminated strings
+        std::vector<ustring> strings;
+        for (size_t b = 0;  b < r.payload.size();  ) {
+            size_t e = r.payload.find ('\0', b);
+            strings.push_back (ustring (r.payload.substr (b, e-b)));
+            b = e + 1;
+        }
+        std::vector<char> data (std::max (size_t(1), strings.size()) * sizeof(ustring), 0);
+        if (strings.size())
+            memcpy (&data[0], &strings[0], strings.size() * sizeof(ustring));
+        m_group.llvm_reloc_data().push_back (data);
+        return &m_group.llvm_reloc_data().back()[0];
+    }
+    case RelocRegex :
+        return (void *) &shadingsys().find_regex (ustring (r.payload));
+    case RelocTextureHandle :
+#if OIIO_VERSION >= 10100
+        return shadingsys().renderer()->get_texture_handle (ustring (r.payload));
+#else
+        return NULL;
+#endif
+    }
+    ASSERT (0 && "unknown relocation kind");
+    return NULL;
+}
+
+
+
+void
+RuntimeOptimizer::llvm_bind_relocations ()
+{
+    // N.B. The JITed code points directly at these slots, so the vector
+    // must not be resized after this.
+    std::vector<void *> &slots (m_group.llvm_reloc_slots());
+    if (slots.empty()) {
+        slots.resize (m_llvm_relocs.size());
+        for (size_t i = 0;  i < m_llvm_relocs.size();  ++i)
+            slots[i] = llvm_resolve_relocation (m_llvm_relocs[i]);
+    } else {
+        // Re-JIT of a group (e.g., tier 2): its code uses the same
+        // relocation numbering, so it can share the slots.
+        ASSERT (m_llvm_relocs.empty() || m_llvm_relocs.size() == slots.size());
+    }
+    for (size_t i = 0;  i < slots.size();  ++i) {
+        std::string name = Strutil::format ("osl_reloc_%d", (int)i);
+        llvm::GlobalVariable *gv = llvm_module()->getGlobalVariable (name);
+        if (gv)
+            m_llvm_exec->addGlobalMapping (gv, &slots[i]);
+    }
+}
+
+
+
+std::string
+RuntimeOptimizer::llvm_group_bitcode (llvm::Function **funcs, int nfuncs)
+{
+    // Make a copy of the module stripped down to the layer functions
+    // and whatever they reference that isn't in the llvm_ops module
+    // (which we will link against when we load it back in).
+    llvm::Module *stripped = llvm::CloneModule (llvm_module());
+    std::set<std::string> layerfuncs;
+    for (int i = 0;  i < nfuncs;  ++i)
+        layerfuncs.insert (funcs[i]->getName().str());
+    for (llvm::Module::iterator f = stripped->begin();  f != stripped->end();  ++f)
+        if (! f->isDeclaration() && ! f->hasLocalLinkage() &&
+            ! layerfuncs.count (f->getName().str()))
+            f->deleteBody ();
+    for (llvm::Module::global_iterator g = stripped->global_begin();
+         g != stripped->global_end();  ++g)
+        if (! g->isDeclaration() && ! g->hasLocalLinkage()) {
+            g->setInitializer (NULL);
+            g->setLinkage (llvm::GlobalValue::ExternalLinkage);
+        }
+    llvm::PassManager dce;
+    dce.add (llvm::createGlobalDCEPass());
+    dce.run (*stripped);
+    std::string bitcode;
+    llvm::raw_string_ostream bcout (bitcode);
+    llvm::WriteBitcodeToFile (stripped, bcout);
+    bcout.flush ();
+    delete stripped;
+    return bitcode;
+}
+
+
+
+RunLLVMGroupFunc
+RuntimeOptimizer::llvm_jit_bitcode (const std::string &bitcode,
+                                    const std::string &entryname,
+                                    bool optimize, std::string &err)
+{
+    llvm_setup_thread ();
+    ASSERT (! m_llvm_module);
+    m_llvm_module = llvm_load_ops_module ();
+    llvm::MemoryBuffer *buf = llvm::MemoryBuffer::getMemBuffer (llvm::StringRef (bitcode));
+    llvm::Module *group = llvm::ParseBitcodeFile (buf, *m_thread->llvm_context, &err);
+    delete buf;
+    bool linked = false;
+    std::vector<std::string> groupfuncs;
+    if (group) {
+        for (llvm::Module::iterator f = group->begin();  f != group->end();  ++f)
+            if (! f->isDeclaration())
+                groupfuncs.push_back (f->getName().str());
+#if OSL_LLVM_VERSION <= 29
+        linked = ! llvm::Linker::LinkModules (m_llvm_module, group, &err);
+#else
+        linked = ! llvm::Linker::LinkModules (m_llvm_module, group,
+                                              llvm::Linker::DestroySource, &err);
+#endif
+        delete group;
+    }
+    llvm::Function *entry = linked ? m_llvm_module->getFunction (entryname) : NULL;
+    if (! entry || ! llvm_create_exec (optimize)) {
+        if (linked && ! entry)
+            err = Strutil::format ("no function \"%s\"", entryname.c_str());
+        delete m_llvm_module;
+        m_llvm_module = NULL;
+        return NULL;
+    }
+
+    if (optimize) {
+        // The whole works: module passes (including inlining of the
+        // llvm_ops functions), then the heavy function passes on what's
+        // left of the group's own functions.
+        llvm_setup_optimization_passes ();
+        m_llvm_passes->run (*llvm_module());
+        m_llvm_func_passes_optimized->doInitialization ();
+        BOOST_FOREACH (const std::string &name, groupfuncs) {
+            llvm::Function *f = llvm_module()->getFunction (name);
+            if (f && ! f->isDeclaration())
+                m_llvm_func_passes_optimized->run (*f);
+        }
+        m_llvm_func_passes_optimized->doFinalization ();
+    }
+
+    llvm_bind_relocations ();
+    RunLLVMGroupFunc func = llvm_jit_function (entry);
+    m_group.llvm_code_size (m_llvm_code_size);
+    m_shadingsys.m_stat_llvm_code_bytes += (long long) m_llvm_code_size;
+    delete m_llvm_exec;   // N.B. also deletes the module
+    m_llvm_exec = NULL;
+    m_llvm_module = NULL;
+    delete m_llvm_perfmap_listener;
+    m_llvm_perfmap_listener = NULL;
+    return func;
+}
+
+
+
+std::string
+RuntimeOptimizer::jitcache_record (const std::string &entryname,
+                                   const std::string &bitcode)
+{
+    std::string out;
+    jitcache_put (out, "osljit", "1");
+    jitcache_put (out, "fingerprint", m_jitcache_fingerprint);
+    jitcache_put (out, "groupdata", Strutil::format ("%llu",
+                      (unsigned long long) m_group.llvm_groupdata_size()));
+    jitcache_put (out, "nothing", m_group.does_nothing() ? "1" : "0");
+    jitcache_put (out, "entry", entryname);
+    for (size_t i = 0;  i < m_llvm_relocs.size();  ++i)
+        jitcache_put (out, "reloc", Strutil::format ("%d ", m_llvm_relocs[i].kind)
+                                    + m_llvm_relocs[i].payload);
+    out += m_jitcache_deps;
+
+    // Remember where the params live in the group data, so that
+    // get_symbol works without re-optimizing.
+    for (int layer = 0;  layer < m_group.nlayers();  ++layer) {
+        BOOST_FOREACH (const Symbol &s, m_group[layer]->symbols()) {
+            if ((s.symtype() == SymTypeParam || s.symtype() == SymTypeOutputParam)
+                  && s.dataoffset() >= 0)
+                jitcache_put (out, "sym", Strutil::format ("%d %d ", layer, s.dataoffset())
+                                          + s.name().string());
+        }
+    }
+    // ...and which of them the code expects in the parameter block
+    BOOST_FOREACH (const CompiledGroup::ParamBlockEntry &p, m_group.param_block_layout())
+        jitcache_put (out, "param", Strutil::format ("%d %d %d ", p.layer, p.offset, p.size)
+                                    + p.name.string());
+
+    if (! m_group.does_nothing() && ! bitcode.empty())
+        jitcache_put (out, "bitcode", bitcode);
+    return out;
+}
+
+
+
+void
+RuntimeOptimizer::jitcache_save (const std::string &entryname,
+                                 const std::string &bitcode)
+{
+    std::string out = jitcache_record (entryname, bitcode);
+
+    // Write to a temp file and rename, so that other threads or
+    // processes never see a partially written entry.
+    ustring dir = shadingsys().m_jitcache;
+    try {
+        boost::filesystem::create_directories (dir.string());
+    } catch (...) {
+    }
+    std::string filename = jitcache_filename (dir, m_jitcache_fingerprint);
+    std::string tmpname = Strutil::format ("%s.%d.%p", filename.c_str(),
+                                           (int)getpid(), this);
+    std::ofstream file (tmpname.c_str(), std::ios::out | std::ios::binary);
+    file.write (out.data(), out.size());
+    file.close ();
+    if (! file || std::rename (tmpname.c_str(), filename.c_str()) != 0) {
+        std::remove (tmpname.c_str());
+        m_shadingsys.warning ("Could not write JIT cache file \"%s\"",
+                              filename.c_str());
+        return;
+    }
+    m_shadingsys.m_stat_jitcache_writes += 1;
+    m_shadingsys.m_stat_jitcache_bytes_written += (long long) out.size();
+}
+
+
+
+bool
+RuntimeOptimizer::jitcache_load ()
+{
+    Timer timer;
+    std::string filename = jitcache_filename (shadingsys().m_jitcache,
+                                              m_jitcache_fingerprint);
+    std::ifstream file (filename.c_str(), std::ios::in | std::ios::binary);
+    if (! file) {
+        m_shadingsys.m_stat_jitcache_misses += 1;
+        return false;
+    }
+    std::string in ((std::istreambuf_iterator<char>(file)),
+                    std::istreambuf_iterator<char>());
+    if (! jitcache_install (in, filename, NULL)) {
+        // Stale, truncated, or colliding entry -- we'll overwrite it
+        m_shadingsys.m_stat_jitcache_misses += 1;
+        return false;
+    }
+    m_shadingsys.m_stat_jitcache_hits += 1;
+    m_shadingsys.m_stat_jitcache_bytes_read += (long long) in.size();
+    m_stat_jitcache_load_time += timer();
+    return true;
+}
+
+
+
+bool
+RuntimeOptimizer::jitcache_install (const std::string &in,
+                                    const std::string &source, void *library)
+{
+    bool valid = false, ok = true, nothing = false;
+    size_t groupdata_size = 0;
+    std::string entryname, bitcode;
+    std::vector<Relocation> relocs;
+    std::vector<std::string> syms, params;
+    std::string tag, data;
+    size_t pos = 0;
+    while (ok && jitcache_get (in, pos, tag, data)) {
+        if (tag == "osljit")
+            valid = (data == "1");
+        else if (tag == "fingerprint")
+            ok = (data == m_jitcache_fingerprint);  // guard vs. collisions
+        else if (tag == "isa")
+            ok = (atoi (data.c_str()) <= host_isa());  // can we run it?
+        else if (tag == "groupdata")
+            groupdata_size = strtoul (data.c_str(), NULL, 10);
+        else if (tag == "nothing")
+            nothing = (data == "1");
+        else if (tag == "entry")
+            entryname = data;
+        else if (tag == "reloc")
+            relocs.push_back (Relocation (atoi (data.c_str()),
+                                          data.substr (data.find(' ')+1)));
+        else if (tag == "dep")
+            ok = jitcache_check_dependency (shadingsys(), data);
+        else if (tag == "sym")
+            syms.push_back (data);
+        else if (tag == "param")
+            params.push_back (data);
+        else if (tag == "bitcode")
+            bitcode.swap (data);
+    }
+    if (! valid || ! ok || pos != in.size() ||
+          (! nothing && (entryname.empty() || (! library && bitcode.empty()))))
+        return false;
+
+    if (! nothing) {
+        m_llvm_relocs.swap (relocs);
+        std::string err;
+        RunLLVMGroupFunc func = NULL;
+        if (library) {
+            // Already compiled: just find the entry point, and point
+            // the library's relocation slots at this process's data.
+            func = (RunLLVMGroupFunc) Plugin::getsym (library, entryname.c_str());
+            for (size_t i = 0;  func && i < m_llvm_relocs.size();  ++i) {
+                std::string name = Strutil::format ("osl_reloc_%d", (int)i);
+                void **slot = (void **) Plugin::getsym (library, name.c_str());
+                if (slot)
+                    *slot = llvm_resolve_relocation (m_llvm_relocs[i]);
+                else
+                    func = NULL;
+            }
+            if (! func)
+                err = "missing symbols";
+        } else {
+            // Link the cached layer functions against the llvm_ops
+            // module and JIT them.
+            func = llvm_jit_bitcode (bitcode, entryname, false, err);
+        }
+        if (! func) {
+            m_shadingsys.warning ("Could not load \"%s\": %s",
+                                  source.c_str(), err.c_str());
+            m_llvm_relocs.clear ();
+            return false;
+        }
+        m_group.llvm_compiled_version (func);
+        // Cached code may only be tier 1 quality, so keep it around in
+        // case the group turns out to be hot.
+        if (! library && shadingsys().m_tieredjit > 0)
+            m_group.llvm_tier2 (bitcode, entryname);
+    }
+
+    m_group.does_nothing (nothing);
+    if (nothing)
+        m_shadingsys.m_stat_empty_groups += 1;
+    m_group.llvm_groupdata_size (groupdata_size);
+    BOOST_FOREACH (const std::string &s, syms) {
+        int layer = -1, offset = -1, namestart = 0;
+        sscanf (s.c_str(), "%d %d %n", &layer, &offset, &namestart);
+        if (layer >= 0 && layer < m_group.nlayers() && namestart > 0) {
+            ShaderInstance *inst = m_group[layer];
+            int symidx = inst->findsymbol (ustring (s.c_str()+namestart));
+            if (symidx >= 0 && symidx < (int)inst->symbols().size())
+                inst->symbol(symidx)->dataoffset (offset);
+        }
+    }
+    m_group.param_block_layout().clear ();
+    BOOST_FOREACH (const std::string &s, params) {
+        int layer = -1, offset = -1, size = 0, namestart = 0;
+        sscanf (s.c_str(), "%d %d %d %n", &layer, &offset, &size, &namestart);
+        if (layer >= 0 && layer < m_group.nlayers() && namestart > 0)
+            m_group.param_block_layout().push_back (
+                CompiledGroup::ParamBlockEntry (layer, ustring (s.c_str()+namestart),
+                                                offset, size));
+    }
+    return true;
+}
+
+
+
+// Ahead-of-time compilation writes a group, together with the parts of
+// llvm_ops it uses, as a native object file.  Linked into a shared
+// library, it exports the group's entry point, one pointer variable
+// "osl_reloc_N" per relocation (filled in when the library is loaded),
+// and the group's JIT cache record as "osl_aot_group" (with its length
+// in "osl_aot_group_size"), plus an "isa" record saying what the code
+// needs from the CPU.
+
+bool
+RuntimeOptimizer::llvm_write_object (const std::string &entryname,
+                                     const std::string &record)
+{
+#if OSL_LLVM_VERSION <= 29
+    m_shadingsys.error ("Could not write compiled group \"%s\": ahead-of-time compilation needs LLVM 3.0 or newer",
+                        m_aot_filename.c_str());
+    return false;
+#else
+    // Work on a copy, since the module itself is about to be JITed
+    llvm::Module *module = llvm::CloneModule (llvm_module());
+
+    // Groups compiled for tier 1 have only had the cheap passes
+    if (shadingsys().m_tieredjit > 0)
+        m_llvm_passes->run (*module);
+
+    // The relocation slots become variables of the library
+    std::vector<std::string> exportnames;
+    exportnames.push_back (entryname);
+    llvm::Constant *nullslot = llvm::ConstantPointerNull::get (llvm_type_void_ptr());
+    for (size_t i = 0;  i < m_llvm_relocs.size();  ++i) {
+        std::string name = Strutil::format ("osl_reloc_%d", (int)i);
+        llvm::GlobalVariable *gv = module->getGlobalVariable (name);
+        if (! gv)   // optimized away, but the loader still looks for it
+            gv = new llvm::GlobalVariable (*module, llvm_type_void_ptr(), false,
+                                           llvm::GlobalValue::ExternalLinkage,
+                                           NULL, name);
+        gv->setConstant (false);
+        gv->setInitializer (nullslot);
+        exportnames.push_back (name);
+    }
+
+    // The record describing the group, and the CPU it was compiled for
+    std::string metadata = record;
+    jitcache_put (metadata, "isa", Strutil::format ("%d", m_llvm_target_isa));
+#if OSL_LLVM_VERSION <= 30
+    llvm::Constant *mdinit = llvm::ConstantArray::get (llvm_context(), metadata, false);
+#else
+    llvm::Constant *mdinit = llvm::ConstantDataArray::getString (llvm_context(), metadata, false);
+#endif
+    new llvm::GlobalVariable (*module, mdinit->getType(), true,
+                              llvm::GlobalValue::ExternalLinkage,
+                              mdinit, "osl_aot_group");
+    new llvm::GlobalVariable (*module, m_llvm_type_int, true,
+                              llvm::GlobalValue::ExternalLinkage,
+                              llvm::ConstantInt::get (llvm_context(),
+                                  llvm::APInt (32, (int)metadata.size())),
+                              "osl_aot_group_size");
+    exportnames.push_back ("osl_aot_group");
+    exportnames.push_back ("osl_aot_group_size");
+
+    // Native code generator for the selected target, making position
+    // independent code so that it can go in a shared library.
+    std::string err;
+    llvm_select_target ();
+#if OSL_LLVM_VERSION <= 30
+    std::string triple = llvm::sys::getHostTriple ();
+#else
+    std::string triple = llvm::sys::getDefaultTargetTriple ();
+#endif
+    std::string features = boost::algorithm::join (m_llvm_target_features, ",");
+    llvm::TargetMachine *tm = NULL;
+    const llvm::Target *target = llvm::TargetRegistry::lookupTarget (triple, err);
+    if (target)
+#if OSL_LLVM_VERSION <= 30
+        tm = target->createTargetMachine (triple, m_llvm_target_cpu, features,
+                                          llvm::Reloc::PIC_);
+#else
+        tm = target->createTargetMachine (triple, m_llvm_target_cpu, features,
+                                          llvm::TargetOptions(),
+                                          llvm::Reloc::PIC_,
+                                          llvm::CodeModel::Default,
+                                          llvm::CodeGenOpt::Aggressive);
+#endif
+
+    bool ok = false;
+    if (tm) {
+        module->setTargetTriple (triple);
+        module->setDataLayout (tm->getTargetData()->getStringRepresentation());
+        // Everything but the exports is private to the library, so that
+        // its copies of the llvm_ops functions don't collide with
+        // anybody else's.
+        std::vector<const char *> exports;
+        for (size_t i = 0;  i < exportnames.size();  ++i)
+            exports.push_back (exportnames[i].c_str());
+        llvm::PassManager passes;
+        passes.add (new llvm::TargetData (*tm->getTargetData()));
+        passes.add (llvm::createInternalizePass (exports));
+        passes.add (llvm::createGlobalDCEPass ());
+        llvm::raw_fd_ostream file (m_aot_filename.c_str(), err,
+                                   llvm::raw_fd_ostream::F_Binary);
+        if (err.empty()) {
+            llvm::formatted_raw_ostream out (file);
+#if OSL_LLVM_VERSION <= 30
+            bool cant = tm->addPassesToEmitFile (passes, out,
+                                                 llvm::TargetMachine::CGFT_ObjectFile,
+                                                 llvm::CodeGenOpt::Aggressive);
+#else
+            bool cant = tm->addPassesToEmitFile (passes, out,
+                                                 llvm::TargetMachine::CGFT_ObjectFile);
+#endif
+            if (cant) {
+                err = "the target can't write object files";
+            } else {
+                passes.run (*module);
+                ok = true;
+            }
+        }
+    }
+    delete tm;
+    delete module;
+    if (! ok) {
+        std::remove (m_aot_filename.c_str());
+        m_shadingsys.error ("Could not write compiled group \"%s\": %s",
+                            m_aot_filename.c_str(), err.c_str());
+    }
+    return ok;
+#endif
+}
+
+
+
+bool
+RuntimeOptimizer::aot_load (const std::string &filename)
+{
+    // N.B. The library is never closed once it's in use: the group's
+    // code lives in it.
+#if OPENIMAGEIO_VERSION >= 1000 /* 0.10.0 */
+    Plugin::Handle library = Plugin::open (filename.c_str(), false);
+#else
+    Plugin::Handle library = Plugin::open (filename.c_str());
+#endif
+    if (! library) {
+        m_shadingsys.error ("Could not open compiled group \"%s\": %s",
+                            filename.c_str(), Plugin::geterror().c_str());
+        return false;
+    }
+    const char *record = (const char *) Plugin::getsym (library, "osl_aot_group");
+    const int *size = (const int *) Plugin::getsym (library, "osl_aot_group_size");
+    m_jitcache_fingerprint = jitcache_fingerprint (false);
+    if (! record || ! size ||
+          ! jitcache_install (std::string (record, *size), filename, library)) {
+        m_shadingsys.error ("\"%s\" does not hold shader group %s compiled for this version, CPU, and scene",
+                            filename.c_str(), m_group.name().c_str());
+        Plugin::close (library);
+        return false;
+    }
+    return true;
+}
+
+
+
 void
 RuntimeOptimizer::initialize_llvm_group ()
 {
@@ -1129,6 +2720,8 @@ RuntimeOptimizer::initialize_llvm_group ()
     // created on demand.
     m_llvm_type_sg = NULL;
     m_llvm_type_groupdata = NULL;
+    m_message_slots.clear ();
+    m_message_slots_size = 0;
     m_llvm_type_closure_component = NULL;
     m_llvm_type_closure_component_attr = NULL;
 
@@ -1216,6 +2809,9 @@ ShadingSystemImpl::SetupLLVM ()
     llvm::DisablePrettyStackTrace = true;
     llvm::llvm_start_multithreaded ();  // enable it to be thread-safe
     llvm::InitializeNativeTarget();
+#if OSL_LLVM_VERSION >= 30
+    llvm::InitializeNativeTargetAsmPrinter();  // for write_compiled_group
+#endif
     done = true;
 }
 
@@ -1275,6 +2871,24 @@ RuntimeOptimizer::llvm_setup_optimization_passes ()
     // Try to make stuff into registers one last time.
     passes.add (llvm::createPromoteMemoryToRegisterPass());
 
+    // The cheap function passes used for tier 1 of tiered JIT: just
+    // enough to get the values out of allocas and the trivially dead
+    // blocks out of the way.
+    fpm.add (llvm::createCFGSimplificationPass());
+    fpm.add (llvm::createPromoteMemoryToRegisterPass());
+
+    // The heavy function passes for tier 2, run on the group's own
+    // functions after the module passes have inlined into them.
+    fpmo.add (llvm::createScalarReplAggregatesPass());
+    fpmo.add (llvm::createInstructionCombiningPass());
+    fpmo.add (llvm::createJumpThreadingPass());         // Thread jumps.
+    fpmo.add (llvm::createReassociatePass());   // Reassociate expressions
+    fpmo.add (llvm::createGVNPass());           // Remove redundancies
+    fpmo.add (llvm::createSCCPPass());          // Constant prop with SCCP
+    fpmo.add (llvm::createInstructionCombiningPass());
+    fpmo.add (llvm::createAggressiveDCEPass()); // Delete dead instructions
+    fpmo.add (llvm::createCFGSimplificationPass());     // Merge & remove BBs
+
 #elif 0
     // This code would apply the standard optimizations used by
     // llvm-gcc.  We have found that for our purposes, they spend too
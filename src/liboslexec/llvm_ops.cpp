@@ -93,6 +93,7 @@ examples), as you are just coding in C++, but there are some rules:
 
 #include <string>
 #include <cstdio>
+#include <cstring>
 
 #include "oslconfig.h"
 #include "oslexec_pvt.h"
@@ -1099,16 +1100,16 @@ osl_substr_ssii (const char *s, int start, int length)
 
 OSL_SHADEOP int
 osl_regex_impl (void *sg_, const char *subject_, void *results, int nresults,
-                const char *pattern, int fullmatch)
+                const char *pattern, int fullmatch, void *compiled)
 {
     extern int osl_regex_impl2 (OSL::ShadingContext *ctx, ustring subject,
                                int *results, int nresults, ustring pattern,
-                               int fullmatch);
+                               int fullmatch, const void *compiled);
 
     ShaderGlobals *sg = (ShaderGlobals *)sg_;
     return osl_regex_impl2 (sg->context, USTR(subject_),
                             (int *)results, nresults,
-                            USTR(pattern), fullmatch);
+                            USTR(pattern), fullmatch, compiled);
 }
 
 
@@ -1535,21 +1536,41 @@ osl_texture_set_interp_code (void *opt, int mode)
 }
 
 
+/// Do a 2D texture lookup, using the texture handle if the filename
+/// was resolved to one at JIT time.
+inline bool
+texture_lookup (ShaderGlobals *sg, const char *name, void *handle,
+                TextureOpt &opt, float s, float t, float dsdx, float dtdx,
+                float dsdy, float dtdy, float *result)
+{
+    RendererServices *renderer (sg->context->renderer());
+#if OIIO_VERSION >= 10100
+    if (handle)
+        return renderer->texture (USTR(name),
+                                  (RendererServices::TextureHandle *)handle,
+                                  sg->context->texture_thread_info(),
+                                  opt, sg, s, t, dsdx, dtdx, dsdy, dtdy,
+                                  result);
+#endif
+    return renderer->texture (USTR(name), opt, sg, s, t,
+                              dsdx, dtdx, dsdy, dtdy, result);
+}
+
+
 OSL_SHADEOP int
-osl_texture (void *sg_, const char *name, void *opt_, float s, float t,
-             float dsdx, float dtdx, float dsdy, float dtdy, int chans,
-             void *result, void *dresultdx, void *dresultdy)
+osl_texture (void *sg_, const char *name, void *handle, void *opt_,
+             float s, float t, float dsdx, float dtdx, float dsdy, float dtdy,
+             int chans, void *result, void *dresultdx, void *dresultdy)
 {
     ShaderGlobals *sg = (ShaderGlobals *)sg_;
-    RendererServices *renderer (sg->context->renderer());
     TextureOpt *opt = (TextureOpt *)opt_;
     opt->nchannels = chans;
     float dresultds[3], dresultdt[3];
     opt->dresultds = dresultdx ? dresultds : NULL;
     opt->dresultdt = dresultdy ? dresultdt : NULL;
 
-    bool ok = renderer->texture (USTR(name), *opt, sg, s, t,
-                                 dsdx, dtdx, dsdy, dtdy, (float *)result);
+    bool ok = texture_lookup (sg, name, handle, *opt, s, t,
+                              dsdx, dtdx, dsdy, dtdy, (float *)result);
 
     // Correct our st texture space gradients into xy-space gradients
     if (dresultdx)
@@ -1562,21 +1583,20 @@ osl_texture (void *sg_, const char *name, void *opt_, float s, float t,
 }
 
 OSL_SHADEOP int
-osl_texture_alpha (void *sg_, const char *name, void *opt_, float s, float t,
-             float dsdx, float dtdx, float dsdy, float dtdy, int chans,
-             void *result, void *dresultdx, void *dresultdy,
+osl_texture_alpha (void *sg_, const char *name, void *handle, void *opt_,
+             float s, float t, float dsdx, float dtdx, float dsdy, float dtdy,
+             int chans, void *result, void *dresultdx, void *dresultdy,
              void *alpha, void *dalphadx, void *dalphady)
 {
     ShaderGlobals *sg = (ShaderGlobals *)sg_;
-    RendererServices *renderer (sg->context->renderer());
     TextureOpt *opt = (TextureOpt *)opt_;
     opt->nchannels = chans + 1;
     float local_result[4], dresultds[4], dresultdt[4];
     opt->dresultds = (dresultdx || dalphadx) ? dresultds : NULL;
     opt->dresultdt = (dresultdy || dalphady) ? dresultdt : NULL;
 
-    bool ok = renderer->texture (USTR(name), *opt, sg, s, t,
-                                 dsdx, dtdx, dsdy, dtdy, local_result);
+    bool ok = texture_lookup (sg, name, handle, *opt, s, t,
+                              dsdx, dtdx, dsdy, dtdy, local_result);
 
     for (int i = 0;  i < chans;  ++i)
         ((float *)result)[i] = local_result[i];
@@ -1955,6 +1975,58 @@ OSL_SHADEOP int osl_raytype_bit (void *sg_, int bit)
 
 
 
+/***********************************************************************
+ * Messages resolved to group data slots (see MessageSlot).  The common
+ * cases are handled here so they can be inlined; errors and strict
+ * bookkeeping go to the slow paths in opmessage.cpp.
+ */
+
+OSL_SHADEOP void osl_setmessage_slot_fail (void *sg, void *slot,
+                                           const char *name,
+                                           const char *sourcefile,
+                                           int sourceline);
+OSL_SHADEOP int osl_getmessage_slot_miss (void *sg, void *slot,
+                                          const char *name, int layeridx,
+                                          const char *sourcefile,
+                                          int sourceline);
+
+
+OSL_SHADEOP void
+osl_setmessage_slot (void *sg, void *slot_, const char *name,
+                     void *val, int size, int layeridx,
+                     const char *sourcefile, int sourceline)
+{
+    MessageSlot *slot = (MessageSlot *)slot_;
+    if (slot->status != 0) {
+        osl_setmessage_slot_fail (sg, slot_, name, sourcefile, sourceline);
+        return;
+    }
+    memcpy (slot->data(), val, size);
+    slot->status = 1;
+    slot->layeridx = layeridx;
+    slot->sourcefile = sourcefile;
+    slot->sourceline = sourceline;
+}
+
+
+
+OSL_SHADEOP int
+osl_getmessage_slot (void *sg, void *slot_, const char *name,
+                     void *val, int size, int derivs, int layeridx,
+                     const char *sourcefile, int sourceline)
+{
+    MessageSlot *slot = (MessageSlot *)slot_;
+    if (slot->status != 1 || slot->layeridx > layeridx)
+        return osl_getmessage_slot_miss (sg, slot_, name, layeridx,
+                                         sourcefile, sourceline);
+    memcpy (val, slot->data(), size);
+    if (derivs)
+        memset (((char *)val)+size, 0, 2*size);
+    return 1;
+}
+
+
+
 /***********************************************************************
  * Utility routines
  */
@@ -2008,3 +2080,12 @@ osl_naninf_check (int ncomps, const void *vals_, int has_derivs,
             return;
         }
 }
+
+
+
+OSL_SHADEOP void
+osl_profile_add (void *sg, int id, long long cycles)
+{
+    ShadingContext *ctx = (ShadingContext *)((ShaderGlobals *)sg)->context;
+    ctx->profile_add (id, cycles);
+}
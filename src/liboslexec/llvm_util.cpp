@@ -26,6 +26,8 @@ THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
 OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 */
 
+#include <cstddef>
+
 #include "llvm_headers.h"
 
 #include "oslexec_pvt.h"
@@ -124,6 +126,9 @@ RuntimeOptimizer::llvm_constant_bool (bool i)
 llvm::Value *
 RuntimeOptimizer::llvm_constant (ustring s)
 {
+    if (m_llvm_relocatable && s.c_str())
+        return llvm_relocatable_ptr (RelocUstring, s.string(),
+                                     (void *)s.c_str(), llvm_type_string());
     // Create a const size_t with the ustring contents
     size_t bits = sizeof(size_t)*8;
     llvm::Value *str = llvm::ConstantInt::get (llvm_context(),
@@ -137,6 +142,8 @@ RuntimeOptimizer::llvm_constant (ustring s)
 llvm::Value *
 RuntimeOptimizer::llvm_constant_ptr (void *p)
 {
+    if (p && m_llvm_relocatable)
+        m_llvm_not_relocatable = true;
     // Create a const size_t with the address
     size_t bits = sizeof(size_t)*8;
     llvm::Value *str = llvm::ConstantInt::get (llvm_context(),
@@ -147,6 +154,74 @@ RuntimeOptimizer::llvm_constant_ptr (void *p)
 
 
 
+llvm::Value *
+RuntimeOptimizer::llvm_relocatable_ptr (RelocKind kind,
+                                        const std::string &payload,
+                                        void *p, llvm::PointerType *type)
+{
+    if (! m_llvm_relocatable)
+        return builder().CreateIntToPtr (llvm_constant (size_t (p)), type,
+                                         "const pointer");
+
+    // Each distinct relocation gets one slot, an external global that
+    // llvm_bind_relocations maps onto group storage at JIT time.
+    std::string key = Strutil::format ("%d ", (int)kind) + payload;
+    int index;
+    std::map<std::string,int>::const_iterator found = m_llvm_reloc_map.find (key);
+    if (found != m_llvm_reloc_map.end()) {
+        index = found->second;
+    } else {
+        index = (int) m_llvm_relocs.size();
+        m_llvm_relocs.push_back (Relocation (kind, payload));
+        m_llvm_reloc_map[key] = index;
+    }
+    std::string name = Strutil::format ("osl_reloc_%d", index);
+    llvm::GlobalVariable *slot = llvm_module()->getGlobalVariable (name);
+    if (! slot)
+        slot = new llvm::GlobalVariable (*llvm_module(), llvm_type_void_ptr(),
+                                         true /* constant */,
+                                         llvm::GlobalValue::ExternalLinkage,
+                                         NULL, name);
+    return llvm_ptr_cast (builder().CreateLoad (slot), type);
+}
+
+
+
+llvm::Value *
+RuntimeOptimizer::llvm_constant_data_ptr (const Symbol &sym)
+{
+    if (! m_llvm_relocatable)
+        return llvm_constant_ptr (sym.data());
+
+    const TypeDesc &t (sym.typespec().simpletype());
+    if (t.basetype == TypeDesc::STRING) {
+        // Strings must be re-interned when the code is loaded, so
+        // relocate the whole array as a list of nul-separated strings.
+        std::string payload;
+        const ustring *s = (const ustring *) sym.data();
+        for (size_t i = 0;  i < t.numelements();  ++i) {
+            payload += s[i].string();
+            payload += '\0';
+        }
+        return llvm_relocatable_ptr (RelocStringArray, payload, sym.data(),
+                                     llvm_type_void_ptr());
+    }
+
+    // Anything else is plain old data, which we can copy into the module.
+    llvm::Constant *init = llvm::ConstantArray::get (llvm_context(),
+                               llvm::StringRef ((const char *)sym.data(),
+                                                sym.size()),
+                               false /* no nul terminator */);
+    llvm::GlobalVariable *gv = new llvm::GlobalVariable (*llvm_module(),
+                                   init->getType(), true /* constant */,
+                                   llvm::GlobalValue::PrivateLinkage,
+                                   init, "osl_constdata");
+    gv->setAlignment (16);
+    return llvm_void_ptr (gv);
+}
+
+
+
 llvm::Value *
 RuntimeOptimizer::llvm_constant (const TypeDesc &type)
 {
@@ -376,7 +451,7 @@ RuntimeOptimizer::llvm_get_pointer (const Symbol& sym, int deriv,
     llvm::Value *result = NULL;
     if (sym.symtype() == SymTypeConst) {
         // For constants, start with *OUR* pointer to the constant values.
-        result = llvm_ptr_cast (llvm_constant_ptr (sym.data()),
+        result = llvm_ptr_cast (llvm_constant_data_ptr (sym),
                                 llvm::PointerType::get (llvm_type(sym.typespec().elementtype()), 0));
 
     } else {
@@ -603,6 +678,178 @@ RuntimeOptimizer::llvm_store_component_value (llvm::Value* new_val,
 
 
 
+llvm::Type *
+RuntimeOptimizer::llvm_type_batch (TypeDesc type)
+{
+    llvm::Type *base = type.basetype == TypeDesc::INT ? llvm_type_int()
+                                                       : llvm_type_float();
+    return (llvm::Type *) llvm::VectorType::get (base, BatchWidth);
+}
+
+
+
+llvm::Value *
+RuntimeOptimizer::llvm_batch_splat (llvm::Value *val)
+{
+    if (llvm::Constant *c = llvm::dyn_cast<llvm::Constant>(val))
+        return llvm::ConstantVector::get (std::vector<llvm::Constant*>(BatchWidth, c));
+    llvm::Type *type = (llvm::Type *) llvm::VectorType::get (val->getType(), BatchWidth);
+    llvm::Type *masktype = (llvm::Type *) llvm::VectorType::get (llvm_type_int(), BatchWidth);
+    llvm::Value *undef = llvm::UndefValue::get (type);
+    llvm::Value *v = builder().CreateInsertElement (undef, val, llvm_constant(0));
+    return builder().CreateShuffleVector (v, undef,
+                                          llvm::Constant::getNullValue (masktype));
+}
+
+
+
+llvm::Value *
+RuntimeOptimizer::llvm_batch_storage (const Symbol &sym)
+{
+    const Symbol *s = sym.dealias ();
+    std::map<const Symbol*,llvm::Value*>::const_iterator found;
+    found = m_batch_values.find (s);
+    if (found != m_batch_values.end())
+        return found->second;
+
+    // Only non-derivative scalars and triples are batched, and globals
+    // and constants are read from where they already are.
+    const TypeSpec &t (s->typespec());
+    if (t.is_array() || t.is_closure_based() || t.is_structure() ||
+        ! (t.is_float() || t.is_int() || t.is_triple()) ||
+        s->has_derivs() || s->symtype() == SymTypeGlobal || s->is_constant())
+        return NULL;
+
+    // Allocate it at the top of the function, as an array of one vector
+    // per component so that it can be promoted to registers, and zero
+    // it so that lanes nothing is stored to don't hold garbage.
+    llvm::BasicBlock &entry (m_layer_func->getEntryBlock());
+    llvm::IRBuilder<> top (&entry, entry.begin());
+    llvm::Type *type = llvm_type_batch (t.simpletype());
+    int n = (int) t.simpletype().aggregate;
+    llvm::Value *ptr = top.CreateAlloca (llvm::ArrayType::get (type, n), 0,
+                                         s->mangled());
+    for (int c = 0;  c < n;  ++c)
+        top.CreateStore (llvm::Constant::getNullValue (type),
+                         top.CreateConstGEP2_32 (ptr, 0, c));
+    m_batch_values[s] = ptr;
+    if ((s->symtype() == SymTypeParam || s->symtype() == SymTypeOutputParam)
+          && s->dataoffset() >= 0)
+        m_batch_params.push_back (s);
+    return ptr;
+}
+
+
+
+llvm::Value *
+RuntimeOptimizer::llvm_batch_load (const Symbol &sym, int component,
+                                   TypeDesc cast)
+{
+    const TypeSpec &t (sym.typespec());
+    if (t.is_array() || t.is_closure_based() || t.is_structure() ||
+        ! (t.is_float() || t.is_int() || t.is_triple()))
+        return NULL;
+    if (! t.is_triple())
+        component = 0;   // scalars give the same value for every component
+
+    llvm::Value *result = NULL;
+    if (sym.is_constant()) {
+        if (t.is_int())
+            result = llvm_constant (((int *)sym.data())[0]);
+        else
+            result = llvm_constant (((float *)sym.data())[component]);
+        result = llvm_batch_splat (result);
+    } else if (sym.symtype() == SymTypeGlobal) {
+        result = llvm_batch_load_global (sym.name(), component);
+    } else if (llvm::Value *ptr = llvm_batch_storage (sym)) {
+        result = builder().CreateLoad (builder().CreateConstGEP2_32 (ptr, 0, component));
+    }
+    if (! result)
+        return NULL;
+
+    if (t.is_int() && cast.basetype == TypeDesc::FLOAT)
+        result = builder().CreateSIToFP (result, llvm_type_batch (TypeDesc::FLOAT));
+    else if (! t.is_int() && cast.basetype == TypeDesc::INT)
+        result = builder().CreateFPToSI (result, llvm_type_batch (TypeDesc::INT));
+    return result;
+}
+
+
+
+llvm::Value *
+RuntimeOptimizer::llvm_batch_load_global (ustring name, int component)
+{
+    typedef ShaderGlobalsBatch SGB;
+    static const struct { ustring name; size_t offset; bool triple, isint; }
+    fields[] = {
+        { ustring("P"),           offsetof(SGB,P),           true,  false },
+        { ustring("I"),           offsetof(SGB,I),           true,  false },
+        { ustring("N"),           offsetof(SGB,N),           true,  false },
+        { ustring("Ng"),          offsetof(SGB,Ng),          true,  false },
+        { ustring("u"),           offsetof(SGB,u),           false, false },
+        { ustring("v"),           offsetof(SGB,v),           false, false },
+        { ustring("dPdu"),        offsetof(SGB,dPdu),        true,  false },
+        { ustring("dPdv"),        offsetof(SGB,dPdv),        true,  false },
+        { ustring("time"),        offsetof(SGB,time),        false, false },
+        { ustring("dtime"),       offsetof(SGB,dtime),       false, false },
+        { ustring("dPdtime"),     offsetof(SGB,dPdtime),     true,  false },
+        { ustring("Ps"),          offsetof(SGB,Ps),          true,  false },
+        { ustring("surfacearea"), offsetof(SGB,surfacearea), false, false },
+        { ustring("backfacing"),  offsetof(SGB,backfacing),  false, true  },
+    };
+
+    for (size_t i = 0;  i < sizeof(fields)/sizeof(fields[0]);  ++i) {
+        if (fields[i].name != name)
+            continue;
+        // Each triple is its x array, then y, then z
+        int offset = (int) fields[i].offset;
+        if (fields[i].triple)
+            offset += component * SGB::MaxSize * sizeof(float);
+        TypeDesc type = fields[i].isint ? TypeDesc::INT : TypeDesc::FLOAT;
+        llvm::Value *ptr = llvm_offset_ptr (m_batch_sg, offset,
+                                            fields[i].isint ? llvm_type_int_ptr()
+                                                            : llvm_type_float_ptr());
+        ptr = builder().CreateGEP (ptr, m_batch_first);
+        ptr = llvm_ptr_cast (ptr, llvm::PointerType::get (llvm_type_batch (type), 0));
+        llvm::LoadInst *load = builder().CreateLoad (ptr);
+        load->setAlignment (sizeof(float));
+        return load;
+    }
+    return NULL;
+}
+
+
+
+bool
+RuntimeOptimizer::llvm_batch_store (llvm::Value *val, const Symbol &sym,
+                                    int component)
+{
+    llvm::Value *ptr = llvm_batch_storage (sym);
+    if (! ptr || ! val)
+        return false;
+    ptr = builder().CreateConstGEP2_32 (ptr, 0, component);
+    // Lanes that are off keep their old values
+    if (m_batch_mask)
+        val = builder().CreateSelect (m_batch_mask, val,
+                                      builder().CreateLoad (ptr));
+    builder().CreateStore (val, ptr);
+    return true;
+}
+
+
+
+bool
+RuntimeOptimizer::llvm_batch_assign (const Symbol &Result, const Symbol &Src)
+{
+    TypeDesc type = Result.typespec().simpletype();
+    for (int i = 0;  i < (int)type.aggregate;  ++i)
+        if (! llvm_batch_store (llvm_batch_load (Src, i, type), Result, i))
+            return false;
+    return true;
+}
+
+
+
 llvm::Value *
 RuntimeOptimizer::layer_run_ptr (int layer)
 {
@@ -67,6 +67,8 @@ public:
       { }
     virtual ~OSOReaderToMaster () { }
     virtual bool parse (const std::string &filename);
+    virtual bool wants_contents () const;
+    virtual void contents (const char *data, size_t size);
     virtual void version (const char *specid, int major, int minor);
     virtual void shader (const char *shadertype, const char *name);
     virtual void symbol (SymType symtype, TypeSpec typespec, const char *name);
@@ -112,6 +114,26 @@ OSOReaderToMaster::parse (const std::string &filename)
 
 
 
+bool
+OSOReaderToMaster::wants_contents () const
+{
+    // The on-disk JIT cache will need the hash of every master, so take
+    // it while the contents are at hand.  Nothing else does, short of
+    // register_compiled_group, which can fall back to
+    // ShaderMaster::hash_oso_file().
+    return ! m_shadingsys.jitcache().empty();
+}
+
+
+
+void
+OSOReaderToMaster::contents (const char *data, size_t size)
+{
+    m_master->m_osohash = ShaderMaster::hash_contents (data, size);
+}
+
+
+
 void
 OSOReaderToMaster::version (const char *specid, int major, int minor)
 {
@@ -494,46 +516,79 @@ ShadingSystemImpl::loadshader (const char *cname)
     }
     ++m_stat_shaders_requested;
     ustring name (cname);
-    lock_guard guard (m_mutex);  // Thread safety
-    ShaderNameMap::const_iterator found = m_shader_masters.find (name);
-    if (found != m_shader_masters.end()) {
-        if (debug())
-            info ("Found %s in shader_masters", name.c_str());
-        // Already loaded this shader, return its reference
-        return (*found).second;
+
+    // Find or claim the map entry for this name.  Only the map itself
+    // is locked, and only briefly -- the search and parse below run
+    // unlocked, so distinct shaders load in parallel, and a thread
+    // asking for a shader that another thread is already reading just
+    // waits for that one load to finish.
+    ShaderMasterEntryRef entry;
+    {
+        boost::unique_lock<boost::mutex> lock (m_shader_masters_mutex);
+        ShaderNameMap::iterator found = m_shader_masters.find (name);
+        if (found != m_shader_masters.end()) {
+            entry = found->second;
+            if (! entry->ready) {
+                ++m_stat_shaders_load_waits;
+                while (! entry->ready)
+                    m_shader_masters_cond.wait (lock);
+            }
+            if (debug())
+                info ("Found %s in shader_masters", name.c_str());
+            // Already loaded this shader, return its reference
+            return entry->master;
+        }
+        entry.reset (new ShaderMasterEntry);
+        m_shader_masters[name] = entry;
     }
 
-    // Not found in the map
-    OSOReaderToMaster oso (*this);
+    // Not found in the map -- we're responsible for loading it
+    std::vector<std::string> searchpath_dirs;
+    {
+        lock_guard guard (m_mutex);
+        searchpath_dirs = m_searchpath_dirs;
+    }
+    ShaderMaster::ref r;
     std::string filename = Filesystem::searchpath_find (name.string() + ".oso",
-                                                        m_searchpath_dirs);
+                                                        searchpath_dirs);
     if (filename.empty ()) {
         // FIXME -- error
         error ("No .oso file could be found for shader \"%s\"", name.c_str());
-        return NULL;
-    }
-    Timer timer;
-    bool ok = oso.parse (filename);
-    ShaderMaster::ref r = ok ? oso.master() : NULL;
-    m_shader_masters[name] = r;
-    if (ok) {
-        ++m_stat_shaders_loaded;
-        info ("Loaded \"%s\" (took %s)", filename.c_str(), Strutil::timeintervalformat(timer(), 2).c_str());
     } else {
-        error ("Unable to read \"%s\"", filename.c_str());
-    }
-    // FIXME -- catch errors
+        OSOReaderToMaster oso (*this);
+        Timer timer;
+        bool ok = oso.parse (filename);
+        r = ok ? oso.master() : NULL;
+        if (ok) {
+            ++m_stat_shaders_loaded;
+            info ("Loaded \"%s\" (took %s)", filename.c_str(), Strutil::timeintervalformat(timer(), 2).c_str());
+        } else {
+            error ("Unable to read \"%s\"", filename.c_str());
+        }
+        // FIXME -- catch errors
 
-    if (r) {
-        r->resolve_syms ();
-    }
+        if (r) {
+            r->resolve_syms ();
+        }
 
-    if (r && m_debug) {
-        std::string s = r->print ();
-        if (s.length())
-            info ("%s", s.c_str());
+        if (r && m_debug) {
+            std::string s = r->print ();
+            if (s.length())
+                info ("%s", s.c_str());
+        }
     }
 
+    // Publish the result and wake anybody waiting for it
+    {
+        boost::lock_guard<boost::mutex> lock (m_shader_masters_mutex);
+        entry->master = r;
+        entry->ready = true;
+        // A shader that wasn't found isn't remembered, so a later
+        // request (perhaps with a new searchpath) tries again.
+        if (filename.empty())
+            m_shader_masters.erase (name);
+        m_shader_masters_cond.notify_all ();
+    }
     return r;
 }
 
@@ -31,6 +31,8 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <cstdio>
 #include <limits>
 #include <sstream>
+#include <fstream>
+#include <iterator>
 
 #include <boost/foreach.hpp>
 
@@ -82,6 +84,26 @@ ShaderMaster::~ShaderMaster ()
 
 
 
+std::string
+ShaderMaster::hash_contents (const char *data, size_t size)
+{
+    return Strutil::format ("%016llx:%llu", fnv1a_hash (data, size),
+                            (unsigned long long) size);
+}
+
+
+
+std::string
+ShaderMaster::hash_oso_file () const
+{
+    std::ifstream in (m_osofilename.c_str(), std::ios::in | std::ios::binary);
+    std::string contents ((std::istreambuf_iterator<char>(in)),
+                          std::istreambuf_iterator<char>());
+    return hash_contents (contents.data(), contents.size());
+}
+
+
+
 int
 ShaderMaster::findsymbol (ustring name) const
 {
@@ -0,0 +1,298 @@
+/*
+Copyright (c) 2009-2010 Sony Pictures Imageworks Inc., et al.
+All Rights Reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are
+met:
+* Redistributions of source code must retain the above copyright
+  notice, this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright
+  notice, this list of conditions and the following disclaimer in the
+  documentation and/or other materials provided with the distribution.
+* Neither the name of Sony Pictures Imageworks nor the names of its
+  contributors may be used to endorse or promote products derived from
+  this software without specific prior written permission.
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <iostream>
+#include <cmath>
+
+#include <boost/random.hpp>
+
+#include <OpenImageIO/dassert.h>
+#include <OpenImageIO/strutil.h>
+#include <OpenImageIO/timer.h>
+
+#include "oslexec_pvt.h"
+#include "noiseimpl.h"
+
+using namespace OSL;
+using namespace OSL::pvt;
+#ifdef OIIO_NAMESPACE
+using OIIO::Timer;
+namespace Strutil = OIIO::Strutil;
+#endif
+
+namespace {
+
+// The noise functions hash and evaluate the gradients of all the corners
+// of a lattice cell at once.  Check both stages against doing it one
+// corner at a time, the way it used to be done, which must give exactly
+// the same bits.
+
+template <int N>
+void
+check_corners (boost::uniform_01<boost::mt19937, float> &rnd)
+{
+    const int COUNT = 1 << N;
+    for (int iter = 0;  iter < 10000;  ++iter) {
+        int lo[N], hi[N];
+        float f[N];
+        for (int d = 0;  d < N;  ++d) {
+            lo[d] = (int) ((2 * rnd() - 1) * 100000);
+            hi[d] = lo[d] + 1;
+            f[d] = rnd();
+        }
+        unsigned int bits[COUNT];
+        inthash_corners<N> (lo, hi, bits);
+        for (int shift = 0;  shift <= 16;  shift += 8) {
+            float g[COUNT];
+            grad_corners<N> (g, bits, shift, f, true);
+            for (int i = 0;  i < COUNT;  ++i) {
+                unsigned int k[N];
+                float c[4] = { 0, 0, 0, 0 };
+                for (int d = 0;  d < N;  ++d) {
+                    k[d] = ((i >> d) & 1) ? hi[d] : lo[d];
+                    c[d] = ((i >> d) & 1) ? f[d] - 1.0f : f[d];
+                }
+                int h = inthash<N> (k);
+                ASSERT (bits[i] == (unsigned int) h);
+                h = (int) ((unsigned int) h >> shift);
+                float ref = (N == 1) ? grad (h, c[0])
+                          : (N == 2) ? grad (h, c[0], c[1])
+                          : (N == 3) ? grad (h, c[0], c[1], c[2])
+                          :            grad (h, c[0], c[1], c[2], c[3]);
+                ASSERT (g[i] == ref);
+            }
+        }
+    }
+}
+
+
+
+// Benchmark one corner at a time against all corners at once.
+template <int N>
+void
+bench_corners ()
+{
+    const int COUNT = 1 << N;
+    const int iters = 1000000;
+    int lo[N], hi[N];
+    float f[N], c[4] = { 0, 0, 0, 0 };
+    for (int d = 0;  d < N;  ++d) {
+        lo[d] = 17 * d;
+        hi[d] = lo[d] + 1;
+        f[d] = 0.25f;
+    }
+    float scalar_sum = 0, lanes_sum = 0;
+    Timer scalar_timer;
+    for (int iter = 0;  iter < iters;  ++iter) {
+        lo[0] = iter;  hi[0] = iter + 1;
+        for (int i = 0;  i < COUNT;  ++i) {
+            unsigned int k[N];
+            for (int d = 0;  d < N;  ++d) {
+                k[d] = ((i >> d) & 1) ? hi[d] : lo[d];
+                c[d] = ((i >> d) & 1) ? f[d] - 1.0f : f[d];
+            }
+            int h = inthash<N> (k);
+            scalar_sum += (N == 1) ? grad (h, c[0])
+                 : (N == 2) ? grad (h, c[0], c[1])
+                 : (N == 3) ? grad (h, c[0], c[1], c[2])
+                 :            grad (h, c[0], c[1], c[2], c[3]);
+        }
+    }
+    double scalar_time = scalar_timer();
+    Timer lanes_timer;
+    for (int iter = 0;  iter < iters;  ++iter) {
+        lo[0] = iter;  hi[0] = iter + 1;
+        unsigned int bits[COUNT];
+        float g[COUNT];
+        inthash_corners<N> (lo, hi, bits);
+        grad_corners<N> (g, bits, 0, f, true);
+        for (int i = 0;  i < COUNT;  ++i)
+            lanes_sum += g[i];
+    }
+    double lanes_time = lanes_timer();
+    // Same bits in the same order, so the sums match exactly
+    ASSERT (scalar_sum == lanes_sum);
+    std::cout << Strutil::format ("perlin %dD corners: %.1f ns one at a time, "
+                                  "%.1f ns at once\n", N,
+                                  1.0e9 * scalar_time / iters,
+                                  1.0e9 * lanes_time / iters);
+}
+
+
+
+// Derivatives must match a finite difference of the value
+void
+check_derivs (boost::uniform_01<boost::mt19937, float> &rnd)
+{
+    Noise noise;
+    const float eps = 1.0e-3f;
+    for (int iter = 0;  iter < 1000;  ++iter) {
+        Vec3 p ((2 * rnd() - 1) * 100, (2 * rnd() - 1) * 100, (2 * rnd() - 1) * 100);
+        Dual2<Vec3> dp (p, Vec3 (1, 0, 0), Vec3 (0, 1, 0));
+        Dual2<float> r;
+        noise (r, dp);
+        float r0, rx, ry;
+        noise (r0, p);
+        noise (rx, p + Vec3 (eps, 0, 0));
+        noise (ry, p + Vec3 (0, eps, 0));
+        ASSERT (r.val() == r0);
+        ASSERT (fabsf (r.dx() - (rx - r0) / eps) < 0.05f);
+        ASSERT (fabsf (r.dy() - (ry - r0) / eps) < 0.05f);
+
+        Dual2<Vec3> rv;
+        Vec3 rv0;
+        noise (rv, dp);
+        noise (rv0, p);
+        ASSERT (rv.val() == rv0);
+    }
+}
+
+
+
+// Periodic noise must repeat
+void
+check_periodic (boost::uniform_01<boost::mt19937, float> &rnd)
+{
+    PeriodicNoise pnoise;
+    Vec3 period (3, 5, 7);
+    for (int iter = 0;  iter < 1000;  ++iter) {
+        Vec3 p ((2 * rnd() - 1) * 10, (2 * rnd() - 1) * 10, (2 * rnd() - 1) * 10);
+        Vec3 a, b;
+        pnoise (a, p, period);
+        pnoise (b, p + period, period);
+        ASSERT (fabsf (a.x - b.x) < 1.0e-4f && fabsf (a.y - b.y) < 1.0e-4f &&
+                fabsf (a.z - b.z) < 1.0e-4f);
+    }
+}
+
+// The batch entry points, points across lanes, must give exactly what
+// one lookup at a time gives.
+template <typename Impl, typename R>
+void
+check_batch (boost::uniform_01<boost::mt19937, float> &rnd, int xcomps,
+             bool usey)
+{
+    Impl impl;
+    const int rcomps = sizeof(R) / sizeof(float);
+    for (int iter = 0;  iter < 100;  ++iter) {
+        float x[3*BatchWidth], y[BatchWidth], r[3*BatchWidth];
+        for (int i = 0;  i < 3*BatchWidth;  ++i)
+            x[i] = (2 * rnd() - 1) * 100;
+        for (int i = 0;  i < BatchWidth;  ++i)
+            y[i] = (2 * rnd() - 1) * 100;
+        noise_batch<Impl> (r, rcomps, x, xcomps, usey ? y : NULL);
+        for (int i = 0;  i < BatchWidth;  ++i) {
+            R ref;
+            if (xcomps == 1 && usey)
+                impl (ref, x[i], y[i]);
+            else if (xcomps == 1)
+                impl (ref, x[i]);
+            else if (usey)
+                impl (ref, batch_vec (x, i), y[i]);
+            else
+                impl (ref, batch_vec (x, i));
+            for (int c = 0;  c < rcomps;  ++c)
+                ASSERT (r[i+c*BatchWidth] == ((const float *)&ref)[c]);
+        }
+    }
+}
+
+
+
+template <typename Impl>
+void
+check_batch (boost::uniform_01<boost::mt19937, float> &rnd)
+{
+    for (int xcomps = 1;  xcomps <= 3;  xcomps += 2) {
+        check_batch<Impl,float> (rnd, xcomps, false);
+        check_batch<Impl,float> (rnd, xcomps, true);
+        check_batch<Impl,Vec3> (rnd, xcomps, false);
+        check_batch<Impl,Vec3> (rnd, xcomps, true);
+    }
+}
+
+
+
+void
+check_pnoise_batch (boost::uniform_01<boost::mt19937, float> &rnd)
+{
+    PeriodicNoise pnoise;
+    for (int iter = 0;  iter < 100;  ++iter) {
+        float x[3*BatchWidth], y[BatchWidth], px[3*BatchWidth], py[BatchWidth];
+        float r[3*BatchWidth];
+        for (int i = 0;  i < 3*BatchWidth;  ++i) {
+            x[i] = (2 * rnd() - 1) * 10;
+            px[i] = 1 + (int) (rnd() * 8);
+        }
+        for (int i = 0;  i < BatchWidth;  ++i) {
+            y[i] = (2 * rnd() - 1) * 10;
+            py[i] = 1 + (int) (rnd() * 8);
+        }
+        pnoise_batch<PeriodicNoise> (r, 3, x, 3, y, px, py);
+        for (int i = 0;  i < BatchWidth;  ++i) {
+            Vec3 ref;
+            pnoise (ref, batch_vec (x, i), y[i], batch_vec (px, i), py[i]);
+            ASSERT (r[i] == ref.x && r[i+BatchWidth] == ref.y &&
+                    r[i+2*BatchWidth] == ref.z);
+        }
+        pnoise_batch<PeriodicNoise> (r, 1, x, 1, NULL, px, NULL);
+        for (int i = 0;  i < BatchWidth;  ++i) {
+            float ref;
+            pnoise (ref, x[i], px[i]);
+            ASSERT (r[i] == ref);
+        }
+    }
+}
+
+} // anonymous namespace
+
+
+
+int main()
+{
+    boost::mt19937 rndgen;
+    boost::uniform_01<boost::mt19937, float> rnd(rndgen);
+
+    check_corners<1> (rnd);
+    check_corners<2> (rnd);
+    check_corners<3> (rnd);
+    check_corners<4> (rnd);
+    check_derivs (rnd);
+    check_periodic (rnd);
+    check_batch<Noise> (rnd);
+    check_batch<SNoise> (rnd);
+    check_batch<CellNoise> (rnd);
+    check_pnoise_batch (rnd);
+    std::cout << "Noise kernels check OK\n";
+
+    bench_corners<1> ();
+    bench_corners<2> ();
+    bench_corners<3> ();
+    bench_corners<4> ();
+    return 0;
+}
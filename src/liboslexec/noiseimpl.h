@@ -28,6 +28,13 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #include <limits>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
 #include "dual.h"
 #include "oslexec_pvt.h"
 
@@ -50,12 +57,102 @@ inline float bits_to_01 (unsigned int bits) {
     return bits * (1.0f / std::numeric_limits<unsigned int>::max());
 }
 
+#if defined(__SSE2__)
+
+/// Four 32 bit integer lanes, with just enough operators to run the
+/// lookup3 hash and the gradient selection below on several lattice
+/// corners at once.  Comparisons return all-ones lanes where true.
+struct int4 {
+    __m128i m;
+    int4 () { }
+    int4 (__m128i v) : m(v) { }
+    int4 (unsigned int v) : m(_mm_set1_epi32 ((int)v)) { }
+    static int4 lane_index () { return _mm_setr_epi32 (0, 1, 2, 3); }
+    static int4 load (const unsigned int *v) { return _mm_loadu_si128 ((const __m128i *)v); }
+    void store (int *v) const { _mm_storeu_si128 ((__m128i *)v, m); }
+    static const int lanes = 4;
+};
+
+inline int4 operator+ (const int4 &a, const int4 &b) { return _mm_add_epi32 (a.m, b.m); }
+inline int4 operator- (const int4 &a, const int4 &b) { return _mm_sub_epi32 (a.m, b.m); }
+inline int4 operator^ (const int4 &a, const int4 &b) { return _mm_xor_si128 (a.m, b.m); }
+inline int4 operator| (const int4 &a, const int4 &b) { return _mm_or_si128 (a.m, b.m); }
+inline int4 operator& (const int4 &a, const int4 &b) { return _mm_and_si128 (a.m, b.m); }
+inline int4 operator<< (const int4 &a, int k) { return _mm_slli_epi32 (a.m, k); }
+inline int4 operator>> (const int4 &a, int k) { return _mm_srli_epi32 (a.m, k); }
+inline int4 & operator+= (int4 &a, const int4 &b) { return a = a + b; }
+inline int4 & operator-= (int4 &a, const int4 &b) { return a = a - b; }
+inline int4 & operator^= (int4 &a, const int4 &b) { return a = a ^ b; }
+inline int4 operator< (const int4 &a, const int4 &b) { return _mm_cmplt_epi32 (a.m, b.m); }
+inline int4 operator== (const int4 &a, const int4 &b) { return _mm_cmpeq_epi32 (a.m, b.m); }
+
+/// Four float lanes, holding the gradients of four lattice corners.
+struct float4 {
+    __m128 m;
+    float4 () { }
+    float4 (__m128 v) : m(v) { }
+    float4 (float v) : m(_mm_set1_ps (v)) { }
+    explicit float4 (const int4 &v) : m(_mm_cvtepi32_ps (v.m)) { }
+    void store (float *v) const { _mm_storeu_ps (v, m); }
+};
+
+inline float4 operator+ (const float4 &a, const float4 &b) { return _mm_add_ps (a.m, b.m); }
+inline float4 operator- (const float4 &a, const float4 &b) { return _mm_sub_ps (a.m, b.m); }
+inline float4 operator* (const float4 &a, const float4 &b) { return _mm_mul_ps (a.m, b.m); }
+
+/// mask ? a : b, per lane
+inline float4 select (const int4 &mask, const float4 &a, const float4 &b) {
+    __m128 m = _mm_castsi128_ps (mask.m);
+    return _mm_or_ps (_mm_and_ps (m, a.m), _mm_andnot_ps (m, b.m));
+}
+
+/// mask ? -a : a, per lane
+inline float4 negate_if (const int4 &mask, const float4 &a) {
+    __m128i sign = _mm_and_si128 (mask.m, _mm_set1_epi32 (0x80000000));
+    return _mm_xor_ps (a.m, _mm_castsi128_ps (sign));
+}
+
+/// all-ones in the lanes of h that have the given bit(s) set
+inline int4 bit_set (const int4 &h, unsigned int bit) {
+    return (h & int4(bit)) == int4(bit);
+}
+
+#endif
+
+#if defined(__AVX2__)
+
+/// Eight lane version of int4, used when the compiler targets AVX2.
+struct int8 {
+    __m256i m;
+    int8 () { }
+    int8 (__m256i v) : m(v) { }
+    int8 (unsigned int v) : m(_mm256_set1_epi32 ((int)v)) { }
+    static int8 lane_index () { return _mm256_setr_epi32 (0, 1, 2, 3, 4, 5, 6, 7); }
+    void store (int *v) const { _mm256_storeu_si256 ((__m256i *)v, m); }
+    static const int lanes = 8;
+};
+
+inline int8 operator+ (const int8 &a, const int8 &b) { return _mm256_add_epi32 (a.m, b.m); }
+inline int8 operator- (const int8 &a, const int8 &b) { return _mm256_sub_epi32 (a.m, b.m); }
+inline int8 operator^ (const int8 &a, const int8 &b) { return _mm256_xor_si256 (a.m, b.m); }
+inline int8 operator| (const int8 &a, const int8 &b) { return _mm256_or_si256 (a.m, b.m); }
+inline int8 operator& (const int8 &a, const int8 &b) { return _mm256_and_si256 (a.m, b.m); }
+inline int8 operator<< (const int8 &a, int k) { return _mm256_slli_epi32 (a.m, k); }
+inline int8 operator>> (const int8 &a, int k) { return _mm256_srli_epi32 (a.m, k); }
+inline int8 & operator+= (int8 &a, const int8 &b) { return a = a + b; }
+inline int8 & operator-= (int8 &a, const int8 &b) { return a = a - b; }
+inline int8 & operator^= (int8 &a, const int8 &b) { return a = a ^ b; }
+
+#endif
+
 /// hash an array of N 32 bit values into a pseudo-random value
 /// based on my favorite hash: http://burtleburtle.net/bob/c/lookup3.c
-/// templated so that the compiler can unroll the loops for us
-template <int N>
-inline unsigned int
-inthash (const unsigned int k[N]) {
+/// templated so that the compiler can unroll the loops for us, and on
+/// the integer type so that the same code hashes one key (unsigned int)
+/// or several keys at once (int4, int8) with bit-identical results.
+template <int N, typename U>
+inline U
+inthash_impl (const U k[N]) {
     // define some handy macros
 #define rot(x,k) (((x)<<(k)) | ((x)>>(32-(k))))
 #define mix(a,b,c) \
@@ -78,8 +175,9 @@ inthash (const unsigned int k[N]) {
     c ^= b; c -= rot(b,24); \
 }
     // now hash the data!
-    unsigned int a, b, c, len = N;
-    a = b = c = 0xdeadbeef + (len << 2) + 13;
+    unsigned int len = N;
+    U a, b, c;
+    a = b = c = U(0xdeadbeef + (len << 2) + 13);
     while (len > 3) {
         a += k[0];
         b += k[1];
@@ -103,6 +201,66 @@ inthash (const unsigned int k[N]) {
 #undef final
 }
 
+template <int N>
+inline unsigned int
+inthash (const unsigned int k[N]) {
+    return inthash_impl<N> (k);
+}
+
+#if defined(__SSE2__)
+// Hash the corners of a lattice cell L at a time, see inthash_corners
+template <int N, typename LANES>
+inline void
+inthash_corners_lanes (const int lo[N], const int hi[N], unsigned int result[1<<N]) {
+    for (int i = 0;  i < (1<<N);  i += LANES::lanes) {
+        // select lo or hi per lane without going through memory
+        LANES index = LANES::lane_index() + LANES(i);
+        LANES k[N];
+        for (int d = 0;  d < N;  ++d) {
+            LANES mask = LANES(0u) - ((index >> d) & LANES(1u));
+            k[d] = LANES(lo[d]) ^ ((LANES(lo[d]) ^ LANES(hi[d])) & mask);
+        }
+        inthash_impl<N> (k).store ((int *)result + i);
+    }
+}
+#endif
+
+/// Hash the 2^N corners of the lattice cell spanning lo..hi, where
+/// corner i takes hi[d] if bit d of i is set and lo[d] otherwise.  The
+/// corners are run through the lookup3 hash as many lanes at a time as
+/// the target supports, so the result is bit-identical to calling
+/// inthash<N> on each corner in turn.  The two corners of a 1D cell are
+/// faster to do one at a time.
+template <int N>
+inline void
+inthash_corners (const int lo[N], const int hi[N], unsigned int result[1<<N]) {
+#if defined(__AVX2__)
+    if ((1<<N) >= 8) {
+        inthash_corners_lanes<N,int8> (lo, hi, result);
+        return;
+    }
+#endif
+#if defined(__SSE2__)
+    if ((1<<N) >= 4) {
+        inthash_corners_lanes<N,int4> (lo, hi, result);
+        return;
+    }
+#endif
+    if (N == 1) {
+        // written out, the generic loop below is noticeably slower
+        unsigned int k0 = lo[0], k1 = hi[0];
+        result[0] = inthash<1> (&k0);
+        result[1] = inthash<1> (&k1);
+        return;
+    }
+    for (int i = 0;  i < (1<<N);  ++i) {
+        unsigned int k[N];
+        for (int d = 0;  d < N;  ++d)
+            k[d] = ((i >> d) & 1) ? hi[d] : lo[d];
+        result[i] = inthash<N> (k);
+    }
+}
+
 struct CellNoise {
     CellNoise () { }
 
@@ -293,65 +451,139 @@ inline T grad (int hash, const T &x, const T &y, const T &z, const T &w) {
 
 typedef Imath::Vec3<int> Vec3i;
 
-inline Vec3 grad (const Vec3i &hash, float x) {
-    return Vec3 (grad (hash.x, x),
-                 grad (hash.y, x),
-                 grad (hash.z, x));
-}
+#if defined(__SSE2__)
+
+// The same 2D-4D gradient functions on four corners at once.  The
+// selections are done with masks rather than branches (the hash bits are
+// random, so the branches above mispredict half of the time), and the
+// arithmetic is done in the same order so the results are bit-identical.
 
-inline Dual2<Vec3> grad (const Vec3i &hash, Dual2<float> x) {
-    Dual2<float> rx = grad (hash.x, x);
-    Dual2<float> ry = grad (hash.y, x);
-    Dual2<float> rz = grad (hash.z, x);
-    return Dual2<Vec3> (Vec3(rx.val(), ry.val(), rz.val()),
-                        Vec3(rx.dx() , ry.dx() , rz.dx() ),
-                        Vec3(rx.dy() , ry.dy() , rz.dy() ));
+inline float4 grad (const int4 &hash, const float4 &x, const float4 &y) {
+    int4 h = hash & int4(7u);
+    int4 lt4 = h < int4(4u);
+    float4 u = select (lt4, x, y);
+    float4 v = select (lt4, y, x);
+    return negate_if (bit_set (h, 1), u) + negate_if (bit_set (h, 2), float4(2.0f) * v);
 }
 
+inline float4 grad (const int4 &hash, const float4 &x, const float4 &y, const float4 &z) {
+    int4 h = hash & int4(15u);
+    float4 u = select (h < int4(8u), x, y);
+    float4 v = select (h < int4(4u), y,
+                       select ((h == int4(12u)) | (h == int4(14u)), x, z));
+    return negate_if (bit_set (h, 1), u) + negate_if (bit_set (h, 2), v);
+}
 
-inline Vec3 grad (const Vec3i &hash, float x, float y) {
-    return Vec3 (grad (hash.x, x, y),
-                 grad (hash.y, x, y),
-                 grad (hash.z, x, y));
+inline float4 grad (const int4 &hash, const float4 &x, const float4 &y, const float4 &z, const float4 &w) {
+    int4 h = hash & int4(31u);
+    float4 u = select (h < int4(24u), x, y);
+    float4 v = select (h < int4(16u), y, z);
+    float4 s = select (h < int4(8u), z, w);
+    return negate_if (bit_set (h, 1), u) + negate_if (bit_set (h, 2), v)
+         + negate_if (bit_set (h, 4), s);
 }
 
-inline Dual2<Vec3> grad (const Vec3i &hash, Dual2<float> x, Dual2<float> y) {
-    Dual2<float> rx = grad (hash.x, x, y);
-    Dual2<float> ry = grad (hash.y, x, y);
-    Dual2<float> rz = grad (hash.z, x, y);
-    return Dual2<Vec3> (Vec3(rx.val(), ry.val(), rz.val()),
-                        Vec3(rx.dx() , ry.dx() , rz.dx() ),
-                        Vec3(rx.dy() , ry.dy() , rz.dy() ));
+#endif
+
+/// Evaluate the N dimensional grad() at all 2^N corners of a lattice
+/// cell: result[i] = grad (bits[i] >> shift, f - corner i), where bits
+/// are the corner hashes from LatticeHash::corners() and f is the offset
+/// of the lookup point from corner 0.  With offset false the corners are
+/// not subtracted, which is what the derivatives of a Dual2 need.
+template <int N>
+inline void
+grad_corners (float *result, const unsigned int *bits, int shift,
+              const float f[N], bool offset) {
+    const int COUNT = 1 << N;
+#if defined(__SSE2__)
+    if (COUNT >= 4) {
+        for (int i = 0;  i < COUNT;  i += 4) {
+            int4 index = int4::lane_index() + int4(i);
+            float4 c[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+            for (int d = 0;  d < N;  ++d) {
+                c[d] = float4 (f[d]);
+                if (offset)
+                    c[d] = c[d] - float4 ((index >> d) & int4(1u));
+            }
+            int4 h = int4::load (bits + i) >> shift;
+            float4 g;
+            switch (N) {
+            case 2 : g = grad (h, c[0], c[1]); break;
+            case 3 : g = grad (h, c[0], c[1], c[2]); break;
+            default: g = grad (h, c[0], c[1], c[2], c[3]); break;
+            }
+            g.store (result + i);
+        }
+        return;
+    }
+#endif
+    for (int i = 0;  i < COUNT;  ++i) {
+        float c[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+        for (int d = 0;  d < N;  ++d)
+            c[d] = (offset && ((i >> d) & 1)) ? f[d] - 1.0f : f[d];
+        int h = (int) (bits[i] >> shift);
+        switch (N) {
+        case 1 : result[i] = grad (h, c[0]); break;
+        case 2 : result[i] = grad (h, c[0], c[1]); break;
+        case 3 : result[i] = grad (h, c[0], c[1], c[2]); break;
+        default: result[i] = grad (h, c[0], c[1], c[2], c[3]); break;
+        }
+    }
 }
 
-inline Vec3 grad (const Vec3i &hash, float x, float y, float z) {
-    return Vec3 (grad (hash.x, x, y, z),
-                 grad (hash.y, x, y, z),
-                 grad (hash.z, x, y, z));
+// The gradients for each kind of perlin result.  Vector results use a
+// different byte of the hash for each channel, and grad() is linear in
+// the lookup point so the derivatives are the gradients of the
+// derivatives (without the corner offsets).
+
+template <int N>
+inline void grad_corners (float *g, const unsigned int *bits, const float f[N]) {
+    grad_corners<N> (g, bits, 0, f, true);
 }
 
-inline Dual2<Vec3> grad (const Vec3i &hash, Dual2<float> x, Dual2<float> y, Dual2<float> z) {
-    Dual2<float> rx = grad (hash.x, x, y, z);
-    Dual2<float> ry = grad (hash.y, x, y, z);
-    Dual2<float> rz = grad (hash.z, x, y, z);
-    return Dual2<Vec3> (Vec3(rx.val(), ry.val(), rz.val()),
-                        Vec3(rx.dx() , ry.dx() , rz.dx() ),
-                        Vec3(rx.dy() , ry.dy() , rz.dy() ));
+template <int N>
+inline void grad_corners (Vec3 *g, const unsigned int *bits, const float f[N]) {
+    float c[3][1<<N];
+    for (int ch = 0;  ch < 3;  ++ch)
+        grad_corners<N> (c[ch], bits, 8*ch, f, true);
+    for (int i = 0;  i < (1<<N);  ++i)
+        g[i] = Vec3 (c[0][i], c[1][i], c[2][i]);
 }
 
-inline Vec3 grad (const Vec3i &hash, float x, float y, float z, float w) {
-    return Vec3 (grad (hash.x, x, y, z, w),
-                 grad (hash.y, x, y, z, w),
-                 grad (hash.z, x, y, z, w));
+template <int N>
+inline void grad_corners (Dual2<float> *g, const unsigned int *bits, const Dual2<float> f[N]) {
+    float val[N], dx[N], dy[N];
+    for (int d = 0;  d < N;  ++d) {
+        val[d] = f[d].val();
+        dx[d]  = f[d].dx();
+        dy[d]  = f[d].dy();
+    }
+    float gval[1<<N], gdx[1<<N], gdy[1<<N];
+    grad_corners<N> (gval, bits, 0, val, true);
+    grad_corners<N> (gdx,  bits, 0, dx,  false);
+    grad_corners<N> (gdy,  bits, 0, dy,  false);
+    for (int i = 0;  i < (1<<N);  ++i)
+        g[i] = Dual2<float> (gval[i], gdx[i], gdy[i]);
 }
 
-inline Dual2<Vec3> grad (const Vec3i &hash, Dual2<float> x, Dual2<float> y, Dual2<float> z, Dual2<float> w) {
-    Dual2<float> rx = grad (hash.x, x, y, z, w);
-    Dual2<float> ry = grad (hash.y, x, y, z, w);
-    Dual2<float> rz = grad (hash.z, x, y, z, w);
-    return Dual2<Vec3> (Vec3(rx.val(), ry.val(), rz.val()),
-                        Vec3(rx.dx() , ry.dx() , rz.dx() ),
-                        Vec3(rx.dy() , ry.dy() , rz.dy() ));
+template <int N>
+inline void grad_corners (Dual2<Vec3> *g, const unsigned int *bits, const Dual2<float> f[N]) {
+    float val[N], dx[N], dy[N];
+    for (int d = 0;  d < N;  ++d) {
+        val[d] = f[d].val();
+        dx[d]  = f[d].dx();
+        dy[d]  = f[d].dy();
+    }
+    float gval[3][1<<N], gdx[3][1<<N], gdy[3][1<<N];
+    for (int ch = 0;  ch < 3;  ++ch) {
+        grad_corners<N> (gval[ch], bits, 8*ch, val, true);
+        grad_corners<N> (gdx[ch],  bits, 8*ch, dx,  false);
+        grad_corners<N> (gdy[ch],  bits, 8*ch, dy,  false);
+    }
+    for (int i = 0;  i < (1<<N);  ++i)
+        g[i] = Dual2<Vec3> (Vec3 (gval[0][i], gval[1][i], gval[2][i]),
+                            Vec3 (gdx[0][i],  gdx[1][i],  gdx[2][i]),
+                            Vec3 (gdy[0][i],  gdy[1][i],  gdy[2][i]));
 }
 
 template <typename T>
@@ -382,12 +614,18 @@ inline Dual2<T> scale4 (const Dual2<T> &result) {
 
 
 template <typename V, typename H, typename T>
-inline void perlin (V& result, H& hash, const T &x) {
+inline void perlin (V& result, const H &hash, const T &x) {
     int X; T fx = floorfrac(x, &X);
     T u = fade(fx);
 
-    result = lerp (u, grad (hash (X  ), fx     ),
-                      grad (hash (X+1), fx-1.0f));
+    // hash and evaluate the gradients of all the lattice corners at once
+    unsigned int bits[2];
+    hash.corners (bits, X);
+    T f[1] = { fx };
+    V g[2];
+    grad_corners<1> (g, bits, f);
+
+    result = lerp (u, g[0], g[1]);
     result = scale1 (result);
 }
 
@@ -399,10 +637,15 @@ inline void perlin (V &result, const H &hash, const T &x, const T &y) {
     T u = fade(fx);
     T v = fade(fy);
 
-    result = lerp (v, lerp (u, grad (hash (X  , Y  ), fx     , fy     ),
-                               grad (hash (X+1, Y  ), fx-1.0f, fy     )),
-                      lerp (u, grad (hash (X  , Y+1), fx     , fy-1.0f),
-                               grad (hash (X+1, Y+1), fx-1.0f, fy-1.0f)));
+    // hash and evaluate the gradients of all the lattice corners at once
+    unsigned int bits[4];
+    hash.corners (bits, X, Y);
+    T f[2] = { fx, fy };
+    V g[4];
+    grad_corners<2> (g, bits, f);
+
+    result = lerp (v, lerp (u, g[0], g[1]),
+                      lerp (u, g[2], g[3]));
     result = scale2 (result);
 }
 
@@ -417,14 +660,17 @@ inline void perlin (V &result, const H &hash, const T &x, const T &y, const T &z
     T v = fade(fy);
     T w = fade(fz);
 
-    result = lerp (w, lerp (v, lerp (u, grad (hash (X  , Y  , Z  ), fx     , fy     , fz      ),
-                                        grad (hash (X+1, Y  , Z  ), fx-1.0f, fy     , fz      )),
-                               lerp (u, grad (hash (X  , Y+1, Z  ), fx     , fy-1.0f, fz      ),
-                                        grad (hash (X+1, Y+1, Z  ), fx-1.0f, fy-1.0f, fz      ))),
-                      lerp (v, lerp (u, grad (hash (X  , Y  , Z+1), fx     , fy     , fz-1.0f ),
-                                        grad (hash (X+1, Y  , Z+1), fx-1.0f, fy     , fz-1.0f )),
-                               lerp (u, grad (hash (X  , Y+1, Z+1), fx     , fy-1.0f, fz-1.0f ),
-                                        grad (hash (X+1, Y+1, Z+1), fx-1.0f, fy-1.0f, fz-1.0f ))));
+    // hash and evaluate the gradients of all the lattice corners at once
+    unsigned int bits[8];
+    hash.corners (bits, X, Y, Z);
+    T f[3] = { fx, fy, fz };
+    V g[8];
+    grad_corners<3> (g, bits, f);
+
+    result = lerp (w, lerp (v, lerp (u, g[0], g[1]),
+                               lerp (u, g[2], g[3])),
+                      lerp (v, lerp (u, g[4], g[5]),
+                               lerp (u, g[6], g[7])));
     result = scale3 (result);
 }
 
@@ -440,26 +686,65 @@ inline void perlin (V &result, const H &hash, const T &x, const T &y, const T &z
     T t = fade(fz);
     T s = fade(fw);
 
-    result = lerp (s, lerp (t, lerp (v, lerp (u, grad (hash (X  , Y  , Z  , W  ), fx     , fy     , fz     , fw     ),
-                                                 grad (hash (X+1, Y  , Z  , W  ), fx-1.0f, fy     , fz     , fw     )),
-                                        lerp (u, grad (hash (X  , Y+1, Z  , W  ), fx     , fy-1.0f, fz     , fw     ),
-                                                 grad (hash (X+1, Y+1, Z  , W  ), fx-1.0f, fy-1.0f, fz     , fw     ))),
-                               lerp (v, lerp (u, grad (hash (X  , Y  , Z+1, W  ), fx     , fy     , fz-1.0f, fw     ),
-                                                 grad (hash (X+1, Y  , Z+1, W  ), fx-1.0f, fy     , fz-1.0f, fw     )),
-                                        lerp (u, grad (hash (X  , Y+1, Z+1, W  ), fx     , fy-1.0f, fz-1.0f, fw     ),
-                                                 grad (hash (X+1, Y+1, Z+1, W  ), fx-1.0f, fy-1.0f, fz-1.0f, fw     )))),
-                      lerp (t, lerp (v, lerp (u, grad (hash (X  , Y  , Z  , W+1), fx     , fy     , fz     , fw-1.0f),
-                                                 grad (hash (X+1, Y  , Z  , W+1), fx-1.0f, fy     , fz     , fw-1.0f)),
-                                        lerp (u, grad (hash (X  , Y+1, Z  , W+1), fx     , fy-1.0f, fz     , fw-1.0f),
-                                                 grad (hash (X+1, Y+1, Z  , W+1), fx-1.0f, fy-1.0f, fz     , fw-1.0f))),
-                               lerp (v, lerp (u, grad (hash (X  , Y  , Z+1, W+1), fx     , fy     , fz-1.0f, fw-1.0f),
-                                                 grad (hash (X+1, Y  , Z+1, W+1), fx-1.0f, fy     , fz-1.0f, fw-1.0f)),
-                                        lerp (u, grad (hash (X  , Y+1, Z+1, W+1), fx     , fy-1.0f, fz-1.0f, fw-1.0f),
-                                                 grad (hash (X+1, Y+1, Z+1, W+1), fx-1.0f, fy-1.0f, fz-1.0f, fw-1.0f)))));
+    // hash and evaluate the gradients of all the lattice corners at once
+    unsigned int bits[16];
+    hash.corners (bits, X, Y, Z, W);
+    T f[4] = { fx, fy, fz, fw };
+    V g[16];
+    grad_corners<4> (g, bits, f);
+
+    result = lerp (s, lerp (t, lerp (v, lerp (u, g[ 0], g[ 1]),
+                                        lerp (u, g[ 2], g[ 3])),
+                               lerp (v, lerp (u, g[ 4], g[ 5]),
+                                        lerp (u, g[ 6], g[ 7]))),
+                      lerp (t, lerp (v, lerp (u, g[ 8], g[ 9]),
+                                        lerp (u, g[10], g[11])),
+                               lerp (v, lerp (u, g[12], g[13]),
+                                        lerp (u, g[14], g[15]))));
     result = scale4 (result);
 }
 
-struct HashScalar {
+/// Base of the lattice hashes used by perlin(), hashing all the corners
+/// of a cell with one call to inthash_corners.  Corner i of the cell is
+/// at (X + (i&1), Y + ((i>>1)&1), ...).  H may hide wrapx()..wrapw() to
+/// remap the lattice coordinates.
+template <typename H>
+struct LatticeHash {
+    int wrapx (int x) const { return x; }
+    int wrapy (int y) const { return y; }
+    int wrapz (int z) const { return z; }
+    int wrapw (int w) const { return w; }
+
+    void corners (unsigned int *result, int X) const {
+        const H &h (static_cast<const H &>(*this));
+        int lo[1] = { h.wrapx (X) };
+        int hi[1] = { h.wrapx (X+1) };
+        inthash_corners<1> (lo, hi, result);
+    }
+
+    void corners (unsigned int *result, int X, int Y) const {
+        const H &h (static_cast<const H &>(*this));
+        int lo[2] = { h.wrapx (X), h.wrapy (Y) };
+        int hi[2] = { h.wrapx (X+1), h.wrapy (Y+1) };
+        inthash_corners<2> (lo, hi, result);
+    }
+
+    void corners (unsigned int *result, int X, int Y, int Z) const {
+        const H &h (static_cast<const H &>(*this));
+        int lo[3] = { h.wrapx (X), h.wrapy (Y), h.wrapz (Z) };
+        int hi[3] = { h.wrapx (X+1), h.wrapy (Y+1), h.wrapz (Z+1) };
+        inthash_corners<3> (lo, hi, result);
+    }
+
+    void corners (unsigned int *result, int X, int Y, int Z, int W) const {
+        const H &h (static_cast<const H &>(*this));
+        int lo[4] = { h.wrapx (X), h.wrapy (Y), h.wrapz (Z), h.wrapw (W) };
+        int hi[4] = { h.wrapx (X+1), h.wrapy (Y+1), h.wrapz (Z+1), h.wrapw (W+1) };
+        inthash_corners<4> (lo, hi, result);
+    }
+};
+
+struct HashScalar : public LatticeHash<HashScalar> {
     int operator() (int x) const {
         unsigned int iv[1];
         iv[0] = x;
@@ -491,7 +776,7 @@ struct HashScalar {
     }
 };
 
-struct HashVector {
+struct HashVector : public LatticeHash<HashVector> {
     Vec3i operator() (int x) const {
         unsigned int iv[1];
         iv[0] = x;
@@ -535,7 +820,7 @@ struct HashVector {
     }
 };
 
-struct HashScalarPeriodic {
+struct HashScalarPeriodic : public LatticeHash<HashScalarPeriodic> {
     HashScalarPeriodic (float px) {
         m_px = quick_floor(px); if (m_px < 1) m_px = 1;
     }
@@ -557,6 +842,11 @@ struct HashScalarPeriodic {
 
     int m_px, m_py, m_pz, m_pw;
 
+    int wrapx (int x) const { return imod (x, m_px); }
+    int wrapy (int y) const { return imod (y, m_py); }
+    int wrapz (int z) const { return imod (z, m_pz); }
+    int wrapw (int w) const { return imod (w, m_pw); }
+
     int operator() (int x) const {
         unsigned int iv[1];
         iv[0] = imod (x, m_px);
@@ -588,7 +878,7 @@ struct HashScalarPeriodic {
     }
 };
 
-struct HashVectorPeriodic {
+struct HashVectorPeriodic : public LatticeHash<HashVectorPeriodic> {
     HashVectorPeriodic (float px) {
         m_px = quick_floor(px); if (m_px < 1) m_px = 1;
     }
@@ -610,6 +900,11 @@ struct HashVectorPeriodic {
 
     int m_px, m_py, m_pz, m_pw;
 
+    int wrapx (int x) const { return imod (x, m_px); }
+    int wrapy (int y) const { return imod (y, m_py); }
+    int wrapz (int z) const { return imod (z, m_pz); }
+    int wrapw (int w) const { return imod (w, m_pw); }
+
     Vec3i operator() (int x) const {
         unsigned int iv[1];
         iv[0] = imod (x, m_px);
@@ -1089,6 +1384,104 @@ struct PeriodicSNoise {
     }
 };
 
+
+
+/// Helpers for the batch noise entry points below, whose results and
+/// coordinates are laid out points across lanes: an array of BatchWidth
+/// floats for each component, all the x's, then the y's, then the z's.
+inline Vec3 batch_vec (const float *v, int lane) {
+    return Vec3 (v[lane], v[lane+BatchWidth], v[lane+2*BatchWidth]);
+}
+
+inline void batch_put (float *r, int lane, float val) { r[lane] = val; }
+
+inline void batch_put (float *r, int lane, const Vec3 &val) {
+    r[lane] = val.x;
+    r[lane+BatchWidth] = val.y;
+    r[lane+2*BatchWidth] = val.z;
+}
+
+template <typename Impl, typename R>
+inline void noise_batch_lanes (float *r, const float *x, int xcomps,
+                               const float *y) {
+    Impl impl;
+    R result;
+    if (xcomps == 1 && ! y) {
+        for (int i = 0;  i < BatchWidth;  ++i) {
+            impl (result, x[i]);
+            batch_put (r, i, result);
+        }
+    } else if (xcomps == 1) {
+        for (int i = 0;  i < BatchWidth;  ++i) {
+            impl (result, x[i], y[i]);
+            batch_put (r, i, result);
+        }
+    } else if (! y) {
+        for (int i = 0;  i < BatchWidth;  ++i) {
+            impl (result, batch_vec (x, i));
+            batch_put (r, i, result);
+        }
+    } else {
+        for (int i = 0;  i < BatchWidth;  ++i) {
+            impl (result, batch_vec (x, i), y[i]);
+            batch_put (r, i, result);
+        }
+    }
+}
+
+/// Evaluate BatchWidth noise lookups, one per lane: r (rcomps = 1 or 3
+/// components) = Impl (x (xcomps = 1 or 3 components), y), where the
+/// optional 2nd coordinate y is NULL if not used.  Each lane runs the
+/// same kernels as a single lookup, so the results are identical.
+template <typename Impl>
+inline void noise_batch (float *r, int rcomps, const float *x, int xcomps,
+                         const float *y) {
+    if (rcomps == 1)
+        noise_batch_lanes<Impl,float> (r, x, xcomps, y);
+    else
+        noise_batch_lanes<Impl,Vec3> (r, x, xcomps, y);
+}
+
+template <typename Impl, typename R>
+inline void pnoise_batch_lanes (float *r, const float *x, int xcomps,
+                                const float *y, const float *px,
+                                const float *py) {
+    Impl impl;
+    R result;
+    if (xcomps == 1 && ! y) {
+        for (int i = 0;  i < BatchWidth;  ++i) {
+            impl (result, x[i], px[i]);
+            batch_put (r, i, result);
+        }
+    } else if (xcomps == 1) {
+        for (int i = 0;  i < BatchWidth;  ++i) {
+            impl (result, x[i], y[i], px[i], py[i]);
+            batch_put (r, i, result);
+        }
+    } else if (! y) {
+        for (int i = 0;  i < BatchWidth;  ++i) {
+            impl (result, batch_vec (x, i), batch_vec (px, i));
+            batch_put (r, i, result);
+        }
+    } else {
+        for (int i = 0;  i < BatchWidth;  ++i) {
+            impl (result, batch_vec (x, i), y[i], batch_vec (px, i), py[i]);
+            batch_put (r, i, result);
+        }
+    }
+}
+
+/// Periodic version of noise_batch: px and py are the periods of x and
+/// y, laid out the same way.
+template <typename Impl>
+inline void pnoise_batch (float *r, int rcomps, const float *x, int xcomps,
+                          const float *y, const float *px, const float *py) {
+    if (rcomps == 1)
+        pnoise_batch_lanes<Impl,float> (r, x, xcomps, y, px, py);
+    else
+        pnoise_batch_lanes<Impl,Vec3> (r, x, xcomps, y, px, py);
+}
+
 } // anonymous namespace
 
 
@@ -171,6 +171,65 @@ osl_getmessage (ShaderGlobals *sg, const char *source_, const char *name_,
 
 
 
+// Slow paths of osl_setmessage_slot and osl_getmessage_slot (in
+// llvm_ops.cpp), with the same diagnostics as the MessageList versions.
+// Type mismatches can't happen here, since a name only gets a slot if
+// all of its uses in the group agree on the type.
+
+OSL_SHADEOP void
+osl_setmessage_slot_fail (ShaderGlobals *sg, MessageSlot *slot,
+                          const char *name_, const char *sourcefile_,
+                          int sourceline)
+{
+    const ustring &name (USTR(name_));
+    const ustring &sourcefile (USTR(sourcefile_));
+    const ustring &slotsourcefile (USTR(slot->sourcefile));
+    if (slot->status == 1)
+        sg->context->shadingsys().error(
+           "message \"%s\" already exists (created here: %s:%d)"
+           " cannot set again from %s:%d",
+           name.c_str(), slotsourcefile.c_str(), slot->sourceline,
+           sourcefile.c_str(), sourceline);
+    else
+        sg->context->shadingsys().error(
+           "message \"%s\" was queried before being set (queried here: %s:%d)"
+           " setting it now (%s:%d) would lead to inconsistent results",
+           name.c_str(), slotsourcefile.c_str(), slot->sourceline,
+           sourcefile.c_str(), sourceline);
+}
+
+
+
+OSL_SHADEOP int
+osl_getmessage_slot_miss (ShaderGlobals *sg, MessageSlot *slot,
+                          const char *name_, int layeridx,
+                          const char *sourcefile_, int sourceline)
+{
+    if (slot->status == 1) {
+        // found message, but was set by a layer deeper than the one querying the message
+        sg->context->shadingsys().error(
+            "message \"%s\" was set by layer #%d (%s:%d)"
+            " but is being queried by layer #%d (%s:%d)"
+            " - messages may only be transfered from nodes "
+            "that appear earlier in the shading network",
+            USTR(name_).c_str(), slot->layeridx,
+            USTR(slot->sourcefile).c_str(), slot->sourceline,
+            layeridx, USTR(sourcefile_).c_str(), sourceline);
+        return 0;
+    }
+    // Not set yet -- record the query (only the first one, as the
+    // MessageList does) so that a later setmessage is reported.
+    if (slot->status == 0 && sg->context->shadingsys().strict_messages()) {
+        slot->status = 2;
+        slot->layeridx = layeridx;
+        slot->sourcefile = sourcefile_;
+        slot->sourceline = sourceline;
+    }
+    return 0;
+}
+
+
+
 #if 0
 OSL_SHADEOP int
 osl_get_attribute (ShaderGlobals *sg,
@@ -377,4 +377,31 @@ PNOISE_IMPL_DERIV (pnoise, PeriodicNoise)
 PNOISE_IMPL (psnoise, PeriodicSNoise)
 PNOISE_IMPL_DERIV (psnoise, PeriodicSNoise)
 
+
+
+// Batch versions, for the batch code of groups: BatchWidth lookups at
+// once, points across lanes (see noise_batch and pnoise_batch).  y (and
+// py) are NULL for lookups without a 2nd coordinate.
+#define NOISE_BATCH_IMPL(opname,implname)                               \
+OSL_SHADEOP void osl_ ##opname## _batch (void *r, int rcomps, void *x,  \
+                                         int xcomps, void *y) {         \
+    noise_batch<implname> ((float *)r, rcomps, (const float *)x,        \
+                           xcomps, (const float *)y);                   \
+}
+
+#define PNOISE_BATCH_IMPL(opname,implname)                              \
+OSL_SHADEOP void osl_ ##opname## _batch (void *r, int rcomps, void *x,  \
+                                         int xcomps, void *y,           \
+                                         void *px, void *py) {          \
+    pnoise_batch<implname> ((float *)r, rcomps, (const float *)x,       \
+                            xcomps, (const float *)y,                   \
+                            (const float *)px, (const float *)py);      \
+}
+
+NOISE_BATCH_IMPL (cellnoise, CellNoise)
+NOISE_BATCH_IMPL (noise, Noise)
+NOISE_BATCH_IMPL (snoise, SNoise)
+PNOISE_BATCH_IMPL (pnoise, PeriodicNoise)
+PNOISE_BATCH_IMPL (psnoise, PeriodicSNoise)
+
 #endif
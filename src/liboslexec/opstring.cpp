@@ -41,15 +41,17 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <boost/regex.hpp>
 
 
-// Heavy lifting of OSL regex operations.
+// Heavy lifting of OSL regex operations.  If the pattern was a
+// constant, compiled is the regex that was found for it at JIT time.
 OSL_SHADEOP int
 osl_regex_impl2 (OSL::ShadingContext *ctx, ustring subject_,
                  int *results, int nresults, ustring pattern,
-                 int fullmatch)
+                 int fullmatch, const void *compiled)
 {
     const std::string &subject (subject_.string());
     boost::match_results<std::string::const_iterator> mresults;
-    const boost::regex &regex (ctx->find_regex (pattern));
+    const boost::regex &regex (compiled ? *(const boost::regex *)compiled
+                                        : ctx->find_regex (pattern));
     if (nresults > 0) {
         std::string::const_iterator start = subject.begin();
         int res = fullmatch ? boost::regex_match (subject, mresults, regex)
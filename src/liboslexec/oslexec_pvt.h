@@ -30,13 +30,21 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #define OSLEXEC_PVT_H
 
 #include <string>
+#include <cstring>
+#include <cstdlib>
+#include <new>
 #include <vector>
 #include <stack>
 #include <map>
 #include <list>
 #include <set>
+#include <deque>
 
 #include <boost/regex_fwd.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/function.hpp>
 
 #include "OpenImageIO/hash.h"
 #include "OpenImageIO/ustring.h"
@@ -83,6 +91,130 @@ namespace OSL_NAMESPACE {
 namespace OSL {
 
 
+/// Run-time profiling counters of one thread (see the "profile"
+/// attribute), indexed by the ids handed out by
+/// ShadingSystemImpl::profile_id.  Only the owning thread writes them,
+/// but getstats() reads them from any thread, so they live in fixed
+/// size pages that never move once allocated.  New pages are published
+/// while holding the same mutex that getstats() holds when reading.
+struct ProfileCounters
+{
+    struct Counter {
+        long long cycles;     ///< Total cycles spent
+        long long calls;      ///< Number of times it ran
+    };
+    enum { PageBits = 8, PageSize = 1 << PageBits, MaxPages = 1024,
+           MaxCounters = PageSize * MaxPages };
+
+    ProfileCounters (mutex &pagemutex) : m_pagemutex(pagemutex) {
+        memset (pages, 0, sizeof(pages));
+    }
+    ~ProfileCounters () {
+        for (int i = 0;  i < MaxPages;  ++i)
+            delete [] pages[i];
+    }
+
+    /// Charge one call taking the given number of cycles to counter id.
+    void add (int id, long long cycles) {
+        Counter *page = pages[id >> PageBits];
+        if (! page)
+            page = new_page (id >> PageBits);
+        Counter &c (page[id & (PageSize-1)]);
+        c.cycles += cycles;
+        c.calls += 1;
+    }
+
+    /// Return counter id, or NULL if this thread never touched its page.
+    /// The caller must hold the page mutex.
+    const Counter *get (int id) const {
+        const Counter *page = pages[id >> PageBits];
+        return page ? page + (id & (PageSize-1)) : NULL;
+    }
+
+private:
+    Counter *new_page (int pageindex) {
+        Counter *p = new Counter[PageSize];
+        memset (p, 0, PageSize * sizeof(Counter));
+        lock_guard lock (m_pagemutex);
+        pages[pageindex] = p;
+        return p;
+    }
+
+    Counter *pages[MaxPages];
+    mutex &m_pagemutex;       ///< Guards publishing of pages[] entries
+};
+
+
+
+/// The statistics that are bumped from many threads at once -- once per
+/// group compiled, or even per batch or getattribute call.  Each thread
+/// keeps its own, without atomics or locks, and ShadingSystemImpl::stats
+/// sums them when asked, so the total may trail the threads that are
+/// still busy.
+struct ShadingStats
+{
+    ShadingStats () { memset (this, 0, sizeof(ShadingStats)); }
+
+    /// Each thread's block is allocated on cache lines of its own, so
+    /// that threads bumping their own counts never share a line.
+    enum { CacheLineSize = 64 };
+    static void *operator new (size_t size) {
+        size_t lines = (size + CacheLineSize - 1) & ~(size_t)(CacheLineSize - 1);
+        char *mem = (char *) malloc (lines + CacheLineSize + sizeof(void *));
+        if (! mem)
+            throw std::bad_alloc ();
+        // Align past room to remember what malloc returned
+        char *p = (char *) (((size_t)mem + sizeof(void *) + CacheLineSize - 1)
+                            & ~(size_t)(CacheLineSize - 1));
+        ((void **)p)[-1] = mem;
+        return p;
+    }
+    static void operator delete (void *p) {
+        if (p)
+            free (((void **)p)[-1]);
+    }
+
+    /// Add other's counts into ours.
+    void merge (const ShadingStats &other);
+
+    int groups_compiled;              ///< Groups compiled
+    int instances_compiled;           ///< Instances compiled
+    int groups_deduped;               ///< Compiles avoided by dedup
+    long long dedup_code_saved;       ///< JIT code bytes dedup saved
+    double optimization_time;         ///< Time spent optimizing
+    double opt_locking_time;          ///<   locking time
+    double specialization_time;       ///<   runtime specialization time
+    double const_lookup_time;         ///<     constant lookup time
+    long long const_lookups;          ///<     constant lookups
+    double opt_fold_time;             ///<     constant folding passes
+    double opt_lifetime_time;         ///<     lifetime tracking
+    double opt_deps_time;             ///<     derivative dependencies
+    double opt_post_time;             ///<     post-opt cleanup
+    int opt_passes;                   ///<     folding passes
+    long long opt_ops_visited;        ///<     ops visited while folding
+    long long opt_ops_skipped;        ///<     clean ops skipped
+    double total_llvm_time;           ///<   total time spent on LLVM
+    double llvm_setup_time;           ///<     llvm setup time
+    double llvm_ops_parse_time;       ///<       parsing llvm_ops
+    double llvm_ops_clone_time;       ///<       cloning llvm_ops
+    double llvm_irgen_time;           ///<     llvm IR generation time
+    double llvm_opt_time;             ///<     llvm IR optimization time
+    double llvm_jit_time;             ///<     llvm JIT time
+    double jitcache_load_time;        ///< Time loading from the JIT cache
+    int tier2_groups;                 ///< Groups re-JITed at tier 2
+    int aot_groups_written;           ///< Groups compiled ahead of time
+    int aot_groups_registered;        ///< Precompiled groups registered
+    double aot_register_time;         ///< Time registering them
+    double tier2_time;                ///< Time spent on tier 2
+    long long getattribute_calls;     ///< Number of getattribute calls
+    double getattribute_time;         ///< Time spent in getattribute
+    double getattribute_fail_time;    ///<   ... on failed lookups
+    long long batches;                ///< execute_batch calls
+    long long batch_points;           ///< Points in all batches
+};
+
+
+
 struct PerThreadInfo
 {
     PerThreadInfo ();
@@ -92,6 +224,10 @@ struct PerThreadInfo
     std::stack<ShadingContext *> context_pool;
     llvm::LLVMContext *llvm_context;
     llvm::JITMemoryManager *llvm_jitmm;
+    llvm::Module *llvm_ops_module;   ///< Parsed llvm_ops, cloned per group
+    int llvm_ops_isa;                ///< Which llvm_ops build is parsed
+    ProfileCounters *profile;        ///< Run-time profile (owned by shadingsys)
+    ShadingStats *stats;             ///< Statistics (owned by shadingsys)
 };
 
 
@@ -103,6 +239,7 @@ class ShadingSystemImpl;
 class ShaderInstance;
 typedef shared_ptr<ShaderInstance> ShaderInstanceRef;
 class Dictionary;
+class DictionaryCache;
 class RuntimeOptimizer;
 
 
@@ -110,6 +247,26 @@ class RuntimeOptimizer;
 /// group.
 typedef void (*RunLLVMGroupFunc)(void* /* shader globals */, void*); 
 
+/// Signature of the function that LLVM generates to run the shader group
+/// on BatchWidth points of a ShaderGlobalsBatch at once, starting with
+/// point 'first', whose group data are heap_point_size bytes apart
+/// starting at 'heap'.  Bit i of lanemask is set if point first+i is to
+/// be shaded.
+typedef void (*RunLLVMBatchFunc)(void* /* ShaderGlobalsBatch */,
+                                 void* /* heap */, int /* heap_point_size */,
+                                 int /* first */, int /* lanemask */);
+
+/// How many points the code made for RunLLVMBatchFunc shades at once
+/// (as vectors of this many floats or ints).
+enum { BatchWidth = 8 };
+
+/// What a run-time profiling counter measures.
+enum ProfileKind {
+    ProfileGroup,        ///< Whole group executions (inclusive)
+    ProfileLayer,        ///< A layer, not counting the layers it calls
+    ProfileOp            ///< One expensive op (texture, noise, trace, ...)
+};
+
 /// Signature of a constant-folding method
 typedef int (*OpFolder) (RuntimeOptimizer &rop, int opnum);
 
@@ -119,13 +276,15 @@ typedef bool (*OpLLVMGen) (RuntimeOptimizer &rop, int opnum);
 struct OpDescriptor {
     ustring name;           // name of op
     OpLLVMGen llvmgen;      // llvm-generating routine
+    OpLLVMGen llvmgen_batch; // same, for BatchWidth points at once (or NULL)
     OpFolder folder;        // constant-folding routine
     bool simple_assign;     // wholy overwites arg0, no other writes,
                             //     no side effects
-    OpDescriptor () { }
+    OpDescriptor () : llvmgen_batch(NULL) { }
     OpDescriptor (const char *n, OpLLVMGen ll, OpFolder f=NULL,
                   bool simple=false)
-        : name(n), llvmgen(ll), folder(f), simple_assign(simple)
+        : name(n), llvmgen(ll), llvmgen_batch(NULL), folder(f),
+          simple_assign(simple)
     {}
 };
 
@@ -247,6 +406,19 @@ inline void stlfree (T &v)
 }
 
 
+/// 64 bit FNV-1a hash of a block of memory.  Unlike ustring hashes,
+/// this is stable from run to run, so it's suitable for on-disk keys.
+inline unsigned long long
+fnv1a_hash (const void *data, size_t size,
+            unsigned long long h = 14695981039346656037ULL)
+{
+    const unsigned char *c = (const unsigned char *)data;
+    for (size_t i = 0;  i < size;  ++i)
+        h = (h ^ c[i]) * 1099511628211ULL;
+    return h;
+}
+
+
 
 
 /// ShaderMaster is the full internal representation of a complete
@@ -283,11 +455,26 @@ public:
     ///
     const std::string &shadername () const { return m_shadername; }
 
+    /// Return a hash (as a string) of the contents of the oso file
+    /// that this master was read from, so that anything keyed on it
+    /// (such as the on-disk JIT cache) notices when the oso changes.
+    /// It's only taken while loading if there's a JIT cache; otherwise
+    /// this is empty.
+    const std::string &osohash () const { return m_osohash; }
+
+    /// Read the oso file as it is on disk now and return the hash of
+    /// its contents, for when osohash() wasn't taken while loading.
+    std::string hash_oso_file () const;
+
+    /// Return the hash string osohash() uses for the given file contents.
+    static std::string hash_contents (const char *data, size_t size);
+
 private:
     ShadingSystemImpl &m_shadingsys;    ///< Back-ptr to the shading system
     ShaderType m_shadertype;            ///< Type of shader
     std::string m_shadername;           ///< Shader name
     std::string m_osofilename;          ///< Full path of oso file
+    std::string m_osohash;              ///< Hash of the oso file contents
     OpcodeVec m_ops;                    ///< Actual code instructions
     std::vector<int> m_args;            ///< Arguments for all the ops
     // Need the code offsets for each code block
@@ -506,6 +693,65 @@ private:
 
 
 
+/// In "paramagnostic" mode, should the value of this (not yet
+/// optimized) parameter be supplied at run time, from its group's
+/// parameter block, rather than compiled into the code?  These are the
+/// geometry-locked input params whose values the optimizer would
+/// otherwise turn into constants.
+inline bool
+param_value_is_agnostic (const Symbol &s)
+{
+    return s.symtype() == SymTypeParam && s.lockgeom() &&
+        ! s.typespec().is_structure() && ! s.typespec().is_closure_based() &&
+        (s.valuesource() == Symbol::InstanceVal ||
+         (s.valuesource() == Symbol::DefaultVal && ! s.has_init_ops()));
+}
+
+
+
+/// The results of compiling a ShaderGroup -- everything needed to run
+/// it.  Groups found to be identical share one of these (see
+/// ShadingSystemImpl::optimize_group), so a tier 2 re-JIT of one of
+/// them upgrades them all.
+struct CompiledGroup {
+    CompiledGroup ()
+        : llvm_compiled_version(NULL), llvm_batch_version(NULL),
+          llvm_groupdata_size(0),
+          llvm_code_size(0), does_nothing(false), llvm_tier2_pending(false)
+    {
+        llvm_tier2_requested = 0;
+    }
+
+    /// Where in the group data each parameter supplied at run time (in
+    /// "paramagnostic" mode) lives.
+    struct ParamBlockEntry {
+        int layer;                     ///< Layer of the param
+        ustring name;                  ///< Name of the param
+        int offset;                    ///< Offset in the group data
+        int size;                      ///< Size of its value (no derivs)
+        ParamBlockEntry (int l, ustring n, int o, int s)
+            : layer(l), name(n), offset(o), size(s) { }
+    };
+
+    RunLLVMGroupFunc volatile llvm_compiled_version;
+    RunLLVMBatchFunc llvm_batch_version; ///< Batch code (NULL if none)
+    size_t llvm_groupdata_size;
+    std::vector<ParamBlockEntry> param_block_layout;
+    size_t llvm_code_size;             ///< Bytes of JITed machine code
+    bool does_nothing;                 ///< Is the group just func() { return; }
+    std::vector<void *> llvm_reloc_slots;  ///< Relocated pointers
+    std::list<std::vector<char> > llvm_reloc_data; ///< Relocated data
+    std::string llvm_tier2_bitcode;    ///< Tier 1 IR, awaiting tier 2
+    std::string llvm_tier2_entry;      ///< Entry point name in that IR
+    volatile bool llvm_tier2_pending;  ///< Tier 2 compile still to do?
+    atomic_int llvm_tier2_requested;   ///< Has tier 2 been asked for?
+    mutex tier2_mutex;                 ///< Serializes the tier 2 re-JIT
+};
+
+typedef shared_ptr<CompiledGroup> CompiledGroupRef;
+
+
+
 /// A ShaderGroup consists of one or more layers (each of which is a
 /// ShaderInstance), and the connections among them.
 class ShaderGroup {
@@ -516,13 +762,21 @@ public:
 
     /// Clear the layers
     ///
-    void clear () { m_layers.clear ();  m_optimized = 0;  m_executions = 0; }
+    void clear () {
+        m_layers.clear ();  m_optimized = 0;  m_executions = 0;
+        m_hot_runs = 0;
+        m_compiled.reset (new CompiledGroup);
+        m_fingerprint[0].clear ();
+        m_fingerprint[1].clear ();
+    }
 
     /// Append a new shader instance on to the end of this group
     ///
     void append (ShaderInstanceRef newlayer) {
         ASSERT (! m_optimized && "should not append to optimized group");
         m_layers.push_back (newlayer);
+        m_fingerprint[0].clear ();
+        m_fingerprint[1].clear ();
     }
 
     /// How many layers are in this group?
@@ -536,22 +790,81 @@ public:
     int optimized () const { return m_optimized; }
     void optimized (int opt) { m_optimized = opt; }
 
-    size_t llvm_groupdata_size () const { return m_llvm_groupdata_size; }
-    void llvm_groupdata_size (size_t size) { m_llvm_groupdata_size = size; }
+    /// Compute (and remember) the string that identifies the group's
+    /// layers, parameter values, and connections: two groups with the
+    /// same fingerprint will compile to the same code.  If paramagnostic
+    /// is true, leave out the values of the params that will be
+    /// supplied at run time (see param_value_is_agnostic).  The two
+    /// flavors are cached separately, since "paramagnostic" may change
+    /// between declaring the group and compiling it.  Masters are named
+    /// by address, so this is only good within one ShadingSystem.
+    const std::string &fingerprint (bool paramagnostic=false);
+
+    /// Write the same description as fingerprint() to out, without
+    /// caching it.  If osohash is true, name each layer's master by the
+    /// hash of its oso contents rather than by address, so that the
+    /// result stays valid from one process to the next.
+    void write_fingerprint (std::ostream &out, bool paramagnostic,
+                            bool osohash) const;
+
+    /// Make this (not yet optimized) group share the layers and
+    /// compiled code of the identical, already optimized group g.
+    void share_compiled (const ShaderGroup &g) {
+        m_compiled = g.m_compiled;
+        build_param_block ();   // while we still have our own values
+        m_layers = g.m_layers;
+    }
+
+    /// Description of the parameter block the compiled code expects.
+    std::vector<CompiledGroup::ParamBlockEntry> &param_block_layout () {
+        return m_compiled->param_block_layout;
+    }
+
+    /// Gather this group's values of the params in param_block_layout()
+    /// into its parameter block.
+    void build_param_block ();
+
+    /// Copy the parameter block into group data about to be run.
+    void init_params (char *groupdata) const {
+        const std::vector<CompiledGroup::ParamBlockEntry> &layout (m_compiled->param_block_layout);
+        const char *val = m_param_block.size() ? &m_param_block[0] : NULL;
+        for (size_t i = 0, e = layout.size();  i < e;  ++i) {
+            memcpy (groupdata + layout[i].offset, val, layout[i].size);
+            val += layout[i].size;
+        }
+    }
+
+    size_t llvm_groupdata_size () const { return m_compiled->llvm_groupdata_size; }
+    void llvm_groupdata_size (size_t size) { m_compiled->llvm_groupdata_size = size; }
 
+    /// N.B. With tiered JIT, the compiled version may be swapped for a
+    /// better one while other threads are running the old one.
     RunLLVMGroupFunc llvm_compiled_version() const {
-        return m_llvm_compiled_version;
+        return m_compiled->llvm_compiled_version;
     }
     void llvm_compiled_version (RunLLVMGroupFunc func) {
-        m_llvm_compiled_version = func;
+        m_compiled->llvm_compiled_version = func;
     }
 
+    /// The version of the group that shades BatchWidth points at once,
+    /// or NULL if it uses ops that can't be done that way.
+    RunLLVMBatchFunc llvm_batch_version() const {
+        return m_compiled->llvm_batch_version;
+    }
+    void llvm_batch_version (RunLLVMBatchFunc func) {
+        m_compiled->llvm_batch_version = func;
+    }
+
+    /// Size of the group's JITed machine code, in bytes.
+    size_t llvm_code_size () const { return m_compiled->llvm_code_size; }
+    void llvm_code_size (size_t size) { m_compiled->llvm_code_size = size; }
+
     /// Is this shader group equivalent to ret void?
     bool does_nothing() const {
-        return m_does_nothing;
+        return m_compiled->does_nothing;
     }
     void does_nothing(bool new_val) {
-        m_does_nothing = new_val;
+        m_compiled->does_nothing = new_val;
     }
 
     long long int executions () const { return m_executions; }
@@ -562,17 +875,59 @@ public:
 #endif
     }
 
+    /// Credit the group with n more executions toward the "tieredjit"
+    /// threshold, and return its new total.  The shading contexts only
+    /// call this for a sample of their executions, so that threads
+    /// running the same group aren't all writing its counter.
+    long long int count_hot_runs (int n) { return m_hot_runs += n; }
+
+    /// Bitcode of the group's quickly compiled (tier 1) layer functions,
+    /// kept so that the group can be re-JITed with full optimization if
+    /// it turns out to be hot, and the name of its entry point.
+    const std::string &llvm_tier2_bitcode () const { return m_compiled->llvm_tier2_bitcode; }
+    const std::string &llvm_tier2_entry () const { return m_compiled->llvm_tier2_entry; }
+    void llvm_tier2 (const std::string &bitcode, const std::string &entry) {
+        m_compiled->llvm_tier2_bitcode = bitcode;
+        m_compiled->llvm_tier2_entry = entry;
+        m_compiled->llvm_tier2_pending = ! bitcode.empty();
+    }
+
+    /// Is there still a tier 2 compile to do for this group?
+    bool llvm_tier2_pending () const { return m_compiled->llvm_tier2_pending; }
+
+    /// Claim the (one) request to re-JIT the group at tier 2, returning
+    /// true only for the first caller.
+    bool request_llvm_tier2 () {
+        return m_compiled->llvm_tier2_requested.bool_compare_and_swap (0, 1);
+    }
+    bool llvm_tier2_requested () const { return m_compiled->llvm_tier2_requested != 0; }
+
+    /// Lock that must be held to re-JIT the group at tier 2.  It lives
+    /// with the compiled code, which identical groups share, so that
+    /// only one of them does it.
+    mutex &llvm_tier2_mutex () { return m_compiled->tier2_mutex; }
+
     void name (ustring name) { m_name = name; }
     ustring name () const { return m_name; }
 
+    /// Slots holding the process-specific pointers (strings, renderer,
+    /// closure callbacks) that relocatable JIT code loads at run time
+    /// instead of embedding them as constants.
+    std::vector<void *> &llvm_reloc_slots () { return m_compiled->llvm_reloc_slots; }
+
+    /// Storage for any data the relocation slots point to.
+    std::list<std::vector<char> > &llvm_reloc_data () { return m_compiled->llvm_reloc_data; }
+
 private:
     ustring m_name;
     std::vector<ShaderInstanceRef> m_layers;
-    RunLLVMGroupFunc m_llvm_compiled_version;
-    size_t m_llvm_groupdata_size;
+    CompiledGroupRef m_compiled;     ///< Compiled code (maybe shared)
+    std::string m_fingerprint[2];    ///< Identifies identical groups,
+                                     ///<   without/with paramagnostic
+    std::vector<char> m_param_block; ///< Values of run-time params
     volatile int m_optimized;        ///< Is it already optimized?
-    bool m_does_nothing;             ///< Is the shading group just func() { return; }
     atomic_ll m_executions;          ///< Number of times the group executed
+    atomic_ll m_hot_runs;            ///< Sampled executions, for tiered JIT
     mutex m_mutex;                   ///< Thread-safe optimization
     friend class ShadingSystemImpl;
 };
@@ -614,6 +969,9 @@ public:
 
     bool empty () const { return m_closure_table.empty(); }
 
+    /// Number of entries in the table (valid ids are 0..size()-1).
+    int size () const { return (int) m_closure_table.size(); }
+
 private:
 
 
@@ -672,6 +1030,15 @@ public:
     void message (const std::string &message);
 
     virtual std::string getstats (int level=1) const;
+    virtual std::string getstats_json () const;
+
+    /// Return the statistics of the thread that owns threadinfo (the
+    /// calling thread if NULL), making them the first time.
+    ShadingStats &thread_stats (PerThreadInfo *threadinfo=NULL);
+
+    /// Return the per-thread statistics summed over all threads.
+    ///
+    ShadingStats stats () const;
 
     ErrorHandler &errhandler () const { return *m_err; }
 
@@ -688,8 +1055,18 @@ public:
     virtual bool execute (ShadingContext &ctx, ShadingAttribState &sas,
                           ShaderGlobals &ssg, bool run=true);
 
+    virtual bool execute_batch (ShadingContext &ctx, ShadingAttribState &sas,
+                                ShaderGlobals *ssg, int npoints,
+                                const unsigned char *runflags=NULL,
+                                bool run=true);
+
+    virtual bool execute_batch (ShadingContext &ctx, ShadingAttribState &sas,
+                                ShaderGlobalsBatch &sgb, int npoints,
+                                const unsigned char *runflags=NULL,
+                                bool run=true);
+
     virtual const void* get_symbol (ShadingContext &ctx, ustring name,
-                                    TypeDesc &type);
+                                    TypeDesc &type, int point=0);
 
     void operator delete (void *todel) { ::delete ((char *)todel); }
 
@@ -714,6 +1091,13 @@ public:
     bool unknown_coordsys_error() const { return m_unknown_coordsys_error; }
     int optimize () const { return m_optimize; }
     int llvm_debug () const { return m_llvm_debug; }
+    ustring jitcache () const { return m_jitcache; }
+    /// Perf map level to use: the "llvm_perfmap" attribute, or 0 if the
+    /// perf map turned out not to be writable.
+    int llvm_perfmap () const {
+        return m_perfmap_unavailable ? 0 : m_llvm_perfmap;
+    }
+    int profile () const { return m_profile; }
 
     ustring commonspace_synonym () const { return m_commonspace_synonym; }
 
@@ -722,6 +1106,9 @@ public:
     /// (at least the ones that can't be overridden by the geometry).
     void optimize_group (ShadingAttribState &attribstate, ShaderGroup &group);
 
+    /// Add the timings and counts of a group's optimization to stats.
+    void add_optimizer_stats (ShadingStats &stats, const RuntimeOptimizer &rop);
+
     int *alloc_int_constants (size_t n) { return m_int_pool.alloc (n); }
     float *alloc_float_constants (size_t n) { return m_float_pool.alloc (n); }
     ustring *alloc_string_constants (size_t n) { return m_string_pool.alloc (n); }
@@ -735,6 +1122,10 @@ public:
         return m_closure_registry.get_entry(id);
     }
 
+    virtual int flatten_closure (const ClosureColor *closure,
+                                 FlatClosureComponent *comps,
+                                 int maxcomps) const;
+
     /// Convert a color in the named space to RGB.
     ///
     Color3 to_rgb (ustring fromspace, float a, float b, float c);
@@ -760,6 +1151,81 @@ public:
 
     virtual void optimize_all_groups (int nthreads=0);
 
+    virtual bool write_compiled_group (ShadingAttribState &sas,
+                                       const char *filename);
+    virtual bool register_compiled_group (ShadingAttribState &sas,
+                                          const char *filename);
+
+    /// Hand a newly declared group to the greedy JIT workers, starting
+    /// them if necessary.
+    void submit_group_to_compile (ShadingAttribStateRef &sas);
+    /// Hand the group most recently returned by state(), if any, to
+    /// the greedy JIT workers.  It's held back until the next group is
+    /// begun (or optimize_all_groups is called), so that the caller can
+    /// still register_compiled_group it.
+    void submit_declared_group ();
+    /// Launch the persistent JIT worker threads if they aren't running.
+    void start_compile_threads (int nthreads);
+    /// Stop and join the JIT worker threads, dropping any queued groups.
+    void stop_compile_threads ();
+    /// Main loop of JIT worker thread number id.
+    void compile_worker (int id);
+    /// Grab the next group to compile, preferring queue `id' and
+    /// stealing from the others when it's empty (id < 0 means the
+    /// caller owns no queue and just steals).  Return false if there is
+    /// nothing left.
+    bool next_group_to_compile (int id, ShadingAttribStateRef &sas);
+    /// Optimize/JIT one group pulled from the compile queues.
+    void compile_queued_group (ShadingAttribStateRef &sas);
+
+    /// A piece of some group's optimization that any idle JIT worker
+    /// may pick up (see RuntimeOptimizer::parallel_layers).
+    typedef boost::function<void()> CompileTask;
+    /// Offer a task to the JIT workers, which take these before
+    /// starting on another group.
+    void submit_compile_task (const CompileTask &task);
+    /// Run one offered task, if there are any; return false if not.
+    bool run_compile_task ();
+    /// Return how many JIT workers are running (without starting any).
+    int compile_threads ();
+
+    /// Called by execute() for groups that have run at least "tieredjit"
+    /// times: queue the group (just once) to be re-JITed at full
+    /// optimization by the background JIT threads.
+    void request_tier2 (ShadingAttribState &sas, ShaderGroup &group);
+
+    /// Re-JIT a hot group at full optimization (tier 2).
+    void reoptimize_group (ShadingAttribState &sas, ShaderGroup &group);
+
+    /// Return a reference to the compiled regular expression for the
+    /// given pattern, compiling it the first time anybody asks.  The
+    /// regex lives as long as the ShadingSystem, and may be used by
+    /// many threads at once.
+    const boost::regex & find_regex (ustring r);
+
+    /// Append a symbol for JITed code to /tmp/perf-<pid>.map, so that
+    /// perf and friends can name it.  The file is created by the first
+    /// call.  Thread-safe.
+    void perfmap_write (const void *addr, size_t size, const std::string &name);
+
+    /// Return the id of the run-time profiling counter for the named
+    /// group, layer or op, making a new one if needed.  Return -1 if
+    /// there's no room for any more counters.  Thread-safe.
+    int profile_id (ProfileKind kind, const std::string &name);
+
+    /// Return the run-time profiling counters of the thread that owns
+    /// threadinfo, making them the first time.
+    ProfileCounters *thread_profile (PerThreadInfo *threadinfo);
+
+    /// Dictionary queries on the dictionaries shared by all contexts
+    /// (and by the optimizer, when the arguments are constants).  Node
+    /// IDs are the same for everybody.  These are thread-safe, but
+    /// lock; contexts keep their own caches in front of them.
+    int dict_find (ustring dictionaryname, ustring query);
+    int dict_find (int nodeID, ustring query);
+    int dict_next (int nodeID);
+    int dict_value (int nodeID, ustring attribname, TypeDesc type, void *data);
+
 #ifdef OIIO_HAVE_BOOST_UNORDERED_MAP
     typedef boost::unordered_map<ustring,OpDescriptor,ustringHash> OpDescriptorMap;
 #else
@@ -809,6 +1275,11 @@ private:
 
     void setup_op_descriptors ();
 
+    /// Return the shared dictionaries, creating them if necessary.
+    Dictionary *dictionary ();
+
+    void free_dict_resources ();
+
     RendererServices *m_renderer;         ///< Renderer services
     TextureSystem *m_texturesys;          ///< Texture system
 
@@ -817,8 +1288,21 @@ private:
     static const int m_errseenmax = 32;
     mutable mutex m_errmutex;
 
-    typedef std::map<ustring,ShaderMaster::ref> ShaderNameMap;
+    /// One entry of the master map.  The entry is inserted as soon as
+    /// a thread starts to load the shader (with ready == false) so that
+    /// other threads requesting the same name wait for that load
+    /// instead of reading the file again; the file search and parse
+    /// happen without holding any lock.
+    struct ShaderMasterEntry {
+        ShaderMaster::ref master;         ///< The master (NULL if failed)
+        bool ready;                       ///< Done loading?
+        ShaderMasterEntry () : ready(false) { }
+    };
+    typedef shared_ptr<ShaderMasterEntry> ShaderMasterEntryRef;
+    typedef std::map<ustring,ShaderMasterEntryRef> ShaderNameMap;
     ShaderNameMap m_shader_masters;       ///< name -> shader masters map
+    boost::mutex m_shader_masters_mutex;  ///< Guards m_shader_masters
+    boost::condition_variable m_shader_masters_cond; ///< Signals a load
 
     ConstantPool<int> m_int_pool;
     ConstantPool<Float> m_float_pool;
@@ -839,8 +1323,20 @@ private:
     bool m_range_checking;                ///< Range check arrays & components?
     bool m_unknown_coordsys_error;        ///< Error to use unknown xform name?
     bool m_greedyjit;                     ///< JIT as much as we can?
+    int m_jitthreads;                     ///< Greedy JIT threads (0 = all)
+    int m_tieredjit;                      ///< Executions before tier 2 JIT
+    bool m_dedupgroups;                   ///< Share code of identical groups?
+    bool m_paramagnostic;                 ///< Don't fold param values?
+    bool m_messageslots;                  ///< Const-named messages in groupdata?
+    bool m_batchjit;                      ///< Also JIT batch (SIMD) code?
     int m_optimize;                       ///< Runtime optimization level
+    int m_optimize_threads;               ///< Threads per big group (0 = running JIT workers)
     int m_llvm_debug;                     ///< More LLVM debugging output
+    int m_llvm_perfmap;                   ///< Perf map: 1=functions, 2=lines
+    int m_profile;                        ///< Profile: 1=layers, 2=ops too
+    ustring m_llvm_cpu;                   ///< JIT target CPU ("host" = ours)
+    ustring m_llvm_features;              ///< Extra JIT target features
+    atomic_int m_llvm_cpu_clamped;        ///< Warned the host can't do it?
     ustring m_debug_groupname;            ///< Name of sole group to debug
     ustring m_debug_layername;            ///< Name of sole layer to debug
     ustring m_only_groupname;             ///< Name of sole group to compile
@@ -849,6 +1345,7 @@ private:
     ustring m_commonspace_synonym;        ///< Synonym for "common" space
     std::vector<ustring> m_raytypes;      ///< Names of ray types
     ustring m_colorspace;                 ///< What RGB colors mean
+    ustring m_jitcache;                   ///< Dir of on-disk JIT cache
 
     // Derived/cached calculations from options:
     Color3 m_Red, m_Green, m_Blue;        ///< Color primaries (xyY)
@@ -870,30 +1367,30 @@ private:
     // Stats
     atomic_int m_stat_shaders_loaded;     ///< Stat: shaders loaded
     atomic_int m_stat_shaders_requested;  ///< Stat: shaders requested
+    atomic_int m_stat_shaders_load_waits; ///< Stat: waited on another load
+    atomic_int m_stat_message_slots;      ///< Stat: messages given slots
+    atomic_int m_stat_groups_parallel_opt; ///< Stat: groups optimized in parallel
     PeakCounter<int> m_stat_instances;    ///< Stat: instances
     PeakCounter<int> m_stat_contexts;     ///< Stat: shading contexts
     int m_stat_groups;                    ///< Stat: shading groups
     int m_stat_groupinstances;            ///< Stat: total inst in all groups
-    atomic_int m_stat_instances_compiled; ///< Stat: instances compiled
-    atomic_int m_stat_groups_compiled;    ///< Stat: groups compiled
     atomic_int m_stat_empty_instances;    ///< Stat: shaders empty after opt
     atomic_int m_stat_empty_groups;       ///< Stat: groups empty after opt
+    atomic_int m_stat_groups_batch;       ///< Stat: groups with batch code
+    atomic_int m_stat_agnostic_params;    ///< Stat: params left unfolded
+    atomic_ll m_stat_llvm_code_bytes;     ///< Stat: total JIT code bytes
     atomic_int m_stat_regexes;            ///< Stat: how many regex's compiled
     atomic_int m_stat_preopt_syms;        ///< Stat: pre-optimization symbols
     atomic_int m_stat_postopt_syms;       ///< Stat: post-optimization symbols
     atomic_int m_stat_preopt_ops;         ///< Stat: pre-optimization ops
     atomic_int m_stat_postopt_ops;        ///< Stat: post-optimization ops
-    double m_stat_optimization_time;      ///< Stat: time spent optimizing
-    double m_stat_opt_locking_time;       ///<   locking time
-    double m_stat_specialization_time;    ///<   runtime specialization time
-    double m_stat_total_llvm_time;        ///<   total time spent on LLVM
-    double m_stat_llvm_setup_time;        ///<     llvm setup time
-    double m_stat_llvm_irgen_time;        ///<     llvm IR generation time
-    double m_stat_llvm_opt_time;          ///<     llvm IR optimization time
-    double m_stat_llvm_jit_time;          ///<     llvm JIT time 
-    double m_stat_getattribute_time;      ///< Stat: time spent in getattribute
-    double m_stat_getattribute_fail_time; ///< Stat: time spent in getattribute
-    atomic_ll m_stat_getattribute_calls;  ///< Stat: Number of getattribute
+    atomic_int m_stat_llvm_ops_parses;    ///<       times llvm_ops parsed
+    atomic_int m_stat_jitcache_hits;      ///< Stat: groups loaded from cache
+    atomic_int m_stat_jitcache_misses;    ///< Stat: groups not in cache
+    atomic_int m_stat_jitcache_writes;    ///< Stat: groups written to cache
+    atomic_int m_stat_jitcache_uncacheable; ///< Stat: groups not cacheable
+    atomic_ll m_stat_jitcache_bytes_read; ///< Stat: bytes read from cache
+    atomic_ll m_stat_jitcache_bytes_written; ///< Stat: bytes written to cache
 
     PeakCounter<off_t> m_stat_memory;     ///< Stat: all shading system memory
 
@@ -909,11 +1406,73 @@ private:
     PeakCounter<off_t> m_stat_mem_inst_connections;
 
     spin_mutex m_stat_mutex;              ///< Mutex for non-atomic stats
+    std::vector<ShadingStats *> m_thread_stats; ///< All threads' stats
+    mutable spin_mutex m_thread_stats_mutex; ///< Guards m_thread_stats
     ClosureRegistry m_closure_registry;
-    std::vector<ShadingAttribStateRef> m_groups_to_compile;
-    atomic_int m_groups_to_compile_count;
-    atomic_int m_threads_currently_compiling;
-    spin_mutex m_groups_to_compile_mutex;
+
+    // Registry of compiled groups, by hash of their fingerprint, so that
+    // identical groups can share one compile (the group itself holds
+    // the full fingerprint to check against).  We don't keep the groups
+    // alive; once the first of a kind is gone, the next one to be
+    // optimized takes its place, and entries for dead groups are swept
+    // out whenever the registry has doubled in size since the last time.
+    struct GroupRegistryEntry {
+        boost::weak_ptr<ShadingAttribState> sas;
+        ShaderGroup *group;
+        bool paramagnostic;               ///< Flavor of group's fingerprint
+        GroupRegistryEntry () : group(NULL), paramagnostic(false) { }
+    };
+    typedef std::map<unsigned long long,GroupRegistryEntry> GroupRegistry;
+    GroupRegistry m_group_registry;
+    size_t m_group_registry_sweep;        ///< Size at which to next sweep
+    spin_mutex m_group_registry_mutex;
+
+    // Greedy JIT scheduler.  Each worker owns a deque of groups waiting
+    // to be compiled; it pops its own work from the back (most recently
+    // declared groups first) and, when it runs dry, steals from the
+    // front of the other workers' deques.
+    struct CompileQueue {
+        spin_mutex mutex;
+        std::deque<ShadingAttribStateRef> groups;
+    };
+    std::vector<shared_ptr<CompileQueue> > m_compile_queues;
+    boost::thread_group m_compile_threads; ///< Persistent JIT workers
+    boost::mutex m_compile_mutex;         ///< Guards worker sleep/wake
+    boost::condition_variable m_compile_cond; ///< Signals new work/done
+    std::deque<CompileTask> m_compile_tasks; ///< Offered parts of groups
+    spin_mutex m_compile_tasks_mutex;     ///< Guards m_compile_tasks
+    atomic_int m_compile_queued;          ///< Groups and tasks queued
+    atomic_int m_compile_pending;         ///< Queued + being compiled
+    atomic_int m_compile_next_queue;      ///< Round-robin submission
+    bool m_compile_shutdown;              ///< Tell workers to exit
+    ShadingAttribStateRef m_declared_group; ///< Newest group, held back
+                                          ///<   from the workers
+    spin_mutex m_declared_group_mutex;    ///< Guards m_declared_group
+    atomic_ll m_stat_jit_steals;          ///< Stat: groups stolen by workers
+
+    Dictionary *m_dictionary;             ///< Dictionaries shared by all
+    spin_mutex m_dictionary_mutex;        ///< Guards m_dictionary creation
+
+#ifdef OIIO_HAVE_BOOST_UNORDERED_MAP
+    typedef boost::unordered_map<ustring, boost::regex*, ustringHash> RegexMap;
+#else
+    typedef hash_map<ustring, boost::regex*, ustringHash> RegexMap;
+#endif
+    RegexMap m_regex_map;                 ///< Compiled regex's
+    mutex m_regex_mutex;                  ///< Guards m_regex_map
+
+    FILE *m_perfmap_file;                 ///< /tmp/perf-<pid>.map, if open
+    mutex m_perfmap_mutex;                ///< Guards m_perfmap_file
+    atomic_int m_perfmap_unavailable;     ///< Couldn't open it, stop trying
+
+    struct ProfileEntry {
+        ProfileKind kind;
+        std::string name;
+    };
+    std::vector<ProfileEntry> m_profile_entries; ///< Profile id -> what
+    std::map<std::string,int> m_profile_ids;  ///< Find existing ids
+    std::vector<ProfileCounters *> m_profile_counters; ///< All threads'
+    mutable mutex m_profile_mutex;        ///< Guards the above
 
     // LLVM stuff
     spin_mutex m_llvm_mutex;
@@ -983,6 +1542,24 @@ struct Message {
     Message* next;          ///< linked list of messages (managed by MessageList below)
 };
 
+/// Header of a message slot in the group data.  When every message in a
+/// group is named by a constant, the RuntimeOptimizer gives each name a
+/// fixed slot (this header followed by the value) and setmessage and
+/// getmessage become direct stores and loads rather than MessageList
+/// searches.  The slots are zeroed (status 0, unset) on group entry.
+struct MessageSlot {
+    int status;             ///< 0 = unset, 1 = set, 2 = queried before set
+    int layeridx;           ///< layer that set (or first queried) it
+    const char *sourcefile; ///< where it was set or queried (a ustring)
+    int sourceline;         ///< line where it was set or queried
+
+    /// Size of the header, padded so that the value is 8-byte aligned.
+    static size_t header_size () { return (sizeof(MessageSlot) + 7) & ~7; }
+
+    /// The value, which follows the header.
+    char *data () { return (char *)this + header_size(); }
+};
+
 /// Represents the list of messages set by a given shader using setmessage and getmessage
 ///
 struct MessageList {
@@ -1041,6 +1618,21 @@ public:
     bool execute (ShaderUse use, ShadingAttribState &sas,
                   ShaderGlobals &ssg, bool run=true);
 
+    /// Execute the shaders for the given use on a batch of npoints
+    /// shade points, each getting its own slice of the heap.  Points
+    /// whose runflag is RunflagOff are skipped (runflags may be NULL
+    /// to run all points).  Return value is as for execute().
+    bool execute_batch (ShaderUse use, ShadingAttribState &sas,
+                        ShaderGlobals *ssg, int npoints,
+                        const Runflag *runflags=NULL, bool run=true);
+
+    /// Execute the shaders for the given use on a batch of npoints (at
+    /// most ShaderGlobalsBatch::MaxSize) shade points, BatchWidth at a
+    /// time if the group has batch code, and otherwise one at a time.
+    bool execute_batch (ShaderUse use, ShadingAttribState &sas,
+                        ShaderGlobalsBatch &sgb, int npoints,
+                        const Runflag *runflags=NULL, bool run=true);
+
     /// Return the current shader use being executed.
     ///
     ShaderUse use () const { return (ShaderUse) m_curuse; }
@@ -1087,12 +1679,14 @@ public:
     /// Return NULL if no such symbol is found.
     Symbol * symbol (ShaderUse use, ustring name);
 
-    /// Return a pointer to where the symbol's data lives.
-    void *symbol_data (Symbol &sym);
+    /// Return a pointer to where the symbol's data lives (for the
+    /// given point, if the last execution was a batch).
+    void *symbol_data (Symbol &sym, int point=0);
 
     /// Return a reference to a compiled regular expression for the
-    /// given string, being careful to cache already-created ones so we
-    /// aren't constantly compiling new ones.
+    /// given string.  The regex itself is the shading system's; we just
+    /// remember where it is, so that we only need its lock once per
+    /// pattern.
     const boost::regex & find_regex (ustring r);
 
     /// Return a pointer to the shading attribs for this context.
@@ -1117,9 +1711,11 @@ public:
     /// attribname is "", return the value of the node itself.
     int dict_value (int nodeID, ustring attribname, TypeDesc type, void *data);
 
-    /// Various setup of the context done by execute().  Return true if
-    /// the function should be executed, otherwise false.
-    bool prepare_execution (ShaderUse use, ShadingAttribState &sas);
+    /// Various setup of the context done by execute() and
+    /// execute_batch() for npoints points.  Return true if the function
+    /// should be executed, otherwise false.
+    bool prepare_execution (ShaderUse use, ShadingAttribState &sas,
+                            int npoints=1);
 
     bool osl_get_attribute (void *renderstate, void *objdata, int dest_derivs,
                             ustring obj_name, ustring attr_name,
@@ -1128,6 +1724,25 @@ public:
 
     PerThreadInfo *thread_info () { return m_threadinfo; }
 
+    /// Charge cycles to run-time profiling counter id (called from
+    /// code compiled with the "profile" attribute set).
+    void profile_add (int id, long long cycles) {
+        ProfileCounters *p = m_threadinfo->profile;
+        if (! p)
+            p = m_shadingsys.thread_profile (m_threadinfo);
+        p->add (id, cycles);
+    }
+
+#if OIIO_VERSION >= 10100
+    /// Return the texture system's per-thread info for this context,
+    /// asking the renderer for it the first time.
+    RendererServices::TexturePerthread *texture_thread_info () {
+        if (! m_texture_thread_info)
+            m_texture_thread_info = m_renderer->get_texture_perthread ();
+        return m_texture_thread_info;
+    }
+#endif
+
 private:
 
     /// Execute the llvm-compiled shaders for the given use (for example,
@@ -1139,24 +1754,35 @@ private:
 
     void free_dict_resources ();
 
+    /// Make sure the heap can hold npoints copies of the group data of
+    /// sgroup, and set m_heap_point_size accordingly.
+    void allocate_heap (ShaderGroup &sgroup, int npoints);
+
     ShadingSystemImpl &m_shadingsys;    ///< Backpointer to shadingsys
     RendererServices *m_renderer;       ///< Ptr to renderer services
     PerThreadInfo *m_threadinfo;        ///< Ptr to our thread's info
+#if OIIO_VERSION >= 10100
+    RendererServices::TexturePerthread *m_texture_thread_info; ///< Texture sys's
+#endif
     ShadingAttribState *m_attribs;      ///< Ptr to shading attrib state
     std::vector<char> m_heap;           ///< Heap memory
+    size_t m_heap_point_size;           ///< Heap bytes per batch point
+    int m_heap_points;                  ///< Points in the last execution
     size_t m_closures_allotted;         ///< Closure memory allotted
+    const ShaderGroup *m_sampled_group; ///< Group m_unsampled_runs are of
+    int m_unsampled_runs;               ///< Runs not yet credited to it
     int m_curuse;                       ///< Current use that we're running
 #ifdef OIIO_HAVE_BOOST_UNORDERED_MAP
-    typedef boost::unordered_map<ustring, boost::regex*, ustringHash> RegexMap;
+    typedef boost::unordered_map<ustring, const boost::regex*, ustringHash> RegexMap;
 #else
-    typedef hash_map<ustring, boost::regex*, ustringHash> RegexMap;
+    typedef hash_map<ustring, const boost::regex*, ustringHash> RegexMap;
 #endif
-    RegexMap m_regex_map;               ///< Compiled regex's
+    RegexMap m_regex_map;               ///< Shading system's regex's we use
     MessageList m_messages;             ///< Message blackboard
 
     SimplePool<20 * 1024> m_closure_pool;
 
-    Dictionary *m_dictionary;
+    DictionaryCache *m_dictionary;      ///< Our dictionary query results
 
     // Struct for holding a record of getattributes we've tried and
     // failed, to speed up subsequent getattributes calls.
@@ -1176,7 +1802,7 @@ private:
 
 
 
-class ShadingAttribState
+class ShadingAttribState : public boost::enable_shared_from_this<ShadingAttribState>
 {
 public:
     ShadingAttribState () { }
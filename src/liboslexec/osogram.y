@@ -41,20 +41,15 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #include "osoreader.h"
 
-#undef yylex
-#define yyFlexLexer osoFlexLexer
-#include "FlexLexer.h"
-
 using namespace OSL;
 using namespace OSL::pvt;
 
-void yyerror (const char *err);
+void yyerror (OSOReader *reader, const char *err);
 
-#define yylex OSOReader::osolexer->yylex
-#define reader OSOReader::reader
-
-static TypeSpec current_typespec;
-static std::string current_shader_name;
+// The parser is pure and takes the reader as a parameter; the tokens
+// come from that reader's own lexer.
+#undef yylex
+#define yylex(lvalp) reader->osolexer()->lex(lvalp)
 
 // Forward declaration
 #ifdef OSL_NAMESPACE
@@ -81,8 +76,10 @@ TypeDesc lextype (int lex);
 }
 
 
-// Tell Bison to track locations for improved error messages
-%locations
+// Make the parser reentrant: no global parse state, and the reader
+// (which owns the lexer) is passed to osoparse().
+%pure-parser
+%parse-param { OSOReader *reader }
 
 
 // Define the terminal symbols.
@@ -114,7 +111,7 @@ TypeDesc lextype (int lex);
 oso_file
         : version shader_declaration symbols_opt codemarker instructions
                 {
-                    OSOReader::osoreader->codeend ();
+                    reader->codeend ();
                     $$ = 0;
                 }
 	;
@@ -124,7 +121,7 @@ version
                 {
                     int major = (int) $2;
                     int minor = (int) (100*($2-major) + 0.5);
-                    OSOReader::osoreader->version ($1, major, minor);
+                    reader->version ($1, major, minor);
                     $$ = 0;
                 }
         ;
@@ -132,8 +129,8 @@ version
 shader_declaration
         : shader_type IDENTIFIER 
                 {
-                    OSOReader::osoreader->shader ($1, $2);
-                    current_shader_name = $2;
+                    reader->shader ($1, $2);
+                    reader->current_shader_name() = $2;
                 }
             hints_opt ENDOFLINE
                 {
@@ -149,7 +146,7 @@ symbols_opt
 codemarker
         : CODE IDENTIFIER ENDOFLINE
                 {
-                    OSOReader::osoreader->codemarker ($2);
+                    reader->codemarker ($2);
                 }
         ;
 
@@ -161,11 +158,11 @@ instructions
 instruction
         : label opcode 
                 {
-                    OSOReader::osoreader->instruction ($1, $2);
+                    reader->instruction ($1, $2);
                 }
             arguments_opt jumptargets_opt hints_opt ENDOFLINE
                 {
-                    OSOReader::osoreader->instruction_end ();
+                    reader->instruction_end ();
                 }
         | codemarker
         | ENDOFLINE
@@ -183,10 +180,10 @@ symbols
 symbol
         : SYMTYPE typespec arraylen_opt IDENTIFIER 
                 {
-                    TypeSpec typespec = current_typespec;
+                    TypeSpec typespec = reader->current_typespec();
                     if ($3)
                         typespec.make_array ($3);
-                    OSOReader::osoreader->symbol ((SymType)$1, typespec, $4);
+                    reader->symbol ((SymType)$1, typespec, $4);
                 }
             initial_values_opt hints_opt ENDOFLINE
         | ENDOFLINE
@@ -196,19 +193,19 @@ symbol
 typespec
         : simple_typename
                 {
-                    current_typespec = lextype ($1);
+                    reader->current_typespec() = lextype ($1);
                     $$ = 0;
                 }
         | CLOSURE simple_typename
                 {
-                    current_typespec = TypeSpec (lextype ($2), true);
+                    reader->current_typespec() = TypeSpec (lextype ($2), true);
                     $$ = 0;
                 }
         | STRUCT IDENTIFIER
                 {
                     // Prepend the shader name to make globally unique
-                    std::string mangled = current_shader_name + "_" + $2;
-                    current_typespec = TypeSpec (mangled.c_str(), 0);
+                    std::string mangled = reader->current_shader_name() + "_" + $2;
+                    reader->current_typespec() = TypeSpec (mangled.c_str(), 0);
                     $$ = 0;
                 }
         ;
@@ -243,17 +240,17 @@ initial_values
 initial_value
         : FLOAT_LITERAL
                 {
-                    OSOReader::osoreader->symdefault ($1);
+                    reader->symdefault ($1);
                     $$ = 0;
                 }
         | INT_LITERAL
                 {
-                    OSOReader::osoreader->symdefault ($1);
+                    reader->symdefault ($1);
                     $$ = 0;
                 }
         | STRING_LITERAL
                 {
-                    OSOReader::osoreader->symdefault ($1);
+                    reader->symdefault ($1);
                     $$ = 0;
                 }
         ;
@@ -280,7 +277,7 @@ arguments
 argument
         : IDENTIFIER
                 {
-                    OSOReader::osoreader->instruction_arg ($1);
+                    reader->instruction_arg ($1);
                 }
         ;
 
@@ -297,7 +294,7 @@ jumptargets
 jumptarget
         : INT_LITERAL
                 {
-                    OSOReader::osoreader->instruction_jump ($1);
+                    reader->instruction_jump ($1);
                 }
         ;
 
@@ -314,7 +311,7 @@ hints
 hint
         : HINT
                 {
-                    OSOReader::osoreader->hint ($1);
+                    reader->hint ($1);
                 }
         ;
 
@@ -323,12 +320,12 @@ hint
 
 
 void
-yyerror (const char *err)
+yyerror (OSOReader *reader, const char *err)
 {
 //    oslcompiler->error (oslcompiler->filename(), oslcompiler->lineno(),
 //                        "Syntax error: %s", err);
     fprintf (stderr, "Error, line %d: %s", 
-             OSOReader::osoreader->lineno(), err);
+             reader->lineno(), err);
 }
 
 
@@ -29,19 +29,22 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <vector>
 #include <string>
 #include <fstream>
+#include <sstream>
 #include <cstdio>
+#include <cstring>
+#include <iterator>
 
-#include "osoreader.h"
+#ifndef _WIN32
+# include <fcntl.h>
+# include <unistd.h>
+# include <sys/mman.h>
+# include <sys/stat.h>
+#endif
 
-#define yyFlexLexer osoFlexLexer
-#include "FlexLexer.h"
+#include "osoreader.h"
 
 #include "OpenImageIO/strutil.h"
 #include "OpenImageIO/dassert.h"
-#include "OpenImageIO/thread.h"
-#ifdef OIIO_NAMESPACE
-using OIIO::lock_guard;
-#endif
 
 
 #ifdef OSL_NAMESPACE
@@ -51,38 +54,459 @@ namespace OSL {
 namespace pvt {   // OSL::pvt
 
 
-osoFlexLexer * OSOReader::osolexer = NULL;
-OSOReader * OSOReader::osoreader = NULL;
-mutex OSOReader::m_osoread_mutex;
+namespace {
+
+// Layout of a binary oso file (all ints are native 32 bit ints; the
+// byteorder field rejects files written on a machine of the other
+// endianness):
+//
+//     BinaryHeader
+//     int stroffsets[nstrings]    offset of each string in strchars
+//     int codes[ncodes]           the record stream
+//     char strchars[strchars]     NUL-terminated strings
+//
+// Each record is a code from BinaryRecord followed by its fixed set of
+// int arguments; strings are referred to by their index.
+
+static const char binary_magic[8] = { '\177', 'O', 'S', 'O', 'b', 'i', 'n', '\0' };
+static const int binary_version = 1;
+static const int binary_byteorder = 0x01020304;
+
+struct BinaryHeader {
+    char magic[8];
+    int version;
+    int byteorder;
+    int nstrings;
+    int ncodes;
+    int strchars;
+};
+
+enum BinaryRecord {
+    BinVersion = 1,      // specid major minor
+    BinShader,           // shadertype name
+    BinSymbol,           // symtype basetype aggregate vecsemantics
+                         //     arraylen closure structname name
+    BinDefaultInt,       // value
+    BinDefaultFloat,     // value (bits)
+    BinDefaultString,    // value
+    BinHint,             // hintstring
+    BinCodemarker,       // name
+    BinCodeend,          //
+    BinInstruction,      // label opcode
+    BinArg,              // name
+    BinJump,             // target
+    BinInstructionEnd    //
+};
+
+};  // anon namespace
+
+
+
+bool
+OSOReader::is_binary (const std::string &filename)
+{
+    char magic[sizeof(binary_magic)];
+    FILE *file = fopen (filename.c_str(), "rb");
+    if (! file)
+        return false;
+    bool binary = (fread (magic, sizeof(magic), 1, file) == 1 &&
+                   ! memcmp (magic, binary_magic, sizeof(magic)));
+    fclose (file);
+    return binary;
+}
 
 
 
 bool
 OSOReader::parse (const std::string &filename)
 {
-    // The lexer/parser isn't thread-safe, so make sure Only one thread
-    // can actually be reading a .oso file at a time.
-    lock_guard guard (m_osoread_mutex);
+    if (is_binary (filename))
+        return parse_binary_file (filename);
 
-    std::fstream input (filename.c_str(), std::ios::in);
-    if (! input.is_open()) {
+    // The lexer and parser keep all their state in this reader and its
+    // lexer, so no lock is needed: distinct readers may parse in
+    // parallel.
+    std::ifstream file (filename.c_str(), std::ios::in | std::ios::binary);
+    if (! file.is_open()) {
         m_err.error ("File %s not found", filename.c_str());
         return false;
     }
+    // Only read it all in one go if contents() wants to see it too;
+    // otherwise lex straight from the file.
+    std::istringstream text;
+    std::istream *input = &file;
+    if (wants_contents ()) {
+        std::string data ((std::istreambuf_iterator<char>(file)),
+                          std::istreambuf_iterator<char>());
+        contents (data.data(), data.size());
+        text.str (data);
+        input = &text;
+    }
 
-    osoreader = this;
-    osolexer = new osoFlexLexer (&input);
-    assert (osolexer);
-    bool ok = ! osoparse ();   // osoparse returns nonzero if error
+    OSOLexer lexer (input, this);
+    m_lexer = &lexer;
+    m_lineno = 1;
+    bool ok = ! osoparse (this);   // osoparse returns nonzero if error
     if (ok) {
 //        m_err.info ("Correctly parsed %s", filename.c_str());
     } else {
         m_err.error ("Failed parse of %s", filename.c_str());
     }
-    delete osolexer;
-    osolexer = NULL;
+    m_lexer = NULL;
+    return ok;
+}
+
+
+
+bool
+OSOReader::parse_binary_file (const std::string &filename)
+{
+    bool ok = false;
+#ifndef _WIN32
+    // Map the file rather than reading it, so the records are decoded
+    // straight out of the page cache.
+    int fd = open (filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+        m_err.error ("File %s not found", filename.c_str());
+        return false;
+    }
+    struct stat st;
+    void *data = MAP_FAILED;
+    if (fstat (fd, &st) == 0 && st.st_size > 0)
+        data = mmap (NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close (fd);
+    if (data != MAP_FAILED) {
+        if (wants_contents ())
+            contents ((const char *)data, (size_t)st.st_size);
+        ok = parse_binary ((const char *)data, (size_t)st.st_size);
+        munmap (data, (size_t)st.st_size);
+    }
+#else
+    std::ifstream input (filename.c_str(), std::ios::in | std::ios::binary);
+    if (! input.is_open()) {
+        m_err.error ("File %s not found", filename.c_str());
+        return false;
+    }
+    std::vector<char> data ((std::istreambuf_iterator<char>(input)),
+                            std::istreambuf_iterator<char>());
+    if (data.size()) {
+        if (wants_contents ())
+            contents (&data[0], data.size());
+        ok = parse_binary (&data[0], data.size());
+    }
+#endif
+    if (! ok)
+        m_err.error ("Failed parse of %s", filename.c_str());
+    return ok;
+}
+
+
+
+bool
+OSOReader::parse_binary (const char *data, size_t size)
+{
+    BinaryHeader header;
+    if (size < sizeof(header))
+        return false;
+    memcpy (&header, data, sizeof(header));
+    if (memcmp (header.magic, binary_magic, sizeof(binary_magic)) ||
+            header.version != binary_version ||
+            header.byteorder != binary_byteorder ||
+            header.nstrings < 0 || header.ncodes < 0 || header.strchars < 0)
+        return false;
+    size_t expected = sizeof(header) +
+                      sizeof(int) * ((size_t)header.nstrings + header.ncodes) +
+                      header.strchars;
+    if (size != expected)
+        return false;
+
+    // The header is a multiple of 4 bytes, so the int arrays that
+    // follow are aligned as long as the image itself is (mmap and
+    // new[] both guarantee it).
+    const int *stroffsets = (const int *)(data + sizeof(header));
+    const int *codes = stroffsets + header.nstrings;
+    const int *codesend = codes + header.ncodes;
+    const char *strchars = (const char *)codesend;
+    for (int i = 0;  i < header.nstrings;  ++i)
+        if (stroffsets[i] < 0 || stroffsets[i] >= header.strchars)
+            return false;
+    if (header.strchars && strchars[header.strchars-1] != 0)
+        return false;   // last string must be terminated
+
+    const int nargs[] = { 0, 3, 2, 8, 1, 1, 1, 1, 1, 0, 2, 1, 1, 0 };
+    for (const int *c = codes;  c < codesend;  c += 1 + nargs[c[0]]) {
+        if (c[0] < BinVersion || c[0] > BinInstructionEnd ||
+                codesend - c <= nargs[c[0]])
+            return false;
+#define STR(i) ((c[i] >= 0 && c[i] < header.nstrings) \
+                ? strchars + stroffsets[c[i]] : NULL)
+        switch (c[0]) {
+        case BinVersion :
+            if (! STR(1))
+                return false;
+            version (STR(1), c[2], c[3]);
+            break;
+        case BinShader :
+            if (! STR(1) || ! STR(2))
+                return false;
+            shader (STR(1), STR(2));
+            break;
+        case BinSymbol : {
+            if (! STR(8))
+                return false;
+            TypeSpec typespec;
+            if (STR(7))
+                typespec = TypeSpec (STR(7), 0);
+            else if (c[6])
+                typespec = TypeSpec (TypeDesc ((TypeDesc::BASETYPE)c[2],
+                                               (TypeDesc::AGGREGATE)c[3],
+                                               (TypeDesc::VECSEMANTICS)c[4]),
+                                     true);
+            else
+                typespec = TypeSpec (TypeDesc ((TypeDesc::BASETYPE)c[2],
+                                               (TypeDesc::AGGREGATE)c[3],
+                                               (TypeDesc::VECSEMANTICS)c[4]));
+            if (c[5])
+                typespec.make_array (c[5]);
+            symbol ((SymType)c[1], typespec, STR(8));
+            break;
+        }
+        case BinDefaultInt :
+            symdefault (c[1]);
+            break;
+        case BinDefaultFloat : {
+            float f;
+            memcpy (&f, &c[1], sizeof(float));
+            symdefault (f);
+            break;
+        }
+        case BinDefaultString :
+            if (! STR(1))
+                return false;
+            symdefault (STR(1));
+            break;
+        case BinHint :
+            if (! STR(1))
+                return false;
+            hint (STR(1));
+            break;
+        case BinCodemarker :
+            if (! STR(1))
+                return false;
+            codemarker (STR(1));
+            break;
+        case BinCodeend :
+            codeend ();
+            break;
+        case BinInstruction :
+            if (! STR(2))
+                return false;
+            instruction (c[1], STR(2));
+            break;
+        case BinArg :
+            if (! STR(1))
+                return false;
+            instruction_arg (STR(1));
+            break;
+        case BinJump :
+            instruction_jump (c[1]);
+            break;
+        case BinInstructionEnd :
+            instruction_end ();
+            break;
+        }
+#undef STR
+    }
+    return true;
+}
+
+
+
+int
+OSOReaderToBinary::string_index (const char *s)
+{
+    if (! s)
+        return -1;
+    std::map<std::string,int>::const_iterator found = m_string_index.find (s);
+    if (found != m_string_index.end())
+        return found->second;
+    int index = (int) m_strings.size();
+    m_strings.push_back (s);
+    m_string_index[s] = index;
+    m_strchars_size += m_strings.back().size() + 1;
+    return index;
+}
+
+
+
+void
+OSOReaderToBinary::version (const char *specid, int major, int minor)
+{
+    m_codes.push_back (BinVersion);
+    m_codes.push_back (string_index (specid));
+    m_codes.push_back (major);
+    m_codes.push_back (minor);
+}
+
+
+
+void
+OSOReaderToBinary::shader (const char *shadertype, const char *name)
+{
+    m_codes.push_back (BinShader);
+    m_codes.push_back (string_index (shadertype));
+    m_codes.push_back (string_index (name));
+}
 
-    input.close ();
+
+
+void
+OSOReaderToBinary::symbol (SymType symtype, TypeSpec typespec,
+                           const char *name)
+{
+    const TypeDesc &t (typespec.simpletype());
+    m_codes.push_back (BinSymbol);
+    m_codes.push_back ((int) symtype);
+    m_codes.push_back ((int) t.basetype);
+    m_codes.push_back ((int) t.aggregate);
+    m_codes.push_back ((int) t.vecsemantics);
+    m_codes.push_back (typespec.arraylength());
+    m_codes.push_back (typespec.is_closure_based());
+    // Struct ids are private to the process, so record the name
+    m_codes.push_back (typespec.structure() ?
+                       string_index (typespec.structspec()->name().c_str()) : -1);
+    m_codes.push_back (string_index (name));
+}
+
+
+
+void
+OSOReaderToBinary::symdefault (int def)
+{
+    m_codes.push_back (BinDefaultInt);
+    m_codes.push_back (def);
+}
+
+
+
+void
+OSOReaderToBinary::symdefault (float def)
+{
+    int bits;
+    memcpy (&bits, &def, sizeof(int));
+    m_codes.push_back (BinDefaultFloat);
+    m_codes.push_back (bits);
+}
+
+
+
+void
+OSOReaderToBinary::symdefault (const char *def)
+{
+    m_codes.push_back (BinDefaultString);
+    m_codes.push_back (string_index (def));
+}
+
+
+
+void
+OSOReaderToBinary::hint (const char *hintstring)
+{
+    m_codes.push_back (BinHint);
+    m_codes.push_back (string_index (hintstring));
+}
+
+
+
+void
+OSOReaderToBinary::codemarker (const char *name)
+{
+    m_codes.push_back (BinCodemarker);
+    m_codes.push_back (string_index (name));
+}
+
+
+
+void
+OSOReaderToBinary::codeend ()
+{
+    m_codes.push_back (BinCodeend);
+}
+
+
+
+void
+OSOReaderToBinary::instruction (int label, const char *opcode)
+{
+    m_codes.push_back (BinInstruction);
+    m_codes.push_back (label);
+    m_codes.push_back (string_index (opcode));
+}
+
+
+
+void
+OSOReaderToBinary::instruction_arg (const char *name)
+{
+    m_codes.push_back (BinArg);
+    m_codes.push_back (string_index (name));
+}
+
+
+
+void
+OSOReaderToBinary::instruction_jump (int target)
+{
+    m_codes.push_back (BinJump);
+    m_codes.push_back (target);
+}
+
+
+
+void
+OSOReaderToBinary::instruction_end ()
+{
+    m_codes.push_back (BinInstructionEnd);
+}
+
+
+
+bool
+OSOReaderToBinary::write (const std::string &filename)
+{
+    BinaryHeader header;
+    memcpy (header.magic, binary_magic, sizeof(binary_magic));
+    header.version = binary_version;
+    header.byteorder = binary_byteorder;
+    header.nstrings = (int) m_strings.size();
+    header.ncodes = (int) m_codes.size();
+    header.strchars = (int) m_strchars_size;
+
+    std::vector<int> stroffsets;
+    stroffsets.reserve (m_strings.size());
+    int offset = 0;
+    for (size_t i = 0;  i < m_strings.size();  ++i) {
+        stroffsets.push_back (offset);
+        offset += (int) m_strings[i].size() + 1;
+    }
+
+    FILE *file = fopen (filename.c_str(), "wb");
+    if (! file) {
+        m_err.error ("Could not open \"%s\"", filename.c_str());
+        return false;
+    }
+    bool ok = (fwrite (&header, sizeof(header), 1, file) == 1);
+    if (stroffsets.size())
+        ok &= (fwrite (&stroffsets[0], sizeof(int), stroffsets.size(), file)
+               == stroffsets.size());
+    if (m_codes.size())
+        ok &= (fwrite (&m_codes[0], sizeof(int), m_codes.size(), file)
+               == m_codes.size());
+    for (size_t i = 0;  i < m_strings.size();  ++i)
+        ok &= (fwrite (m_strings[i].c_str(), m_strings[i].size()+1, 1, file) == 1);
+    ok &= (fclose (file) == 0);
+    if (! ok)
+        m_err.error ("Error writing \"%s\"", filename.c_str());
     return ok;
 }
 
@@ -29,17 +29,23 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #ifndef OSL_OSOREADER_H
 #define OSL_OSOREADER_H
 
+#include <map>
+
 #include "osl_pvt.h"
 
-#include "OpenImageIO/thread.h"
-#ifdef OIIO_NAMESPACE
-using OIIO::mutex;
+// Declare osoFlexLexer, unless this is the flex-generated oso scanner
+// itself, which has already included FlexLexer.h for it.  (FlexLexer.h
+// may be included again with a different yyFlexLexer, so this coexists
+// with the oslc lexer.)
+#ifndef OSL_OSOLEX_SCANNER
+#undef yyFlexLexer
+#define yyFlexLexer osoFlexLexer
+#include "FlexLexer.h"
+#undef yyFlexLexer
 #endif
 
-
-
-class osoFlexLexer;
-extern int osoparse ();
+union YYSTYPE;
+class OSOLexer;
 
 
 #ifdef OSL_NAMESPACE
@@ -56,15 +62,33 @@ class OSOReader {
 public:
     OSOReader (ErrorHandler *errhandler = NULL) 
         : m_err (errhandler ? *errhandler : ErrorHandler::default_handler()),
-          m_lineno(1)
+          m_lineno(1), m_lexer(NULL)
     { }
     virtual ~OSOReader () { }
 
     /// Read in the oso file, parse it, call the various callbacks.
     /// Return true if the file was correctly parsed, false if there was
-    /// an unrecoverable error reading the file.
+    /// an unrecoverable error reading the file.  Both the text format
+    /// and the binary format (see OSOReaderToBinary) are accepted; the
+    /// format is detected from the start of the file.
     virtual bool parse (const std::string &filename);
 
+    /// Decode a binary oso image already in memory (as written by
+    /// OSOReaderToBinary), calling the various callbacks.  Return true
+    /// if it was correctly decoded.
+    bool parse_binary (const char *data, size_t size);
+
+    /// Does the file look like a binary oso?
+    ///
+    static bool is_binary (const std::string &filename);
+
+    /// If this returns true, parse() will call contents() with the
+    /// entire contents of the file, before any of the other callbacks.
+    virtual bool wants_contents () const { return false; }
+
+    /// Called with the entire contents of the file, if wants_contents().
+    virtual void contents (const char *data, size_t size) { }
+
     /// Declare the shader version.
     ///
     virtual void version (const char *specid, int major, int minor) { }
@@ -126,17 +150,71 @@ public:
     /// be called by the lexer.
     int lineno () const { return m_lineno; }
 
-    /// Pointer to the one and only lexer in effect.  This is 'public',
-    /// but NOBODY should modify this except for this class and the
-    /// lexer internals.
-    static osoFlexLexer *osolexer;
+    /// The lexer in effect for this reader's parse.  Each reader owns
+    /// its own lexer and parse state, so any number of threads may be
+    /// reading .oso files at once.  Should only be used by the parser.
+    OSOLexer *osolexer () const { return m_lexer; }
 
-    static OSOReader *osoreader;
+    /// Type of the symbol currently being declared.  Should only be
+    /// used by the parser.
+    TypeSpec &current_typespec () { return m_current_typespec; }
 
-private:
+    /// Name of the shader being read (used to mangle struct names).
+    /// Should only be used by the parser.
+    std::string &current_shader_name () { return m_current_shader_name; }
+
+protected:
     ErrorHandler &m_err;
+
+private:
     int m_lineno;
-    static mutex m_osoread_mutex;
+    OSOLexer *m_lexer;
+    TypeSpec m_current_typespec;
+    std::string m_current_shader_name;
+
+    bool parse_binary_file (const std::string &filename);
+};
+
+
+
+/// OSOReader that records everything it is fed and writes it back out in
+/// the compact binary oso format: a header, a table of all the distinct
+/// strings, and a stream of fixed-size int records for the declarations,
+/// defaults, hints and instructions, referring to strings by index.
+/// Reading it back needs no tokenizing or number conversion, and each
+/// distinct string is stored once.  Typical use is to parse() a text
+/// .oso and then write() the binary form.
+class OSOReaderToBinary : public OSOReader {
+public:
+    OSOReaderToBinary (ErrorHandler *errhandler = NULL)
+        : OSOReader (errhandler), m_strchars_size(0) { }
+    virtual ~OSOReaderToBinary () { }
+
+    /// Write everything recorded so far to the named file.  Return true
+    /// on success.
+    bool write (const std::string &filename);
+
+    virtual void version (const char *specid, int major, int minor);
+    virtual void shader (const char *shadertype, const char *name);
+    virtual void symbol (SymType symtype, TypeSpec typespec, const char *name);
+    virtual void symdefault (int def);
+    virtual void symdefault (float def);
+    virtual void symdefault (const char *def);
+    virtual void hint (const char *hintstring);
+    virtual void codemarker (const char *name);
+    virtual void codeend ();
+    virtual void instruction (int label, const char *opcode);
+    virtual void instruction_arg (const char *name);
+    virtual void instruction_jump (int target);
+    virtual void instruction_end ();
+
+private:
+    int string_index (const char *s);
+
+    std::vector<int> m_codes;              ///< Record stream
+    std::vector<std::string> m_strings;    ///< Distinct strings, in order
+    std::map<std::string,int> m_string_index; ///< String -> index
+    size_t m_strchars_size;                ///< Total string bytes (w/ NUL)
 };
 
 
@@ -150,4 +228,27 @@ using namespace OSL_NAMESPACE;
 #endif
 
 
+
+/// Reentrant .oso lexer: the flex actions run as members of this class
+/// (via %option yyclass), so the semantic value and the reader to
+/// report line numbers to are per-instance rather than globals.
+class OSOLexer : public osoFlexLexer {
+public:
+    OSOLexer (std::istream *in, OSL::pvt::OSOReader *reader)
+        : osoFlexLexer (in), m_reader(reader), m_lval(NULL) { }
+
+    /// Return the next token, storing its value in *lval.
+    int lex (YYSTYPE *lval) { m_lval = lval; return yylex (); }
+
+    /// The flex-generated scanner.
+    int yylex ();
+
+private:
+    OSL::pvt::OSOReader *m_reader;
+    YYSTYPE *m_lval;
+};
+
+extern int osoparse (OSL::pvt::OSOReader *reader);
+
+
 #endif /* OSL_OSOREADER_H */
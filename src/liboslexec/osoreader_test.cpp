@@ -0,0 +1,185 @@
+/*
+Copyright (c) 2009-2011 Sony Pictures Imageworks Inc., et al.
+All Rights Reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are
+met:
+* Redistributions of source code must retain the above copyright
+  notice, this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright
+  notice, this list of conditions and the following disclaimer in the
+  documentation and/or other materials provided with the distribution.
+* Neither the name of Sony Pictures Imageworks nor the names of its
+  contributors may be used to endorse or promote products derived from
+  this software without specific prior written permission.
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <vector>
+#include <string>
+#include <sstream>
+#include <iostream>
+
+#include <OpenImageIO/dassert.h>
+#include <OpenImageIO/strutil.h>
+#include <OpenImageIO/timer.h>
+
+#include "osoreader.h"
+
+using namespace OSL;
+using namespace OSL::pvt;
+#ifdef OIIO_NAMESPACE
+using OIIO::Timer;
+namespace Strutil = OIIO::Strutil;
+#endif
+
+
+namespace {
+
+// Reader that just logs every callback, so the text and binary forms of
+// a shader can be checked for producing exactly the same calls.
+class OSOReaderLog : public OSOReader {
+public:
+    std::ostringstream log;
+
+    void version (const char *specid, int major, int minor) {
+        log << "version " << specid << ' ' << major << ' ' << minor << '\n';
+    }
+    void shader (const char *shadertype, const char *name) {
+        log << "shader " << shadertype << ' ' << name << '\n';
+    }
+    void symbol (SymType symtype, TypeSpec typespec, const char *name) {
+        log << "symbol " << (int)symtype << ' ' << typespec.string()
+            << ' ' << name << '\n';
+    }
+    void symdefault (int def) { log << "idefault " << def << '\n'; }
+    void symdefault (float def) { log << "fdefault " << def << '\n'; }
+    void symdefault (const char *def) { log << "sdefault " << def << '\n'; }
+    void hint (const char *hintstring) { log << "hint " << hintstring << '\n'; }
+    void codemarker (const char *name) { log << "code " << name << '\n'; }
+    void codeend () { log << "codeend\n"; }
+    void instruction (int label, const char *opcode) {
+        log << "op " << label << ' ' << opcode << '\n';
+    }
+    void instruction_arg (const char *name) { log << "arg " << name << '\n'; }
+    void instruction_jump (int target) { log << "jump " << target << '\n'; }
+    void instruction_end () { log << "opend\n"; }
+};
+
+
+
+// Write a synthetic text .oso with the given number of symbols and ops,
+// shaped like oslc output (hints on everything, a few defaults).
+void
+write_test_oso (const std::string &filename, int nsyms, int nops)
+{
+    FILE *f = fopen (filename.c_str(), "w");
+    ASSERT (f);
+    fprintf (f, "OpenShadingLanguage 1.00\n");
+    fprintf (f, "# Compiled by osoreader_test\n");
+    fprintf (f, "surface test\n");
+    fprintf (f, "param\tfloat\tKd\t0.5\t\t%%read{0,%d} %%write{2147483647,-1}\n", nops-1);
+    fprintf (f, "param\tcolor\tCs\t1 0.5 0.25\t\t%%read{0,%d} %%write{2147483647,-1}\n", nops-1);
+    fprintf (f, "param\tstring\ttexname\t\"foo.tx\"\t\t%%read{0,%d} %%write{2147483647,-1}\n", nops-1);
+    fprintf (f, "param\tint[2]\tcount\t1 2\t\t%%read{0,%d} %%write{2147483647,-1}\n", nops-1);
+    fprintf (f, "oparam\tclosure color\tbsdf\t\t%%read{2147483647,-1} %%write{0,%d}\n", nops-1);
+    fprintf (f, "global\tpoint\tP\t%%read{0,%d} %%write{2147483647,-1} %%derivs\n", nops-1);
+    for (int i = 0;  i < nsyms;  ++i)
+        fprintf (f, "local\tfloat\tlocal_%d\t%%read{%d,%d} %%write{%d,%d} %%derivs\n",
+                 i, i % nops, i % nops, i % nops, i % nops);
+    fprintf (f, "const\tfloat\t$const1\t1\t%%read{0,0} %%write{2147483647,-1}\n");
+    fprintf (f, "code ___main___\n");
+    for (int i = 0;  i < nops;  ++i) {
+        if (i % 16 == 0)
+            fprintf (f, "# test.osl:%d\n#    some source code\n", i);
+        fprintf (f, "\tadd\t\tlocal_%d local_%d $const1\t%%filename{\"test.osl\"} %%line{%d} %%argrw{\"wrr\"}\n",
+                 i % nsyms, (i+1) % nsyms, i);
+    }
+    fprintf (f, "\tend\n");
+    fclose (f);
+}
+
+};  // anon namespace
+
+
+
+int
+main ()
+{
+    const int nsyms = 2000, nops = 20000, ntrials = 5;
+    std::string textfile ("osoreader_test_text.oso");
+    std::string binfile ("osoreader_test_bin.oso");
+    write_test_oso (textfile, nsyms, nops);
+
+    // Convert to binary
+    {
+        OSOReaderToBinary bin;
+        ASSERT (bin.parse (textfile));
+        ASSERT (bin.write (binfile));
+    }
+    ASSERT (! OSOReader::is_binary (textfile));
+    ASSERT (OSOReader::is_binary (binfile));
+
+    // Both forms must produce the same callbacks
+    OSOReaderLog textlog, binlog;
+    ASSERT (textlog.parse (textfile));
+    ASSERT (binlog.parse (binfile));
+    ASSERT (textlog.log.str() == binlog.log.str());
+
+    // A binary image with trailing garbage or a truncated one must be
+    // rejected rather than misread.
+    {
+        FILE *f = fopen (binfile.c_str(), "rb");
+        ASSERT (f);
+        std::string image;
+        char buf[4096];
+        size_t n;
+        while ((n = fread (buf, 1, sizeof(buf), f)) > 0)
+            image.append (buf, n);
+        fclose (f);
+        std::vector<int> aligned ((image.size() + sizeof(int)) / sizeof(int));
+        memcpy (&aligned[0], image.data(), image.size());
+        OSOReader reader;
+        ASSERT (reader.parse_binary ((const char *)&aligned[0], image.size()));
+        ASSERT (! reader.parse_binary ((const char *)&aligned[0], image.size()-1));
+        ASSERT (! reader.parse_binary ((const char *)&aligned[0], image.size()+1));
+    }
+
+    // Time loading each form
+    double texttime = 1.0e30, bintime = 1.0e30;
+    for (int t = 0;  t < ntrials;  ++t) {
+        Timer timer;
+        OSOReader text;
+        text.parse (textfile);
+        texttime = std::min (texttime, timer());
+        timer.reset ();
+        timer.start ();
+        OSOReader bin;
+        bin.parse (binfile);
+        bintime = std::min (bintime, timer());
+    }
+    std::cout << "Loading " << nsyms << " symbols, " << nops << " ops:\n";
+    std::cout << "  text   " << Strutil::timeintervalformat (texttime, 4) << "\n";
+    std::cout << "  binary " << Strutil::timeintervalformat (bintime, 4)
+              << Strutil::format ("  (%.1fx)", texttime / std::max (bintime, 1.0e-9))
+              << "\n";
+
+    remove (textfile.c_str());
+    remove (binfile.c_str());
+    std::cout << "oso binary format check OK" << std::endl;
+    return 0;
+}
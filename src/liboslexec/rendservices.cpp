@@ -37,9 +37,6 @@ using namespace OSL::pvt;
 #include "OpenImageIO/strutil.h"
 #include "OpenImageIO/dassert.h"
 #include "OpenImageIO/filesystem.h"
-#ifdef OIIO_NAMESPACE
-using OIIO::spin_lock;
-#endif
 
 #include <boost/algorithm/string.hpp>
 
@@ -97,9 +94,12 @@ RendererServices::get_inverse_matrix (Matrix44 &result, ustring to)
 
 
 
-// Just ask for the global shared TextureSystem.
+// Just ask for the global shared TextureSystem.  The default options
+// are only applied the first time, so that any the renderer set on the
+// shared TextureSystem since then aren't clobbered by each new
+// RendererServices.
 static TextureSystem *
-texturesys ()
+shared_texturesys ()
 {
     static TextureSystem *ts = NULL;
     static spin_mutex mutex;
@@ -115,6 +115,15 @@ texturesys ()
 
 
 
+RendererServices::RendererServices (TextureSystem *texsys)
+    : m_texturesys(texsys)
+{
+    if (! m_texturesys)
+        m_texturesys = shared_texturesys ();
+}
+
+
+
 bool
 RendererServices::texture (ustring filename, TextureOpt &options,
                            ShaderGlobals *sg,
@@ -137,6 +146,55 @@ RendererServices::texture (ustring filename, TextureOpt &options,
 
 
 
+#if OIIO_VERSION >= 10100
+RendererServices::TextureHandle *
+RendererServices::get_texture_handle (ustring filename)
+{
+    if (! supports ("texture_handles"))
+        return NULL;
+    return texturesys()->get_texture_handle (filename);
+}
+
+
+
+RendererServices::TexturePerthread *
+RendererServices::get_texture_perthread ()
+{
+    return texturesys()->get_perthread_info ();
+}
+
+
+
+bool
+RendererServices::texture (ustring filename, TextureHandle *texture_handle,
+                           TexturePerthread *texture_thread_info,
+                           TextureOpt &options, ShaderGlobals *sg,
+                           float s, float t, float dsdx, float dtdx,
+                           float dsdy, float dtdy, float *result)
+{
+    if (! texture_handle)
+        return texture (filename, options, sg, s, t,
+                        dsdx, dtdx, dsdy, dtdy, result);
+    if (! texture_thread_info)
+        texture_thread_info = texturesys()->get_perthread_info ();
+    bool status = texturesys()->texture (texture_handle, texture_thread_info,
+                                         options, s, t,
+                                         dsdx, dtdx, dsdy, dtdy, result);
+    if (!status)
+    {
+        std::string err = texturesys()->geterror();
+        if (err.size()) {
+            std::cerr << "[RendererServices::texture] " << err.c_str();
+            if (err[err.size()-1] != '\n')
+                std::cerr << "\n";
+        }
+    }
+    return status;
+}
+#endif
+
+
+
 bool
 RendererServices::texture3d (ustring filename, TextureOpt &options,
                              ShaderGlobals *sg, const Vec3 &P,
@@ -31,6 +31,7 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <cstdio>
 #include <cmath>
 
+#include <boost/bind.hpp>
 #include <boost/foreach.hpp>
 #include <boost/regex.hpp>
 
@@ -92,9 +93,17 @@ RuntimeOptimizer::set_inst (int newlayer)
     ASSERT (m_inst != NULL);
     set_debug ();
     m_all_consts.clear ();
+    m_const_hash.clear ();
     m_symbol_aliases.clear ();
     m_block_aliases.clear ();
+    m_block_aliased.clear ();
     m_param_aliases.clear ();
+    m_stale_syms.clear ();
+    m_stale_list.clear ();
+    m_sym_users_begin.clear ();
+    m_sym_users.clear ();
+    m_op_dirty.clear ();
+    m_block_visit.clear ();
 }
 
 
@@ -118,18 +127,65 @@ RuntimeOptimizer::set_debug ()
 
 
 
+// Hash of a constant's type and value.  Equivalent types (see
+// equivalent()) may differ in their vector semantics, so leave that out.
+static unsigned long long
+constant_hash (const TypeSpec &type, const void *data)
+{
+    TypeDesc t (type.simpletype());
+    int key[3] = { t.basetype, t.aggregate, t.arraylen };
+    return fnv1a_hash (data, t.size(), fnv1a_hash (key, sizeof(key)));
+}
+
+
+
 int
 RuntimeOptimizer::find_constant (const TypeSpec &type, const void *data)
 {
-    for (int i = 0;  i < (int)m_all_consts.size();  ++i) {
-        const Symbol &s (*inst()->symbol(m_all_consts[i]));
-        ASSERT (s.symtype() == SymTypeConst);
+#if 0
+    // Reading the clock costs about as much as the lookup itself, so
+    // only change the #if's if you want to benchmark the lookups.
+    Timer timer;
+#endif
+    ++m_stat_const_lookups;
+    int result = -1;
+    ConstantHashMap::const_iterator found =
+        m_const_hash.find (constant_hash (type, data));
+    if (found != m_const_hash.end()) {
+        const Symbol &s (*inst()->symbol(found->second));
         if (equivalent (s.typespec(), type) &&
               !memcmp (s.data(), data, s.typespec().simpletype().size())) {
-            return m_all_consts[i];
+            result = found->second;
+        } else {
+            // Two different constants share the hash -- very rare, so
+            // just fall back to searching them all.
+            for (int i = 0;  i < (int)m_all_consts.size();  ++i) {
+                const Symbol &s (*inst()->symbol(m_all_consts[i]));
+                if (equivalent (s.typespec(), type) &&
+                      !memcmp (s.data(), data, s.typespec().simpletype().size())) {
+                    result = m_all_consts[i];
+                    break;
+                }
+            }
         }
     }
-    return -1;
+#if 0
+    m_stat_const_lookup_time += timer();
+#endif
+    return result;
+}
+
+
+
+void
+RuntimeOptimizer::add_to_constant_table (int symindex)
+{
+    const Symbol &s (*inst()->symbol(symindex));
+    ASSERT (s.symtype() == SymTypeConst);
+    m_all_consts.push_back (symindex);
+    // Keep the first of any duplicates, as a linear search would find
+    m_const_hash.insert (std::make_pair (constant_hash (s.typespec(), s.data()),
+                                         symindex));
 }
 
 
@@ -157,7 +213,7 @@ RuntimeOptimizer::add_constant (const TypeSpec &type, const void *data)
                 "we shouldn't have to realloc here");
         ind = (int) inst()->symbols().size ();
         inst()->symbols().push_back (newconst);
-        m_all_consts.push_back (ind);
+        add_to_constant_table (ind);
     }
     return ind;
 }
@@ -330,6 +386,12 @@ RuntimeOptimizer::insert_code (int opnum, ustring opname,
         ASSERT (m_bblockids.size() == code.size()-1);
         m_bblockids.insert (m_bblockids.begin()+opnum, 1, m_bblockids[opnum]);
     }
+    // The op numbers in the symbol user lists are now off, so visit
+    // everything for the rest of this optimization pass.
+    if (m_block_visit.size())
+        std::fill (m_block_visit.begin(), m_block_visit.end(), 1);
+    if (m_op_dirty.size())
+        m_op_dirty.insert (m_op_dirty.begin()+opnum, 1, 1);
     if (m_in_conditional.size()) {
         ASSERT (m_in_conditional.size() == code.size()-1);
         m_in_conditional.insert (m_in_conditional.begin()+opnum, 1,
@@ -1343,7 +1405,7 @@ DECLFOLDER(constfold_regex_search)
         DASSERT (Subj.typespec().is_string() && Reg.typespec().is_string());
         const ustring &s (*(ustring *)Subj.data());
         const ustring &r (*(ustring *)Reg.data());
-        boost::regex reg (r.string());
+        const boost::regex &reg (rop.shadingsys().find_regex (r));
         int result = boost::regex_search (s.string(), reg);
         int cind = rop.add_constant (TypeDesc::TypeInt, &result);
         rop.turn_into_assign (op, cind, "const fold");
@@ -1630,6 +1692,12 @@ DECLFOLDER(constfold_matrix)
         else
             ok &= rs->get_inverse_matrix (Mto, to);
         if (ok) {
+            if (from != Strings::common && from != commonsyn)
+                rop.add_jitcache_dependency (RuntimeOptimizer::DepMatrix, from,
+                                             ustring(), TypeDesc::TypeMatrix, &Mfrom);
+            if (to != Strings::common && to != commonsyn)
+                rop.add_jitcache_dependency (RuntimeOptimizer::DepInverseMatrix, to,
+                                             ustring(), TypeDesc::TypeMatrix, &Mto);
             // The from-to matrix is known and not time-varying, so just
             // turn it into a constant rather than calling getmatrix at
             // execution time.
@@ -1683,6 +1751,12 @@ DECLFOLDER(constfold_getmatrix)
     else
         ok &= rs->get_inverse_matrix (Mto, to);
     if (ok) {
+        if (from != Strings::common && from != commonsyn)
+            rop.add_jitcache_dependency (RuntimeOptimizer::DepMatrix, from,
+                                         ustring(), TypeDesc::TypeMatrix, &Mfrom);
+        if (to != Strings::common && to != commonsyn)
+            rop.add_jitcache_dependency (RuntimeOptimizer::DepInverseMatrix, to,
+                                         ustring(), TypeDesc::TypeMatrix, &Mto);
         // The from-to matrix is known and not time-varying, so just
         // turn it into a constant rather than calling getmatrix at
         // execution time.
@@ -1822,6 +1896,8 @@ DECLFOLDER(constfold_gettextureinfo)
         // or, if it failed:
         //       assign result 0
         if (result) {
+            rop.add_jitcache_dependency (RuntimeOptimizer::DepTextureInfo,
+                                         filename, dataname, t, mydata);
             int resultarg = rop.inst()->args()[op.firstarg()+0];
             int dataarg = rop.inst()->args()[op.firstarg()+3];
             // If not an array, turn the getattribute into an assignment
@@ -1870,6 +1946,105 @@ DECLFOLDER(constfold_gettextureinfo)
 
 
 
+// dict_find -- the dictionaries are shared by the whole shading system,
+// so the node IDs we find now are just as good when the shader runs.
+DECLFOLDER(constfold_dict_find)
+{
+    // int dict_find (string dict, string query)
+    // int dict_find (int nodeID, string query)
+    Opcode &op (rop.inst()->ops()[opnum]);
+    Symbol &Source (*rop.opargsym (op, 1));
+    Symbol &Query (*rop.opargsym (op, 2));
+    if (! Source.is_constant() || ! Query.is_constant())
+        return 0;
+    ustring query = *(ustring *)Query.data();
+    int result;
+    if (Source.typespec().is_string()) {
+        ustring dictionary = *(ustring *)Source.data();
+        result = rop.shadingsys().dict_find (dictionary, query);
+        rop.add_jitcache_dependency (RuntimeOptimizer::DepDictFind,
+                                     dictionary, query,
+                                     TypeDesc::TypeInt, &result);
+    } else {
+        int node = *(int *)Source.data();
+        result = rop.shadingsys().dict_find (node, query);
+        rop.add_jitcache_dependency (RuntimeOptimizer::DepDictFindNode,
+                                     ustring::format ("%d", node), query,
+                                     TypeDesc::TypeInt, &result);
+    }
+    int cind = rop.add_constant (TypeDesc::TypeInt, &result);
+    rop.turn_into_assign (op, cind, "const fold dict_find");
+    return 1;
+}
+
+
+
+DECLFOLDER(constfold_dict_next)
+{
+    // int dict_next (int nodeID)
+    Opcode &op (rop.inst()->ops()[opnum]);
+    Symbol &Node (*rop.opargsym (op, 1));
+    if (! Node.is_constant())
+        return 0;
+    int node = *(int *)Node.data();
+    int result = rop.shadingsys().dict_next (node);
+    rop.add_jitcache_dependency (RuntimeOptimizer::DepDictNext,
+                                 ustring::format ("%d", node), ustring(),
+                                 TypeDesc::TypeInt, &result);
+    int cind = rop.add_constant (TypeDesc::TypeInt, &result);
+    rop.turn_into_assign (op, cind, "const fold dict_next");
+    return 1;
+}
+
+
+
+DECLFOLDER(constfold_dict_value)
+{
+    // int dict_value (int nodeID, string attribname, output TYPE value)
+    Opcode &op (rop.inst()->ops()[opnum]);
+    Symbol &Node (*rop.opargsym (op, 1));
+    Symbol &Name (*rop.opargsym (op, 2));
+    Symbol &Value (*rop.opargsym (op, 3));
+    if (! Node.is_constant() || ! Name.is_constant() ||
+        Value.typespec().is_array() || Value.typespec().is_structure() ||
+        Value.typespec().is_closure_based())
+        return 0;
+    int node = *(int *)Node.data();
+    ustring name = *(ustring *)Name.data();
+    TypeDesc t = Value.typespec().simpletype();
+    void *mydata = alloca (t.size ());
+    // Leave failed lookups alone; they don't touch the value, and
+    // there's little to gain.
+    if (! rop.shadingsys().dict_value (node, name, t, mydata))
+        return 0;
+    rop.add_jitcache_dependency (RuntimeOptimizer::DepDictValue,
+                                 ustring::format ("%d", node), name,
+                                 t, mydata);
+
+    // Now we turn
+    //       dict_value result nodeID name value
+    // into this:
+    //       assign result 1
+    //       assign value [retrieved values]
+    int resultarg = rop.inst()->args()[op.firstarg()+0];
+    int valuearg = rop.inst()->args()[op.firstarg()+3];
+    rop.inst()->args()[op.firstarg()+0] = valuearg;
+    int cind = rop.add_constant (Value.typespec(), mydata);
+    rop.turn_into_assign (op, cind, "const fold dict_value");
+    int one = 1;
+    std::vector<int> args_to_add;
+    args_to_add.push_back (resultarg);
+    args_to_add.push_back (rop.add_constant (TypeDesc::TypeInt, &one));
+    rop.insert_code (opnum, u_assign, args_to_add, true);
+    Opcode &newop (rop.inst()->ops()[opnum]);
+    newop.argwriteonly (0);
+    newop.argread (1, true);
+    newop.argwrite (1, false);
+    return 1;
+}
+
+
+
 // texture -- we can eliminate a lot of superfluous setting of optional
 // parameters to their default values.
 DECLFOLDER(constfold_texture)
@@ -2066,7 +2241,7 @@ DECLFOLDER(constfold_assign)
 /// effectively constants, make constants for them an alias them to the
 /// constant.
 void
-RuntimeOptimizer::find_constant_params (ShaderGroup &group)
+RuntimeOptimizer::find_constant_params (ShaderGroup &group, bool local)
 {
     for (int i = inst()->firstparam();  i < inst()->lastparam();  ++i) {
         Symbol *s (inst()->symbol(i));
@@ -2077,6 +2252,8 @@ RuntimeOptimizer::find_constant_params (ShaderGroup &group)
             continue;  // Don't mess with params that can change with the geom
         if (s->typespec().is_structure() || s->typespec().is_closure_based())
             continue;  // We don't mess with struct placeholders or closures
+        if (param_is_agnostic (m_layer, *s))
+            continue;  // Value will be supplied when the group runs
 
         if (s->valuesource() == Symbol::InstanceVal ||
             (s->valuesource() == Symbol::DefaultVal && !s->has_init_ops())) {
@@ -2116,13 +2293,16 @@ RuntimeOptimizer::find_constant_params (ShaderGroup &group)
                     }
                 }
             }
-        } else if (s->valuesource() == Symbol::ConnectedVal) {
+        } else if (s->valuesource() == Symbol::ConnectedVal && ! local) {
             // It's connected to an earlier layer.  If the output var of
             // the upstream shader is effectively constant, then so is
-            // this variable.
+            // this variable.  (Not when optimizing locally, since the
+            // upstream layer may be changing underneath us.)
             BOOST_FOREACH (Connection &c, inst()->connections()) {
                 if (c.dst.param == i) {
                     Symbol *srcsym = group[c.srclayer]->symbol(c.src.param);
+                    if (param_is_agnostic (c.srclayer, *srcsym))
+                        break;   // Not constant, supplied at run time
                     if (!srcsym->everused() &&
                         (srcsym->valuesource() == Symbol::DefaultVal ||
                          srcsym->valuesource() == Symbol::InstanceVal) &&
@@ -2144,6 +2324,25 @@ RuntimeOptimizer::find_constant_params (ShaderGroup &group)
 
 
 
+void
+RuntimeOptimizer::find_agnostic_params ()
+{
+    m_agnostic_params.clear ();
+    m_agnostic_params.resize (m_group.nlayers());
+    for (int layer = 0;  layer < m_group.nlayers();  ++layer) {
+        ShaderInstance *inst = m_group[layer];
+        for (int i = inst->firstparam();  i < inst->lastparam();  ++i) {
+            const Symbol *s = inst->symbol (i);
+            if (param_value_is_agnostic (*s)) {
+                m_agnostic_params[layer].insert (s->name());
+                m_shadingsys.m_stat_agnostic_params += 1;
+            }
+        }
+    }
+}
+
+
+
 /// Set up m_in_conditional[] to be true for all ops that are inside of
 /// conditionals, false for all unconditionally-executed ops.
 void
@@ -2220,6 +2419,129 @@ RuntimeOptimizer::find_basic_blocks (bool do_llvm)
 
 
 
+void
+RuntimeOptimizer::find_symbol_users ()
+{
+    OpcodeVec &code (inst()->ops());
+    size_t nsyms = inst()->symbols().size();
+
+    // Count the uses of each symbol, turn the counts into starting
+    // offsets, then fill in the op numbers.
+    m_sym_users_begin.clear ();
+    m_sym_users_begin.resize (nsyms+1, 0);
+    BOOST_FOREACH (Opcode &op, code)
+        for (int a = 0;  a < op.nargs();  ++a)
+            ++m_sym_users_begin[oparg(op,a)+1];
+    for (size_t s = 0;  s < nsyms;  ++s)
+        m_sym_users_begin[s+1] += m_sym_users_begin[s];
+    m_sym_users.resize (m_sym_users_begin[nsyms]);
+    std::vector<int> next (m_sym_users_begin.begin(),
+                           m_sym_users_begin.end()-1);
+    for (int opnum = 0, e = (int)code.size();  opnum < e;  ++opnum) {
+        Opcode &op (code[opnum]);
+        for (int a = 0;  a < op.nargs();  ++a)
+            m_sym_users[next[oparg(op,a)]++] = opnum;
+    }
+}
+
+
+
+void
+RuntimeOptimizer::mark_users_dirty (int symindex, bool now)
+{
+    // Symbols made since the lists were built have no users listed, but
+    // any op using them has changed, so is already marked.
+    if (symindex+1 >= (int)m_sym_users_begin.size())
+        return;
+    for (int u = m_sym_users_begin[symindex], e = m_sym_users_begin[symindex+1];
+         u < e;  ++u) {
+        int opnum = m_sym_users[u];
+        if (opnum < (int)m_op_dirty.size())
+            m_op_dirty[opnum] = 1;
+        if (now && opnum < (int)m_bblockids.size() &&
+                m_bblockids[opnum] < (int)m_block_visit.size())
+            m_block_visit[m_bblockids[opnum]] = 1;
+    }
+}
+
+
+
+void
+RuntimeOptimizer::mark_changes (const OpcodeVec &oldops,
+                                const std::vector<int> &oldargs,
+                                const std::vector<int> &oldlifetimes)
+{
+    OpcodeVec &code (inst()->ops());
+    std::vector<int> &args (inst()->args());
+    int nops = (int) code.size();
+    if (nops != (int)oldops.size()) {
+        // Ops were inserted, so the op numbers no longer line up.  Just
+        // look at everything again.
+        m_op_dirty.clear ();
+        m_op_dirty.resize (nops, 1);
+        return;
+    }
+
+    // Find the ops that changed.  They need another look, as do all the
+    // users of the symbols they used before or after the change.
+    std::vector<int> nchanged (nops+1, 0);  // changed ops before each op
+    bool jumps_changed = false, messages_changed = false;
+    for (int opnum = 0;  opnum < nops;  ++opnum) {
+        const Opcode &op (code[opnum]), &old (oldops[opnum]);
+        bool same = (op.opname() == old.opname() &&
+                     op.firstarg() == old.firstarg() &&
+                     op.nargs() == old.nargs() &&
+                     op.firstarg()+op.nargs() <= (int)oldargs.size());
+        for (int a = 0;  same && a < op.nargs();  ++a)
+            same = (args[op.firstarg()+a] == oldargs[op.firstarg()+a]);
+        nchanged[opnum+1] = nchanged[opnum] + (same ? 0 : 1);
+        if (same)
+            continue;
+        m_op_dirty[opnum] = 1;
+        for (int a = 0;  a < old.nargs();  ++a)
+            if (old.firstarg()+a < (int)oldargs.size())
+                mark_users_dirty (oldargs[old.firstarg()+a]);
+        for (int a = 0;  a < op.nargs();  ++a)
+            mark_users_dirty (args[op.firstarg()+a]);
+        if (op.jump(0) >= 0 || old.jump(0) >= 0)
+            jumps_changed = true;
+        if (old.opname() == u_setmessage)
+            messages_changed = true;
+    }
+
+    if (jumps_changed) {
+        // The basic blocks and conditional regions moved around
+        std::fill (m_op_dirty.begin(), m_op_dirty.end(), 1);
+        return;
+    }
+
+    for (int opnum = 0;  opnum < nops;  ++opnum) {
+        const Opcode &op (code[opnum]);
+        // A conditional or loop whose body changed may now be empty
+        if (op.jump(0) >= 0) {
+            int end = std::min (op.farthest_jump(), nops);
+            if (end > opnum+1 && nchanged[end] > nchanged[opnum+1])
+                m_op_dirty[opnum] = 1;
+        }
+        // A getmessage may now be impossible
+        if (messages_changed && op.opname() == u_getmessage)
+            m_op_dirty[opnum] = 1;
+    }
+
+    // Users of symbols whose lifetimes or downstream connections
+    // changed may now be optimizable.
+    for (int s = 0, e = (int)oldlifetimes.size()/5;  s < e;  ++s) {
+        const Symbol &sym (*inst()->symbol(s));
+        const int *old = &oldlifetimes[5*s];
+        if (sym.firstread() != old[0] || sym.lastread() != old[1] ||
+            sym.firstwrite() != old[2] || sym.lastwrite() != old[3] ||
+            (int)sym.connected_down() != old[4])
+            mark_users_dirty (s);
+    }
+}
+
+
+
 /// For 'R = A_const' where R and A are different, but coerceable,
 /// types, turn it into a constant assignment of the exact type.
 /// Return true if a change was made, otherwise return false.
@@ -2284,7 +2606,9 @@ RuntimeOptimizer::coerce_assigned_constant (Opcode &op)
 void
 RuntimeOptimizer::clear_stale_syms ()
 {
-    m_stale_syms.clear ();
+    BOOST_FOREACH (int sym, m_stale_list)
+        m_stale_syms[sym] = -1;
+    m_stale_list.clear ();
 }
 
 
@@ -2292,9 +2616,9 @@ RuntimeOptimizer::clear_stale_syms ()
 void
 RuntimeOptimizer::use_stale_sym (int sym)
 {
-    std::map<int,int>::iterator i = m_stale_syms.find(sym);
-    if (i != m_stale_syms.end())
-        m_stale_syms.erase (i);
+    // Leave it in m_stale_list; clearing it again later is harmless.
+    if (sym < (int)m_stale_syms.size())
+        m_stale_syms[sym] = -1;
 }
 
 
@@ -2321,15 +2645,15 @@ RuntimeOptimizer::is_simple_assign (Opcode &op)
 void
 RuntimeOptimizer::simple_sym_assign (int sym, int opnum)
 {
-    if (m_shadingsys.optimize() >= 2) {
-        std::map<int,int>::iterator i = m_stale_syms.find(sym);
-        if (i != m_stale_syms.end()) {
-            Opcode &uselessop (inst()->ops()[i->second]);
-            turn_into_nop (uselessop,
-                           Strutil::format("remove stale value assignment to %s, reassigned on op %d", opargsym(uselessop,0)->name().c_str(), opnum).c_str());
-        }
+    if (sym >= (int)m_stale_syms.size())
+        m_stale_syms.resize (inst()->symbols().size(), -1);
+    if (m_shadingsys.optimize() >= 2 && m_stale_syms[sym] >= 0) {
+        Opcode &uselessop (inst()->ops()[m_stale_syms[sym]]);
+        turn_into_nop (uselessop,
+                       Strutil::format("remove stale value assignment to %s, reassigned on op %d", opargsym(uselessop,0)->name().c_str(), opnum).c_str());
     }
     m_stale_syms[sym] = opnum;
+    m_stale_list.push_back (sym);
 }
 
 
@@ -2500,16 +2824,16 @@ RuntimeOptimizer::dealias_symbol (int symindex, int opnum)
             symindex = i;
             continue;
         }
-        std::map<int,int>::const_iterator found;
-        found = m_symbol_aliases.find (symindex);
-        if (found != m_symbol_aliases.end()) {
+        if (symindex < (int)m_symbol_aliases.size() &&
+                m_symbol_aliases[symindex] >= 0) {
             // permanent alias for the sym
-            symindex = found->second;
+            symindex = m_symbol_aliases[symindex];
             continue;
         }
         if (inst()->symbol(symindex)->symtype() == SymTypeParam &&
             opnum >= inst()->maincodebegin()) {
             // Only check parameter aliases for main code
+            std::map<int,int>::const_iterator found;
             found = m_param_aliases.find (symindex);
             if (found != m_param_aliases.end()) {
                 symindex = found->second;
@@ -2530,7 +2854,10 @@ void
 RuntimeOptimizer::make_symbol_room (int howmany)
 {
     inst()->make_symbol_room (howmany);
-    m_block_aliases.resize (inst()->symbols().size()+howmany, -1);
+    size_t n = inst()->symbols().size()+howmany;
+    m_block_aliases.resize (n, -1);
+    m_symbol_aliases.resize (n, -1);
+    m_stale_syms.resize (n, -1);
 }
 
 
@@ -2670,16 +2997,16 @@ RuntimeOptimizer::mark_outgoing_connections ()
 
 
 void
-RuntimeOptimizer::optimize_instance ()
+RuntimeOptimizer::optimize_instance (bool local)
 {
     // Make a list of the indices of all constants.
     for (int i = 0, e = (int)inst()->symbols().size();  i < e;  ++i)
         if (inst()->symbol(i)->symtype() == SymTypeConst)
-            m_all_consts.push_back (i);
+            add_to_constant_table (i);
 
     // Turn all geom-locked parameters into constants.
     if (m_shadingsys.optimize() >= 2) {
-        find_constant_params (group());
+        find_constant_params (group(), local);
     }
 
 #ifdef DEBUG
@@ -2691,13 +3018,17 @@ RuntimeOptimizer::optimize_instance ()
     }
 #endif
 
-    // Try to fold constants.  We take several passes, until we get to
-    // the point that not much is improving.  It rarely goes beyond 3-4
-    // passes, but we have a hard cutoff at 10 just to be sure we don't
-    // ever get into an infinite loop from an unforseen cycle.  where we
-    // end up inadvertently transforming A => B => A => etc.
+    // Try to fold constants.  We take several passes, until nothing
+    // more changes.  The first pass looks at every op; after that, only
+    // basic blocks holding an op that changed, or an op using a symbol
+    // whose value, alias, or lifetime changed, can have anything new to
+    // offer, so those are the only ones we revisit.  We still have a
+    // hard cutoff at 10 passes just to be sure we don't ever get into an
+    // infinite loop from an unforseen cycle where we end up
+    // inadvertently transforming A => B => A => etc.
     int totalchanged = 0;
-    int reallydone = 0;   // Force one pass after we think we're done
+    m_op_dirty.clear ();
+    m_op_dirty.resize (inst()->ops().size(), 1);
     for (int pass = 0;  pass < 10;  ++pass) {
 
         // Once we've made one pass (and therefore called
@@ -2706,9 +3037,41 @@ RuntimeOptimizer::optimize_instance ()
         if (pass != 0 && inst()->unused())
             break;
 
+        // Stop when nothing is left to revisit
+        if (std::find (m_op_dirty.begin(), m_op_dirty.end(), 1) == m_op_dirty.end())
+            break;
+
+        Timer fold_timer;
+        ++m_stat_opt_passes;
+
         // Track basic blocks and conditional states
         find_conditionals ();
         find_basic_blocks ();
+        find_symbol_users ();
+
+        // Visit the blocks of the ops marked last time, and start the
+        // marks for the next pass afresh.
+        m_block_visit.clear ();
+        m_block_visit.resize (m_bblockids.size() ? m_bblockids.back()+1 : 1, 0);
+        for (size_t i = 0;  i < m_op_dirty.size();  ++i)
+            if (m_op_dirty[i])
+                m_block_visit[m_bblockids[i]] = 1;
+        m_op_dirty.clear ();
+        m_op_dirty.resize (inst()->ops().size(), 0);
+
+        // Remember the code and symbol lifetimes as they were, to see
+        // what this pass changes.
+        OpcodeVec oldops (inst()->ops());
+        std::vector<int> oldargs (inst()->args());
+        std::vector<int> oldlifetimes;
+        oldlifetimes.reserve (inst()->symbols().size() * 5);
+        BOOST_FOREACH (Symbol &s, inst()->symbols()) {
+            oldlifetimes.push_back (s.firstread());
+            oldlifetimes.push_back (s.lastread());
+            oldlifetimes.push_back (s.firstwrite());
+            oldlifetimes.push_back (s.lastwrite());
+            oldlifetimes.push_back (s.connected_down());
+        }
 
         // Constant aliases valid for just this basic block
         clear_block_aliases ();
@@ -2727,6 +3090,22 @@ RuntimeOptimizer::optimize_instance ()
             inst()->ops().reserve (num_ops+1);
             Opcode &op (inst()->ops()[opnum]);
 
+            // Skip blocks with nothing new to look at, but still note the
+            // messages they set, since folding getmessage depends on it.
+            if (! m_block_visit[m_bblockids[opnum]]) {
+                if (op.opname() == u_setmessage &&
+                        m_shadingsys.optimize() >= 2) {
+                    Symbol &Name (*opargsym (op, 0));
+                    if (Name.is_constant())
+                        register_message (*(ustring *)Name.data());
+                    else
+                        register_unknown_message ();
+                }
+                ++m_stat_opt_ops_skipped;
+                continue;
+            }
+            ++m_stat_opt_ops_visited;
+
             // Find the farthest this instruction jumps to (-1 for ops
             // that don't jump) so we can mark conditional regions.
             int jumpend = op.farthest_jump();
@@ -2879,15 +3258,16 @@ RuntimeOptimizer::optimize_instance ()
 
         }
 
-        totalchanged += changed;
-        // info ("Pass %d, changed %d\n", pass, changed);
+        m_stat_opt_fold_time += fold_timer();
 
         // Now that we've rewritten the code, we need to re-track the
         // variable lifetimes.
+        Timer lifetime_timer;
         track_variable_lifetimes ();
 
         // Recompute which of our params have downstream connections.
         mark_outgoing_connections ();
+        m_stat_opt_lifetime_time += lifetime_timer();
 
         // Elide unconnected parameters that are never read.
         FOREACH_PARAM (Symbol &s, inst()) {
@@ -2899,20 +3279,22 @@ RuntimeOptimizer::optimize_instance ()
             }
         }
 
+        totalchanged += changed;
+        // info ("Pass %d, changed %d\n", pass, changed);
+
         // FIXME -- we should re-evaluate whether writes_globals() is still
         // true for this layer.
 
-        // If nothing changed, we're done optimizing.  But wait, it may be
-        // that after re-tracking variable lifetimes, we can notice new
-        // optimizations!  So force another pass, then we're really done.
-        if (changed < 1) {
-            if (++reallydone > 3)
-                break;
-        } else {
-            reallydone = 0;
-        }
+        // Mark what needs another look in the next pass.
+        mark_changes (oldops, oldargs, oldlifetimes);
     }
 
+    // Everything below changes what the other layers see (our
+    // connections and the messages we send), so it waits for the
+    // serial passes.
+    if (local)
+        return;
+
     // A layer that was allowed to run lazily originally, if it no
     // longer (post-optimized) has any outgoing connections, is no
     // longer needed at all.
@@ -2983,20 +3365,6 @@ RuntimeOptimizer::track_variable_lifetimes ()
 
 
 
-// Add to the dependency map that "symbol A depends on symbol B".
-void
-RuntimeOptimizer::add_dependency (SymDependency &dmap, int A, int B)
-{
-    ASSERT (A < (int)inst()->symbols().size());
-    ASSERT (B < (int)inst()->symbols().size());
-    dmap[A].insert (B);
-    // Unification -- make all of B's dependencies be dependencies of A.
-    BOOST_FOREACH (int r, dmap[B])
-        dmap[A].insert (r);
-}
-
-
-
 void
 RuntimeOptimizer::syms_used_in_op (Opcode &op, std::vector<int> &rsyms,
                                    std::vector<int> &wsyms)
@@ -3016,21 +3384,14 @@ RuntimeOptimizer::syms_used_in_op (Opcode &op, std::vector<int> &rsyms,
 
 
 
-// Fake symbol index for "derivatives" entry in dependency map.
-static const int DerivSym = -1;
-
-
-
 /// Run through all the ops, for each one marking its 'written'
-/// arguments as dependent upon its 'read' arguments (and performing
-/// unification as we go), yielding a dependency map that lets us look
-/// up any symbol and see the set of other symbols on which it ever
-/// depends on during execution of the shader.
+/// arguments as dependent upon its 'read' arguments, yielding flat
+/// per-symbol lists of the symbols each one directly depends on.  Any
+/// symbol reachable through those lists from one that needs derivatives
+/// needs them too.
 void
 RuntimeOptimizer::track_variable_dependencies ()
 {
-    SymDependency symdeps;
-
     // It's important to note that this is simplistically conservative
     // in that it overestimates dependencies.  To see why this is the
     // case, consider the following code:
@@ -3059,8 +3420,12 @@ RuntimeOptimizer::track_variable_dependencies ()
     // cause them to be reassigned in exactly the way that confuses this
     // analysis).
 
-    symdeps.clear ();
+    int nsyms = (int) inst()->symbols().size();
 
+    // Gather every "w depends on r" edge, and the symbols whose
+    // derivatives are taken by an op.
+    std::vector<std::pair<int,int> > edges;
+    std::vector<int> needderivs;
     std::vector<int> read, written;
     // Loop over all ops...
     BOOST_FOREACH (Opcode &op, inst()->ops()) {
@@ -3073,37 +3438,49 @@ RuntimeOptimizer::track_variable_dependencies ()
         // FIXME -- special cases here!  like if any ops implicitly read
         // or write to globals without them needing to be arguments.
 
-        // For each symbol w written by the op...
-        BOOST_FOREACH (int w, written) {
-            // For each symbol r read by the op, make w depend on r.
-            // (Unless r is a constant , in which case it's not necessary.)
+        // For each symbol w written by the op, make w depend on each
+        // symbol r read by the op.  (Unless r is a constant, in which
+        // case it's not necessary.)
+        BOOST_FOREACH (int w, written)
             BOOST_FOREACH (int r, read)
                 if (inst()->symbol(r)->symtype() != SymTypeConst)
-                    add_dependency (symdeps, w, r);
-            // If the op takes derivs, make the pseudo-symbol DerivSym
-            // depend on those arguments.
-            if (op.argtakesderivs_all()) {
-                for (int a = 0;  a < op.nargs();  ++a)
-                    if (op.argtakesderivs(a)) {
-                        Symbol &s (*opargsym (op, a));
-                        // Constants can't take derivs
-                        if (s.symtype() == SymTypeConst)
-                            continue;
-                        // Careful -- not all globals can take derivs
-                        if (s.symtype() == SymTypeGlobal &&
-                            ! (s.mangled() == Strings::P ||
-                               s.mangled() == Strings::I ||
-                               s.mangled() == Strings::u ||
-                               s.mangled() == Strings::v ||
-                               s.mangled() == Strings::Ps))
-                            continue;
-                        add_dependency (symdeps, DerivSym,
-                                        inst()->arg(a+op.firstarg()));
-                    }
-            }
+                    edges.push_back (std::make_pair (w, r));
+
+        // If the op takes derivs (and writes anything), its arguments
+        // need derivs.
+        if (written.size() && op.argtakesderivs_all()) {
+            for (int a = 0;  a < op.nargs();  ++a)
+                if (op.argtakesderivs(a)) {
+                    Symbol &s (*opargsym (op, a));
+                    // Constants can't take derivs
+                    if (s.symtype() == SymTypeConst)
+                        continue;
+                    // Careful -- not all globals can take derivs
+                    if (s.symtype() == SymTypeGlobal &&
+                        ! (s.mangled() == Strings::P ||
+                           s.mangled() == Strings::I ||
+                           s.mangled() == Strings::u ||
+                           s.mangled() == Strings::v ||
+                           s.mangled() == Strings::Ps))
+                        continue;
+                    needderivs.push_back (inst()->arg(a+op.firstarg()));
+                }
         }
     }
 
+    // Sort the edges into flat lists: the symbols that symbol i depends
+    // on are deps[depsbegin[i] .. depsbegin[i+1]-1].
+    std::vector<int> depsbegin (nsyms+1, 0), deps (edges.size());
+    for (size_t e = 0;  e < edges.size();  ++e)
+        ++depsbegin[edges[e].first+1];
+    for (int i = 0;  i < nsyms;  ++i)
+        depsbegin[i+1] += depsbegin[i];
+    {
+        std::vector<int> next (depsbegin.begin(), depsbegin.end()-1);
+        for (size_t e = 0;  e < edges.size();  ++e)
+            deps[next[edges[e].first]++] = edges[e].second;
+    }
+
     // Propagate derivative dependencies for any syms already known to
     // need derivs.  It's probably marked that way because another layer
     // downstream connects to it and needs derivatives of that
@@ -3117,16 +3494,26 @@ RuntimeOptimizer::track_variable_dependencies ()
               !s.typespec().is_closure_based() && s.mangled() != Strings::N)
             s.has_derivs(true);
         if (s.has_derivs())
-            add_dependency (symdeps, DerivSym, snum);
+            needderivs.push_back (snum);
         ++snum;
     }
 
-    // Mark all symbols needing derivatives as such
-    BOOST_FOREACH (int d, symdeps[DerivSym]) {
+    // Everything those symbols depend on needs derivs too.  Walk the
+    // dependencies with a worklist, visiting each symbol once.
+    std::vector<char> visited (nsyms, 0);
+    while (needderivs.size()) {
+        int d = needderivs.back();
+        needderivs.pop_back ();
+        if (visited[d])
+            continue;
+        visited[d] = 1;
         Symbol *s = inst()->symbol(d);
         if (! s->typespec().is_closure_based() && 
                 s->typespec().elementtype().is_floatbased())
             s->has_derivs (true);
+        for (int i = depsbegin[d];  i < depsbegin[d+1];  ++i)
+            if (! visited[deps[i]])
+                needderivs.push_back (deps[i]);
     }
 
     // Only some globals are allowed to have derivatives
@@ -3139,49 +3526,6 @@ RuntimeOptimizer::track_variable_dependencies ()
                s.mangled() == Strings::Ps))
             s.has_derivs (false);
     }
-
-#if 0
-    // Helpful for debugging
-
-    std::cerr << "track_variable_dependencies\n";
-    std::cerr << "\nDependencies:\n";
-    BOOST_FOREACH (SymDependency::value_type &m, symdeps) {
-        if (m.first == DerivSym)
-            std::cerr << "$derivs depends on ";
-        else
-            std::cerr << inst->symbol(m.first)->mangled() << " depends on ";
-        BOOST_FOREACH (int d, m.second) {
-            if (d == DerivSym)
-                std::cerr << "$derivs ";
-            else
-                std::cerr << inst->symbol(d)->mangled() << ' ';
-        }
-        std::cerr << "\n";
-    }
-    std::cerr << "\n\n";
-
-    // Invert the dependency
-    SymDependency influences;
-    BOOST_FOREACH (SymDependency::value_type &m, symdeps)
-        BOOST_FOREACH (int d, m.second)
-            influences[d].insert (m.first);
-
-    std::cerr << "\nReverse dependencies:\n";
-    BOOST_FOREACH (SymDependency::value_type &m, influences) {
-        if (m.first == DerivSym)
-            std::cerr << "$derivs contrbutes to ";
-        else
-            std::cerr << inst->symbol(m.first)->mangled() << " contributes to ";
-        BOOST_FOREACH (int d, m.second) {
-            if (d == DerivSym)
-                std::cerr << "$derivs ";
-            else
-                std::cerr << inst->symbol(d)->mangled() << ' ';
-        }
-        std::cerr << "\n";
-    }
-    std::cerr << "\n\n";
-#endif
 }
 
 
@@ -3433,6 +3777,122 @@ RuntimeOptimizer::collapse_ops ()
 
 
 
+void
+RuntimeOptimizer::optimize_layer_locally (int layer)
+{
+    set_inst (layer);
+    m_inst->copy_code_from_master ();
+    m_stat_preopt_syms += inst()->symbols().size();
+    m_stat_preopt_ops += inst()->ops().size();
+    // We don't know which messages the other layers send, so never
+    // fold a getmessage here.
+    m_unknown_message_sent = true;
+    optimize_instance (true);
+}
+
+
+
+void
+RuntimeOptimizer::post_optimize_layer (int layer)
+{
+    set_inst (layer);
+    if (! inst()->unused())
+        post_optimize_instance ();
+}
+
+
+
+/// Groups with fewer layers than this aren't worth farming out.
+static const int min_parallel_layers = 16;
+
+
+
+namespace {
+
+/// What parallel_layers shares with the JIT workers helping it.  They
+/// hold it by shared_ptr, because a worker may only get to its task
+/// after the job is over, in which case it just does nothing.
+struct LayerJob {
+    RuntimeOptimizer *rop;
+    RuntimeOptimizer::LayerTask task;
+    atomic_int nextlayer;          ///< Next layer to hand out
+    spin_mutex mutex;              ///< Guards merging the helpers' stats
+    boost::mutex state_mutex;      ///< Guards running and closed
+    boost::condition_variable done; ///< Signals the last helper is done
+    int running;                   ///< Helpers at work
+    bool closed;                   ///< Too late for helpers to join?
+    LayerJob () : rop(NULL), task(NULL), running(0), closed(false) {
+        nextlayer = 0;
+    }
+};
+
+};  // anonymous namespace
+
+
+
+static void
+layer_job_helper (shared_ptr<LayerJob> job)
+{
+    {
+        boost::lock_guard<boost::mutex> lock (job->state_mutex);
+        if (job->closed)
+            return;
+        ++job->running;
+    }
+    job->rop->layer_worker (job->task, &job->nextlayer, &job->mutex);
+    boost::lock_guard<boost::mutex> lock (job->state_mutex);
+    if (--job->running == 0)
+        job->done.notify_all ();
+}
+
+
+
+void
+RuntimeOptimizer::layer_worker (LayerTask task, atomic_int *nextlayer,
+                                spin_mutex *mutex)
+{
+    RuntimeOptimizer rop (m_shadingsys, m_group);
+    rop.m_agnostic_params = m_agnostic_params;
+    int nlayers = m_group.nlayers ();
+    for (int layer = (*nextlayer)++;  layer < nlayers;  layer = (*nextlayer)++)
+        (rop.*task) (layer);
+
+    spin_lock lock (*mutex);
+    // Constants we add later must not reuse any name the workers made
+    m_next_newconst = std::max (m_next_newconst, rop.m_next_newconst);
+    m_stat_const_lookup_time += rop.m_stat_const_lookup_time;
+    m_stat_const_lookups += rop.m_stat_const_lookups;
+    m_stat_opt_fold_time += rop.m_stat_opt_fold_time;
+    m_stat_opt_lifetime_time += rop.m_stat_opt_lifetime_time;
+    m_stat_opt_passes += rop.m_stat_opt_passes;
+    m_stat_opt_ops_visited += rop.m_stat_opt_ops_visited;
+    m_stat_opt_ops_skipped += rop.m_stat_opt_ops_skipped;
+    m_stat_preopt_syms += rop.m_stat_preopt_syms;
+    m_stat_preopt_ops += rop.m_stat_preopt_ops;
+}
+
+
+
+void
+RuntimeOptimizer::parallel_layers (LayerTask task, int nthreads)
+{
+    shared_ptr<LayerJob> job (new LayerJob);
+    job->rop = this;
+    job->task = task;
+    // Offer the work to the JIT workers rather than starting threads
+    // of our own, so that we only ever get help from idle ones.  We
+    // pitch in ourselves, and do whatever they don't get to.
+    for (int t = 1;  t < nthreads;  ++t)
+        m_shadingsys.submit_compile_task (boost::bind (layer_job_helper, job));
+    layer_worker (task, &job->nextlayer, &job->mutex);
+    boost::unique_lock<boost::mutex> lock (job->state_mutex);
+    job->closed = true;
+    while (job->running)
+        job->done.wait (lock);
+}
+
+
+
 void
 RuntimeOptimizer::optimize_group ()
 {
@@ -3456,20 +3916,65 @@ RuntimeOptimizer::optimize_group ()
     if (m_shadingsys.m_closure_registry.empty())
         m_shadingsys.register_builtin_closures();
 
+    // Figure out which params we must leave alone, before the
+    // optimizer starts changing them.
+    if (m_shadingsys.m_paramagnostic)
+        find_agnostic_params ();
+
+    // If there's an on-disk JIT cache, see if the group is already in
+    // it.  If not, generate relocatable code so that we can add it.
+    // Profiled code has this run's counter ids baked in, so it can
+    // neither come from nor go into the cache.  Code compiled ahead of
+    // time is always relocatable, and is never cached.
+    if (! m_aot_filename.empty()) {
+        m_jitcache_fingerprint = jitcache_fingerprint (false);
+        m_llvm_relocatable = true;
+    } else if (m_shadingsys.m_jitcache && ! m_shadingsys.profile()) {
+        m_jitcache_fingerprint = jitcache_fingerprint ();
+        if (jitcache_load ())
+            return;
+        m_llvm_relocatable = true;
+    }
+
+    // Big groups get a head start: copy and fold each layer on its
+    // own, all at once, before the passes that propagate values between
+    // layers.  Those only have to finish the job.  (Not when debugging,
+    // so that the printouts stay in order.)
+    bool parallel = (m_shadingsys.m_optimize_threads != 1 &&
+                     nlayers >= min_parallel_layers &&
+                     ! m_shadingsys.debug() &&
+                     m_shadingsys.m_debug_groupname.empty() &&
+                     m_shadingsys.m_debug_layername.empty());
+    int nthreads = 1;
+    if (parallel) {
+        // threads <= 0 means us plus every JIT worker that greedyjit or
+        // tieredjit already started -- just us if there are none, since
+        // a pool shouldn't appear behind the renderer's back.
+        nthreads = m_shadingsys.m_optimize_threads;
+        if (nthreads < 1)
+            nthreads = m_shadingsys.compile_threads () + 1;
+        parallel = (nthreads > 1);
+    }
+    if (parallel) {
+        parallel_layers (&RuntimeOptimizer::optimize_layer_locally,
+                         std::min (nthreads, nlayers));
+        ++m_shadingsys.m_stat_groups_parallel_opt;
+    }
+
     // Optimize each layer, from first to last
-    size_t old_nsyms = 0, old_nops = 0;
     for (int layer = 0;  layer < nlayers;  ++layer) {
         set_inst (layer);
-        m_inst->copy_code_from_master ();
-        if (debug() && m_shadingsys.optimize() >= 1) {
-            std::cout << "Before optimizing layer " << layer << " " 
-                      << inst()->layername() 
-                      << ", I get:\n" << inst()->print()
-                      << "\n--------------------------------\n\n";
+        if (! parallel) {
+            m_inst->copy_code_from_master ();
+            if (debug() && m_shadingsys.optimize() >= 1) {
+                std::cout << "Before optimizing layer " << layer << " " 
+                          << inst()->layername() 
+                          << ", I get:\n" << inst()->print()
+                          << "\n--------------------------------\n\n";
+            }
+            m_stat_preopt_syms += inst()->symbols().size();
+            m_stat_preopt_ops += inst()->ops().size();
         }
-
-        old_nsyms += inst()->symbols().size();
-        old_nops += inst()->ops().size();
         optimize_instance ();
     }
 
@@ -3482,6 +3987,7 @@ RuntimeOptimizer::optimize_group ()
             optimize_instance ();
     }
 
+    Timer deps_timer;
     for (int layer = nlayers-1;  layer >= 0;  --layer) {
         set_inst (layer);
         track_variable_dependencies ();
@@ -3501,14 +4007,22 @@ RuntimeOptimizer::optimize_group ()
         }
     }
 
+    m_stat_opt_deps_time = deps_timer();
+
     // Post-opt cleanup: add useparam, coalesce temporaries, etc.
-    for (int layer = 0;  layer < nlayers;  ++layer) {
-        set_inst (layer);
-        if (! inst()->unused())
-            post_optimize_instance ();
+    Timer post_timer;
+    if (parallel) {
+        parallel_layers (&RuntimeOptimizer::post_optimize_layer,
+                         std::min (nthreads, nlayers));
+    } else {
+        for (int layer = 0;  layer < nlayers;  ++layer)
+            post_optimize_layer (layer);
     }
 
-    // Get rid of nop instructions and unused symbols.
+    // Get rid of nop instructions and unused symbols.  Collapsing the
+    // symbols renumbers the connections of later layers, so this part
+    // stays serial.
+    size_t old_nsyms = m_stat_preopt_syms, old_nops = m_stat_preopt_ops;
     size_t new_nsyms = 0, new_nops = 0;
     for (int layer = 0;  layer < nlayers;  ++layer) {
         set_inst (layer);
@@ -3528,6 +4042,7 @@ RuntimeOptimizer::optimize_group ()
         new_nsyms += inst()->symbols().size();
         new_nops += inst()->ops().size();
     }
+    m_stat_opt_post_time = post_timer();
 
     m_stat_specialization_time = rop_timer();
 
@@ -3598,86 +4113,471 @@ ShadingSystemImpl::optimize_group (ShadingAttribState &attribstate,
 {
     Timer timer;
     lock_guard lock (group.m_mutex);
+    ShadingStats &stats (thread_stats());
     if (group.optimized()) {
-        spin_lock stat_lock (m_stat_mutex);
         double t = timer();
-        m_stat_optimization_time += t;
-        m_stat_opt_locking_time += t;
+        stats.optimization_time += t;
+        stats.opt_locking_time += t;
         return;
     }
     double locking_time = timer();
 
+    // If an identical group has been seen already, we can just use its
+    // results.  Otherwise, register this one as the first of its kind.
+    // (Not when we're restricting compilation to one group by name,
+    // since then identical groups can have different outcomes.)
+    ShadingAttribStateRef canon_sas;
+    ShaderGroup *canon = NULL;
+    if (m_dedupgroups && ! m_only_groupname && group.nlayers()) {
+        bool paramagnostic = m_paramagnostic;
+        const std::string &fingerprint (group.fingerprint (paramagnostic));
+        unsigned long long hash = fnv1a_hash (fingerprint.data(),
+                                              fingerprint.size());
+        spin_lock registry_lock (m_group_registry_mutex);
+        if (m_group_registry.size() >= m_group_registry_sweep) {
+            for (GroupRegistry::iterator i = m_group_registry.begin();
+                 i != m_group_registry.end(); ) {
+                if (i->second.sas.expired())
+                    m_group_registry.erase (i++);
+                else
+                    ++i;
+            }
+            m_group_registry_sweep = std::max (size_t(64),
+                                               2 * m_group_registry.size());
+        }
+        GroupRegistryEntry &entry (m_group_registry[hash]);
+        canon_sas = entry.sas.lock ();
+        // Only compare against the flavor of fingerprint the other group
+        // was registered with -- it's the only one sure to be computed
+        // already.  (Treating a cross-flavor match as a miss just costs
+        // a compile.)
+        if (canon_sas && entry.group != &group &&
+              entry.paramagnostic == paramagnostic &&
+              entry.group->fingerprint (paramagnostic) == fingerprint) {
+            canon = entry.group;
+        } else if (canon_sas && entry.group != &group) {
+            // A different group that happens to share the hash, and got
+            // here first.  Just compile this one on its own.
+            canon_sas.reset ();
+        } else {
+            entry.sas = attribstate.shared_from_this ();
+            entry.group = &group;
+            entry.paramagnostic = paramagnostic;
+        }
+    }
+    if (canon) {
+        // Compile the original (or wait for whoever is doing so).  N.B.
+        // it can't be waiting on us: first-of-a-kind groups never
+        // lock another group.
+        optimize_group (*canon_sas, *canon);
+        group.share_compiled (*canon);
+        attribstate.changed_shaders ();
+        group.m_optimized = true;
+        stats.groups_deduped += 1;
+        stats.dedup_code_saved += (long long) canon->llvm_code_size();
+        stats.optimization_time += timer();
+        stats.opt_locking_time += locking_time;
+        return;
+    }
+
     RuntimeOptimizer rop (*this, group);
     rop.optimize_group ();
+    group.build_param_block ();
 
     attribstate.changed_shaders ();
     group.m_optimized = true;
-    spin_lock stat_lock (m_stat_mutex);
-    m_stat_optimization_time += timer();
-    m_stat_opt_locking_time += locking_time + rop.m_stat_opt_locking_time;
-    m_stat_specialization_time += rop.m_stat_specialization_time;
-    m_stat_total_llvm_time += rop.m_stat_total_llvm_time;
-    m_stat_llvm_setup_time += rop.m_stat_llvm_setup_time;
-    m_stat_llvm_irgen_time += rop.m_stat_llvm_irgen_time;
-    m_stat_llvm_opt_time += rop.m_stat_llvm_opt_time;
-    m_stat_llvm_jit_time += rop.m_stat_llvm_jit_time;
-    m_stat_groups_compiled += 1;
-    m_stat_instances_compiled += group.nlayers();
+    stats.optimization_time += timer();
+    stats.opt_locking_time += locking_time;
+    add_optimizer_stats (stats, rop);
+    stats.groups_compiled += 1;
+    stats.instances_compiled += group.nlayers();
 }
 
 
 
-static void optimize_all_groups_wrapper (ShadingSystemImpl *ss)
+void
+ShadingSystemImpl::add_optimizer_stats (ShadingStats &stats,
+                                        const RuntimeOptimizer &rop)
 {
-    ss->optimize_all_groups (1);
+    stats.opt_locking_time += rop.m_stat_opt_locking_time;
+    stats.specialization_time += rop.m_stat_specialization_time;
+    stats.const_lookup_time += rop.m_stat_const_lookup_time;
+    stats.const_lookups += rop.m_stat_const_lookups;
+    stats.opt_fold_time += rop.m_stat_opt_fold_time;
+    stats.opt_lifetime_time += rop.m_stat_opt_lifetime_time;
+    stats.opt_deps_time += rop.m_stat_opt_deps_time;
+    stats.opt_post_time += rop.m_stat_opt_post_time;
+    stats.opt_passes += rop.m_stat_opt_passes;
+    stats.opt_ops_visited += rop.m_stat_opt_ops_visited;
+    stats.opt_ops_skipped += rop.m_stat_opt_ops_skipped;
+    stats.total_llvm_time += rop.m_stat_total_llvm_time;
+    stats.llvm_setup_time += rop.m_stat_llvm_setup_time;
+    stats.llvm_ops_parse_time += rop.m_stat_llvm_ops_parse_time;
+    stats.llvm_ops_clone_time += rop.m_stat_llvm_ops_clone_time;
+    stats.llvm_irgen_time += rop.m_stat_llvm_irgen_time;
+    stats.llvm_opt_time += rop.m_stat_llvm_opt_time;
+    stats.llvm_jit_time += rop.m_stat_llvm_jit_time;
+    stats.jitcache_load_time += rop.m_stat_jitcache_load_time;
 }
 
 
 
 void
-ShadingSystemImpl::optimize_all_groups (int nthreads)
+ShadingSystemImpl::submit_group_to_compile (ShadingAttribStateRef &sas)
 {
-    if (! m_greedyjit) {
-        // No greedy JIT, just free any groups we've recorded
-        spin_lock lock (m_groups_to_compile_mutex);
-        m_groups_to_compile.clear ();
-        m_groups_to_compile_count = 0;
-        return;
+    start_compile_threads (m_jitthreads);
+    ++m_compile_pending;
+    int q = (m_compile_next_queue++) % (int)m_compile_queues.size();
+    if (q < 0)
+        q += (int)m_compile_queues.size();
+    {
+        CompileQueue &queue (*m_compile_queues[q]);
+        spin_lock lock (queue.mutex);
+        queue.groups.push_back (sas);
+    }
+    // Bump the count and signal while holding the mutex, so a worker
+    // that just found every queue empty can't miss the wakeup.
+    boost::lock_guard<boost::mutex> lock (m_compile_mutex);
+    ++m_compile_queued;
+    m_compile_cond.notify_all ();
+}
+
+
+
+void
+ShadingSystemImpl::submit_declared_group ()
+{
+    ShadingAttribStateRef sas;
+    {
+        spin_lock lock (m_declared_group_mutex);
+        sas.swap (m_declared_group);
+    }
+    if (sas)
+        submit_group_to_compile (sas);
+}
+
+
+
+void
+ShadingSystemImpl::request_tier2 (ShadingAttribState &sas, ShaderGroup &group)
+{
+    if (group.request_llvm_tier2 ()) {
+        ShadingAttribStateRef sasref (sas.shared_from_this());
+        submit_group_to_compile (sasref);
+    }
+}
+
+
+
+void
+ShadingSystemImpl::reoptimize_group (ShadingAttribState &sas,
+                                     ShaderGroup &group)
+{
+    Timer timer;
+    lock_guard lock (group.m_mutex);
+    // Deduped groups share their compiled code, so also lock that, lest
+    // two of them re-JIT it at once.
+    lock_guard tier2_lock (group.llvm_tier2_mutex());
+    if (! group.llvm_tier2_pending())
+        return;   // already done (or failed, or another group did it)
+    ShadingStats &stats (thread_stats());
+    RuntimeOptimizer rop (*this, group);
+    if (rop.reoptimize_group ())
+        stats.tier2_groups += 1;
+    stats.tier2_time += timer();
+    stats.llvm_ops_parse_time += rop.m_stat_llvm_ops_parse_time;
+    stats.llvm_ops_clone_time += rop.m_stat_llvm_ops_clone_time;
+}
+
+
+
+bool
+ShadingSystemImpl::write_compiled_group (ShadingAttribState &sas,
+                                         const char *filename)
+{
+    Timer timer;
+    ShaderGroup &group (sas.shadergroup (ShadUseSurface));
+    lock_guard lock (group.m_mutex);
+    if (! group.nlayers() || group.optimized()) {
+        error ("write_compiled_group: group %s is %s", group.name().c_str(),
+               group.nlayers() ? "already compiled" : "empty");
+        return false;
+    }
+    if (profile() || m_only_groupname) {
+        error ("write_compiled_group: not possible with \"%s\" set",
+               profile() ? "profile" : "only_groupname");
+        return false;
     }
 
-    // Spawn a bunch of threads to do this in parallel -- just call this
-    // routine again (with threads=1) for each thread.
+    RuntimeOptimizer rop (*this, group);
+    rop.aot_output (filename);
+    rop.optimize_group ();
+    group.build_param_block ();
+
+    sas.changed_shaders ();
+    group.m_optimized = true;
+    ShadingStats &stats (thread_stats());
+    stats.optimization_time += timer();
+    add_optimizer_stats (stats, rop);
+    stats.groups_compiled += 1;
+    stats.instances_compiled += group.nlayers();
+    if (rop.aot_written ())
+        stats.aot_groups_written += 1;
+    return rop.aot_written ();
+}
+
+
+
+bool
+ShadingSystemImpl::register_compiled_group (ShadingAttribState &sas,
+                                            const char *filename)
+{
+    Timer timer;
+    ShaderGroup &group (sas.shadergroup (ShadUseSurface));
+    lock_guard lock (group.m_mutex);
+    if (! group.nlayers() || group.optimized()) {
+        error ("register_compiled_group: group %s is %s", group.name().c_str(),
+               group.nlayers() ? "already compiled" : "empty");
+        return false;
+    }
+
+    // The closures are part of what identifies the group
+    if (m_closure_registry.empty())
+        register_builtin_closures();
+
+    RuntimeOptimizer rop (*this, group);
+    if (! rop.aot_load (filename))
+        return false;
+    group.build_param_block ();
+
+    sas.changed_shaders ();
+    group.m_optimized = true;
+    {
+        // Nothing left for the greedy JIT workers to do with it
+        spin_lock lock (m_declared_group_mutex);
+        if (m_declared_group.get() == &sas)
+            m_declared_group.reset ();
+    }
+    ShadingStats &stats (thread_stats());
+    stats.aot_groups_registered += 1;
+    stats.aot_register_time += timer();
+    return true;
+}
+
+
+
+int
+ShadingSystemImpl::compile_threads ()
+{
+    boost::lock_guard<boost::mutex> lock (m_compile_mutex);
+    return (int) m_compile_queues.size();
+}
+
+
+
+void
+ShadingSystemImpl::submit_compile_task (const CompileTask &task)
+{
+    start_compile_threads (m_jitthreads);
+    {
+        spin_lock lock (m_compile_tasks_mutex);
+        m_compile_tasks.push_back (task);
+    }
+    boost::lock_guard<boost::mutex> lock (m_compile_mutex);
+    ++m_compile_queued;
+    m_compile_cond.notify_all ();
+}
+
+
+
+bool
+ShadingSystemImpl::run_compile_task ()
+{
+    CompileTask task;
+    {
+        spin_lock lock (m_compile_tasks_mutex);
+        if (m_compile_tasks.empty())
+            return false;
+        task.swap (m_compile_tasks.front());
+        m_compile_tasks.pop_front ();
+        --m_compile_queued;
+    }
+    task ();
+    return true;
+}
+
+
+
+static void compile_worker_wrapper (ShadingSystemImpl *ss, int id)
+{
+    ss->compile_worker (id);
+}
+
+
+
+void
+ShadingSystemImpl::start_compile_threads (int nthreads)
+{
+    boost::lock_guard<boost::mutex> lock (m_compile_mutex);
+    if (m_compile_queues.size() || m_compile_shutdown)
+        return;   // already running (or shutting down)
     if (nthreads < 1)  // threads <= 0 means use all hardware available
-        nthreads = std::min ((int)boost::thread::hardware_concurrency(),
-                             (int)m_groups_to_compile_count);
-    if (nthreads > 1) {
-        if (m_threads_currently_compiling)
-            return;   // never mind, somebody else spawned the JIT threads
-        boost::thread_group threads;
-        m_threads_currently_compiling += nthreads;
-        for (int t = 0;  t < nthreads;  ++t)
-            threads.add_thread (new boost::thread (optimize_all_groups_wrapper, this));
-        threads.join_all ();
-        m_threads_currently_compiling -= nthreads;
-        return;
+        nthreads = (int) boost::thread::hardware_concurrency();
+    nthreads = std::max (nthreads, 1);
+    // Create all the queues before any worker can look at them
+    for (int t = 0;  t < nthreads;  ++t)
+        m_compile_queues.push_back (shared_ptr<CompileQueue>(new CompileQueue));
+    for (int t = 0;  t < nthreads;  ++t)
+        m_compile_threads.add_thread (new boost::thread (compile_worker_wrapper, this, t));
+}
+
+
+
+void
+ShadingSystemImpl::stop_compile_threads ()
+{
+    {
+        boost::lock_guard<boost::mutex> lock (m_compile_mutex);
+        m_compile_shutdown = true;
+        m_compile_cond.notify_all ();
+    }
+    // Workers finish the group they're on, if any, then exit
+    m_compile_threads.join_all ();
+    BOOST_FOREACH (shared_ptr<CompileQueue> &queue, m_compile_queues) {
+        spin_lock lock (queue->mutex);
+        queue->groups.clear ();
     }
+    {
+        spin_lock lock (m_compile_tasks_mutex);
+        m_compile_tasks.clear ();
+    }
+    m_compile_queued = 0;
+    m_compile_pending = 0;
+}
+
+
+
+bool
+ShadingSystemImpl::next_group_to_compile (int id, ShadingAttribStateRef &sas)
+{
+    int nqueues = (int) m_compile_queues.size();
+    if (! m_compile_queued || ! nqueues)
+        return false;
+    // Our own queue first, newest group first
+    if (id >= 0) {
+        CompileQueue &queue (*m_compile_queues[id]);
+        spin_lock lock (queue.mutex);
+        if (! queue.groups.empty()) {
+            sas = queue.groups.back ();
+            queue.groups.pop_back ();
+            --m_compile_queued;
+            return true;
+        }
+    }
+    // Then steal the oldest group from somebody else, starting with our
+    // neighbor so that idle workers don't all pile onto the same queue.
+    for (int i = 1;  i <= nqueues;  ++i) {
+        int victim = (std::max(id,0) + i) % nqueues;
+        if (victim == id)
+            continue;
+        CompileQueue &queue (*m_compile_queues[victim]);
+        spin_lock lock (queue.mutex);
+        if (! queue.groups.empty()) {
+            sas = queue.groups.front ();
+            queue.groups.pop_front ();
+            --m_compile_queued;
+            ++m_stat_jit_steals;
+            return true;
+        }
+    }
+    return false;
+}
+
+
 
-    // And here's the single thread case
-    while (m_groups_to_compile_count) {
+void
+ShadingSystemImpl::compile_queued_group (ShadingAttribStateRef &sas)
+{
+    if (! sas.unique()) {   // don't compile if nobody recorded it but us
+        ShaderGroup &sgroup (sas->shadergroup (ShadUseSurface));
+        // If a render thread already demanded this group, it compiled
+        // it (or holds its lock and is doing so) -- optimize_group
+        // notices and returns without redoing the work.
+        optimize_group (*sas, sgroup);
+        if (sgroup.llvm_tier2_requested())
+            reoptimize_group (*sas, sgroup);
+    }
+    sas.reset ();
+    if (--m_compile_pending == 0) {
+        // Wake anybody in optimize_all_groups waiting for us to finish
+        boost::lock_guard<boost::mutex> lock (m_compile_mutex);
+        m_compile_cond.notify_all ();
+    }
+}
+
+
+
+void
+ShadingSystemImpl::compile_worker (int id)
+{
+    while (1) {
+        // Help finish groups already being optimized before starting
+        // on another one
+        if (run_compile_task ())
+            continue;
         ShadingAttribStateRef sas;
-        {
-            spin_lock lock (m_groups_to_compile_mutex);
-            if (m_groups_to_compile.size() == 0)
-                return;  // Nothing left to compile
-            sas = m_groups_to_compile.back ();
-            m_groups_to_compile.pop_back ();
+        if (next_group_to_compile (id, sas)) {
+            compile_queued_group (sas);
+            continue;
         }
-        --m_groups_to_compile_count;
-        if (! sas.unique()) {   // don't compile if nobody recorded it but us
-            ShaderGroup &sgroup (sas->shadergroup (ShadUseSurface));
-                optimize_group (*sas, sgroup);
+        boost::unique_lock<boost::mutex> lock (m_compile_mutex);
+        if (m_compile_shutdown)
+            return;
+        if (! m_compile_queued)
+            m_compile_cond.wait (lock);
+        if (m_compile_shutdown)
+            return;
+    }
+}
+
+
+
+void
+ShadingSystemImpl::optimize_all_groups (int nthreads)
+{
+    if (! m_greedyjit) {
+        // No greedy JIT, just free any groups we've recorded.  But keep
+        // the hot groups waiting to be re-JITed at tier 2: nobody will
+        // ask for those again, since their request was already claimed.
+        BOOST_FOREACH (shared_ptr<CompileQueue> &queue, m_compile_queues) {
+            spin_lock lock (queue->mutex);
+            std::deque<ShadingAttribStateRef> keep;
+            BOOST_FOREACH (ShadingAttribStateRef &sas, queue->groups) {
+                if (sas->shadergroup(ShadUseSurface).llvm_tier2_requested())
+                    keep.push_back (sas);
+            }
+            int dropped = (int) (queue->groups.size() - keep.size());
+            m_compile_queued -= dropped;
+            m_compile_pending -= dropped;
+            queue->groups.swap (keep);
         }
+        return;
     }
+
+    // The workers are normally already running (declaring groups starts
+    // them), but hand over the last group held back by state(), make
+    // sure, then pitch in by stealing from them until the backlog is
+    // drained.
+    submit_declared_group ();
+    start_compile_threads (nthreads ? nthreads : m_jitthreads);
+    ShadingAttribStateRef sas;
+    while (next_group_to_compile (-1, sas))
+        compile_queued_group (sas);
+
+    // Wait for the groups the workers are still in the middle of
+    boost::unique_lock<boost::mutex> lock (m_compile_mutex);
+    while (m_compile_pending > 0 && ! m_compile_shutdown)
+        m_compile_cond.wait (lock);
 }
 
 
@@ -54,12 +54,25 @@ public:
           m_group(group),
           m_inst(NULL),
           m_next_newconst(0),
+          m_message_slots_begin(0), m_message_slots_size(0),
           m_stat_opt_locking_time(0), m_stat_specialization_time(0),
+          m_stat_const_lookup_time(0), m_stat_const_lookups(0),
+          m_stat_opt_fold_time(0), m_stat_opt_lifetime_time(0),
+          m_stat_opt_deps_time(0), m_stat_opt_post_time(0),
+          m_stat_opt_passes(0), m_stat_opt_ops_visited(0),
+          m_stat_opt_ops_skipped(0),
+          m_stat_preopt_syms(0), m_stat_preopt_ops(0),
           m_stat_total_llvm_time(0), m_stat_llvm_setup_time(0),
+          m_stat_llvm_ops_parse_time(0), m_stat_llvm_ops_clone_time(0),
           m_stat_llvm_irgen_time(0), m_stat_llvm_opt_time(0),
-          m_stat_llvm_jit_time(0),
+          m_stat_llvm_jit_time(0), m_stat_jitcache_load_time(0),
+          m_llvm_relocatable(false), m_llvm_not_relocatable(false),
           m_llvm_context(NULL), m_llvm_module(NULL),
-          m_llvm_exec(NULL), m_builder(NULL),
+          m_llvm_exec(NULL), m_llvm_code_size(0), m_llvm_isa(-1),
+          m_llvm_target_isa(-1), m_aot_written(false),
+          m_llvm_perfmap_listener(NULL),
+          m_llvm_profile_start(NULL), m_llvm_profile_children(NULL),
+          m_builder(NULL), m_batch_mask(NULL),
           m_llvm_passes(NULL), m_llvm_func_passes(NULL),
           m_llvm_func_passes_optimized(NULL)
     {
@@ -71,13 +84,35 @@ public:
         delete m_llvm_passes;
         delete m_llvm_func_passes;
         delete m_llvm_func_passes_optimized;
+        delete m_llvm_perfmap_listener;
     }
 
     void optimize_group ();
 
+    /// Re-JIT an already optimized group from the bitcode its first
+    /// (quickly compiled) tier saved, this time running the full set of
+    /// LLVM optimizations, and swap the result in.  Return true if
+    /// successful.
+    bool reoptimize_group ();
+
+    /// When the group is optimized, also write it, compiled to native
+    /// code, to the named object file (see
+    /// ShadingSystem::write_compiled_group).
+    void aot_output (const std::string &filename) { m_aot_filename = filename; }
+
+    /// Was the object file requested by aot_output written?
+    bool aot_written () const { return m_aot_written; }
+
+    /// Set up the (not yet optimized) group to run the code in a shared
+    /// library built from llvm_write_object output, without optimizing
+    /// or JITing anything.  Return true if successful.
+    bool aot_load (const std::string &filename);
+
     /// Optimize one layer of a group, given what we know about its
-    /// instance variables and connections.
-    void optimize_instance ();
+    /// instance variables and connections.  If local is true, only use
+    /// what the layer knows by itself (nothing from the other layers or
+    /// their connections), so that it may run alongside other layers.
+    void optimize_instance (bool local=false);
 
     /// Post-optimization cleanup of a layer: add 'useparam' instructions,
     /// track variable lifetimes, coalesce temporaries.
@@ -87,6 +122,26 @@ public:
     ///
     void set_inst (int layer);
 
+    /// Copy the code of the given layer from its master and do as much
+    /// optimization as is possible without looking at other layers.
+    void optimize_layer_locally (int layer);
+
+    /// Post-optimize the given layer, if it's used at all.
+    void post_optimize_layer (int layer);
+
+    typedef void (RuntimeOptimizer::*LayerTask) (int layer);
+
+    /// Run task on every layer of the group, with the help of up to
+    /// nthreads-1 idle JIT workers, each with its own RuntimeOptimizer.
+    /// The tasks must not touch any layer but their own.
+    void parallel_layers (LayerTask task, int nthreads);
+
+    /// Body of each parallel_layers thread (this one and the helping
+    /// workers): grab layers until there are none left, then fold our
+    /// stats into this optimizer's.
+    void layer_worker (LayerTask task, atomic_int *nextlayer,
+                       spin_mutex *mutex);
+
     /// Re-check what debugging level we ought to be at.
     void set_debug ();
 
@@ -109,6 +164,10 @@ public:
     /// type and data[...].  Return -1 if no matching const is found.
     int find_constant (const TypeSpec &type, const void *data);
 
+    /// Add the constant symbol with the given index to the table that
+    /// find_constant searches.
+    void add_to_constant_table (int symindex);
+
     /// Search for a constant whose type and value match type and data[...],
     /// returning its index if one exists, or else creating a new constant
     /// and returning its index.  If copy is true, allocate new space and
@@ -138,7 +197,23 @@ public:
     /// of instructions that were altered.
     int turn_into_nop (int begin, int end, const char *why=NULL);
 
-    void find_constant_params (ShaderGroup &group);
+    void find_constant_params (ShaderGroup &group, bool local=false);
+
+    /// In "paramagnostic" mode, note (before optimizing) which params
+    /// of each layer will have their values supplied at run time from
+    /// the group's parameter block instead of being folded.
+    void find_agnostic_params ();
+
+    /// Is sym a param of the given layer whose value will be supplied
+    /// at run time?
+    bool param_is_agnostic (int layer, const Symbol &sym) const {
+        return layer < (int)m_agnostic_params.size() &&
+            m_agnostic_params[layer].count (sym.name());
+    }
+
+    /// Fill in the group's parameter block layout from the group data
+    /// offsets of the agnostic params.
+    void llvm_param_block_layout ();
 
     void find_conditionals ();
 
@@ -146,6 +221,23 @@ public:
 
     void find_basic_blocks (bool do_llvm = false);
 
+    /// Build the flat lists of the ops that use each symbol (read or
+    /// write it), which tell the optimizer what to revisit when a
+    /// symbol's value, alias, or lifetime changes.
+    void find_symbol_users ();
+
+    /// Mark every op that uses the symbol as needing another look in
+    /// the next optimization pass.  If now is true, also make sure
+    /// that the rest of the current pass visits them.
+    void mark_users_dirty (int symindex, bool now=false);
+
+    /// After an optimization pass, compare the code (and the symbol
+    /// lifetimes) with how they were when the pass started, and mark
+    /// what needs another look in the next pass.
+    void mark_changes (const OpcodeVec &oldops,
+                       const std::vector<int> &oldargs,
+                       const std::vector<int> &oldlifetimes);
+
     bool coerce_assigned_constant (Opcode &op);
 
     void make_param_use_instanceval (Symbol *R);
@@ -163,6 +255,7 @@ public:
     ///
     void block_alias (int symindex, int alias) {
         m_block_aliases[symindex] = alias;
+        m_block_aliased.push_back (symindex);
     }
 
     /// Reset the block-local alias of 'symindex' so it doesn't alias to
@@ -172,16 +265,21 @@ public:
     }
 
     /// Reset all block-local aliases (done when we enter a new basic
-    /// block).
+    /// block).  Only the entries that were set are touched.
     void clear_block_aliases () {
-        m_block_aliases.clear ();
+        for (size_t i = 0, e = m_block_aliased.size();  i < e;  ++i)
+            m_block_aliases[m_block_aliased[i]] = -1;
+        m_block_aliased.clear ();
         m_block_aliases.resize (inst()->symbols().size(), -1);
     }
 
-    /// Set the new global alias of 'symindex' to 'alias'.
-    ///
+    /// Set the new global alias of 'symindex' to 'alias'.  Every op that
+    /// uses 'symindex' will need to be looked at again.
     void global_alias (int symindex, int alias) {
+        if (symindex >= (int)m_symbol_aliases.size())
+            m_symbol_aliases.resize (inst()->symbols().size(), -1);
         m_symbol_aliases[symindex] = alias;
+        mark_users_dirty (symindex, true);
     }
 
     /// Is the given symbol stale?  A "stale" symbol is one that, within
@@ -190,7 +288,7 @@ public:
     /// The point is that if they are simply assigned again before being
     /// used, that first assignment can be turned into a no-op.
     bool sym_is_stale (int sym) {
-        return m_stale_syms.find(sym) != m_stale_syms.end();
+        return sym < (int)m_stale_syms.size() && m_stale_syms[sym] >= 0;
     }
 
     /// Clear the stale symbol list -- we do this when entering a new
@@ -241,17 +339,11 @@ public:
     void track_variable_lifetimes ();
     void track_variable_lifetimes (const SymbolPtrVec &allsymptrs);
 
-    /// For each symbol, have a list of the symbols it depends on (or that
-    /// depends on it).
-    typedef std::map<int, std::set<int> > SymDependency;
-
     void syms_used_in_op (Opcode &op,
                           std::vector<int> &rsyms, std::vector<int> &wsyms);
 
     void track_variable_dependencies ();
 
-    void add_dependency (SymDependency &dmap, int A, int B);
-
     void mark_outgoing_connections ();
 
     /// Squeeze out unused symbols from an instance that has been
@@ -300,6 +392,125 @@ public:
     /// and store the llvm::Function* handle to it with the ShaderGroup.
     void build_llvm_group ();
 
+    /// Make sure this thread has an LLVMContext and JIT memory manager.
+    ///
+    void llvm_setup_thread ();
+
+    /// Decide which CPU and features the JIT should generate code for
+    /// (from the "llvm_cpu" and "llvm_features" attributes), and which
+    /// build of llvm_ops goes with them.  Only done once.
+    void llvm_select_target ();
+
+    /// Return a new Module holding the precompiled llvm_ops bitcode.
+    /// The bitcode is only parsed once per thread (i.e., per
+    /// LLVMContext); after that we hand out copies of that Module.
+    llvm::Module *llvm_load_ops_module ();
+
+    /// Create the ExecutionEngine for m_llvm_module.  Return true on
+    /// success.  If aggressive is true, ask the code generator to try
+    /// harder, too.
+    bool llvm_create_exec (bool aggressive=false);
+
+    /// JIT the given function (which must be in m_llvm_module) and
+    /// return a pointer to the machine code.
+    RunLLVMGroupFunc llvm_jit_function (llvm::Function *func);
+
+    /// Return the bitcode of a copy of m_llvm_module stripped down to
+    /// just the layer functions (and whatever they reference that isn't
+    /// in the llvm_ops module).
+    std::string llvm_group_bitcode (llvm::Function **funcs, int nfuncs);
+
+    /// Link bitcode made by llvm_group_bitcode against a fresh llvm_ops
+    /// module, bind relocations, and JIT the named entry point, running
+    /// the full set of optimizations first if optimize is true.  Return
+    /// the compiled entry point, or NULL (and an explanation in err) on
+    /// failure.  The module and ExecutionEngine are freed afterwards.
+    RunLLVMGroupFunc llvm_jit_bitcode (const std::string &bitcode,
+                                       const std::string &entryname,
+                                       bool optimize, std::string &err);
+
+    /// Kinds of process-specific pointers that relocatable code loads
+    /// from a slot at run time rather than embedding as a constant.
+    enum RelocKind { RelocUstring, RelocRenderer, RelocClosurePrepare,
+                     RelocClosureSetup, RelocTypeDesc, RelocStringArray,
+                     RelocTextureHandle, RelocRegex };
+
+    /// One relocated pointer: what it is, and the (process-independent)
+    /// information needed to recreate it.
+    struct Relocation {
+        int kind;
+        std::string payload;
+        Relocation (int k, const std::string &p) : kind(k), payload(p) { }
+    };
+
+    /// Return a pointer of the given type to p.  If we are generating
+    /// relocatable code (for the JIT cache), p is instead loaded from a
+    /// slot that is filled in at JIT time from kind and payload.
+    llvm::Value *llvm_relocatable_ptr (RelocKind kind,
+                                       const std::string &payload,
+                                       void *p, llvm::PointerType *type);
+
+    /// Compute the pointer for a relocation, allocating any storage
+    /// it needs in the group.
+    void *llvm_resolve_relocation (const Relocation &r);
+
+    /// Fill in the group's relocation slots (unless an earlier JIT of
+    /// the group already did) and map the relocation globals of
+    /// m_llvm_module onto them.  Must be called after the
+    /// ExecutionEngine is created but before anything is JITed.
+    void llvm_bind_relocations ();
+
+    /// Kinds of external queries that constant folding relied upon.
+    enum JitCacheDepKind { DepMatrix, DepInverseMatrix, DepTextureInfo,
+                           DepDictFind, DepDictFindNode, DepDictNext,
+                           DepDictValue };
+
+    /// Record that optimization of this group depended on the result
+    /// of an external (renderer, texture system, or dictionary) query, so
+    /// that a cached copy of the group can be validated against the current
+    /// scene before it's used.
+    void add_jitcache_dependency (JitCacheDepKind kind, ustring name,
+                                  ustring dataname, TypeDesc type,
+                                  const void *data);
+
+    /// Return the string that fully identifies the group for the
+    /// purposes of the on-disk JIT cache.  Ahead-of-time compiled
+    /// groups carry their own llvm_ops and are checked against the
+    /// host separately, so for them (with_target false) the llvm_ops
+    /// build and JIT target are left out.
+    std::string jitcache_fingerprint (bool with_target=true);
+
+    /// Try to set up the group from the on-disk JIT cache, returning
+    /// true if successful.
+    bool jitcache_load ();
+
+    /// Write the current (optimized, not yet JITed) group to the JIT
+    /// cache, given the name of its entry point and the bitcode from
+    /// llvm_group_bitcode.
+    void jitcache_save (const std::string &entryname,
+                        const std::string &bitcode);
+
+    /// Return the JIT cache record describing the optimized group: its
+    /// entry point, group data, relocations, dependencies, and symbol
+    /// and parameter block layout, plus the bitcode if not empty.
+    std::string jitcache_record (const std::string &entryname,
+                                 const std::string &bitcode);
+
+    /// Set up the group from a JIT cache record (read from source),
+    /// JITing the bitcode it holds, or if library is not NULL, using
+    /// the already compiled code in that shared library.  Return true
+    /// if successful, false if the record is stale, doesn't match the
+    /// group, or can't be loaded.
+    bool jitcache_install (const std::string &in, const std::string &source,
+                           void *library);
+
+    /// Write the optimized group in m_llvm_module, with all of llvm_ops
+    /// that it uses, to m_aot_filename as a native object file holding
+    /// the entry point, the relocation slots, and the given JIT cache
+    /// record.  Return true on success.
+    bool llvm_write_object (const std::string &entryname,
+                            const std::string &record);
+
     int layer_remap (int origlayer) const { return m_layer_remap[origlayer]; }
 
     /// Set up a bunch of static things we'll need for the whole group.
@@ -315,6 +526,60 @@ public:
     /// current basic block if bb==NULL).
     bool build_llvm_code (int beginop, int endop, llvm::BasicBlock *bb=NULL);
 
+    /// Create the function that runs the whole group on BatchWidth
+    /// points at once (see RunLLVMBatchFunc), with every value a vector
+    /// holding all the points.  This must come after the layer functions
+    /// are built, since it needs their group data layout.  Return NULL
+    /// if any op (or symbol) of the group can't be done that way.
+    llvm::Function* build_llvm_batch ();
+
+    /// Build the batch code for the current instance: its params, its
+    /// main code, and its connections to later layers.
+    bool build_llvm_batch_instance ();
+
+    /// Build the batch code for the ops in [begin,end).  Return false
+    /// if any of them has no batch version.
+    bool build_llvm_batch_code (int beginop, int endop);
+
+    /// Batch version of llvm_assign_initial_value, for a param.
+    bool llvm_batch_assign_initial_value (const Symbol &sym);
+
+    /// Batch version of llvm_assign_impl.
+    bool llvm_batch_assign (const Symbol &Result, const Symbol &Src);
+
+    /// The vector type holding BatchWidth values of the given base type
+    /// (FLOAT or INT).
+    llvm::Type *llvm_type_batch (TypeDesc type);
+
+    /// Return a vector with val in every lane.
+    llvm::Value *llvm_batch_splat (llvm::Value *val);
+
+    /// Return the batch storage of sym, making it if need be.  Return
+    /// NULL if sym's type can't be batched.
+    llvm::Value *llvm_batch_storage (const Symbol &sym);
+
+    /// Batch version of llvm_load_value: the given component of sym for
+    /// every lane, cast to cast's base type if it's FLOAT or INT (scalars
+    /// give the same value for every component).  Return NULL if sym
+    /// can't be batched.
+    llvm::Value *llvm_batch_load (const Symbol &sym, int component=0,
+                                  TypeDesc cast=TypeDesc::UNKNOWN);
+
+    /// Load the named field of the ShaderGlobalsBatch for every lane, or
+    /// return NULL if it's not a field that batch code can read.
+    llvm::Value *llvm_batch_load_global (ustring name, int component=0);
+
+    /// Batch version of llvm_store_value: store into the lanes of sym
+    /// that are on in the current mask.  Return false if sym can't be
+    /// batched or is a global.
+    bool llvm_batch_store (llvm::Value *val, const Symbol &sym,
+                           int component=0);
+
+    /// Lanes whose values are stored while building batch code (NULL
+    /// means all of them).
+    llvm::Value *llvm_batch_mask () const { return m_batch_mask; }
+    void llvm_batch_mask (llvm::Value *mask) { m_batch_mask = mask; }
+
     typedef std::map<std::string, llvm::AllocaInst*> AllocationMap;
 
     void llvm_assign_initial_value (const Symbol& sym);
@@ -496,6 +761,18 @@ public:
         return llvm_void_ptr (m_llvm_groupdata_ptr);
     }
 
+    /// Give each message name a fixed slot in the group data (see
+    /// MessageSlot), starting at the given offset, if every setmessage
+    /// and getmessage in the group can be resolved at JIT time.  Return
+    /// the offset past the slots, and add the slot storage to fields.
+    size_t llvm_assign_message_slots (size_t offset,
+                                      std::vector<llvm::Type*> &fields);
+
+    /// Return the group data offset of the slot for the message named
+    /// by the symbol, or -1 if it has none and must go through the
+    /// context's MessageList.
+    int message_slot (const Symbol &name) const;
+
     /// Return a ref to where the "layer_run" flag is stored for the
     /// named layer.
     llvm::Value *layer_run_ptr (int layer);
@@ -520,6 +797,8 @@ public:
     ///
     llvm::Value *llvm_constant_ptr (void *p, llvm::PointerType *type)
     {
+        if (p && m_llvm_relocatable)
+            m_llvm_not_relocatable = true;
         return builder().CreateIntToPtr (llvm_constant (size_t (p)), type, "const pointer");
     }
 
@@ -537,6 +816,10 @@ public:
     /// representation of a TypeDesc.
     llvm::Value *llvm_constant (const TypeDesc &type);
 
+    /// Return a void pointer to the data of constant symbol sym.
+    ///
+    llvm::Value *llvm_constant_data_ptr (const Symbol &sym);
+
     /// Generate LLVM code to zero out the variable (including derivs)
     ///
     void llvm_assign_zero (const Symbol &sym);
@@ -578,6 +861,14 @@ public:
 
     void llvm_gen_debug_printf (const std::string &message);
 
+    /// Generate code that reads the CPU's cycle counter (as an i64).
+    ///
+    llvm::Value *llvm_cycles ();
+
+    /// Generate code that charges the given number of cycles (an i64
+    /// value) to run-time profiling counter id.  Does nothing if id < 0.
+    void llvm_profile_add (int id, llvm::Value *cycles);
+
     /// Generate code to call the given layer.  If 'unconditional' is
     /// true, call it without even testing if the layer has already been
     /// called.
@@ -703,6 +994,10 @@ public:
     /// Check for inf/nan in all written-to arguments of the op
     void llvm_generate_debugnan (const Opcode &op);
 
+    /// Tag the code generated from here on with the op's source file
+    /// and line, for the per-line perf map.
+    void llvm_set_source_location (const Opcode &op);
+
     llvm::Function *layer_func () const { return m_layer_func; }
 
     void llvm_setup_optimization_passes ();
@@ -721,11 +1016,24 @@ private:
 
     // All below is just for the one inst we're optimizing:
     std::vector<int> m_all_consts;    ///< All const symbol indices for inst
+#ifdef OIIO_HAVE_BOOST_UNORDERED_MAP
+    typedef boost::unordered_map<unsigned long long,int> ConstantHashMap;
+#else
+    typedef hash_map<unsigned long long,int> ConstantHashMap;
+#endif
+    ConstantHashMap m_const_hash;     ///< Hash of type+value -> first const
     int m_next_newconst;              ///< Unique ID for next new const we add
-    std::map<int,int> m_symbol_aliases; ///< Global symbol aliases
-    std::vector<int> m_block_aliases;   ///< Local block aliases
+    std::vector<int> m_symbol_aliases;  ///< Global symbol aliases (or -1)
+    std::vector<int> m_block_aliases;   ///< Local block aliases (or -1)
+    std::vector<int> m_block_aliased;   ///< Syms with a block alias set
     std::map<int,int> m_param_aliases;  ///< Params aliasing to params/globals
-    std::map<int,int> m_stale_syms;     ///< Stale symbols for this block
+    std::vector<std::set<ustring> > m_agnostic_params; ///< Per layer
+    std::vector<int> m_stale_syms;      ///< Stale sym -> assigning op (or -1)
+    std::vector<int> m_stale_list;      ///< Syms that are stale in the block
+    std::vector<int> m_sym_users_begin; ///< Per sym: start in m_sym_users
+    std::vector<int> m_sym_users;       ///< Ops using each sym, flattened
+    std::vector<char> m_op_dirty;       ///< Ops to revisit next pass
+    std::vector<char> m_block_visit;    ///< Blocks to visit this pass
     int m_local_unknown_message_sent;   ///< Non-const setmessage in this inst
     std::vector<ustring> m_local_messages_sent; ///< Messages set in this inst
     std::vector<int> m_bblockids;       ///< Basic block IDs for each op
@@ -734,22 +1042,65 @@ private:
     int m_num_used_layers;              ///< Number of layers actually used
     double m_stat_opt_locking_time;       ///<   locking time
     double m_stat_specialization_time;    ///<   specialization time
+    double m_stat_const_lookup_time;      ///<     constant lookup time
+    long long m_stat_const_lookups;       ///<     constant lookups
+    double m_stat_opt_fold_time;          ///<     constant folding passes
+    double m_stat_opt_lifetime_time;      ///<     lifetime tracking
+    double m_stat_opt_deps_time;          ///<     derivative dependencies
+    double m_stat_opt_post_time;          ///<     post-opt cleanup
+    int m_stat_opt_passes;                ///<     folding passes
+    long long m_stat_opt_ops_visited;     ///<     ops visited while folding
+    long long m_stat_opt_ops_skipped;     ///<     clean ops skipped
+    size_t m_stat_preopt_syms;            ///<   symbols before optimization
+    size_t m_stat_preopt_ops;             ///<   ops before optimization
     double m_stat_total_llvm_time;        ///<   total time spent on LLVM
     double m_stat_llvm_setup_time;        ///<     llvm setup time
+    double m_stat_llvm_ops_parse_time;    ///<       parsing llvm_ops
+    double m_stat_llvm_ops_clone_time;    ///<       cloning llvm_ops
     double m_stat_llvm_irgen_time;        ///<     llvm IR generation time
     double m_stat_llvm_opt_time;          ///<     llvm IR optimization time
     double m_stat_llvm_jit_time;          ///<     llvm JIT time
+    double m_stat_jitcache_load_time;     ///<   time loading from cache
+
+    // JIT cache
+    std::string m_jitcache_fingerprint; ///< Key of the group in the cache
+    bool m_llvm_relocatable;            ///< Generating relocatable code?
+    bool m_llvm_not_relocatable;        ///< Code embeds unrelocated ptrs
+    std::vector<Relocation> m_llvm_relocs; ///< Relocated pointers
+    std::map<std::string,int> m_llvm_reloc_map; ///< Find existing relocs
+    std::string m_jitcache_deps;        ///< Serialized dependencies
+    std::string m_aot_filename;         ///< Object file to write, if any
+    bool m_aot_written;                 ///< Was it written?
 
     // LLVM stuff
     llvm::LLVMContext *m_llvm_context;
     llvm::Module *m_llvm_module;
     llvm::ExecutionEngine *m_llvm_exec;
+    size_t m_llvm_code_size;            ///< Machine code JITed by m_llvm_exec
+    int m_llvm_isa;                     ///< llvm_ops build to use (-1 = unset)
+    int m_llvm_target_isa;              ///< ISA level of the target CPU
+    std::string m_llvm_target_cpu;      ///< Target CPU exactly as asked for
+    std::vector<std::string> m_llvm_target_features; ///< ... and features
+    std::string m_llvm_cpu;             ///< JIT target CPU, clamped to host
+    std::vector<std::string> m_llvm_features; ///< JIT target features
+    llvm::JITEventListener *m_llvm_perfmap_listener; ///< Writes the perf map
+    llvm::Value *m_llvm_profile_start;  ///< Layer's entry cycle count
+    llvm::Value *m_llvm_profile_children; ///< Cycles spent in called layers
     AllocationMap m_named_values;
     std::map<const Symbol*,int> m_param_order_map;
+    std::map<ustring,int> m_message_slots; ///< Message name -> slot offset
+    int m_message_slots_begin;          ///< Group data offset of the slots
+    int m_message_slots_size;           ///< Total bytes of message slots
     llvm::IRBuilder<> *m_builder;
     llvm::Value *m_llvm_shaderglobals_ptr;
     llvm::Value *m_llvm_groupdata_ptr;
     llvm::Function *m_layer_func;     ///< Current layer func we're building
+    std::map<const Symbol*,llvm::Value*> m_batch_values; ///< Batch storage
+    std::vector<const Symbol*> m_batch_params; ///< Params in m_batch_values
+    llvm::Value *m_batch_mask;        ///< Lanes being stored (NULL = all)
+    llvm::Value *m_batch_sg;          ///< ShaderGlobalsBatch* of batch func
+    llvm::Value *m_batch_first;       ///< First point of the batch func
+    std::vector<llvm::Value *> m_batch_groupdata; ///< Each lane's group data
     std::vector<llvm::BasicBlock *> m_loop_after_block; // stack for break
     std::vector<llvm::BasicBlock *> m_loop_step_block;  // stack for continue
     std::vector<llvm::BasicBlock *> m_return_block;     // stack for func call
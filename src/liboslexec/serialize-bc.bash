@@ -1,14 +1,16 @@
 #!/bin/bash
 
 # Turn an LLVM-compiled bitfile into a C++ source file where the compiled
-# bitcode is in a huge array.
+# bitcode is in a huge array.  The optional third argument names the
+# symbols (default osl_llvm_compiled_ops, giving ..._block and ..._size).
 
 in=$1
 out=$2
+sym=${3:-osl_llvm_compiled_ops}
 
 echo "#include <cstddef>" > $out
-echo "unsigned char osl_llvm_compiled_ops_block[] = {" >> $out
+echo "unsigned char ${sym}_block[] = {" >> $out
 hexdump -v -e '"" /1 "0x%02x" ",\n"' $in >> $out
 echo "0x00 };" >> $out
-echo "size_t osl_llvm_compiled_ops_size = sizeof(osl_llvm_compiled_ops_block)-1;" >> $out
+echo "size_t ${sym}_size = sizeof(${sym}_block)-1;" >> $out
 
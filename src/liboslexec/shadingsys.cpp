@@ -29,9 +29,17 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <vector>
 #include <string>
 #include <cstdio>
+#include <algorithm>
+#ifdef _WIN32
+# include <process.h>
+# define getpid _getpid
+#else
+# include <unistd.h>
+#endif
 
 #include <boost/algorithm/string.hpp>
 #include <boost/foreach.hpp>
+#include <boost/regex.hpp>
 
 #include "oslexec_pvt.h"
 #include "genclosure.h"
@@ -106,7 +114,8 @@ ShadingSystem::~ShadingSystem ()
 
 
 PerThreadInfo::PerThreadInfo ()
-    : llvm_context(NULL), llvm_jitmm(NULL)
+    : llvm_context(NULL), llvm_jitmm(NULL), llvm_ops_module(NULL),
+      llvm_ops_isa(-1), profile(NULL), stats(NULL)
 {
 }
 
@@ -114,6 +123,7 @@ PerThreadInfo::PerThreadInfo ()
 
 PerThreadInfo::~PerThreadInfo ()
 {
+    delete llvm_ops_module;   // N.B. before the context it lives in
     delete llvm_context;
     // N.B. Do NOT delete the jitmm -- another thread may need the code!
     // Don't worry, we stashed a pointer in the shadingsys.
@@ -175,36 +185,50 @@ ShadingSystemImpl::ShadingSystemImpl (RendererServices *renderer,
       m_clearmemory (false), m_rebind (false), m_debugnan (false),
       m_lockgeom_default (false), m_strict_messages(true),
       m_range_checking(true), m_unknown_coordsys_error(true),
-      m_greedyjit(false),
-      m_optimize (1),
-      m_llvm_debug(false),
+      m_greedyjit(false), m_jitthreads(0), m_tieredjit(0),
+      m_dedupgroups(true), m_paramagnostic(false), m_messageslots(true),
+      m_batchjit(false),
+      m_optimize (1), m_optimize_threads (0),
+      m_llvm_debug(false), m_llvm_perfmap(0), m_profile(0),
+      m_llvm_cpu("host"),
       m_commonspace_synonym("world"),
       m_colorspace("Rec709"),
-      m_in_group (false),
-      m_stat_opt_locking_time(0), m_stat_specialization_time(0),
-      m_stat_total_llvm_time(0),
-      m_stat_llvm_setup_time(0), m_stat_llvm_irgen_time(0),
-      m_stat_llvm_opt_time(0), m_stat_llvm_jit_time(0)
+      m_in_group (false)
 {
     m_stat_shaders_loaded = 0;
     m_stat_shaders_requested = 0;
+    m_stat_shaders_load_waits = 0;
+    m_stat_message_slots = 0;
+    m_group_registry_sweep = 64;
+    m_stat_groups_parallel_opt = 0;
+    m_llvm_cpu_clamped = 0;
     m_stat_groups = 0;
     m_stat_groupinstances = 0;
-    m_stat_instances_compiled = 0;
-    m_stat_groups_compiled = 0;
     m_stat_empty_instances = 0;
     m_stat_empty_groups = 0;
+    m_stat_groups_batch = 0;
+    m_stat_agnostic_params = 0;
+    m_stat_llvm_code_bytes = 0;
     m_stat_regexes = 0;
     m_stat_preopt_syms = 0;
     m_stat_postopt_syms = 0;
     m_stat_preopt_ops = 0;
     m_stat_postopt_ops = 0;
-    m_stat_optimization_time = 0;
-    m_stat_getattribute_time = 0;
-    m_stat_getattribute_fail_time = 0;
-    m_stat_getattribute_calls = 0;
-    m_groups_to_compile_count = 0;
-    m_threads_currently_compiling = 0;
+    m_stat_jitcache_hits = 0;
+    m_stat_jitcache_misses = 0;
+    m_stat_jitcache_writes = 0;
+    m_stat_jitcache_uncacheable = 0;
+    m_stat_jitcache_bytes_read = 0;
+    m_stat_jitcache_bytes_written = 0;
+    m_compile_queued = 0;
+    m_compile_pending = 0;
+    m_compile_next_queue = 0;
+    m_compile_shutdown = false;
+    m_dictionary = NULL;
+    m_perfmap_file = NULL;
+    m_perfmap_unavailable = 0;
+    m_stat_jit_steals = 0;
+    m_stat_llvm_ops_parses = 0;
 
     // If client didn't supply an error handler, just use the default
     // one that echoes to the terminal.
@@ -220,7 +244,12 @@ ShadingSystemImpl::ShadingSystemImpl (RendererServices *renderer,
     }
 #endif
 
-    // If client didn't supply a texture system, create a new one
+    // If client didn't supply a texture system, use the renderer's, so
+    // that the texture handles it hands out are good for our lookups.
+    if (! m_texturesys && m_renderer)
+        m_texturesys = m_renderer->texturesys ();
+
+    // If there's still no texture system, create a new one
     if (! m_texturesys) {
         m_texturesys = TextureSystem::create (true /* shared */);
         ASSERT (m_texturesys);
@@ -301,9 +330,9 @@ ShadingSystemImpl::setup_op_descriptors ()
     OP (cross,       generic,             none,          true);
     OP (degrees,     generic,             none,          true);
     OP (determinant, generic,             none,          true);
-    OP (dict_find,   dict_find,           none,          false);
-    OP (dict_next,   dict_next,           none,          false);
-    OP (dict_value,  dict_value,          none,          false);
+    OP (dict_find,   dict_find,           dict_find,     false);
+    OP (dict_next,   dict_next,           dict_next,     false);
+    OP (dict_value,  dict_value,          dict_value,    false);
     OP (distance,    generic,             none,          true);
     OP (div,         div,                 div,           true);
     OP (dot,         generic,             dot,           true);
@@ -407,6 +436,64 @@ ShadingSystemImpl::setup_op_descriptors ()
     OP (while,       loop_op,             none,          false);
     OP (xor,         bitwise_binary_op,   none,          true);
 #undef OP
+
+    // Ops that can also be done for BatchWidth points at once (see
+    // RuntimeOptimizer::build_llvm_batch).
+#define BATCHOP(name,ll)                                                 \
+    extern bool llvm_gen_batch_##ll (RuntimeOptimizer &rop, int opnum);  \
+    m_op_descriptor[ustring(#name)].llvmgen_batch = llvm_gen_batch_##ll;
+
+    // name          llvmgen_batch
+    BATCHOP (abs,         abs);
+    BATCHOP (add,         arith);
+    BATCHOP (and,         andor);
+    BATCHOP (assign,      assign);
+    BATCHOP (backfacing,  get_simple_SG_field);
+    BATCHOP (bitand,      bitwise_binary_op);
+    BATCHOP (bitor,       bitwise_binary_op);
+    BATCHOP (ceil,        floorceil);
+    BATCHOP (cellnoise,   noise);
+    BATCHOP (clamp,       clamp);
+    BATCHOP (color,       construct_triple);
+    BATCHOP (compassign,  compassign);
+    BATCHOP (compl,       compl);
+    BATCHOP (compref,     compref);
+    BATCHOP (cross,       cross);
+    BATCHOP (div,         arith);
+    BATCHOP (dot,         dot);
+    BATCHOP (eq,          compare_op);
+    BATCHOP (fabs,        abs);
+    BATCHOP (floor,       floorceil);
+    BATCHOP (fmod,        arith);
+    BATCHOP (functioncall, functioncall);
+    BATCHOP (ge,          compare_op);
+    BATCHOP (gt,          compare_op);
+    BATCHOP (if,          if);
+    BATCHOP (le,          compare_op);
+    BATCHOP (lt,          compare_op);
+    BATCHOP (max,         minmax);
+    BATCHOP (min,         minmax);
+    BATCHOP (mod,         arith);
+    BATCHOP (mul,         arith);
+    BATCHOP (neg,         neg);
+    BATCHOP (neq,         compare_op);
+    BATCHOP (noise,       noise);
+    BATCHOP (normal,      construct_triple);
+    BATCHOP (or,          andor);
+    BATCHOP (pnoise,      noise);
+    BATCHOP (point,       construct_triple);
+    BATCHOP (psnoise,     noise);
+    BATCHOP (shl,         bitwise_binary_op);
+    BATCHOP (shr,         bitwise_binary_op);
+    BATCHOP (snoise,      noise);
+    BATCHOP (sqrt,        sqrt);
+    BATCHOP (step,        step);
+    BATCHOP (sub,         arith);
+    BATCHOP (surfacearea, get_simple_SG_field);
+    BATCHOP (useparam,    useparam);
+    BATCHOP (vector,      construct_triple);
+    BATCHOP (xor,         bitwise_binary_op);
+#undef BATCHOP
 }
 
 
@@ -428,7 +515,18 @@ ShadingSystemImpl::register_closure(const char *name, int id, const ClosureParam
 
 ShadingSystemImpl::~ShadingSystemImpl ()
 {
+    m_declared_group.reset ();
+    stop_compile_threads ();
     printstats ();
+    free_dict_resources ();
+    for (RegexMap::iterator it = m_regex_map.begin(); it != m_regex_map.end(); ++it)
+        delete it->second;
+    if (m_perfmap_file)
+        fclose (m_perfmap_file);
+    for (size_t i = 0;  i < m_profile_counters.size();  ++i)
+        delete m_profile_counters[i];
+    for (size_t i = 0;  i < m_thread_stats.size();  ++i)
+        delete m_thread_stats[i];
     // N.B. just let m_texsys go -- if we asked for one to be created,
     // we asked for a shared one.
 
@@ -474,15 +572,27 @@ ShadingSystemImpl::attribute (const std::string &name, TypeDesc type,
     ATTR_SET ("debugnan", int, m_debugnan);
     ATTR_SET ("lockgeom", int, m_lockgeom_default);
     ATTR_SET ("optimize", int, m_optimize);
+    ATTR_SET ("optimize_threads", int, m_optimize_threads);
     ATTR_SET ("llvm_debug", int, m_llvm_debug);
+    ATTR_SET ("llvm_perfmap", int, m_llvm_perfmap);
+    ATTR_SET ("profile", int, m_profile);
     ATTR_SET ("strict_messages", int, m_strict_messages);
     ATTR_SET ("range_checking", int, m_range_checking);
     ATTR_SET ("unknown_coordsys_error", int, m_unknown_coordsys_error);
     ATTR_SET ("greedyjit", int, m_greedyjit);
+    ATTR_SET ("jitthreads", int, m_jitthreads);
+    ATTR_SET ("tieredjit", int, m_tieredjit);
+    ATTR_SET ("dedupgroups", int, m_dedupgroups);
+    ATTR_SET ("paramagnostic", int, m_paramagnostic);
+    ATTR_SET ("messageslots", int, m_messageslots);
+    ATTR_SET ("batchjit", int, m_batchjit);
     ATTR_SET_STRING ("commonspace", m_commonspace_synonym);
     ATTR_SET_STRING ("debug_groupname", m_debug_groupname);
     ATTR_SET_STRING ("debug_layername", m_debug_layername);
     ATTR_SET_STRING ("only_groupname", m_only_groupname);
+    ATTR_SET_STRING ("jitcache", m_jitcache);
+    ATTR_SET_STRING ("llvm_cpu", m_llvm_cpu);
+    ATTR_SET_STRING ("llvm_features", m_llvm_features);
 
     // cases for special handling
     if (name == "searchpath:shader" && type == TypeDesc::STRING) {
@@ -539,36 +649,89 @@ ShadingSystemImpl::getattribute (const std::string &name, TypeDesc type,
     ATTR_DECODE ("debugnan", int, m_debugnan);
     ATTR_DECODE ("lockgeom", int, m_lockgeom_default);
     ATTR_DECODE ("optimize", int, m_optimize);
+    ATTR_DECODE ("optimize_threads", int, m_optimize_threads);
     ATTR_DECODE ("llvm_debug", int, m_llvm_debug);
+    ATTR_DECODE ("llvm_perfmap", int, m_llvm_perfmap);
+    ATTR_DECODE ("profile", int, m_profile);
     ATTR_DECODE ("strict_messages", int, m_strict_messages);
     ATTR_DECODE ("range_checking", int, m_range_checking);
     ATTR_DECODE ("unknown_coordsys_error", int, m_unknown_coordsys_error);
     ATTR_DECODE ("greedyjit", int, m_greedyjit);
+    ATTR_DECODE ("jitthreads", int, m_jitthreads);
+    ATTR_DECODE ("tieredjit", int, m_tieredjit);
+    ATTR_DECODE ("dedupgroups", int, m_dedupgroups);
+    ATTR_DECODE ("paramagnostic", int, m_paramagnostic);
+    ATTR_DECODE ("messageslots", int, m_messageslots);
+    ATTR_DECODE ("batchjit", int, m_batchjit);
     ATTR_DECODE_STRING ("commonspace", m_commonspace_synonym);
     ATTR_DECODE_STRING ("colorspace", m_colorspace);
     ATTR_DECODE_STRING ("debug_groupname", m_debug_groupname);
     ATTR_DECODE_STRING ("debug_layername", m_debug_layername);
     ATTR_DECODE_STRING ("only_groupname", m_only_groupname);
+    ATTR_DECODE_STRING ("jitcache", m_jitcache);
+    ATTR_DECODE_STRING ("llvm_cpu", m_llvm_cpu);
+    ATTR_DECODE_STRING ("llvm_features", m_llvm_features);
+
+    // Everything else is a statistic.  Only sum up the per-thread
+    // ones if we're really being asked for one.
+    if (name.compare (0, 5, "stat:") != 0)
+        return false;
+    ShadingStats st (stats());
     ATTR_DECODE ("stat:masters", int, m_stat_shaders_loaded);
+    ATTR_DECODE ("stat:master_load_waits", int, m_stat_shaders_load_waits);
     ATTR_DECODE ("stat:groups", int, m_stat_groups);
-    ATTR_DECODE ("stat:instances_compiled", int, m_stat_instances_compiled);
-    ATTR_DECODE ("stat:groups_compiled", int, m_stat_groups_compiled);
+    ATTR_DECODE ("stat:instances_compiled", int, st.instances_compiled);
+    ATTR_DECODE ("stat:groups_compiled", int, st.groups_compiled);
     ATTR_DECODE ("stat:empty_instances", int, m_stat_empty_instances);
     ATTR_DECODE ("stat:empty_groups", int, m_stat_empty_groups);
+    ATTR_DECODE ("stat:groups_batch", int, m_stat_groups_batch);
+    ATTR_DECODE ("stat:groups_deduped", int, st.groups_deduped);
+    ATTR_DECODE ("stat:agnostic_params", int, m_stat_agnostic_params);
+    ATTR_DECODE ("stat:message_slots", int, m_stat_message_slots);
+    ATTR_DECODE ("stat:groups_parallel_opt", int, m_stat_groups_parallel_opt);
+    ATTR_DECODE ("stat:dedup_code_saved", long long, st.dedup_code_saved);
+    ATTR_DECODE ("stat:jit_code_bytes", long long, m_stat_llvm_code_bytes);
     ATTR_DECODE ("stat:instances", int, m_stat_groupinstances);
     ATTR_DECODE ("stat:regexes", int, m_stat_regexes);
     ATTR_DECODE ("stat:preopt_syms", int, m_stat_preopt_syms);
     ATTR_DECODE ("stat:postopt_syms", int, m_stat_postopt_syms);
     ATTR_DECODE ("stat:preopt_ops", int, m_stat_preopt_ops);
     ATTR_DECODE ("stat:postopt_ops", int, m_stat_postopt_ops);
-    ATTR_DECODE ("stat:optimization_time", float, m_stat_optimization_time);
-    ATTR_DECODE ("stat:opt_locking_time", float, m_stat_opt_locking_time);
-    ATTR_DECODE ("stat:specialization_time", float, m_stat_specialization_time);
-    ATTR_DECODE ("stat:total_llvm_time", float, m_stat_total_llvm_time);
-    ATTR_DECODE ("stat:llvm_setup_time", float, m_stat_llvm_setup_time);
-    ATTR_DECODE ("stat:llvm_irgen_time", float, m_stat_llvm_irgen_time);
-    ATTR_DECODE ("stat:llvm_opt_time", float, m_stat_llvm_opt_time);
-    ATTR_DECODE ("stat:llvm_jit_time", float, m_stat_llvm_jit_time);
+    ATTR_DECODE ("stat:optimization_time", float, st.optimization_time);
+    ATTR_DECODE ("stat:opt_locking_time", float, st.opt_locking_time);
+    ATTR_DECODE ("stat:specialization_time", float, st.specialization_time);
+    ATTR_DECODE ("stat:const_lookup_time", float, st.const_lookup_time);
+    ATTR_DECODE ("stat:const_lookups", long long, st.const_lookups);
+    ATTR_DECODE ("stat:opt_fold_time", float, st.opt_fold_time);
+    ATTR_DECODE ("stat:opt_lifetime_time", float, st.opt_lifetime_time);
+    ATTR_DECODE ("stat:opt_deps_time", float, st.opt_deps_time);
+    ATTR_DECODE ("stat:opt_post_time", float, st.opt_post_time);
+    ATTR_DECODE ("stat:opt_passes", int, st.opt_passes);
+    ATTR_DECODE ("stat:opt_ops_visited", long long, st.opt_ops_visited);
+    ATTR_DECODE ("stat:opt_ops_skipped", long long, st.opt_ops_skipped);
+    ATTR_DECODE ("stat:total_llvm_time", float, st.total_llvm_time);
+    ATTR_DECODE ("stat:llvm_setup_time", float, st.llvm_setup_time);
+    ATTR_DECODE ("stat:llvm_ops_parse_time", float, st.llvm_ops_parse_time);
+    ATTR_DECODE ("stat:llvm_ops_clone_time", float, st.llvm_ops_clone_time);
+    ATTR_DECODE ("stat:llvm_ops_parses", int, m_stat_llvm_ops_parses);
+    ATTR_DECODE ("stat:llvm_irgen_time", float, st.llvm_irgen_time);
+    ATTR_DECODE ("stat:llvm_opt_time", float, st.llvm_opt_time);
+    ATTR_DECODE ("stat:llvm_jit_time", float, st.llvm_jit_time);
+    ATTR_DECODE ("stat:batches", long long, st.batches);
+    ATTR_DECODE ("stat:batch_points", long long, st.batch_points);
+    ATTR_DECODE ("stat:jit_steals", long long, m_stat_jit_steals);
+    ATTR_DECODE ("stat:jitcache_hits", int, m_stat_jitcache_hits);
+    ATTR_DECODE ("stat:jitcache_misses", int, m_stat_jitcache_misses);
+    ATTR_DECODE ("stat:jitcache_writes", int, m_stat_jitcache_writes);
+    ATTR_DECODE ("stat:jitcache_uncacheable", int, m_stat_jitcache_uncacheable);
+    ATTR_DECODE ("stat:jitcache_bytes_read", long long, m_stat_jitcache_bytes_read);
+    ATTR_DECODE ("stat:jitcache_bytes_written", long long, m_stat_jitcache_bytes_written);
+    ATTR_DECODE ("stat:jitcache_load_time", float, st.jitcache_load_time);
+    ATTR_DECODE ("stat:tier2_groups", int, st.tier2_groups);
+    ATTR_DECODE ("stat:tier2_time", float, st.tier2_time);
+    ATTR_DECODE ("stat:aot_groups_written", int, st.aot_groups_written);
+    ATTR_DECODE ("stat:aot_groups_registered", int, st.aot_groups_registered);
+    ATTR_DECODE ("stat:aot_register_time", float, st.aot_register_time);
     ATTR_DECODE ("stat:memory_current", long long, m_stat_memory.current());
     ATTR_DECODE ("stat:memory_peak", long long, m_stat_memory.peak());
     ATTR_DECODE ("stat:mem_master_current", long long, m_stat_mem_master.current());
@@ -711,10 +874,14 @@ ShadingSystemImpl::getstats (int level) const
         out << "  No shaders requested\n";
         return out.str();
     }
+    ShadingStats st (stats());
     out << "  Shaders:\n";
     out << "    Requested: " << m_stat_shaders_requested << "\n";
     out << "    Loaded:    " << m_stat_shaders_loaded << "\n";
     out << "    Masters:   " << m_stat_shaders_loaded << "\n";
+    if (m_stat_shaders_load_waits)
+        out << "    Waited on concurrent loads: "
+            << m_stat_shaders_load_waits << "\n";
     out << "    Instances: " << m_stat_instances << "\n";
     out << "  Shading groups:   " << m_stat_groups << "\n";
     out << "    Total instances in all groups: " << m_stat_groupinstances << "\n";
@@ -743,14 +910,31 @@ ShadingSystemImpl::getstats (int level) const
                             (100.0*(int)m_stat_syms_with_derivs)/std::max((int)m_stat_total_syms,1)); 
 #endif
 
-    out << "  Compiled " << m_stat_groups_compiled << " groups, "
-        << m_stat_instances_compiled << " instances\n";
+    out << "  Compiled " << st.groups_compiled << " groups, "
+        << st.instances_compiled << " instances\n";
     out << "  After optimization, " << m_stat_empty_instances 
         << " empty instances ("
-        << (int)(100.0f*m_stat_empty_instances/m_stat_instances_compiled)
+        << (int)(100.0f*m_stat_empty_instances/st.instances_compiled)
         << "%)\n";
     out << "  After optimization, " << m_stat_empty_groups << " empty groups ("
-        << (int)(100.0f*m_stat_empty_groups/m_stat_groups_compiled)<< "%)\n";
+        << (int)(100.0f*m_stat_empty_groups/st.groups_compiled)<< "%)\n";
+    if (st.groups_deduped)
+        out << "  Identical groups sharing code: " << st.groups_deduped
+            << " (saved " << Strutil::memformat (st.dedup_code_saved)
+            << " of JIT code)\n";
+    if (m_paramagnostic)
+        out << "  Params supplied at run time (paramagnostic): "
+            << m_stat_agnostic_params << "\n";
+    if (m_messageslots)
+        out << "  Messages resolved to group data slots: "
+            << m_stat_message_slots << "\n";
+    if (m_stat_groups_parallel_opt)
+        out << "  Groups optimized a layer per thread: "
+            << m_stat_groups_parallel_opt << "\n";
+    if (m_batchjit)
+        out << "  Groups with batch (SIMD) code: "
+            << m_stat_groups_batch << "\n";
+    out << "  JIT code: " << Strutil::memformat (m_stat_llvm_code_bytes) << "\n";
     out << Strutil::format ("  Optimized %llu ops to %llu (%.1f%%)\n",
                             (long long)m_stat_preopt_ops,
                             (long long)m_stat_postopt_ops,
@@ -760,28 +944,124 @@ ShadingSystemImpl::getstats (int level) const
                             (long long)m_stat_postopt_syms,
                             100.0*(double(m_stat_postopt_syms)/double(m_stat_preopt_syms)-1.0));
     out << "  Runtime optimization cost: "
-        << Strutil::timeintervalformat (m_stat_optimization_time, 2) << "\n";
+        << Strutil::timeintervalformat (st.optimization_time, 2) << "\n";
     out << "    locking:                   "
-        << Strutil::timeintervalformat (m_stat_opt_locking_time, 2) << "\n";
+        << Strutil::timeintervalformat (st.opt_locking_time, 2) << "\n";
     out << "    runtime specialization:    "
-        << Strutil::timeintervalformat (m_stat_specialization_time, 2) << "\n";
-    if (m_stat_total_llvm_time > 0.0) {
+        << Strutil::timeintervalformat (st.specialization_time, 2) << "\n";
+    out << "      constant folding:        "
+        << Strutil::timeintervalformat (st.opt_fold_time, 2)
+        << " (" << st.opt_passes << " passes, "
+        << st.opt_ops_visited << " ops visited, "
+        << st.opt_ops_skipped << " skipped)\n";
+    // Lookups are only timed when benchmarking (see find_constant)
+    if (st.const_lookup_time > 0)
+        out << "        constant lookup:       "
+            << Strutil::timeintervalformat (st.const_lookup_time, 2)
+            << " (" << st.const_lookups << " lookups)\n";
+    else
+        out << "        constant lookups:      " << st.const_lookups << "\n";
+    out << "      lifetimes:               "
+        << Strutil::timeintervalformat (st.opt_lifetime_time, 2) << "\n";
+    out << "      derivatives:             "
+        << Strutil::timeintervalformat (st.opt_deps_time, 2) << "\n";
+    out << "      post-optimize cleanup:   "
+        << Strutil::timeintervalformat (st.opt_post_time, 2) << "\n";
+    if (st.total_llvm_time > 0.0) {
         out << "    LLVM setup:                "
-            << Strutil::timeintervalformat (m_stat_llvm_setup_time, 2) << "\n";
+            << Strutil::timeintervalformat (st.llvm_setup_time, 2) << "\n";
+        out << "      llvm_ops parse:          "
+            << Strutil::timeintervalformat (st.llvm_ops_parse_time, 2)
+            << " (" << m_stat_llvm_ops_parses << " times)\n";
+        out << "      llvm_ops copy:           "
+            << Strutil::timeintervalformat (st.llvm_ops_clone_time, 2) << "\n";
         out << "    LLVM IR gen:               "
-            << Strutil::timeintervalformat (m_stat_llvm_irgen_time, 2) << "\n";
+            << Strutil::timeintervalformat (st.llvm_irgen_time, 2) << "\n";
         out << "    LLVM optimize:             "
-            << Strutil::timeintervalformat (m_stat_llvm_opt_time, 2) << "\n";
+            << Strutil::timeintervalformat (st.llvm_opt_time, 2) << "\n";
         out << "    LLVM JIT:                  "
-            << Strutil::timeintervalformat (m_stat_llvm_jit_time, 2) << "\n";
+            << Strutil::timeintervalformat (st.llvm_jit_time, 2) << "\n";
     }
 
+    if (m_jitcache.size()) {
+        out << "  JIT cache (" << m_jitcache << "):\n";
+        out << "    Hits: " << m_stat_jitcache_hits << ", misses: "
+            << m_stat_jitcache_misses << ", uncacheable: "
+            << m_stat_jitcache_uncacheable << "\n";
+        out << "    Read " << Strutil::memformat (m_stat_jitcache_bytes_read)
+            << " (" << Strutil::timeintervalformat (st.jitcache_load_time, 2)
+            << "), wrote " << m_stat_jitcache_writes << " groups ("
+            << Strutil::memformat (m_stat_jitcache_bytes_written) << ")\n";
+    }
+    if (st.aot_groups_written || st.aot_groups_registered) {
+        out << "  Compiled ahead of time: " << st.aot_groups_written
+            << " groups written, " << st.aot_groups_registered
+            << " registered ("
+            << Strutil::timeintervalformat (st.aot_register_time, 2) << ")\n";
+    }
+    if (m_tieredjit > 0) {
+        out << "  Tiered JIT: " << st.tier2_groups
+            << " groups re-optimized after " << m_tieredjit << " executions ("
+            << Strutil::timeintervalformat (st.tier2_time, 2) << ")\n";
+    }
+    if (m_compile_queues.size()) {
+        out << "  Greedy JIT: " << m_compile_queues.size() << " worker threads, "
+            << m_stat_jit_steals << " groups stolen\n";
+    }
+    if (st.batches) {
+        out << "  Batched executions: " << st.batches << " ("
+            << st.batch_points << " points, "
+            << Strutil::format ("%.1f", double(st.batch_points)/double(st.batches))
+            << " avg)\n";
+    }
+    if (m_profile) {
+        // Sum the per-thread counters, then list the most expensive
+        // groups, layers and ops.
+        lock_guard lock (m_profile_mutex);
+        size_t nids = m_profile_entries.size();
+        std::vector<ProfileCounters::Counter> totals (nids);
+        long long grouptime = 0;
+        for (size_t t = 0;  t < m_profile_counters.size();  ++t) {
+            for (size_t id = 0;  id < nids;  ++id) {
+                const ProfileCounters::Counter *c = m_profile_counters[t]->get ((int)id);
+                if (c) {
+                    totals[id].cycles += c->cycles;
+                    totals[id].calls += c->calls;
+                    if (m_profile_entries[id].kind == ProfileGroup)
+                        grouptime += c->cycles;
+                }
+            }
+        }
+        out << "  Run-time profile ("
+            << Strutil::format ("%.3g", double(grouptime)) << " cycles):\n";
+        static const char *kindnames[] = { "Groups", "Layers", "Ops" };
+        size_t topn = level > 1 ? 50 : 10;
+        for (int kind = ProfileGroup;  kind <= ProfileOp;  ++kind) {
+            std::vector<std::pair<long long,int> > sorted;
+            for (size_t id = 0;  id < nids;  ++id)
+                if (m_profile_entries[id].kind == kind && totals[id].calls)
+                    sorted.push_back (std::make_pair (totals[id].cycles, (int)id));
+            if (sorted.empty())
+                continue;
+            std::sort (sorted.rbegin(), sorted.rend());  // most expensive first
+            out << "    " << kindnames[kind] << " (top "
+                << std::min (topn, sorted.size()) << " of " << sorted.size()
+                << "):\n";
+            for (size_t i = 0;  i < sorted.size() && i < topn;  ++i) {
+                const ProfileCounters::Counter &c (totals[sorted[i].second]);
+                out << Strutil::format ("      %5.1f%%  %10lld calls  %10.0f cycles/call  %s\n",
+                                        100.0 * c.cycles / std::max (grouptime, 1LL),
+                                        c.calls, double(c.cycles) / c.calls,
+                                        m_profile_entries[sorted[i].second].name.c_str());
+            }
+        }
+    }
     out << "  Regex's compiled: " << m_stat_regexes << "\n";
-    if (m_stat_getattribute_calls) {
-        out << "  getattribute calls: " << m_stat_getattribute_calls << " ("
-            << Strutil::timeintervalformat (m_stat_getattribute_time, 2) << ")\n";
+    if (st.getattribute_calls) {
+        out << "  getattribute calls: " << st.getattribute_calls << " ("
+            << Strutil::timeintervalformat (st.getattribute_time, 2) << ")\n";
         out << "     (fail time "
-            << Strutil::timeintervalformat (m_stat_getattribute_fail_time, 2) << ")\n";
+            << Strutil::timeintervalformat (st.getattribute_fail_time, 2) << ")\n";
     }
     out << "  Memory total: " << m_stat_memory.memstat() << '\n';
     out << "    Master memory: " << m_stat_mem_master.memstat() << '\n';
@@ -820,6 +1100,238 @@ ShadingSystemImpl::printstats () const
 
 
 
+namespace {
+
+/// Just enough of a JSON writer for getstats_json: nested objects whose
+/// leaves are numbers.
+class JsonStats {
+public:
+    JsonStats () : m_first(true) { m_out << "{"; }
+
+    void begin (const char *name) {
+        key (name);
+        m_out << "{";
+        m_first = true;
+    }
+    void end () { m_out << "}";  m_first = false; }
+
+    void add (const char *name, int val) { key (name);  m_out << val; }
+    void add (const char *name, long long val) { key (name);  m_out << val; }
+    void add (const char *name, double val) {
+        key (name);
+        m_out << Strutil::format ("%.6g", val);
+    }
+    void add_peak (const char *name, long long current, long long peak) {
+        begin (name);
+        add ("current", current);
+        add ("peak", peak);
+        end ();
+    }
+
+    std::string str () const { return m_out.str() + "}"; }
+
+private:
+    void key (const char *name) {
+        if (! m_first)
+            m_out << ",";
+        m_first = false;
+        m_out << "\"" << name << "\":";
+    }
+    std::ostringstream m_out;
+    bool m_first;               ///< Nothing written yet at this level
+};
+
+};  // anonymous namespace
+
+
+
+std::string
+ShadingSystemImpl::getstats_json () const
+{
+    ShadingStats st (stats());
+    JsonStats j;
+
+    j.begin ("shaders");
+    j.add ("requested", (int)m_stat_shaders_requested);
+    j.add ("loaded", (int)m_stat_shaders_loaded);
+    j.add ("load_waits", (int)m_stat_shaders_load_waits);
+    j.add_peak ("instances", m_stat_instances.current(), m_stat_instances.peak());
+    j.end ();
+
+    j.begin ("groups");
+    j.add ("total", m_stat_groups);
+    j.add ("instances", m_stat_groupinstances);
+    j.add ("compiled", st.groups_compiled);
+    j.add ("instances_compiled", st.instances_compiled);
+    j.add ("empty", (int)m_stat_empty_groups);
+    j.add ("empty_instances", (int)m_stat_empty_instances);
+    j.add ("deduped", st.groups_deduped);
+    j.add ("dedup_code_saved", st.dedup_code_saved);
+    j.add ("parallel_opt", (int)m_stat_groups_parallel_opt);
+    j.add ("batch", (int)m_stat_groups_batch);
+    j.end ();
+
+    j.add_peak ("contexts", m_stat_contexts.current(), m_stat_contexts.peak());
+
+    j.begin ("optimization");
+    j.add ("time", st.optimization_time);
+    j.add ("locking_time", st.opt_locking_time);
+    j.add ("specialization_time", st.specialization_time);
+    j.add ("fold_time", st.opt_fold_time);
+    j.add ("passes", st.opt_passes);
+    j.add ("ops_visited", st.opt_ops_visited);
+    j.add ("ops_skipped", st.opt_ops_skipped);
+    j.add ("const_lookup_time", st.const_lookup_time);
+    j.add ("const_lookups", st.const_lookups);
+    j.add ("lifetime_time", st.opt_lifetime_time);
+    j.add ("deps_time", st.opt_deps_time);
+    j.add ("post_time", st.opt_post_time);
+    j.add ("preopt_syms", (int)m_stat_preopt_syms);
+    j.add ("postopt_syms", (int)m_stat_postopt_syms);
+    j.add ("preopt_ops", (int)m_stat_preopt_ops);
+    j.add ("postopt_ops", (int)m_stat_postopt_ops);
+    j.add ("agnostic_params", (int)m_stat_agnostic_params);
+    j.add ("message_slots", (int)m_stat_message_slots);
+    j.end ();
+
+    j.begin ("llvm");
+    j.add ("total_time", st.total_llvm_time);
+    j.add ("setup_time", st.llvm_setup_time);
+    j.add ("ops_parse_time", st.llvm_ops_parse_time);
+    j.add ("ops_parses", (int)m_stat_llvm_ops_parses);
+    j.add ("ops_clone_time", st.llvm_ops_clone_time);
+    j.add ("irgen_time", st.llvm_irgen_time);
+    j.add ("opt_time", st.llvm_opt_time);
+    j.add ("jit_time", st.llvm_jit_time);
+    j.add ("code_bytes", (long long)m_stat_llvm_code_bytes);
+    j.add ("jit_steals", (long long)m_stat_jit_steals);
+    j.add ("tier2_groups", st.tier2_groups);
+    j.add ("tier2_time", st.tier2_time);
+    j.end ();
+
+    j.begin ("jitcache");
+    j.add ("hits", (int)m_stat_jitcache_hits);
+    j.add ("misses", (int)m_stat_jitcache_misses);
+    j.add ("uncacheable", (int)m_stat_jitcache_uncacheable);
+    j.add ("writes", (int)m_stat_jitcache_writes);
+    j.add ("bytes_read", (long long)m_stat_jitcache_bytes_read);
+    j.add ("bytes_written", (long long)m_stat_jitcache_bytes_written);
+    j.add ("load_time", st.jitcache_load_time);
+    j.end ();
+
+    j.begin ("aot");
+    j.add ("groups_written", st.aot_groups_written);
+    j.add ("groups_registered", st.aot_groups_registered);
+    j.add ("register_time", st.aot_register_time);
+    j.end ();
+
+    j.begin ("execution");
+    j.add ("batches", st.batches);
+    j.add ("batch_points", st.batch_points);
+    j.add ("getattribute_calls", st.getattribute_calls);
+    j.add ("getattribute_time", st.getattribute_time);
+    j.add ("getattribute_fail_time", st.getattribute_fail_time);
+    j.add ("regexes", (int)m_stat_regexes);
+    j.end ();
+
+    j.begin ("memory");
+    j.add_peak ("total", m_stat_memory.current(), m_stat_memory.peak());
+    j.add_peak ("master", m_stat_mem_master.current(), m_stat_mem_master.peak());
+    j.add_peak ("master_ops", m_stat_mem_master_ops.current(),
+                m_stat_mem_master_ops.peak());
+    j.add_peak ("master_args", m_stat_mem_master_args.current(),
+                m_stat_mem_master_args.peak());
+    j.add_peak ("master_syms", m_stat_mem_master_syms.current(),
+                m_stat_mem_master_syms.peak());
+    j.add_peak ("master_defaults", m_stat_mem_master_defaults.current(),
+                m_stat_mem_master_defaults.peak());
+    j.add_peak ("master_consts", m_stat_mem_master_consts.current(),
+                m_stat_mem_master_consts.peak());
+    j.add_peak ("inst", m_stat_mem_inst.current(), m_stat_mem_inst.peak());
+    j.add_peak ("inst_syms", m_stat_mem_inst_syms.current(),
+                m_stat_mem_inst_syms.peak());
+    j.add_peak ("inst_paramvals", m_stat_mem_inst_paramvals.current(),
+                m_stat_mem_inst_paramvals.peak());
+    j.add_peak ("inst_connections", m_stat_mem_inst_connections.current(),
+                m_stat_mem_inst_connections.peak());
+    j.end ();
+
+    return j.str();
+}
+
+
+
+void
+ShadingStats::merge (const ShadingStats &other)
+{
+    groups_compiled += other.groups_compiled;
+    instances_compiled += other.instances_compiled;
+    groups_deduped += other.groups_deduped;
+    dedup_code_saved += other.dedup_code_saved;
+    optimization_time += other.optimization_time;
+    opt_locking_time += other.opt_locking_time;
+    specialization_time += other.specialization_time;
+    const_lookup_time += other.const_lookup_time;
+    const_lookups += other.const_lookups;
+    opt_fold_time += other.opt_fold_time;
+    opt_lifetime_time += other.opt_lifetime_time;
+    opt_deps_time += other.opt_deps_time;
+    opt_post_time += other.opt_post_time;
+    opt_passes += other.opt_passes;
+    opt_ops_visited += other.opt_ops_visited;
+    opt_ops_skipped += other.opt_ops_skipped;
+    total_llvm_time += other.total_llvm_time;
+    llvm_setup_time += other.llvm_setup_time;
+    llvm_ops_parse_time += other.llvm_ops_parse_time;
+    llvm_ops_clone_time += other.llvm_ops_clone_time;
+    llvm_irgen_time += other.llvm_irgen_time;
+    llvm_opt_time += other.llvm_opt_time;
+    llvm_jit_time += other.llvm_jit_time;
+    jitcache_load_time += other.jitcache_load_time;
+    tier2_groups += other.tier2_groups;
+    tier2_time += other.tier2_time;
+    aot_groups_written += other.aot_groups_written;
+    aot_groups_registered += other.aot_groups_registered;
+    aot_register_time += other.aot_register_time;
+    getattribute_calls += other.getattribute_calls;
+    getattribute_time += other.getattribute_time;
+    getattribute_fail_time += other.getattribute_fail_time;
+    batches += other.batches;
+    batch_points += other.batch_points;
+}
+
+
+
+ShadingStats &
+ShadingSystemImpl::thread_stats (PerThreadInfo *threadinfo)
+{
+    if (! threadinfo)
+        threadinfo = get_perthread_info ();
+    if (! threadinfo->stats) {
+        // Ours to keep, so the counts outlive the thread.
+        threadinfo->stats = new ShadingStats;
+        spin_lock lock (m_thread_stats_mutex);
+        m_thread_stats.push_back (threadinfo->stats);
+    }
+    return *threadinfo->stats;
+}
+
+
+
+ShadingStats
+ShadingSystemImpl::stats () const
+{
+    // No need to stop the other threads, we just read their counts as
+    // they are right now.
+    ShadingStats total;
+    spin_lock lock (m_thread_stats_mutex);
+    for (size_t i = 0;  i < m_thread_stats.size();  ++i)
+        total.merge (*m_thread_stats[i]);
+    return total;
+}
+
+
+
 bool
 ShadingSystemImpl::Parameter (const char *name, TypeDesc t, const void *val)
 {
@@ -840,6 +1352,7 @@ ShadingSystemImpl::ShaderGroupBegin (const char *groupname)
         error ("Nested ShaderGroupBegin() calls");
         return false;
     }
+    submit_declared_group ();
     m_in_group = true;
     m_group_use = ShadUseUnknown;
     m_group_name = ustring (groupname);
@@ -888,6 +1401,10 @@ ShadingSystemImpl::ShaderGroupEnd (void)
                 inst->run_lazily (false);
             }
         }
+        // Now that it's complete, fingerprint the group so that we can
+        // recognize identical groups.
+        if (m_dedupgroups)
+            (void) sgroup.fingerprint (m_paramagnostic);
     }
 
     m_in_group = false;
@@ -1042,11 +1559,20 @@ ShadingSystemImpl::ConnectShaders (const char *srclayer, const char *srcparam,
 ShadingAttribStateRef
 ShadingSystemImpl::state ()
 {
-    {
-        // Record the state for later greedy JITing
-        spin_lock lock (m_groups_to_compile_mutex);
-        m_groups_to_compile.push_back (m_curattrib);
-        ++m_groups_to_compile_count;
+    // Let the JIT workers get started on it in the background -- but
+    // not until the next group is begun, since the caller may yet
+    // register_compiled_group this one.
+    if (m_greedyjit) {
+        ShadingAttribStateRef prev;
+        {
+            spin_lock lock (m_declared_group_mutex);
+            if (m_declared_group != m_curattrib) {
+                prev.swap (m_declared_group);
+                m_declared_group = m_curattrib;
+            }
+        }
+        if (prev)
+            submit_group_to_compile (prev);
     }
     return m_curattrib;
 }
@@ -1110,14 +1636,36 @@ ShadingSystemImpl::execute (ShadingContext &ctx, ShadingAttribState &sas,
 
 
 
+bool
+ShadingSystemImpl::execute_batch (ShadingContext &ctx, ShadingAttribState &sas,
+                                  ShaderGlobals *ssg, int npoints,
+                                  const unsigned char *runflags, bool run)
+{
+    return ctx.execute_batch (ShadUseSurface, sas, ssg, npoints,
+                              (const Runflag *)runflags, run);
+}
+
+
+
+bool
+ShadingSystemImpl::execute_batch (ShadingContext &ctx, ShadingAttribState &sas,
+                                  ShaderGlobalsBatch &sgb, int npoints,
+                                  const unsigned char *runflags, bool run)
+{
+    return ctx.execute_batch (ShadUseSurface, sas, sgb, npoints,
+                              (const Runflag *)runflags, run);
+}
+
+
+
 const void *
 ShadingSystemImpl::get_symbol (ShadingContext &ctx, ustring name,
-                               TypeDesc &type)
+                               TypeDesc &type, int point)
 {
     Symbol *sym = ctx.symbol (ShadUseSurface, name);
     if (sym) {
         type = sym->typespec().simpletype();
-        return ctx.symbol_data (*sym);
+        return ctx.symbol_data (*sym, point);
     } else {
         return NULL;
     }
@@ -1232,6 +1780,84 @@ ShadingSystemImpl::raytype_bit (ustring name)
 
 
 
+const boost::regex &
+ShadingSystemImpl::find_regex (ustring r)
+{
+    lock_guard lock (m_regex_mutex);
+    RegexMap::const_iterator found = m_regex_map.find (r);
+    if (found != m_regex_map.end())
+        return *found->second;
+    // otherwise, it wasn't found, add it
+    boost::regex *regex = new boost::regex (r.c_str());
+    m_regex_map[r] = regex;
+    m_stat_regexes += 1;
+    return *regex;
+}
+
+
+
+
+void
+ShadingSystemImpl::perfmap_write (const void *addr, size_t size,
+                                  const std::string &name)
+{
+    if (m_perfmap_unavailable)
+        return;
+    lock_guard lock (m_perfmap_mutex);
+    if (m_perfmap_unavailable)
+        return;
+    if (! m_perfmap_file) {
+        std::string filename = Strutil::format ("/tmp/perf-%d.map", (int)getpid());
+        m_perfmap_file = fopen (filename.c_str(), "a");
+        if (! m_perfmap_file) {
+            error ("Could not open perf map \"%s\"", filename.c_str());
+            m_perfmap_unavailable = 1;   // don't try again
+            return;
+        }
+    }
+    // perf wants "START SIZE symbolname", addresses in hex
+    fprintf (m_perfmap_file, "%llx %llx %s\n",
+             (unsigned long long)(size_t)addr, (unsigned long long)size,
+             name.c_str());
+    fflush (m_perfmap_file);
+}
+
+
+
+int
+ShadingSystemImpl::profile_id (ProfileKind kind, const std::string &name)
+{
+    std::string key = Strutil::format ("%d %s", (int)kind, name.c_str());
+    lock_guard lock (m_profile_mutex);
+    std::map<std::string,int>::const_iterator found = m_profile_ids.find (key);
+    if (found != m_profile_ids.end())
+        return found->second;
+    int id = (int) m_profile_entries.size();
+    if (id >= ProfileCounters::MaxCounters)
+        return -1;
+    ProfileEntry entry;
+    entry.kind = kind;
+    entry.name = name;
+    m_profile_entries.push_back (entry);
+    m_profile_ids[key] = id;
+    return id;
+}
+
+
+
+ProfileCounters *
+ShadingSystemImpl::thread_profile (PerThreadInfo *threadinfo)
+{
+    if (! threadinfo->profile) {
+        // Ours to keep, so the totals outlive the thread.
+        threadinfo->profile = new ProfileCounters (m_profile_mutex);
+        lock_guard lock (m_profile_mutex);
+        m_profile_counters.push_back (threadinfo->profile);
+    }
+    return threadinfo->profile;
+}
+
+
 
 void ClosureRegistry::register_closure(const char *name, int id, const ClosureParam *params, int size,
                                        PrepareClosureFunc prepare, SetupClosureFunc setup, CompareClosureFunc compare)
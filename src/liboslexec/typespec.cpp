@@ -49,15 +49,56 @@ namespace pvt {   // OSL::pvt
 
 
 
+// Guards additions to the struct list, which may come from several
+// threads reading .oso files at once.
+static spin_mutex struct_list_mutex;
+
+// Number of entries of the struct list that are fully constructed.  It
+// is only raised after an entry is added, so structspec() can look up
+// existing entries without taking the lock.
+static atomic_int struct_list_size;
+
+
+
 std::vector<shared_ptr<StructSpec> > &
 TypeSpec::struct_list ()
 {
-    static std::vector<shared_ptr<StructSpec> > m_structs;
+    // Struct ids are shorts, so reserving the maximum up front means the
+    // list never reallocates, and lookups of existing entries stay valid
+    // while another thread is adding one.  Doing it in the constructor
+    // makes it happen exactly once, before any thread can see the list.
+    struct StructList : public std::vector<shared_ptr<StructSpec> > {
+        StructList () { reserve (0x8000); }
+    };
+    static StructList m_structs;
     return m_structs;
 }
 
 
 
+void
+TypeSpec::clear_struct_list ()
+{
+    spin_lock lock (struct_list_mutex);
+    struct_list_size = 0;
+    struct_list().clear ();
+}
+
+
+
+StructSpec *
+TypeSpec::structspec (int id)
+{
+    if (! id)
+        return NULL;
+    std::vector<shared_ptr<StructSpec> > & m_structs (struct_list());
+    // The list never reallocates (see struct_list()), so any entry below
+    // the published size can be read while another is being added.
+    return id < struct_list_size ? m_structs[id].get() : NULL;
+}
+
+
+
 TypeSpec::TypeSpec (const char *name, int structid, int arraylen)
     : m_simple(TypeDesc::UNKNOWN, arraylen), m_structure((short)structid),
       m_closure(false)
@@ -73,6 +114,7 @@ TypeSpec::structure_id (const char *name, bool add)
 {
     std::vector<shared_ptr<StructSpec> > & m_structs (struct_list());
     ustring n (name);
+    spin_lock lock (struct_list_mutex);
     for (int i = (int)m_structs.size()-1;  i > 0;  --i) {
         ASSERT ((int)m_structs.size() > i);
         if (m_structs[i] && m_structs[i]->name() == n)
@@ -80,8 +122,11 @@ TypeSpec::structure_id (const char *name, bool add)
     }
     if (add) {
         ASSERT (m_structs.size() < 0x8000 && "more struct id's than fit in a short!");
-        int id = new_struct (new StructSpec (n, 0));
-        return id;
+        if (m_structs.size() == 0)
+            m_structs.resize (1);   // Allocate an empty one
+        m_structs.push_back (shared_ptr<StructSpec>(new StructSpec (n, 0)));
+        struct_list_size = (int)m_structs.size();
+        return (int)m_structs.size()-1;
     }
     return 0;   // Not found, not added
 }
@@ -92,9 +137,12 @@ int
 TypeSpec::new_struct (StructSpec *n)
 {
     std::vector<shared_ptr<StructSpec> > & m_structs (struct_list());
+    spin_lock lock (struct_list_mutex);
+    ASSERT (m_structs.size() < 0x8000 && "more struct id's than fit in a short!");
     if (m_structs.size() == 0)
         m_structs.resize (1);   // Allocate an empty one
     m_structs.push_back (shared_ptr<StructSpec>(n));
+    struct_list_size = (int)m_structs.size();
     return (int)m_structs.size()-1;
 }
 
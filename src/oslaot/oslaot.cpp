@@ -0,0 +1,342 @@
+/*
+Copyright (c) 2009-2010 Sony Pictures Imageworks Inc., et al.
+All Rights Reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are
+met:
+* Redistributions of source code must retain the above copyright
+  notice, this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright
+  notice, this list of conditions and the following disclaimer in the
+  documentation and/or other materials provided with the distribution.
+* Neither the name of Sony Pictures Imageworks nor the names of its
+  contributors may be used to endorse or promote products derived from
+  this software without specific prior written permission.
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+// oslaot -- compile a shader group ahead of time into a shared library
+// that a renderer can hand to ShadingSystem::register_compiled_group,
+// so that it never has to optimize or JIT the group itself.
+//
+// The group is described by a text file with one statement per line
+// ('#' starts a comment):
+//
+//     param <type> <name> <value>...     e.g. param color Cs 1 0.5 0
+//     shader <shadername> <layername>
+//     connect <layer>.<param> <layer>.<param>
+//
+// where <type> is int, float, string, color, point, vector, normal, or
+// matrix, optionally followed by an array length ("float[4]").  As with
+// ShadingSystem::Parameter, each shader statement gets the params given
+// since the previous one.
+
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <list>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <OpenImageIO/argparse.h>
+#include <OpenImageIO/errorhandler.h>
+#include <OpenImageIO/strutil.h>
+
+#include "oslexec.h"
+using namespace OSL;
+
+#ifdef OIIO_NAMESPACE
+using OIIO::ArgParse;
+#endif
+
+
+
+/// A renderer that knows nothing about the scene, so that the group's
+/// optimization doesn't come to depend on it.
+class AOTRenderer : public RendererServices
+{
+public:
+    AOTRenderer () { }
+    virtual bool get_matrix (Matrix44 &result, TransformationPtr xform,
+                             float time) { return false; }
+    virtual bool get_matrix (Matrix44 &result, TransformationPtr xform) {
+        return false;
+    }
+    virtual bool get_matrix (Matrix44 &result, ustring from, float time) {
+        return false;
+    }
+    virtual bool get_matrix (Matrix44 &result, ustring from) { return false; }
+    virtual bool get_attribute (void *renderstate, bool derivatives,
+                                ustring object, TypeDesc type, ustring name,
+                                void *val) { return false; }
+    virtual bool get_array_attribute (void *renderstate, bool derivatives,
+                                      ustring object, TypeDesc type,
+                                      ustring name, int index, void *val) {
+        return false;
+    }
+    virtual bool get_userdata (bool derivatives, ustring name, TypeDesc type,
+                               void *renderstate, void *val) { return false; }
+    virtual bool has_userdata (ustring name, TypeDesc type, void *renderstate) {
+        return false;
+    }
+};
+
+
+
+static std::string groupfile, outputfile;
+static std::string llvm_cpu = "generic", llvm_features;
+static std::string linker;
+static std::vector<std::string> options;
+static bool verbose = false;
+static ErrorHandler errhandler;
+
+
+
+static int
+set_groupfile (int argc, const char *argv[])
+{
+    for (int i = 0;  i < argc;  ++i)
+        groupfile = argv[i];
+    return 0;
+}
+
+
+
+static void
+getargs (int argc, const char *argv[])
+{
+    static bool help = false;
+    ArgParse ap;
+    ap.options ("Usage:  oslaot [options] groupfile -o output.so",
+                "%*", set_groupfile, "",
+                "--help", &help, "Print help message",
+                "-v", &verbose, "Verbose messages",
+                "-o %s", &outputfile, "Output file (.so or .dylib to link a "
+                        "shared library, anything else for just the object file)",
+                "--llvm_cpu %s", &llvm_cpu, "CPU to compile for (default: generic)",
+                "--llvm_features %s", &llvm_features, "Extra target features (e.g. +sse4.2)",
+                "--option %L %L", &options, &options,
+                        "Set a ShadingSystem option (args: name value)",
+                "--linker %s", &linker, "Command that links the shared library "
+                        "(default: $CXX or c++)",
+                NULL);
+    if (ap.parse (argc, argv) < 0 || groupfile.empty() || outputfile.empty()) {
+        std::cerr << ap.geterror() << std::endl;
+        ap.usage ();
+        exit (EXIT_FAILURE);
+    }
+    if (help) {
+        std::cout << "oslaot -- compile an OSL shader group ahead of time\n";
+        ap.usage ();
+        exit (EXIT_SUCCESS);
+    }
+    if (verbose)
+        errhandler.verbosity (ErrorHandler::VERBOSE);
+}
+
+
+
+/// Parse a type name such as "color" or "float[4]".
+static bool
+parse_type (const std::string &s, TypeDesc &type)
+{
+    std::string base = s;
+    int arraylen = 0;
+    size_t bracket = s.find ('[');
+    if (bracket != std::string::npos) {
+        base = s.substr (0, bracket);
+        arraylen = atoi (s.c_str() + bracket + 1);
+        if (arraylen < 1)
+            return false;
+    }
+    if (base == "int")
+        type = TypeDesc::TypeInt;
+    else if (base == "float")
+        type = TypeDesc::TypeFloat;
+    else if (base == "string")
+        type = TypeDesc::TypeString;
+    else if (base == "color")
+        type = TypeDesc::TypeColor;
+    else if (base == "point")
+        type = TypeDesc::TypePoint;
+    else if (base == "vector")
+        type = TypeDesc::TypeVector;
+    else if (base == "normal")
+        type = TypeDesc::TypeNormal;
+    else if (base == "matrix")
+        type = TypeDesc::TypeMatrix;
+    else
+        return false;
+    type.arraylen = arraylen;
+    return true;
+}
+
+
+
+/// Read the group description and declare the group to the
+/// ShadingSystem.  Return false (after printing why) if it's malformed.
+static bool
+declare_group (ShadingSystem *shadingsys, std::istream &in)
+{
+    // Parameter values must stay put until the Shader() that uses them
+    std::list<std::vector<char> > paramdata;
+    std::string line;
+    for (int lineno = 1;  std::getline (in, line);  ++lineno) {
+        size_t comment = line.find ('#');
+        if (comment != std::string::npos)
+            line.erase (comment);
+        std::istringstream words (line);
+        std::string cmd;
+        if (! (words >> cmd))
+            continue;
+        bool ok = false;
+        if (cmd == "param") {
+            std::string typestr, name;
+            TypeDesc type;
+            ok = (words >> typestr >> name) && parse_type (typestr, type);
+            int n = ok ? (int) (type.numelements() * type.aggregate) : 0;
+            if (ok && type.basetype == TypeDesc::STRING) {
+                paramdata.push_back (std::vector<char> (n * sizeof(ustring)));
+                ustring *vals = (ustring *) &paramdata.back()[0];
+                std::string s;
+                for (int i = 0;  ok && i < n;  ++i)
+                    if ((ok = (words >> s)))
+                        vals[i] = ustring (s);
+            } else if (ok && type.basetype == TypeDesc::INT) {
+                paramdata.push_back (std::vector<char> (n * sizeof(int)));
+                int *vals = (int *) &paramdata.back()[0];
+                for (int i = 0;  ok && i < n;  ++i)
+                    ok = (words >> vals[i]);
+            } else if (ok) {
+                paramdata.push_back (std::vector<char> (n * sizeof(float)));
+                float *vals = (float *) &paramdata.back()[0];
+                for (int i = 0;  ok && i < n;  ++i)
+                    ok = (words >> vals[i]);
+            }
+            ok = ok && shadingsys->Parameter (name.c_str(), type,
+                                              &paramdata.back()[0]);
+        } else if (cmd == "shader") {
+            std::string shadername, layername;
+            ok = (words >> shadername >> layername) &&
+                 shadingsys->Shader ("surface", shadername.c_str(),
+                                     layername.c_str());
+        } else if (cmd == "connect") {
+            std::string src, dst;
+            ok = (words >> src >> dst);
+            size_t sdot = src.find ('.'), ddot = dst.find ('.');
+            ok = ok && sdot != std::string::npos && ddot != std::string::npos &&
+                 shadingsys->ConnectShaders (src.substr(0,sdot).c_str(),
+                                             src.substr(sdot+1).c_str(),
+                                             dst.substr(0,ddot).c_str(),
+                                             dst.substr(ddot+1).c_str());
+        }
+        if (! ok) {
+            std::cerr << "oslaot: " << groupfile << ":" << lineno
+                      << ": could not understand \"" << line << "\"\n";
+            return false;
+        }
+    }
+    return true;
+}
+
+
+
+/// Set a ShadingSystem option given on the command line, as an int if
+/// the value looks like one, and otherwise as a string.
+static void
+set_option (ShadingSystem *shadingsys, const std::string &name,
+            const std::string &value)
+{
+    char *end = NULL;
+    long i = strtol (value.c_str(), &end, 10);
+    if (value.size() && *end == 0)
+        shadingsys->attribute (name, (int) i);
+    else
+        shadingsys->attribute (name, value.c_str());
+}
+
+
+
+static bool
+ends_with (const std::string &s, const char *suffix)
+{
+    size_t n = strlen (suffix);
+    return s.size() >= n && s.compare (s.size()-n, n, suffix) == 0;
+}
+
+
+
+int
+main (int argc, const char *argv[])
+{
+    getargs (argc, argv);
+
+    std::ifstream in (groupfile.c_str());
+    if (! in) {
+        std::cerr << "oslaot: could not open \"" << groupfile << "\"\n";
+        return EXIT_FAILURE;
+    }
+
+    AOTRenderer rend;
+    ShadingSystem *shadingsys = ShadingSystem::create (&rend, NULL, &errhandler);
+    // Same default as testshade; override with --option lockgeom 0.
+    // Remember that the renderer must use the same options that the
+    // group is compiled with, or it won't accept the library.
+    shadingsys->attribute ("lockgeom", 1);
+    for (size_t i = 0;  i+1 < options.size();  i += 2)
+        set_option (shadingsys, options[i], options[i+1]);
+    shadingsys->attribute ("llvm_cpu", llvm_cpu.c_str());
+    if (llvm_features.size())
+        shadingsys->attribute ("llvm_features", llvm_features.c_str());
+
+    shadingsys->ShaderGroupBegin ();
+    bool ok = declare_group (shadingsys, in);
+    shadingsys->ShaderGroupEnd ();
+    ShadingAttribStateRef group = shadingsys->state ();
+
+    // Write the object, and link it into a shared library if asked
+    bool link = ends_with (outputfile, ".so") || ends_with (outputfile, ".dylib");
+    std::string objfile = link ? outputfile + ".o" : outputfile;
+    ok = ok && shadingsys->write_compiled_group (*group, objfile.c_str());
+    if (ok && link) {
+        if (linker.empty())
+            linker = getenv ("CXX") ? getenv ("CXX") : "c++";
+#ifdef __APPLE__
+        // The shadeops are resolved against liboslexec when it's loaded
+        std::string flags = "-dynamiclib -undefined dynamic_lookup";
+#else
+        std::string flags = "-shared";
+#endif
+        std::string command = OIIO::Strutil::format ("%s %s -o \"%s\" \"%s\"",
+                                                     linker.c_str(), flags.c_str(),
+                                                     outputfile.c_str(), objfile.c_str());
+        if (verbose)
+            std::cout << command << "\n";
+        ok = (system (command.c_str()) == 0);
+        if (! ok)
+            std::cerr << "oslaot: could not link \"" << outputfile << "\"\n";
+        std::remove (objfile.c_str());
+    }
+    if (verbose)
+        std::cout << shadingsys->getstats (1) << "\n";
+
+    group.reset ();
+    ShadingSystem::destroy (shadingsys);
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
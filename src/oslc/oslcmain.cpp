@@ -59,6 +59,7 @@ usage ()
         "\t-O0, -O1, -O2  Set optimization level (default=1)\n"
         "\t-d             Debug mode\n"
         "\t-E             Only preprocess the input and output to stdout\n"
+        "\t-b             Write a binary .oso (faster to load)\n"
         ;
 }
 
@@ -83,6 +84,7 @@ main (int argc, const char *argv[])
                  ! strcmp (argv[a], "-q") ||
                  ! strcmp (argv[a], "-d") ||
                  ! strcmp (argv[a], "-E") ||
+                 ! strcmp (argv[a], "-b") ||
                  ! strcmp (argv[a], "-O") || ! strcmp (argv[a], "-O0") ||
                  ! strcmp (argv[a], "-O1") || ! strcmp (argv[a], "-O2")) {
             // Valid command-line argument
@@ -27,6 +27,8 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 */
 
 
+#include <cstring>
+
 #include "oslexec.h"
 #include "simplerend.h"
 using namespace OSL;
@@ -44,6 +46,7 @@ static ustring u_perspective("perspective");
 
 
 SimpleRenderer::SimpleRenderer ()
+    : m_texture_callback(false), m_texture_callbacks(0)
 {
     Matrix44 M;  M.makeIdentity();
     camera_params (M, u_perspective, 90.0f,
@@ -52,6 +55,30 @@ SimpleRenderer::SimpleRenderer ()
 
 
 
+bool
+SimpleRenderer::supports (const char *feature) const
+{
+    if (! strcmp (feature, "texture_handles"))
+        return ! m_texture_callback;
+    return false;
+}
+
+
+
+bool
+SimpleRenderer::texture (ustring filename, TextureOpt &options,
+                         ShaderGlobals *sg,
+                         float s, float t, float dsdx, float dtdx,
+                         float dsdy, float dtdy, float *result)
+{
+    if (m_texture_callback)
+        ++m_texture_callbacks;
+    return RendererServices::texture (filename, options, sg, s, t,
+                                      dsdx, dtdx, dsdy, dtdy, result);
+}
+
+
+
 void
 SimpleRenderer::camera_params (const Matrix44 &world_to_camera,
                                ustring projection, float hfov,
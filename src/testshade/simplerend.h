@@ -53,6 +53,8 @@ public:
     SimpleRenderer ();
     ~SimpleRenderer () { }
 
+    virtual bool supports (const char *feature) const;
+
     virtual bool get_matrix (Matrix44 &result, TransformationPtr xform,
                              float time);
     virtual bool get_matrix (Matrix44 &result, ustring from, float time);
@@ -72,6 +74,18 @@ public:
                                void *renderstate, void *val);
     virtual bool has_userdata (ustring name, TypeDesc type, void *renderstate);
 
+    using RendererServices::texture;
+    virtual bool texture (ustring filename, TextureOpt &options,
+                          ShaderGlobals *sg,
+                          float s, float t, float dsdx, float dtdx,
+                          float dsdy, float dtdy, float *result);
+
+    /// Act like a renderer that does its own texture lookups by
+    /// filename and knows nothing of texture handles, and count how
+    /// many lookups come to us.
+    void texture_callback (bool on) { m_texture_callback = on; }
+    int texture_callbacks () const { return m_texture_callbacks; }
+
     virtual int pointcloud_search (ustring filename, const OSL::Vec3 &center,
                                    float radius, int max_points, size_t *out_indices,
                                    float *out_distances, int derivs_offset);
@@ -93,6 +107,8 @@ private:
     ustring m_projection;
     float m_fov, m_hither, m_yon;
     int m_xres, m_yres;
+    bool m_texture_callback;
+    int m_texture_callbacks;
 };
 
 
@@ -68,10 +68,17 @@ static bool stats = false;
 static bool O0 = false, O1 = true, O2 = false;
 static bool pixelcenters = false;
 static bool debugnan = false;
+static bool paramagnostic = false;
+static bool paramagnostic_off = false;
+static bool texture_callback = false;
+static bool batch = false;
+static std::vector<std::string> printvars;
 static int xres = 1, yres = 1;
 static std::string layername;
 static std::vector<std::string> connections;
 static std::vector<std::string> iparams, fparams, vparams, sparams;
+static std::vector<std::string> lastiparams, lastfparams, lastvparams, lastsparams;
+static std::vector<std::string> variants;
 static float fparamdata[1000];   // bet that's big enough
 static int fparamindex = 0;
 static int iparamdata[1000];
@@ -81,6 +88,9 @@ static int sparamindex = 0;
 static ErrorHandler errhandler;
 static int iters = 1;
 static std::string raytype = "camera";
+static std::string llvm_cpu, llvm_features;
+static std::string compiledgroup;
+static std::string statsjsonfile;
 static SimpleRenderer rend;  // RendererServices
 static OSL::Matrix44 Mshad;  // "shader" space to "common" space matrix
 static OSL::Matrix44 Mobj;   // "object" space to "common" space matrix
@@ -131,6 +141,8 @@ add_shader (int argc, const char *argv[])
         shadingsys->attribute ("optimize", O2 ? 2 : (O0 ? 0 : 1));
     shadingsys->attribute ("lockgeom", 1);
     shadingsys->attribute ("debugnan", debugnan);
+    shadingsys->attribute ("paramagnostic", paramagnostic);
+    shadingsys->attribute ("batchjit", batch);
 
     for (int i = 0;  i < argc;  i++) {
         inject_params ();
@@ -140,6 +152,10 @@ add_shader (int argc, const char *argv[])
                             layername.length() ? layername.c_str() : NULL);
 
         layername.clear ();
+        lastiparams.swap (iparams);
+        lastfparams.swap (fparams);
+        lastvparams.swap (vparams);
+        lastsparams.swap (sparams);
         iparams.clear ();
         fparams.clear ();
         vparams.clear ();
@@ -162,6 +178,7 @@ getargs (int argc, const char *argv[])
                 "--debug", &debug, "Lots of debugging info",
                 "--debug2", &debug2, "Even more debugging info",
                 "--stats", &stats, "Print run statistics",
+                "--stats_json %s", &statsjsonfile, "Write the statistics, as JSON, to the named file",
                 "-g %d %d", &xres, &yres, "Make an X x Y grid of shading points",
                 "-o %L %L", &outputvars, &outputfiles,
                         "Output (variable, filename)",
@@ -190,6 +207,16 @@ getargs (int argc, const char *argv[])
                 "-O2", &O2, "Do lots of runtime shader optimization",
                 "--center", &pixelcenters, "Shade at output pixel 'centers' rather than corners",
                 "--debugnan", &debugnan, "Turn on 'debugnan' mode",
+                "--paramagnostic", &paramagnostic, "Supply param values at run time instead of folding them",
+                "--paramagnostic_off", &paramagnostic_off, "Turn paramagnostic off again after declaring the groups",
+                "--llvm_cpu %s", &llvm_cpu, "Set the JIT target CPU (default: host)",
+                "--llvm_features %s", &llvm_features, "Set extra JIT target features (e.g. +avx,-fma)",
+                "--compiled %s", &compiledgroup, "Run the group from a library made by oslaot",
+                "--texture_callback", &texture_callback, "Do texture lookups by filename in the renderer, without handles",
+                "--batch", &batch, "Shade the grid in batches with execute_batch and SIMD batch code",
+                "--print %L", &printvars, "Print the value of the named output at each point",
+                "--variant %L %L", &variants, &variants,
+                        "Also shade a copy of a one-layer group with another value of a float param (args: name value)",
 //                "-v", &verbose, "Verbose output",
                 NULL);
     if (ap.parse(argc, argv) < 0 || shadernames.empty()) {
@@ -384,7 +411,8 @@ setup_output_images (ShadingSystem *shadingsys,
 // and integrate the lights using that BSDF to determine the radiance
 // in the direction of the camera for that pixel.
 static void
-save_outputs (ShadingSystem *shadingsys, ShadingContext *ctx, int x, int y)
+save_outputs (ShadingSystem *shadingsys, ShadingContext *ctx, int x, int y,
+              int point=0)
 {
     // For each output requested on the command line...
     for (size_t i = 0;  i < outputfiles.size();  ++i) {
@@ -395,7 +423,8 @@ save_outputs (ShadingSystem *shadingsys, ShadingContext *ctx, int x, int y)
         // Ask for a pointer to the symbol's data, as computed by this
         // shader.
         TypeDesc t;
-        const void *data = shadingsys->get_symbol (*ctx, outputvarnames[i], t);
+        const void *data = shadingsys->get_symbol (*ctx, outputvarnames[i], t,
+                                                   point);
         if (!data)
             continue;  // Skip if symbol isn't found
 
@@ -414,6 +443,100 @@ save_outputs (ShadingSystem *shadingsys, ShadingContext *ctx, int x, int y)
         }
         // N.B. Drop any outputs that aren't float- or int-based
     }
+
+    // Print the values of the --print variables
+    for (size_t i = 0;  i < printvars.size();  ++i) {
+        TypeDesc t;
+        const void *data = shadingsys->get_symbol (*ctx, ustring(printvars[i]),
+                                                   t, point);
+        if (!data)
+            continue;
+        std::cout << printvars[i] << " at (" << x << ", " << y << "):";
+        for (int c = 0;  c < (int)(t.numelements() * t.aggregate);  ++c) {
+            if (t.basetype == TypeDesc::FLOAT)
+                std::cout << " " << ((const float *)data)[c];
+            else if (t.basetype == TypeDesc::INT)
+                std::cout << " " << ((const int *)data)[c];
+        }
+        std::cout << "\n";
+    }
+}
+
+
+
+// Declare a copy of the (one-layer) group, with the same params except
+// that float param "name" is given the value "value".  Groups like that
+// are candidates for sharing code under "paramagnostic".
+static ShadingAttribStateRef
+declare_variant (const std::string &name, const std::string &value)
+{
+    shadingsys->ShaderGroupBegin ();
+    iparams = lastiparams;
+    vparams = lastvparams;
+    sparams = lastsparams;
+    fparams.clear ();
+    for (size_t p = 0;  p < lastfparams.size();  p += 2)
+        if (lastfparams[p] != name) {
+            fparams.push_back (lastfparams[p]);
+            fparams.push_back (lastfparams[p+1]);
+        }
+    fparams.push_back (name);
+    fparams.push_back (value);
+    inject_params ();
+    shadingsys->Shader ("surface", shadernames.back().c_str(), NULL);
+    shadingsys->ShaderGroupEnd ();
+    return shadingsys->state ();
+}
+
+
+
+static void
+shade_variant (ShadingContext *ctx, ShadingAttribState &variantstate)
+{
+    ShaderGlobals sg;
+    for (int y = 0;  y < yres;  ++y)
+        for (int x = 0;  x < xres;  ++x) {
+            setup_shaderglobals (sg, shadingsys, x, y);
+            shadingsys->execute (*ctx, variantstate, sg);
+        }
+}
+
+
+
+// Shade the whole grid with execute_batch, ShaderGlobalsBatch::MaxSize
+// points at a time, and save the outputs if asked.
+static void
+shade_batches (ShadingContext *ctx, ShadingAttribState &sas, bool save)
+{
+    ShaderGlobals sg;
+    ShaderGlobalsBatch sgb;
+    int npoints = xres * yres;
+    for (int begin = 0;  begin < npoints;  begin += ShaderGlobalsBatch::MaxSize) {
+        int n = std::min (npoints - begin, (int)ShaderGlobalsBatch::MaxSize);
+        memset (&sgb, 0, sizeof(ShaderGlobalsBatch));
+        for (int i = 0;  i < n;  ++i) {
+            setup_shaderglobals (sg, shadingsys, (begin+i) % xres, (begin+i) / xres);
+            sgb.P.set (i, sg.P);
+            sgb.dPdx.set (i, sg.dPdx);
+            sgb.dPdy.set (i, sg.dPdy);
+            sgb.dPdz.set (i, sg.dPdz);
+            sgb.N.set (i, sg.N);
+            sgb.Ng.set (i, sg.Ng);
+            sgb.u[i] = sg.u;  sgb.dudx[i] = sg.dudx;  sgb.dudy[i] = sg.dudy;
+            sgb.v[i] = sg.v;  sgb.dvdx[i] = sg.dvdx;  sgb.dvdy[i] = sg.dvdy;
+            sgb.dPdu.set (i, sg.dPdu);
+            sgb.dPdv.set (i, sg.dPdv);
+            sgb.object2common[i] = sg.object2common;
+            sgb.shader2common[i] = sg.shader2common;
+            sgb.surfacearea[i] = sg.surfacearea;
+            sgb.raytype = sg.raytype;
+        }
+        shadingsys->execute_batch (*ctx, sas, sgb, n);
+        if (save)
+            for (int i = 0;  i < n;  ++i)
+                save_outputs (shadingsys, ctx, (begin+i) % xres,
+                              (begin+i) / xres, i);
+    }
 }
 
 
@@ -479,6 +602,11 @@ test_shade (int argc, const char *argv[])
     // Get the command line arguments.  That will set up all the shader
     // instances and their parameters for the group.
     getargs (argc, argv);
+    if (llvm_cpu.size())
+        shadingsys->attribute ("llvm_cpu", llvm_cpu.c_str());
+    if (llvm_features.size())
+        shadingsys->attribute ("llvm_features", llvm_features.c_str());
+    rend.texture_callback (texture_callback);
 
     // Now set up the connections
     for (size_t i = 0;  i < connections.size();  i += 4) {
@@ -499,9 +627,28 @@ test_shade (int argc, const char *argv[])
 
     // Now we should have a valid shading state, to get a reference to it.
     ShadingAttribStateRef shaderstate = shadingsys->state ();
+
+    // Use the ahead-of-time compiled version of the group, if we have
+    // one that matches.  If not, it just gets compiled as usual, but we
+    // say which happened, so that tests can tell.
+    if (compiledgroup.size()) {
+        if (! shadingsys->register_compiled_group (*shaderstate, compiledgroup.c_str()))
+            std::cerr << "Could not use compiled group \"" << compiledgroup << "\"\n";
+        int registered = 0;
+        shadingsys->getattribute ("stat:aot_groups_registered", registered);
+        std::cout << "Compiled groups registered: " << registered << "\n";
+    }
     if (outputfiles.size() != 0)
         std::cout << "\n";
 
+    std::vector<ShadingAttribStateRef> variantstates;
+    for (size_t v = 0;  v < variants.size();  v += 2)
+        variantstates.push_back (declare_variant (variants[v], variants[v+1]));
+    // Nothing is compiled until first executed, so this is the setting
+    // the groups will be compiled with.
+    if (paramagnostic_off)
+        shadingsys->attribute ("paramagnostic", 0);
+
     // Set up the named transformations, including shader and object.
     // For this test application, we just do this statically; in a real
     // renderer, the global named space (like "myspace") would probably
@@ -541,6 +688,10 @@ test_shade (int argc, const char *argv[])
     // which is useful for time trials of things that would be too quick
     // to accurately time for a single iteration
     for (int iter = 0;  iter < iters;  ++iter) {
+        if (batch) {
+            shade_batches (ctx, *shaderstate, iter == (iters - 1));
+            continue;
+        }
 
         // Loop over all pixels in the image (in x and y)...
         for (int y = 0, n = 0;  y < yres;  ++y) {
@@ -575,6 +726,9 @@ test_shade (int argc, const char *argv[])
         }
     }
 
+    for (size_t v = 0;  v < variantstates.size();  ++v)
+        shade_variant (ctx, *variantstates[v]);
+
     // We're done shading with this context.
     shadingsys->release_context (ctx);
 
@@ -586,6 +740,21 @@ test_shade (int argc, const char *argv[])
 
     if (outputfiles.size() == 0)
         std::cout << "\n";
+    if (texture_callback)
+        std::cout << "Renderer texture() lookups: "
+                  << rend.texture_callbacks() << "\n";
+    if (batch) {
+        int groups_batch = 0;
+        shadingsys->getattribute ("stat:groups_batch", groups_batch);
+        std::cout << "Groups with batch code: " << groups_batch << "\n";
+    }
+    if (variants.size()) {
+        int deduped = 0, agnostic = 0;
+        shadingsys->getattribute ("stat:groups_deduped", deduped);
+        shadingsys->getattribute ("stat:agnostic_params", agnostic);
+        std::cout << "Groups sharing code: " << deduped << "\n";
+        std::cout << "Params supplied at run time: " << agnostic << "\n";
+    }
 
     // Write the output images to disk
     for (size_t i = 0;  i < outputimgs.size();  ++i) {
@@ -605,6 +774,12 @@ test_shade (int argc, const char *argv[])
         std::cout << "\n";
         std::cout << shadingsys->getstats (5) << "\n";
     }
+    if (statsjsonfile.size()) {
+        std::ofstream out (statsjsonfile.c_str());
+        out << shadingsys->getstats_json () << "\n";
+        if (! out)
+            std::cerr << "Could not write " << statsjsonfile << "\n";
+    }
 
     // We're done with the shading system now, destroy it
     ShadingSystem::destroy (shadingsys);
@@ -0,0 +1,36 @@
+#!/usr/bin/python 
+
+import os
+import sys
+
+path = ""
+command = ""
+if len(sys.argv) > 2 :
+    os.chdir (sys.argv[1])
+    path = sys.argv[2] + "/"
+
+# Compile the group in group.txt ahead of time, then have testshade
+# declare the same group and run it from the library.  (The library is
+# only accepted if it was made with the same options.)
+opt = os.environ.get ("TESTSHADE_OPT", "1")
+command = path + "oslc/oslc a.osl > out.txt"
+command = command + "; " + path + "oslc/oslc b.osl >> out.txt"
+command = command + "; " + path + "oslaot/oslaot --option optimize " + opt
+command = command + " group.txt -o group.so >> out.txt"
+command = command + "; " + path + "testshade/testshade --compiled group.so "
+command = command + "--fparam Kd 0.25 --layer alayer a "
+command = command + "--sparam label aot --layer blayer b "
+command = command + "--connect alayer f blayer f >> out.txt"
+
+# Outputs to check against references
+outputs = [ "out.txt" ]
+
+# Files that need to be cleaned up, IN ADDITION to outputs
+cleanfiles = [ "a.oso", "b.oso", "group.so" ]
+
+
+# boilerplate
+sys.path = [".."] + sys.path
+import runtest
+ret = runtest.runtest (command, outputs, cleanfiles)
+sys.exit (ret)
@@ -0,0 +1,30 @@
+#!/usr/bin/python 
+
+import os
+import sys
+
+path = ""
+command = ""
+if len(sys.argv) > 2 :
+    os.chdir (sys.argv[1])
+    path = sys.argv[2] + "/"
+
+# Shade the same grid with the SIMD batch code and then one point at a
+# time; both must print the same values.  The 5x4 grid makes a full
+# batch of 16 points and a partial one of 4.
+command = path + "oslc/oslc test.osl > out.txt"
+command = command + "; " + path + "testshade/testshade --batch -g 5 4 --print f --print c --print i test >> out.txt"
+command = command + "; " + path + "testshade/testshade -g 5 4 --print f --print c --print i test >> out.txt"
+
+# Outputs to check against references
+outputs = [ "out.txt" ]
+
+# Files that need to be cleaned up, IN ADDITION to outputs
+cleanfiles = [ ]
+
+
+# boilerplate
+sys.path = [".."] + sys.path
+import runtest
+ret = runtest.runtest (command, outputs, cleanfiles)
+sys.exit (ret)
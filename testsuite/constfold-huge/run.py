@@ -0,0 +1,44 @@
+#!/usr/bin/python 
+
+import os
+import sys
+
+path = ""
+command = ""
+if len(sys.argv) > 2 :
+    os.chdir (sys.argv[1])
+    path = sys.argv[2] + "/"
+
+# Generate a huge shader whose every op constant folds into a new
+# constant, to exercise the runtime optimizer's constant table.  Run
+# testshade with --stats by hand to see the time spent in constant
+# lookup.  All values are exact in float, so the result is too.
+n = 4000
+f = open ("test.osl", "w")
+f.write ("shader test ()\n{\n")
+f.write ("    float scale = 0.25;\n")
+f.write ("    float base = 1;\n")
+f.write ("    float sum = 0;\n")
+for i in range(n) :
+    f.write ("    float v%d = %d * scale + base;\n" % (i, i))
+    f.write ("    sum += v%d;\n" % i)
+f.write ("    printf (\"sum = %g\\n\", sum);\n")
+f.write ("}\n")
+f.close ()
+
+# A command to run
+command = path + "oslc/oslc test.osl > out.txt"
+command = command + "; " + path + "testshade/testshade test >> out.txt"
+
+# Outputs to check against references
+outputs = [ "out.txt" ]
+
+# Files that need to be cleaned up, IN ADDITION to outputs
+cleanfiles = [ "test.osl", "test.oso" ]
+
+
+# boilerplate
+sys.path = [".."] + sys.path
+import runtest
+ret = runtest.runtest (command, outputs, cleanfiles)
+sys.exit (ret)
@@ -0,0 +1,59 @@
+#!/usr/bin/python
+
+# Time a handful of math-heavy testsuite shaders with the JIT aimed at
+# different CPUs, to see what the "llvm_cpu" attribute buys on this
+# machine.  Run from the testsuite directory:
+#
+#     python isa-bench.py <build dir> [iters]
+#
+# where <build dir> contains oslc/oslc and testshade/testshade.  Each
+# shader is run once per CPU and the run times are reported relative to
+# the "generic" target.
+
+import os
+import re
+import sys
+
+path = ""
+iters = 10
+if len(sys.argv) > 1 :
+    path = os.path.abspath (sys.argv[1]) + "/"
+if len(sys.argv) > 2 :
+    iters = int (sys.argv[2])
+
+tests = [ "arithmetic", "noise", "pnoise", "cellnoise", "matrix",
+          "geomath", "trig", "exponential", "spline" ]
+cpus = [ "generic", "corei7", "corei7-avx", "core-avx2", "host" ]
+
+def seconds (s) :
+    # Parse the output of Strutil::timeintervalformat, e.g. "1m 2.5s"
+    total = 0.0
+    for (val, unit) in re.findall ("([0-9.]+)([dhms])", s) :
+        total += float(val) * { "d":86400, "h":3600, "m":60, "s":1 }[unit]
+    return total
+
+def runtime (test, cpu) :
+    command = (path + "testshade/testshade -g 512 512 --stats " +
+               "--iters " + str(iters) + " --llvm_cpu " + cpu + " test")
+    f = os.popen ("cd " + test + "; " + command + " 2>&1")
+    out = f.read ()
+    if f.close () != None :
+        return None
+    m = re.search ("Run  : (.*)", out)
+    if m == None :
+        return None
+    return seconds (m.group(1))
+
+print "%-16s" % "test" + "".join (["%12s" % c for c in cpus])
+for test in tests :
+    if not os.path.exists (os.path.join (test, "test.osl")) :
+        continue
+    os.system ("cd " + test + "; " + path + "oslc/oslc test.osl > /dev/null")
+    times = [ runtime (test, c) for c in cpus ]
+    line = "%-16s" % test
+    for t in times :
+        if t == None or times[0] == None or t == 0 :
+            line = line + "%12s" % "-"
+        else :
+            line = line + "%11.2fx" % (times[0] / t)
+    print line
@@ -0,0 +1,16 @@
+#!/usr/bin/python
+
+# Check that the file named on the command line is well-formed JSON, and
+# print its sections and their fields (but not their values, which vary
+# from run to run).
+
+import json
+import sys
+
+stats = json.load (open (sys.argv[1]))
+for section in sorted (stats.keys()) :
+    value = stats[section]
+    if isinstance (value, dict) :
+        sys.stdout.write (section + ": " + " ".join (sorted (value.keys())) + "\n")
+    else :
+        sys.stdout.write (section + " (not a section!)\n")
@@ -0,0 +1,29 @@
+#!/usr/bin/python 
+
+import os
+import sys
+
+path = ""
+command = ""
+if len(sys.argv) > 2 :
+    os.chdir (sys.argv[1])
+    path = sys.argv[2] + "/"
+
+# Shade, write the statistics as JSON, and check that they parse and
+# have all the sections we expect.
+command = path + "oslc/oslc test.osl > out.txt"
+command = command + "; " + path + "testshade/testshade --stats_json stats.json test >> out.txt"
+command = command + "; " + sys.executable + " checkjson.py stats.json >> out.txt"
+
+# Outputs to check against references
+outputs = [ "out.txt" ]
+
+# Files that need to be cleaned up, IN ADDITION to outputs
+cleanfiles = [ "stats.json" ]
+
+
+# boilerplate
+sys.path = [".."] + sys.path
+import runtest
+ret = runtest.runtest (command, outputs, cleanfiles)
+sys.exit (ret)